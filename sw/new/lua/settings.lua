@@ -649,7 +649,20 @@ settings.DatabaseSettings = SettingsScreen:new {
     end)
     update:focus()
 
+    local cancel = actions_container:Button {}
+    cancel:Label { text = "Stop update" }
+    cancel:onClicked(function()
+      database.cancel_update()
+    end)
+
     self.bindings = self.bindings + {
+      database.updating:bind(function(updating)
+        if updating then
+          cancel:clear_flag(lvgl.FLAG.HIDDEN)
+        else
+          cancel:add_flag(lvgl.FLAG.HIDDEN)
+        end
+      end),
       database.auto_update:bind(function(en)
         if en then
           auto_update_sw:add_state(lvgl.STATE.CHECKED)
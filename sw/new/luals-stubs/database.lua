@@ -14,6 +14,11 @@ local database = {}
 --- @return Index[]
 function database.indexes() end
 
+--- Stops any in-progress database re-index as soon as possible. Tracks that
+--- have already been updated are kept, and the next update continues from
+--- where this one stopped.
+function database.cancel_update() end
+
 --- Returns the track in the database with the id given
 --- @param id TrackId
 --- @return Track
@@ -32,6 +37,12 @@ local Track = {}
 --- @class Iterator
 local Iterator = {}
 
+--- Returns the number of records at this iterator's level of the index, such
+--- as the number of albums in the "All Albums" index. This is quick to look up,
+--- and doesn't depend on how far the iterator has been advanced.
+--- @return integer
+function Iterator:total() end
+
 --- A TrackId is a unique identifier, representing a playable track in the
 --- user's library.
 --- @class TrackId
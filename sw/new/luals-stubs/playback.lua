@@ -10,6 +10,8 @@
 --- @field playing Property Whether or not audio is allowed to be played. if there is a current track, then this indicated whether playback is paused or unpaused. If there is no current track, this determines what will happen when the first track is added to the queue.
 --- @field track Property The currently playing track.
 --- @field position Property The current playback position within the current track, in seconds.
+--- @field resampler_budget Property How much CPU time may be spent converting tracks to the output's sample rate, from 0 (least) to 2 (most). Higher budgets sound cleaner. Takes effect from the next track.
+--- @field replaygain Property Whether to even out loudness between tracks using their ReplayGain tags. 0 for off, 1 to use per-track gains, or 2 to use per-album gains. Tracks without tags play unchanged.
 local playback = {}
 
 --- Returns whether or not this file can be played (i.e. is this an audio track) 
@@ -88,8 +88,11 @@ auto DrFlacDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
     return cpp::fail(Error::kMalformedData);
   }
 
-  if (offset && !drflac_seek_to_pcm_frame(flac_, offset * flac_->sampleRate)) {
-    return cpp::fail(Error::kMalformedData);
+  if (offset) {
+    auto res = Seek(static_cast<uint64_t>(offset) * flac_->sampleRate);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
+    }
   }
 
   OutputFormat format{
@@ -107,6 +110,16 @@ auto DrFlacDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   return format;
 }
 
+auto DrFlacDecoder::Seek(uint64_t pcm_frame) -> cpp::result<void, Error> {
+  // dr_flac uses the stream's seek table if it has one, and otherwise bisects
+  // the stream by frame headers. Either way, it finishes by decoding forward
+  // to exactly the right frame.
+  if (!drflac_seek_to_pcm_frame(flac_, pcm_frame)) {
+    return cpp::fail(Error::kMalformedData);
+  }
+  return {};
+}
+
 auto DrFlacDecoder::DecodeTo(std::span<sample::Sample> output)
     -> cpp::result<OutputInfo, Error> {
   size_t frames_to_read = output.size() / flac_->channels / 2;
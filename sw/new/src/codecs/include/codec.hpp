@@ -13,6 +13,7 @@
 #include <span>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "result.hpp"
 #include "sample.hpp"
@@ -22,6 +23,20 @@
 
 namespace codecs {
 
+/*
+ * Where evenly spaced frames begin within a stream. Codecs that would otherwise
+ * have to walk every frame from the start of a stream in order to seek within
+ * it can use this to jump most of the way there instead.
+ */
+struct SeekIndex {
+  // How many frames there are between consecutive entries.
+  uint32_t stride;
+  // The position of every `stride`th frame of audio, starting with the first.
+  std::pmr::vector<uint32_t> positions;
+
+  bool operator==(const SeekIndex&) const = default;
+};
+
 /*
  * Interface for an abstract source of file-like data.
  */
@@ -57,6 +72,14 @@ class IStream {
    */
   virtual auto SetPreambleFinished() -> void {}
 
+  /*
+   * Returns an index of this stream's frames that was built ahead of time, if
+   * there is one.
+   */
+  virtual auto GetSeekIndex() -> std::shared_ptr<const SeekIndex> {
+    return {};
+  }
+
  protected:
   StreamType t_;
 };
@@ -113,11 +136,23 @@ class ICodec {
 
   /*
    * Decodes metadata or headers from the given input stream, and returns the
-   * format for the samples that will be decoded from it.
+   * format for the samples that will be decoded from it. If `offset` is
+   * non-zero, decoding begins that many seconds into the stream.
    */
   virtual auto OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
       -> cpp::result<OutputFormat, Error> = 0;
 
+  /*
+   * Moves an open stream to the given PCM frame (i.e. the sample index for
+   * each channel), such that the next call to DecodeTo begins with exactly
+   * that frame. Frame 0 is the first frame of audio in the stream, after any
+   * encoder delay.
+   *
+   * Requires a seekable input stream. Codecs that can't seek with sample
+   * accuracy return kUnsupportedFormat.
+   */
+  virtual auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> = 0;
+
   struct OutputInfo {
     std::size_t samples_written;
     bool is_stream_finished;
@@ -33,6 +33,8 @@ class DrFlacDecoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
   DrFlacDecoder(const DrFlacDecoder&) = delete;
   DrFlacDecoder& operator=(const DrFlacDecoder&) = delete;
 
@@ -14,6 +14,7 @@
 #include <span>
 
 #include "mad.h"
+#include "requantizer.hpp"
 #include "sample.hpp"
 #include "source_buffer.hpp"
 
@@ -32,23 +33,45 @@ class MadMp3Decoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
+  /*
+   * Walks every frame header within the given stream, and records where its
+   * frames begin. This reads the entire stream, so it's best done in the
+   * background; the result can then be handed to later decoders of the same
+   * stream via IStream::GetSeekIndex.
+   */
+  static auto BuildSeekIndex(IStream&) -> std::optional<SeekIndex>;
+
   MadMp3Decoder(const MadMp3Decoder&) = delete;
   MadMp3Decoder& operator=(const MadMp3Decoder&) = delete;
 
  private:
-  auto SkipID3Tags(IStream& stream) -> std::optional<uint32_t>;
+  static auto SkipID3Tags(IStream& stream) -> std::optional<uint32_t>;
 
   struct Mp3Info {
     uint16_t starting_sample;
     uint32_t length;
-    std::optional<uint32_t> bytes;
-    std::optional<std::span<const unsigned char, 100>> toc;
   };
 
   auto GetMp3Info(const mad_header& header) -> std::optional<Mp3Info>;
   
   auto GetBytesUsed() -> std::size_t;
 
+  /*
+   * Finds where to begin decoding in order for the frame with the given index
+   * to decode exactly as it would have if the whole stream were decoded from
+   * the start. Returns the index and position of that earlier frame.
+   */
+  auto FindPrerollFrame(uint64_t frame_index)
+      -> std::optional<std::pair<uint64_t, int64_t>>;
+
+  /*
+   * Discards all decoder state, and resumes decoding from the frame at the
+   * given position.
+   */
+  auto Restart(int64_t position) -> void;
+
   std::shared_ptr<IStream> input_;
   SourceBuffer buffer_;
 
@@ -62,10 +85,31 @@ class MadMp3Decoder : public ICodec {
   int current_stream_sample_;
   // How many samples in the current stream (channels separate) with encoder delay/padding removed
   int total_samples_;
-  // Encoder delay, i.e. how many samples to skip at the start of the stream
+  // How many samples (channels combined) to skip before the next one we
+  // output. Set to skip the encoder delay, and any pre-roll after a seek.
   int skip_samples_;
+  // Encoder delay, i.e. how many samples to skip at the start of the stream
+  int encoder_delay_;
+
+  // Position of the first audio frame within the stream, after any tags and
+  // gapless info.
+  int64_t data_start_;
+  // The first frame's header, which every later frame should match apart
+  // from its bitrate, padding, and the like.
+  uint32_t first_header_;
+  uint32_t samples_per_frame_;
+  uint32_t sample_rate_hz_;
+  uint8_t channels_;
+
+  // Index of frame positions that was built ahead of time, if the stream came
+  // with one. Otherwise, seek_index_ is built up as seeks walk the stream.
+  std::shared_ptr<const SeekIndex> prebuilt_index_;
+  SeekIndex seek_index_;
+
   bool is_eof_;
   bool is_eos_;
+
+  sample::Requantizer requantizer_;
 };
 
 }  // namespace codecs
@@ -31,6 +31,8 @@ class NativeDecoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
   NativeDecoder(const NativeDecoder&) = delete;
   NativeDecoder& operator=(const NativeDecoder&) = delete;
 
@@ -32,6 +32,8 @@ class XiphOpusDecoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
   XiphOpusDecoder(const XiphOpusDecoder&) = delete;
   XiphOpusDecoder& operator=(const XiphOpusDecoder&) = delete;
 
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "requantizer.hpp"
+#include "sample.hpp"
+
+namespace codecs {
+
+enum class PcmFormat {
+  kInteger,
+  kFloat,
+};
+
+/*
+ * Converts a block of interleaved PCM samples into our own sample format. The
+ * input must contain exactly as many samples as the output has room for.
+ * Samples wider than 16 bits are reduced by the given requantizer, which
+ * should belong to the stream being converted.
+ */
+using PcmConverter = void (*)(std::span<const std::byte> in,
+                              std::span<sample::Sample> out,
+                              sample::Requantizer& requantizer);
+
+/*
+ * Returns a converter specialised for the given sample encoding, or nullptr if
+ * the encoding isn't supported. Integer samples of one byte are unsigned, and
+ * wider integer samples are signed.
+ */
+auto PcmConverterFor(PcmFormat format,
+                     uint16_t bytes_per_sample,
+                     std::endian order) -> PcmConverter;
+
+}  // namespace codecs
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "sample.hpp"
+
+namespace sample {
+
+/*
+ * Reduces high resolution samples down to our 16 bit sample format, using
+ * TPDF dither and (optionally) noise shaping to turn the truncation error
+ * into benign, signal-independent noise.
+ *
+ * Both the dither and the noise shaping carry state from one sample to the
+ * next, so each stream should have its own instance. Output is entirely
+ * determined by the seed and the samples given so far.
+ */
+class Requantizer {
+ public:
+  enum class Shaping {
+    // Flat dither noise.
+    kNone,
+    // Error feedback through (1 - z^-1), which moves the noise floor towards
+    // higher frequencies at the cost of a little more noise overall.
+    kFirstOrder,
+    // Error feedback through (1 - z^-1)^2. Quieter at low frequencies again,
+    // but only suitable for sample rates of 44.1kHz and up.
+    kSecondOrder,
+  };
+
+  static constexpr size_t kMaxChannels = 8;
+  static constexpr uint32_t kDefaultSeed = 0x1b873593;
+
+  explicit Requantizer(uint32_t seed = kDefaultSeed);
+
+  /*
+   * Prepares for a new stream with the given layout. The random sequence
+   * continues from where it was, so that streams don't all start out with
+   * identical noise.
+   */
+  auto Reset(uint8_t channels, Shaping shaping) -> void;
+
+  /*
+   * Requantizes a block of interleaved samples, each of which is left-aligned
+   * within a 32 bit word. Blocks needn't begin or end on a frame boundary.
+   */
+  auto Requantize(std::span<const int32_t> in, std::span<Sample> out) -> void;
+
+  /* Returns the shaping that suits the given sample rate. */
+  static auto ShapingFor(uint32_t sample_rate_hz) -> Shaping;
+
+ private:
+  template <Shaping kShaping>
+  auto requantize(std::span<const int32_t> in, std::span<Sample> out) -> void;
+
+  uint32_t rng_;
+  uint8_t channels_;
+  Shaping shaping_;
+
+  // The channel that the next sample belongs to.
+  uint8_t channel_;
+  // The most recent quantisation errors for each channel.
+  std::array<std::array<int32_t, 2>, kMaxChannels> error_;
+};
+
+}  // namespace sample
@@ -15,23 +15,68 @@
 
 namespace codecs {
 
+/*
+ * Ring buffer of encoded bytes, waiting to be decoded.
+ *
+ * Decoders generally need to see a whole frame at once, so the bytes passed to
+ * ConsumeBytes are always contiguous, even when they wrap around the end of
+ * the ring. This is done by mirroring the start of the ring just past its end,
+ * which costs a small copy once per lap, rather than shuffling every leftover
+ * byte back to the start of the buffer each time it is refilled.
+ */
 class SourceBuffer {
  public:
   SourceBuffer();
   ~SourceBuffer();
 
+  /*
+   * Reads more bytes from the given stream if the buffer is running low.
+   * Returns true if the stream has reached its end.
+   */
   auto Refill(IStream* src) -> bool;
-  auto AddBytes(std::function<size_t(std::span<std::byte>)> writer) -> void;
-  auto ConsumeBytes(std::function<size_t(std::span<std::byte>)> reader) -> void;
+
+  /*
+   * Invokes `writer` with free space in the buffer. `writer` should return the
+   * number of bytes it filled in.
+   */
+  template <typename Writer>
+  auto AddBytes(Writer&& writer) -> void {
+    size_t added_bytes = std::invoke(writer, WritableBytes());
+    CommitWrite(added_bytes);
+  }
+
+  /*
+   * Invokes `reader` with every buffered byte that can be presented
+   * contiguously. This is always at least enough for one frame of any of our
+   * codecs. `reader` should return the number of bytes it used.
+   */
+  template <typename Reader>
+  auto ConsumeBytes(Reader&& reader) -> void {
+    size_t bytes_consumed = std::invoke(reader, ReadableBytes());
+    CommitRead(bytes_consumed);
+  }
+
   auto Empty() -> void;
 
+  /*
+   * Returns the total number of bytes that have been copied internally in
+   * order to keep buffered bytes contiguous.
+   */
+  auto BytesMoved() const -> uint64_t { return bytes_moved_; }
+
   SourceBuffer(const SourceBuffer&) = delete;
   SourceBuffer& operator=(const SourceBuffer&) = delete;
 
  private:
+  auto WritableBytes() -> std::span<std::byte>;
+  auto CommitWrite(size_t) -> void;
+  auto ReadableBytes() -> std::span<std::byte>;
+  auto CommitRead(size_t) -> void;
+
   const std::span<std::byte> buffer_;
   size_t bytes_in_buffer_;
   size_t offset_of_bytes_;
+  uint64_t bytes_moved_;
 };
 
 }  // namespace codecs
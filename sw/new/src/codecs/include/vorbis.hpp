@@ -32,6 +32,8 @@ class TremorVorbisDecoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
   TremorVorbisDecoder(const TremorVorbisDecoder&) = delete;
   TremorVorbisDecoder& operator=(const TremorVorbisDecoder&) = delete;
 
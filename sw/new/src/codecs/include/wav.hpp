@@ -13,6 +13,8 @@
 #include <string>
 #include <utility>
 
+#include "pcm_convert.hpp"
+#include "requantizer.hpp"
 #include "sample.hpp"
 #include "source_buffer.hpp"
 
@@ -37,6 +39,8 @@ class WavDecoder : public ICodec {
   auto DecodeTo(std::span<sample::Sample> destination)
       -> cpp::result<OutputInfo, Error> override;
 
+  auto Seek(uint64_t pcm_frame) -> cpp::result<void, Error> override;
+
   WavDecoder(const WavDecoder&) = delete;
   WavDecoder& operator=(const WavDecoder&) = delete;
 
@@ -48,6 +52,10 @@ class WavDecoder : public ICodec {
   OutputFormat output_format_;
   uint16_t bytes_per_sample_;
   uint16_t num_channels_;
+  // Offset of the first sample within the stream.
+  int64_t data_start_;
+  PcmConverter converter_;
+  sample::Requantizer requantizer_;
 
   auto GetFormat() const -> uint16_t;
 };
@@ -8,6 +8,8 @@
 #include <stdint.h>
 #include <sys/_stdint.h>
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <optional>
@@ -17,6 +19,8 @@
 
 #include "codec.hpp"
 #include "esp_log.h"
+#include "memory_resource.hpp"
+#include "requantizer.hpp"
 #include "result.hpp"
 #include "sample.hpp"
 #include "types.hpp"
@@ -27,6 +31,135 @@ namespace codecs {
 
 static constexpr uint32_t kMallocCaps = MALLOC_CAP_SPIRAM;
 
+// How many samples to gather up before handing them to the requantizer.
+static constexpr size_t kRequantizeChunk = 64;
+
+/* Clips a synthesised sample, and left-aligns it within 32 bits. */
+static inline auto widen(mad_fixed_t src) -> int32_t {
+  src = std::clamp<mad_fixed_t>(src, -MAD_F_ONE, MAD_F_ONE - 1);
+  return static_cast<int32_t>(src) << (31 - MAD_F_FRACBITS);
+}
+
+// Layer III frames may begin their main data this many bytes before their
+// header, within the frames before them.
+static constexpr int64_t kMaxReservoirBytes = 511;
+
+// The furthest back from its target that a seek will begin decoding. Enough
+// to cover the bit reservoir even at the lowest bitrates.
+static constexpr uint64_t kMaxPrerollFrames = 15;
+
+// How many frames apart the entries of a SeekIndex are. For typical Layer III
+// streams this is a little under a second of audio.
+static constexpr uint32_t kSeekIndexStride = 32;
+
+static auto HeaderBits(std::span<const std::byte, 4> bytes) -> uint32_t {
+  return static_cast<uint32_t>(bytes[0]) << 24 |
+         static_cast<uint32_t>(bytes[1]) << 16 |
+         static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+}
+
+/*
+ * Parses the MPEG audio frame header at the start of `bytes`, and returns the
+ * length of the frame in bytes. Headers that don't share the stream's version,
+ * layer, and sample rate are treated as false syncs. Free format streams
+ * aren't supported.
+ */
+static auto FrameLength(std::span<const std::byte, 4> bytes, uint32_t first)
+    -> std::optional<size_t> {
+  static constexpr uint16_t kBitrates[5][15] = {
+      // MPEG-1 layers I, II, and III.
+      {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+      {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+      // MPEG-2 and 2.5 layer I, then layers II and III.
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+  };
+  static constexpr uint32_t kSampleRates[3] = {44100, 48000, 32000};
+
+  uint32_t header = HeaderBits(bytes);
+  // Sync word, version, layer, and sample rate.
+  constexpr uint32_t kFixedBits = 0xfffe0c00;
+  if ((header & kFixedBits) != (first & kFixedBits)) {
+    return {};
+  }
+
+  int version = (header >> 19) & 0x3;  // 3 for MPEG-1, 2 for 2, 0 for 2.5
+  int layer = 4 - ((header >> 17) & 0x3);
+  int bitrate_index = (header >> 12) & 0xf;
+  int rate_index = (header >> 10) & 0x3;
+  uint32_t padding = (header >> 9) & 0x1;
+  if (layer > 3 || version == 1 || bitrate_index == 0 ||
+      bitrate_index == 0xf || rate_index == 0x3) {
+    return {};
+  }
+
+  int table = version == 3 ? layer - 1 : (layer == 1 ? 3 : 4);
+  uint32_t bitrate = kBitrates[table][bitrate_index] * 1000;
+  uint32_t rate = kSampleRates[rate_index] >> (version == 3 ? 0 : 3 - version);
+  if (layer == 1) {
+    return (12 * bitrate / rate + padding) * 4;
+  }
+  if (layer == 3 && version != 3) {
+    return 72 * bitrate / rate + padding;
+  }
+  return 144 * bitrate / rate + padding;
+}
+
+/*
+ * Walks the frame headers of `stream`, beginning with the frame at `position`,
+ * and calls `fn` with the position of each frame until it returns false. Only
+ * the headers are parsed, but every byte in between is still read. Returns
+ * false if the stream ended first.
+ */
+template <typename Fn>
+static auto ScanFrames(IStream& stream,
+                       SourceBuffer& buffer,
+                       uint32_t first_header,
+                       int64_t position,
+                       Fn&& fn) -> bool {
+  stream.SeekTo(position, IStream::SeekFrom::kStartOfStream);
+  buffer.Empty();
+
+  size_t skip = 0;
+  bool done = false;
+  bool eof = false;
+  while (!done) {
+    if (!eof) {
+      eof = buffer.Refill(&stream);
+    }
+    size_t used = 0;
+    buffer.ConsumeBytes([&](std::span<std::byte> buf) -> size_t {
+      while (!done) {
+        size_t skipped = std::min(skip, buf.size() - used);
+        used += skipped;
+        skip -= skipped;
+        if (skip > 0 || buf.size() - used < 4) {
+          break;
+        }
+        auto length = FrameLength(buf.subspan(used).first<4>(), first_header);
+        if (!length) {
+          // Not a frame header. Resynchronise one byte at a time, as libmad
+          // would.
+          used++;
+          continue;
+        }
+        if (!fn(position + static_cast<int64_t>(used))) {
+          done = true;
+        } else {
+          skip = *length;
+        }
+      }
+      position += used;
+      return used;
+    });
+    if (!done && eof && used == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
 MadMp3Decoder::MadMp3Decoder()
     : input_(),
       buffer_(),
@@ -41,8 +174,17 @@ MadMp3Decoder::MadMp3Decoder()
       current_stream_sample_(0),
       total_samples_(0),
       skip_samples_(0),
+      encoder_delay_(0),
+      data_start_(0),
+      first_header_(0),
+      samples_per_frame_(0),
+      sample_rate_hz_(0),
+      channels_(0),
+      prebuilt_index_(),
+      seek_index_(),
       is_eof_(false),
-      is_eos_(false) {
+      is_eos_(false),
+      requantizer_() {
   mad_stream_init(stream_.get());
   mad_frame_init(frame_.get());
   mad_synth_init(synth_.get());
@@ -76,6 +218,9 @@ auto MadMp3Decoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   mad_header_init(&header);
   bool eof = false;
   bool got_header = false;
+  int64_t position = id3size.value_or(0);
+  int64_t first_frame = 0;
+  int64_t second_frame = 0;
   while (!eof && !got_header) {
     eof = buffer_.Refill(input_.get());
 
@@ -91,6 +236,7 @@ auto MadMp3Decoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
           continue;
         }
         if (stream_->error == MAD_ERROR_BUFLEN) {
+          position += GetBytesUsed();
           return GetBytesUsed();
         }
         eof = true;
@@ -98,6 +244,8 @@ auto MadMp3Decoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
       }
 
       got_header = true;
+      first_frame = position + (stream_->this_frame - stream_->buffer);
+      second_frame = position + (stream_->next_frame - stream_->buffer);
       return GetBytesUsed();
     });
   }
@@ -106,19 +254,43 @@ auto MadMp3Decoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
     return cpp::fail(ICodec::Error::kMalformedData);
   }
 
-  uint8_t channels = MAD_NCHANNELS(&header);
+  channels_ = MAD_NCHANNELS(&header);
+  sample_rate_hz_ = header.samplerate;
+  samples_per_frame_ = 32 * MAD_NSBSAMPLES(&header);
+  first_header_ = HeaderBits(std::span{
+      reinterpret_cast<const std::byte*>(stream_->this_frame), 4}.first<4>());
+
   OutputFormat output{
-      .num_channels = channels,
+      .num_channels = channels_,
       .sample_rate_hz = header.samplerate,
   };
 
+  // If the first frame holds gapless info, then it's only there for our
+  // benefit, and the audio begins with the frame after it.
   auto mp3_info = GetMp3Info(header);
-  uint64_t cbr_length = 0;
+  data_start_ = mp3_info ? second_frame : first_frame;
+
+  // Use the stream's prebuilt index if it has one, so long as it agrees with
+  // us about where the audio begins.
+  prebuilt_index_ = input->GetSeekIndex();
+  if (prebuilt_index_ &&
+      (prebuilt_index_->stride == 0 || prebuilt_index_->positions.empty() ||
+       prebuilt_index_->positions[0] != data_start_)) {
+    ESP_LOGW(kTag, "ignoring mismatched seek index");
+    prebuilt_index_.reset();
+  }
+  seek_index_ = {
+      .stride = kSeekIndexStride,
+      .positions = std::pmr::vector<uint32_t>{&memory::kSpiRamResource},
+  };
+
   if (mp3_info) {
-    output.total_samples = mp3_info->length * channels;
+    output.total_samples = mp3_info->length * channels_;
   } else if (input->Size() && header.bitrate > 0) {
-    cbr_length = (input->Size().value() * 8) / header.bitrate;
-    output.total_samples = cbr_length * output.sample_rate_hz * channels;
+    // Constant bitrate; work out the length from the size of the stream.
+    uint64_t data_bits = (input->Size().value() - data_start_) * 8;
+    output.total_samples =
+        data_bits * output.sample_rate_hz / header.bitrate * channels_;
   }
   total_samples_ = output.total_samples.value();
 
@@ -127,85 +299,190 @@ auto MadMp3Decoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   if (id3size && input->Size()) {
     auto data_size = input->Size().value() - id3size.value();
     double sample_size = data_size * 8.0 / output.total_samples.value();
-    output.bitrate_kbps = static_cast<uint32_t>(output.sample_rate_hz * channels * sample_size / 1024);
+    output.bitrate_kbps = static_cast<uint32_t>(output.sample_rate_hz * channels_ * sample_size / 1024);
   }
 
   // For gapless MP3s, save samples to skip
-  if (mp3_info) {
-    skip_samples_ = mp3_info->starting_sample;
-  }
+  encoder_delay_ = mp3_info ? mp3_info->starting_sample : 0;
 
-  if (offset > 1 && cbr_length > 0) {
-    // Constant bitrate seeking
-    uint64_t skip_bytes = header.bitrate * (offset - 1) / 8;
-    input->SeekTo(skip_bytes, IStream::SeekFrom::kCurrentPosition);
-    // Reset the offset so the next part will seek to the next second
-    offset = 1;
-  } else if (offset > 1 && mp3_info && mp3_info->toc && mp3_info->bytes) {
-    // VBR seeking
-    double percent =
-        ((offset - 1) * output.sample_rate_hz) / (double)mp3_info->length * 100;
-    percent = std::clamp(percent, 0., 100.);
-    int index = (int)percent;
-    if (index > 99)
-      index = 99;
-    uint8_t first_val = (*mp3_info->toc)[index];
-    uint8_t second_val = 255;
-    if (index < 99) {
-      second_val = (*mp3_info->toc)[index + 1];
+  if (offset > 0) {
+    auto res = Seek(static_cast<uint64_t>(offset) * output.sample_rate_hz);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
     }
-    double interp = first_val + (second_val - first_val) * (percent - index);
-    uint32_t bytes_to_skip =
-        (uint32_t)((1.0 / 255.0) * interp * mp3_info->bytes.value());
-    input->SeekTo(bytes_to_skip, IStream::SeekFrom::kCurrentPosition);
-    offset = 1;
+  } else {
+    Restart(data_start_);
+    skip_samples_ = encoder_delay_;
   }
 
-  if (offset != 0) {
-    buffer_.Empty();
-    uint32_t leftover_bytes = stream_->bufend - stream_->buffer;
-    mad_stream_skip(stream_.get(), leftover_bytes);
+  return output;
+}
+
+auto MadMp3Decoder::Seek(uint64_t pcm_frame) -> cpp::result<void, Error> {
+  if (!input_->CanSeek()) {
+    return cpp::fail(Error::kUnsupportedFormat);
   }
 
-  mad_timer_t timer;
-  mad_timer_reset(&timer);
-  bool need_refill = offset == 0 ? false : true;
-  bool seek_err = false;
+  // Work out which frame the target sample is in, remembering that the
+  // encoder delay comes before the first sample.
+  uint64_t sample = pcm_frame + encoder_delay_;
+  auto start = FindPrerollFrame(sample / samples_per_frame_);
+  if (!start) {
+    return cpp::fail(Error::kOutOfInput);
+  }
 
-  while (mad_timer_count(timer, MAD_UNITS_SECONDS) < offset) {
-    if (seek_err) {
-      return cpp::fail(ICodec::Error::kMalformedData);
-    }
+  // Decode from the start of the pre-roll, discarding everything up to the
+  // target sample.
+  Restart(start->second);
+  skip_samples_ = sample - start->first * samples_per_frame_;
+  current_stream_sample_ = pcm_frame * channels_;
+  return {};
+}
 
-    if (need_refill && buffer_.Refill(input_.get())) {
-      return cpp::fail(ICodec::Error::kMalformedData);
+auto MadMp3Decoder::BuildSeekIndex(IStream& stream)
+    -> std::optional<SeekIndex> {
+  if (!stream.CanSeek()) {
+    return {};
+  }
+  int64_t position = SkipID3Tags(stream).value_or(0);
+  SourceBuffer buffer{};
+
+  // Find the first frame the same way that libmad does: a valid header, with
+  // the next frame's sync word directly after its frame. If that first frame
+  // only holds gapless info, then the audio begins with the frame after it.
+  std::optional<uint32_t> first_header;
+  int64_t data_start = 0;
+  bool eof = false;
+  while (!first_header) {
+    if (!eof) {
+      eof = buffer.Refill(&stream);
     }
-    need_refill = false;
-
-    buffer_.ConsumeBytes([&](std::span<std::byte> buf) -> size_t {
-      mad_stream_buffer(stream_.get(),
-                        reinterpret_cast<const unsigned char*>(buf.data()),
-                        buf.size());
-
-      while (mad_header_decode(&header, stream_.get()) < 0) {
-        if (MAD_RECOVERABLE(stream_->error)) {
+    size_t used = 0;
+    buffer.ConsumeBytes([&](std::span<std::byte> buf) -> size_t {
+      for (; buf.size() - used >= 4; used++) {
+        auto frame = buf.subspan(used);
+        uint32_t header = HeaderBits(frame.first<4>());
+        auto length = FrameLength(frame.first<4>(), header);
+        if ((header & 0xffe00000) != 0xffe00000 || !length) {
           continue;
         }
-        if (stream_->error == MAD_ERROR_BUFLEN) {
-          need_refill = true;
-          return GetBytesUsed();
+        if (frame.size() < *length + 2) {
+          break;
         }
-        // The error is unrecoverable. Give up.
-        seek_err = true;
-        return 0;
+        if (frame[*length] != std::byte{0xff} ||
+            (frame[*length + 1] & std::byte{0xe0}) != std::byte{0xe0}) {
+          continue;
+        }
+        first_header = header;
+        data_start = position + used;
+
+        bool mpeg1 = ((header >> 19) & 0x3) == 3;
+        bool mono = ((header >> 6) & 0x3) == 3;
+        size_t info_offset = mono ? 4 + 17 : (mpeg1 ? 4 + 32 : 4 + 9);
+        if (*length >= 48) {
+          auto tag = frame.subspan(info_offset, 4);
+          if (std::memcmp(tag.data(), "Xing", 4) == 0 ||
+              std::memcmp(tag.data(), "Info", 4) == 0 ||
+              std::memcmp(tag.data(), "VBRI", 4) == 0) {
+            data_start += *length;
+          }
+        }
+        break;
       }
-
-      mad_timer_add(&timer, header.duration);
-      return GetBytesUsed();
+      position += used;
+      return used;
     });
+    if (!first_header && eof && used == 0) {
+      return {};
+    }
   }
 
-  return output;
+  SeekIndex index{
+      .stride = kSeekIndexStride,
+      .positions = std::pmr::vector<uint32_t>{&memory::kSpiRamResource},
+  };
+  uint64_t frame = 0;
+  ScanFrames(stream, buffer, *first_header, data_start, [&](int64_t pos) {
+    if (frame++ % index.stride == 0) {
+      index.positions.push_back(pos);
+    }
+    return true;
+  });
+  return index;
+}
+
+auto MadMp3Decoder::Restart(int64_t position) -> void {
+  input_->SeekTo(position, IStream::SeekFrom::kStartOfStream);
+  buffer_.Empty();
+
+  // Re-initialising the stream forgets the contents of the bit reservoir.
+  mad_stream_finish(stream_.get());
+  mad_stream_init(stream_.get());
+  mad_frame_mute(frame_.get());
+  mad_synth_mute(synth_.get());
+
+  current_frame_sample_ = -1;
+  current_stream_sample_ = 0;
+  skip_samples_ = 0;
+  is_eof_ = false;
+  is_eos_ = false;
+  requantizer_.Reset(channels_,
+                     sample::Requantizer::ShapingFor(sample_rate_hz_));
+}
+
+auto MadMp3Decoder::FindPrerollFrame(uint64_t frame_index)
+    -> std::optional<std::pair<uint64_t, int64_t>> {
+  // Recent frame positions, indexed by frame index.
+  std::array<int64_t, kMaxPrerollFrames + 1> positions;
+  auto position_of = [&](uint64_t i) -> int64_t& {
+    return positions[i % positions.size()];
+  };
+
+  // Walk the frame headers until we reach the frame we're after, starting from
+  // the closest indexed frame that leaves room for the pre-roll. Without an
+  // index, this means walking from the very start of the audio, so we index
+  // frames as we pass them to make later seeks cheaper.
+  const SeekIndex& index = prebuilt_index_ ? *prebuilt_index_ : seek_index_;
+  uint64_t earliest =
+      frame_index >= kMaxPrerollFrames ? frame_index - kMaxPrerollFrames : 0;
+  uint64_t entry = 0;
+  int64_t from = data_start_;
+  if (!index.positions.empty()) {
+    entry = std::min<uint64_t>(earliest / index.stride,
+                               index.positions.size() - 1);
+    from = index.positions[entry];
+  }
+
+  uint64_t current = entry * index.stride;
+  bool found = ScanFrames(
+      *input_, buffer_, first_header_, from, [&](int64_t position) {
+        position_of(current) = position;
+        if (!prebuilt_index_ && current % seek_index_.stride == 0 &&
+            current / seek_index_.stride == seek_index_.positions.size()) {
+          seek_index_.positions.push_back(position);
+        }
+        if (current == frame_index) {
+          return false;
+        }
+        current++;
+        return true;
+      });
+  if (!found) {
+    return {};
+  }
+
+  // Layer III frames may begin their data up to 511 bytes back, within the
+  // frames before them (the 'bit reservoir'). The target frame's output also
+  // depends on the two frames before it, via the overlap between granules and
+  // the synthesis filter's history. So we need to start far enough back that
+  // those two frames have their reservoir available.
+  uint64_t start = frame_index >= 2 ? frame_index - 2 : 0;
+  while (start > 0 && frame_index - start < kMaxPrerollFrames &&
+         position_of(frame_index - 2) - position_of(start) <
+             kMaxReservoirBytes) {
+    start--;
+  }
+  return std::make_pair(start, position_of(start));
 }
 
 auto MadMp3Decoder::DecodeTo(std::span<sample::Sample> output)
@@ -214,15 +491,25 @@ auto MadMp3Decoder::DecodeTo(std::span<sample::Sample> output)
     if (!is_eof_) {
       is_eof_ = buffer_.Refill(input_.get());
       if (is_eof_) {
-        buffer_.AddBytes([&](std::span<std::byte> buf) -> size_t {
-          if (buf.size() < MAD_BUFFER_GUARD) {
-            is_eof_ = false;
-            return 0;
-          }
-          ESP_LOGI(kTag, "adding MAD_BUFFER_GUARD");
-          std::fill_n(buf.begin(), MAD_BUFFER_GUARD, std::byte(0));
-          return 8;
-        });
+        // The guard may straddle the end of the ring, in which case it's added
+        // in two parts.
+        size_t guard_bytes = 0;
+        size_t added = 1;
+        while (guard_bytes < MAD_BUFFER_GUARD && added > 0) {
+          buffer_.AddBytes([&](std::span<std::byte> buf) -> size_t {
+            added = std::min<size_t>(buf.size(),
+                                     MAD_BUFFER_GUARD - guard_bytes);
+            std::fill_n(buf.begin(), added, std::byte(0));
+            return added;
+          });
+          guard_bytes += added;
+        }
+        if (guard_bytes < MAD_BUFFER_GUARD) {
+          // No room yet; try again once more of the buffer has been consumed.
+          is_eof_ = false;
+        } else {
+          ESP_LOGI(kTag, "added MAD_BUFFER_GUARD");
+        }
       }
     }
 
@@ -234,6 +521,13 @@ auto MadMp3Decoder::DecodeTo(std::span<sample::Sample> output)
       // Decode the next frame. To signal errors, this returns -1 and
       // stashes an error code in the stream structure.
       while (mad_frame_decode(frame_.get(), stream_.get()) < 0) {
+        if (stream_->error == MAD_ERROR_BADDATAPTR) {
+          // The frame's data begins in earlier frames that we haven't seen,
+          // as happens just after seeking. Output silence in its place, so
+          // that every frame still produces its share of samples.
+          mad_frame_mute(frame_.get());
+          break;
+        }
         if (MAD_RECOVERABLE(stream_->error)) {
           // Recoverable errors are usually malformed parts of the stream.
           // We can recover from them by just retrying the decode.
@@ -261,26 +555,44 @@ auto MadMp3Decoder::DecodeTo(std::span<sample::Sample> output)
 
   size_t output_sample = 0;
   if (current_frame_sample_ >= 0) {
-    // Skip any gap samples indicated by the headers
-    while (skip_samples_ > 0) {
-      skip_samples_--;
-      current_frame_sample_++;
-    }
+    // Skip any gap samples indicated by the headers, or left over from
+    // seeking. These may span several frames.
+    int skip = std::min(skip_samples_,
+                        synth_->pcm.length - current_frame_sample_);
+    skip_samples_ -= skip;
+    current_frame_sample_ += skip;
 
     // Process samples until we hit the end of the frame or stream
+    int channels = synth_->pcm.channels;
+    std::array<int32_t, kRequantizeChunk> wide;
     while (current_frame_sample_ < synth_->pcm.length && current_stream_sample_ <= total_samples_) {
-      if (output_sample + synth_->pcm.channels >= output.size()) {
+      if (output_sample + channels >= output.size()) {
         // We can't fit the next full frame into the buffer.
         return OutputInfo{.samples_written = output_sample,
                           .is_stream_finished = false};
       }
 
-      for (int channel = 0; channel < synth_->pcm.channels; channel++) {
-        output[output_sample++] =
-            sample::FromMad(synth_->pcm.samples[channel][current_frame_sample_]);
+      // Interleave as many whole frames as will fit into the chunk, the
+      // output, and the rest of the stream, then requantize them together.
+      int frames = std::min<int>({
+          synth_->pcm.length - current_frame_sample_,
+          static_cast<int>(output.size() - output_sample - 1) / channels,
+          static_cast<int>(wide.size()) / channels,
+          (total_samples_ - current_stream_sample_) / channels + 1,
+      });
+      size_t len = 0;
+      for (int i = 0; i < frames; i++) {
+        for (int channel = 0; channel < channels; channel++) {
+          wide[len++] =
+              widen(synth_->pcm.samples[channel][current_frame_sample_ + i]);
+        }
       }
-      current_frame_sample_++;
-      current_stream_sample_ += synth_->pcm.channels;
+      requantizer_.Requantize(std::span{wide}.first(len),
+                              output.subspan(output_sample, len));
+
+      output_sample += len;
+      current_frame_sample_ += frames;
+      current_stream_sample_ += frames * channels;
     }
     if (current_stream_sample_ > total_samples_) {
       is_eos_ = true;
@@ -381,10 +693,7 @@ auto MadMp3Decoder::GetMp3Info(const mad_header& header)
     return {};
   }
 
-  // Check TOC and bytes in the bitstream (used for VBR seeking)
-  // Also get gapless playback info: encoder delay and padding
-  std::optional<std::span<const unsigned char, 100>> toc;
-  std::optional<uint32_t> bytes;
+  // Get gapless playback info: encoder delay and padding
   auto lame_offset = xing_offset;
   uint16_t starting_sample = 0;
   uint16_t encoder_padding = 0;
@@ -394,32 +703,18 @@ auto MadMp3Decoder::GetMp3Info(const mad_header& header)
                      ((uint32_t)flags_raw[1] << 16) +
                      ((uint32_t)flags_raw[2] << 8) + ((uint32_t)flags_raw[3]);
     lame_offset += 8;
-    auto toc_offset = 8;
-    auto bytes_offset = 8;
     if (flags & 1) {
       // Frames field is present
       lame_offset += 4;
-      toc_offset += 4;
-      bytes_offset += 4;
     }
     if (flags & 2) {
       // Bytes field is present
       lame_offset += 4;
-      toc_offset += 4;
     }
     if (flags & 4) {
-      // TOC flag is set
+      // TOC flag is set. We seek by frame headers instead, since the TOC is
+      // only accurate to the nearest 1% of the stream.
       lame_offset += 100;
-      if (flags & 2) {
-        // Bytes field
-        unsigned char const* bytes_raw = stream_->this_frame + xing_offset + bytes_offset;
-        uint32_t num_bytes =
-            ((uint32_t)bytes_raw[0] << 24) + ((uint32_t)bytes_raw[1] << 16) +
-            ((uint32_t)bytes_raw[2] << 8) + ((uint32_t)bytes_raw[3]);
-        bytes.emplace(num_bytes);
-      }
-      // Read the table of contents in
-      toc.emplace((stream_->this_frame + xing_offset + toc_offset), 100);
     }
     if (flags & 8) {
       lame_offset += 4;
@@ -439,8 +734,6 @@ auto MadMp3Decoder::GetMp3Info(const mad_header& header)
   return Mp3Info{
       .starting_sample = starting_sample,
       .length = (frames_count * samples_per_frame - starting_sample - encoder_padding),
-      .bytes = bytes,
-      .toc = toc,
   };
 }
 
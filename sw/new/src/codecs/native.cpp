@@ -26,13 +26,30 @@ NativeDecoder::NativeDecoder() : input_() {}
 auto NativeDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
     -> cpp::result<OutputFormat, ICodec::Error> {
   input_ = input;
-  return OutputFormat{
+  OutputFormat format{
       .num_channels = 1,
       .sample_rate_hz = 48000,
       .total_samples = {},
       // sample rate * channels * bits per sample / bits per kb
       .bitrate_kbps = 48000 * 1 * 16 / 1024,
   };
+  if (offset > 0) {
+    auto res = Seek(static_cast<uint64_t>(offset) * format.sample_rate_hz);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
+    }
+  }
+  return format;
+}
+
+auto NativeDecoder::Seek(uint64_t pcm_frame) -> cpp::result<void, Error> {
+  if (!input_->CanSeek()) {
+    return cpp::fail(Error::kUnsupportedFormat);
+  }
+  // Native streams are raw mono samples, with no header.
+  input_->SeekTo(pcm_frame * sizeof(sample::Sample),
+                 IStream::SeekFrom::kStartOfStream);
+  return {};
 }
 
 auto NativeDecoder::DecodeTo(std::span<sample::Sample> output)
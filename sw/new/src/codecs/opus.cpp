@@ -135,8 +135,11 @@ auto XiphOpusDecoder::OpenStream(std::shared_ptr<IStream> input,
     bitrate_kbps = b / 1024;
   }
 
-  if (offset && op_pcm_seek(opus_, offset * 48000) != 0) {
-    return cpp::fail(Error::kInternalError);
+  if (offset) {
+    auto res = Seek(static_cast<uint64_t>(offset) * 48000);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
+    }
   }
 
   return OutputFormat{
@@ -147,6 +150,15 @@ auto XiphOpusDecoder::OpenStream(std::shared_ptr<IStream> input,
   };
 }
 
+auto XiphOpusDecoder::Seek(uint64_t pcm_frame) -> cpp::result<void, Error> {
+  // Opus is always decoded at 48kHz, so frames map directly onto granule
+  // positions. opusfile takes care of pre-roll and of the stream's pre-skip.
+  if (op_pcm_seek(opus_, pcm_frame) != 0) {
+    return cpp::fail(Error::kInternalError);
+  }
+  return {};
+}
+
 auto XiphOpusDecoder::DecodeTo(std::span<sample::Sample> output)
     -> cpp::result<OutputInfo, Error> {
   int samples_written = op_read_stereo(opus_, output.data(), output.size());
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "pcm_convert.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "requantizer.hpp"
+#include "sample.hpp"
+
+namespace codecs {
+
+// Each kernel below is a simple loop over the whole block, with the sample
+// encoding fixed at compile time, so that the compiler is free to unroll and
+// vectorise it. Samples wider than 16 bits are first widened to 32 bits in
+// small chunks, and then requantized.
+
+// Enough samples to amortise the requantizer's setup, whilst remaining
+// comfortably small enough to live on the stack.
+static constexpr size_t kChunkSize = 64;
+
+/* Returns the byte at the given significance (0 = least) within a sample. */
+template <size_t kBytes, std::endian kOrder>
+static inline auto byteAt(const std::byte* sample, size_t significance)
+    -> uint32_t {
+  if constexpr (kOrder == std::endian::little) {
+    return static_cast<uint8_t>(sample[significance]);
+  } else {
+    return static_cast<uint8_t>(sample[kBytes - 1 - significance]);
+  }
+}
+
+template <size_t kBytes, std::endian kOrder>
+static auto convertInteger(std::span<const std::byte> in,
+                           std::span<sample::Sample> out,
+                           sample::Requantizer& requantizer) -> void {
+  const std::byte* src = in.data();
+  sample::Sample* dest = out.data();
+  size_t count = out.size();
+
+  if constexpr (kBytes == 1) {
+    // 8 bit samples are unsigned. Recentring around zero is the same as
+    // flipping the top bit.
+    for (size_t i = 0; i < count; i++) {
+      dest[i] = static_cast<sample::Sample>(
+          (byteAt<1, kOrder>(src + i, 0) ^ 0x80) << 8);
+    }
+  } else if constexpr (kBytes == 2) {
+    for (size_t i = 0; i < count; i++) {
+      const std::byte* s = src + i * 2;
+      dest[i] = static_cast<sample::Sample>(byteAt<2, kOrder>(s, 1) << 8 |
+                                            byteAt<2, kOrder>(s, 0));
+    }
+  } else {
+    std::array<int32_t, kChunkSize> wide;
+    for (size_t start = 0; start < count; start += kChunkSize) {
+      size_t len = std::min(kChunkSize, count - start);
+      for (size_t i = 0; i < len; i++) {
+        const std::byte* s = src + (start + i) * kBytes;
+        uint32_t val = 0;
+        for (size_t b = 0; b < kBytes; b++) {
+          val |= byteAt<kBytes, kOrder>(s, b) << ((4 - kBytes + b) * 8);
+        }
+        wide[i] = static_cast<int32_t>(val);
+      }
+      requantizer.Requantize(std::span{wide}.first(len),
+                             out.subspan(start, len));
+    }
+  }
+}
+
+/* Scales a float sample to 32 bits in the same way as sample::FromDouble. */
+static inline auto widen(double val) -> int32_t {
+  return std::clamp<double>(val, -1.0, 1.0) * static_cast<double>(INT32_MAX);
+}
+
+template <std::endian kOrder>
+static auto convertFloat32(std::span<const std::byte> in,
+                           std::span<sample::Sample> out,
+                           sample::Requantizer& requantizer) -> void {
+  const std::byte* src = in.data();
+  size_t count = out.size();
+
+  std::array<int32_t, kChunkSize> wide;
+  for (size_t start = 0; start < count; start += kChunkSize) {
+    size_t len = std::min(kChunkSize, count - start);
+    for (size_t i = 0; i < len; i++) {
+      const std::byte* s = src + (start + i) * 4;
+      uint64_t val = byteAt<4, kOrder>(s, 3) << 24 |
+                     byteAt<4, kOrder>(s, 2) << 16 |
+                     byteAt<4, kOrder>(s, 1) << 8 | byteAt<4, kOrder>(s, 0);
+      // Widen to a double by rebiasing the exponent. Unlike a cast, this
+      // never produces a NaN, so out of range values are always clamped.
+      uint64_t sign = val >> 31;
+      uint64_t exp = (val >> 23) & 0xff;
+      uint64_t mantissa = val & 0x7fffff;
+      uint64_t widened =
+          sign << 63 | (exp - 127 + 1023) << 52 | mantissa << 29;
+      wide[i] = widen(std::bit_cast<double>(widened));
+    }
+    requantizer.Requantize(std::span{wide}.first(len),
+                           out.subspan(start, len));
+  }
+}
+
+template <std::endian kOrder>
+static auto convertFloat64(std::span<const std::byte> in,
+                           std::span<sample::Sample> out,
+                           sample::Requantizer& requantizer) -> void {
+  const std::byte* src = in.data();
+  size_t count = out.size();
+
+  std::array<int32_t, kChunkSize> wide;
+  for (size_t start = 0; start < count; start += kChunkSize) {
+    size_t len = std::min(kChunkSize, count - start);
+    for (size_t i = 0; i < len; i++) {
+      const std::byte* s = src + (start + i) * 8;
+      uint64_t val = 0;
+      for (size_t b = 0; b < 8; b++) {
+        val |= static_cast<uint64_t>(byteAt<8, kOrder>(s, b)) << (b * 8);
+      }
+      wide[i] = widen(std::bit_cast<double>(val));
+    }
+    requantizer.Requantize(std::span{wide}.first(len),
+                           out.subspan(start, len));
+  }
+}
+
+template <std::endian kOrder>
+static auto converterFor(PcmFormat format, uint16_t bytes_per_sample)
+    -> PcmConverter {
+  switch (format) {
+    case PcmFormat::kInteger:
+      switch (bytes_per_sample) {
+        case 1:
+          return convertInteger<1, kOrder>;
+        case 2:
+          return convertInteger<2, kOrder>;
+        case 3:
+          return convertInteger<3, kOrder>;
+        case 4:
+          return convertInteger<4, kOrder>;
+      }
+      break;
+    case PcmFormat::kFloat:
+      switch (bytes_per_sample) {
+        case 4:
+          return convertFloat32<kOrder>;
+        case 8:
+          return convertFloat64<kOrder>;
+      }
+      break;
+  }
+  return nullptr;
+}
+
+auto PcmConverterFor(PcmFormat format,
+                     uint16_t bytes_per_sample,
+                     std::endian order) -> PcmConverter {
+  if (order == std::endian::big) {
+    return converterFor<std::endian::big>(format, bytes_per_sample);
+  }
+  return converterFor<std::endian::little>(format, bytes_per_sample);
+}
+
+}  // namespace codecs
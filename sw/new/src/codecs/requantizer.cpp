@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "requantizer.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "sample.hpp"
+
+namespace sample {
+
+// All of the arithmetic happens with 24 bit samples, which leaves plenty of
+// headroom within an int32_t for the dither and the shaped error. The bits
+// below that are far beneath the noise floor of the output anyway.
+static constexpr int kWorkingShift = 8;
+static constexpr int kOutputShift = 16 - kWorkingShift;
+static constexpr int32_t kHalfStep = 1 << (kOutputShift - 1);
+
+Requantizer::Requantizer(uint32_t seed)
+    : rng_(seed), channels_(1), shaping_(Shaping::kNone), channel_(0) {
+  error_.fill({0, 0});
+}
+
+auto Requantizer::Reset(uint8_t channels, Shaping shaping) -> void {
+  channels_ = std::clamp<uint8_t>(channels, 1, kMaxChannels);
+  shaping_ = shaping;
+  channel_ = 0;
+  error_.fill({0, 0});
+}
+
+auto Requantizer::Requantize(std::span<const int32_t> in,
+                             std::span<Sample> out) -> void {
+  switch (shaping_) {
+    case Shaping::kNone:
+      requantize<Shaping::kNone>(in, out);
+      break;
+    case Shaping::kFirstOrder:
+      requantize<Shaping::kFirstOrder>(in, out);
+      break;
+    case Shaping::kSecondOrder:
+      requantize<Shaping::kSecondOrder>(in, out);
+      break;
+  }
+}
+
+auto Requantizer::ShapingFor(uint32_t sample_rate_hz) -> Shaping {
+  // At lower sample rates, the shaped noise would land well within the
+  // audible range.
+  if (sample_rate_hz >= 44100) {
+    return Shaping::kSecondOrder;
+  }
+  return Shaping::kNone;
+}
+
+template <Requantizer::Shaping kShaping>
+auto Requantizer::requantize(std::span<const int32_t> in,
+                             std::span<Sample> out) -> void {
+  size_t count = std::min(in.size(), out.size());
+  uint32_t rng = rng_;
+  uint8_t channel = channel_;
+
+  for (size_t i = 0; i < count; i++) {
+    // A plain LCG is plenty for dither; its high bits are well distributed,
+    // and it costs only a multiply and an add per sample. The difference of
+    // two uniform bytes gives a triangular distribution spanning +/- 1 LSB.
+    rng = rng * 1664525u + 1013904223u;
+    int32_t dither = static_cast<int32_t>(rng >> 24) -
+                     static_cast<int32_t>((rng >> 16) & 0xff);
+
+    int32_t target = in[i] >> kWorkingShift;
+    if constexpr (kShaping == Shaping::kFirstOrder) {
+      target -= error_[channel][0];
+    } else if constexpr (kShaping == Shaping::kSecondOrder) {
+      target -= 2 * error_[channel][0] - error_[channel][1];
+    }
+
+    int32_t quantised = (target + dither + kHalfStep) >> kOutputShift;
+
+    if constexpr (kShaping != Shaping::kNone) {
+      // The error is taken before clipping. Feeding back clipping error
+      // would let the filter run away on full scale signals.
+      error_[channel][1] = error_[channel][0];
+      error_[channel][0] = (quantised << kOutputShift) - target;
+      if (++channel == channels_) {
+        channel = 0;
+      }
+    }
+
+    out[i] = std::clamp<int32_t>(quantised, INT16_MIN, INT16_MAX);
+  }
+
+  rng_ = rng;
+  channel_ = channel;
+}
+
+}  // namespace sample
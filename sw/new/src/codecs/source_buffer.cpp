@@ -8,6 +8,7 @@
 #include <sys/_stdint.h>
 
 #include <algorithm>
+#include <cassert>
 #include <cstring>
 
 #include "esp_heap_caps.h"
@@ -21,12 +22,18 @@ namespace codecs {
 static constexpr size_t kBufferSize = 1024 * 16;
 static constexpr size_t kReadThreshold = 1024 * 8;
 
+// Bytes at the start of the ring that are mirrored past its end. This must be
+// at least the size of the largest frame that any codec reads in one go; the
+// largest possible mp3 frame is a little under 3KiB.
+static constexpr size_t kMirrorSize = 1024 * 4;
+
 SourceBuffer::SourceBuffer()
-    : buffer_(reinterpret_cast<std::byte*>(
-                  heap_caps_malloc(kBufferSize, MALLOC_CAP_SPIRAM)),
-              kBufferSize),
+    : buffer_(reinterpret_cast<std::byte*>(heap_caps_malloc(
+                  kBufferSize + kMirrorSize, MALLOC_CAP_SPIRAM)),
+              kBufferSize + kMirrorSize),
       bytes_in_buffer_(0),
-      offset_of_bytes_(0) {
+      offset_of_bytes_(0),
+      bytes_moved_(0) {
   assert(buffer_.data() != nullptr);
 }
 
@@ -43,34 +50,45 @@ auto SourceBuffer::Refill(IStream* src) -> bool {
     ssize_t bytes_read = src->Read(buf);
     // Treat read errors as EOF.
     eof = bytes_read <= 0;
-    return bytes_read;
+    return std::max<ssize_t>(bytes_read, 0);
   });
   return eof;
 }
 
-auto SourceBuffer::AddBytes(std::function<size_t(std::span<std::byte>)> writer)
-    -> void {
-  if (offset_of_bytes_ > 0) {
-    std::memmove(buffer_.data(), buffer_.data() + offset_of_bytes_,
-                 bytes_in_buffer_);
-    offset_of_bytes_ = 0;
-  }
-  size_t added_bytes = std::invoke(writer, buffer_.subspan(bytes_in_buffer_));
-  assert(bytes_in_buffer_ + added_bytes <= buffer_.size_bytes());
+auto SourceBuffer::WritableBytes() -> std::span<std::byte> {
+  size_t start = (offset_of_bytes_ + bytes_in_buffer_) % kBufferSize;
+  size_t free_bytes = kBufferSize - bytes_in_buffer_;
+  return buffer_.subspan(start, std::min(free_bytes, kBufferSize - start));
+}
+
+auto SourceBuffer::CommitWrite(size_t added_bytes) -> void {
+  assert(bytes_in_buffer_ + added_bytes <= kBufferSize);
+  size_t start = (offset_of_bytes_ + bytes_in_buffer_) % kBufferSize;
   bytes_in_buffer_ += added_bytes;
+
+  // Keep the mirror in sync with the start of the ring.
+  if (start < kMirrorSize) {
+    size_t mirrored = std::min(added_bytes, kMirrorSize - start);
+    std::memcpy(buffer_.data() + kBufferSize + start, buffer_.data() + start,
+                mirrored);
+    bytes_moved_ += mirrored;
+  }
+}
+
+auto SourceBuffer::ReadableBytes() -> std::span<std::byte> {
+  size_t contiguous = kBufferSize - offset_of_bytes_ + kMirrorSize;
+  return buffer_.subspan(offset_of_bytes_,
+                         std::min(bytes_in_buffer_, contiguous));
 }
 
-auto SourceBuffer::ConsumeBytes(
-    std::function<size_t(std::span<std::byte>)> reader) -> void {
-  size_t bytes_consumed =
-      std::invoke(reader, buffer_.subspan(offset_of_bytes_, bytes_in_buffer_));
+auto SourceBuffer::CommitRead(size_t bytes_consumed) -> void {
   assert(bytes_consumed <= bytes_in_buffer_);
 
   bytes_in_buffer_ -= bytes_consumed;
   if (bytes_in_buffer_ == 0) {
     offset_of_bytes_ = 0;
   } else {
-    offset_of_bytes_ += bytes_consumed;
+    offset_of_bytes_ = (offset_of_bytes_ + bytes_consumed) % kBufferSize;
   }
 }
 
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+
+#include "codec.hpp"
+#include "mad.hpp"
+#include "memory_stream.hpp"
+#include "sample.hpp"
+#include "test.mp3.hpp"
+#include "types.hpp"
+
+namespace codecs {
+
+// Where the fixture's audio begins, after its Xing header. Its two audio
+// frames are 192 and 32 kbps, so repeating them makes for a VBR stream of any
+// length we like.
+static constexpr size_t kFirstAudioFrame = 417;
+static constexpr size_t kSecondAudioFrame = 1043;
+static constexpr uint32_t kSamplesPerFrame = 1152;
+static constexpr uint32_t kSampleRate = 44100;
+
+static auto fixture() -> std::span<const std::byte> {
+  return std::span<const std::byte>{reinterpret_cast<std::byte*>(test_mp3),
+                                    test_mp3_len};
+}
+
+/*
+ * The fixture's two audio frames, swapped around. Without a Xing header, the
+ * decoder guesses the stream's length from the first frame's bitrate, so the
+ * slower frame goes first in order for the guess to overshoot rather than cut
+ * the stream short.
+ */
+static auto audioFrames() -> std::span<const std::byte> {
+  static const std::vector<std::byte> frames = []() {
+    auto all = fixture();
+    std::vector<std::byte> out{all.begin() + kSecondAudioFrame, all.end()};
+    out.insert(out.end(), all.begin() + kFirstAudioFrame,
+               all.begin() + kSecondAudioFrame);
+    return out;
+  }();
+  return frames;
+}
+
+/*
+ * A MemoryStream that may come with a prebuilt index, and that keeps count of
+ * how much has been read from it.
+ */
+class IndexedStream : public MemoryStream {
+ public:
+  IndexedStream(std::span<const std::byte> data,
+                size_t repeats,
+                std::shared_ptr<const SeekIndex> index)
+      : MemoryStream(StreamType::kMp3, data, repeats),
+        bytes_read(0),
+        index_(index) {}
+
+  auto Read(std::span<std::byte> dest) -> ssize_t override {
+    ssize_t res = MemoryStream::Read(dest);
+    bytes_read += res;
+    return res;
+  }
+
+  auto GetSeekIndex() -> std::shared_ptr<const SeekIndex> override {
+    return index_;
+  }
+
+  size_t bytes_read;
+
+ private:
+  std::shared_ptr<const SeekIndex> index_;
+};
+
+static auto buildIndex(size_t repeats) -> std::shared_ptr<SeekIndex> {
+  MemoryStream stream{StreamType::kMp3, audioFrames(), repeats};
+  auto index = MadMp3Decoder::BuildSeekIndex(stream);
+  REQUIRE(index);
+  return std::make_shared<SeekIndex>(*index);
+}
+
+/*
+ * Decodes until some samples come out. The first few frames after a seek may
+ * be pre-roll, which is decoded but then discarded.
+ */
+static auto decodeSome(ICodec& codec) -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out(kSamplesPerFrame * 2);
+  for (;;) {
+    auto res = codec.DecodeTo(out);
+    REQUIRE(res.has_value());
+    if (res->samples_written > 0 || res->is_stream_finished) {
+      out.resize(res->samples_written);
+      return out;
+    }
+  }
+}
+
+/* Seeks to the given PCM frame, then decodes a little from there. */
+static auto decodeFrom(std::shared_ptr<IndexedStream> stream, uint64_t frame)
+    -> std::vector<sample::Sample> {
+  MadMp3Decoder codec{};
+  REQUIRE(codec.OpenStream(stream, 0).has_value());
+  REQUIRE(codec.Seek(frame).has_value());
+  return decodeSome(codec);
+}
+
+TEST_CASE("mp3 seek index", "[unit]") {
+  constexpr size_t kRepeats = 200;
+
+  SECTION("records every stride'th frame") {
+    auto index = buildIndex(kRepeats);
+    // Every entry is an even number of frames in, so each one is a whole
+    // number of repeats of the fixture's two frames.
+    REQUIRE(index->stride % 2 == 0);
+    REQUIRE(index->positions.size() ==
+            (kRepeats * 2 + index->stride - 1) / index->stride);
+    for (size_t i = 0; i < index->positions.size(); i++) {
+      REQUIRE(index->positions[i] ==
+              i * index->stride / 2 * audioFrames().size());
+    }
+  }
+
+  SECTION("begins after any gapless info") {
+    MemoryStream stream{StreamType::kMp3, fixture()};
+    auto index = MadMp3Decoder::BuildSeekIndex(stream);
+    REQUIRE(index);
+    REQUIRE(index->positions.size() == 1);
+    REQUIRE(index->positions[0] == kFirstAudioFrame);
+  }
+
+  SECTION("fails for streams with no frames") {
+    std::vector<std::byte> junk(4096, std::byte{0x42});
+    MemoryStream stream{StreamType::kMp3, junk};
+    REQUIRE(!MadMp3Decoder::BuildSeekIndex(stream));
+  }
+
+  SECTION("seeks exactly as a seek without an index does") {
+    auto index = buildIndex(kRepeats);
+
+    // An index for some other stream, which should be ignored.
+    auto wrong = std::make_shared<SeekIndex>(*index);
+    wrong->positions[0] += 1;
+
+    uint64_t total = kRepeats * 2 * kSamplesPerFrame;
+    for (uint64_t frame : std::vector<uint64_t>{0, 1, 1151, 40000, 123457,
+                                                total - 5000}) {
+      INFO("seeking to frame " << frame);
+      auto expected = decodeFrom(
+          std::make_shared<IndexedStream>(audioFrames(), kRepeats, nullptr),
+          frame);
+      REQUIRE(!expected.empty());
+
+      auto indexed =
+          std::make_shared<IndexedStream>(audioFrames(), kRepeats, index);
+      REQUIRE(decodeFrom(indexed, frame) == expected);
+      // Only the last stretch of the stream before the target was read.
+      REQUIRE(indexed->bytes_read < 64 * 1024);
+
+      REQUIRE(decodeFrom(std::make_shared<IndexedStream>(audioFrames(),
+                                                         kRepeats, wrong),
+                         frame) == expected);
+    }
+  }
+}
+
+TEST_CASE("mp3 seek latency", "[.benchmark]") {
+  // About two hours of audio; the length of a long podcast episode.
+  constexpr size_t kRepeats = 2 * 60 * 60 * kSampleRate / kSamplesPerFrame / 2;
+
+  int64_t start = esp_timer_get_time();
+  auto index = buildIndex(kRepeats);
+  std::printf("indexed %zu KiB in %lld ms, into %zu entries\n",
+              kRepeats * audioFrames().size() / 1024,
+              (esp_timer_get_time() - start) / 1000, index->positions.size());
+
+  std::printf("%8s %14s %14s %14s %14s\n", "minutes", "scan us",
+              "scan KiB read", "index us", "index KiB read");
+  uint64_t total = kRepeats * 2 * kSamplesPerFrame;
+  for (uint64_t minutes = 0; minutes <= 120; minutes += 10) {
+    uint64_t frame = std::min(minutes * 60 * kSampleRate, total - 5000);
+    std::printf("%8u", static_cast<unsigned>(minutes));
+    for (auto i : {std::shared_ptr<SeekIndex>{}, index}) {
+      auto stream =
+          std::make_shared<IndexedStream>(audioFrames(), kRepeats, i);
+      MadMp3Decoder codec{};
+      REQUIRE(codec.OpenStream(stream, 0).has_value());
+      stream->bytes_read = 0;
+
+      // Time from asking for the seek until the first samples are ready.
+      int64_t start = esp_timer_get_time();
+      REQUIRE(codec.Seek(frame).has_value());
+      REQUIRE(!decodeSome(codec).empty());
+      int64_t elapsed = esp_timer_get_time() - start;
+      std::printf(" %14lld %14zu", elapsed, stream->bytes_read / 1024);
+    }
+    std::printf("\n");
+  }
+}
+
+}  // namespace codecs
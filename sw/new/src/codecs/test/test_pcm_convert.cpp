@@ -0,0 +1,235 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "pcm_convert.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+
+#include "requantizer.hpp"
+#include "sample.hpp"
+
+namespace codecs {
+
+/*
+ * The per-sample conversions that WavDecoder used before it had specialised
+ * kernels, kept as the reference that the kernels must match. Samples wider
+ * than 16 bits are widened to 32 bits here, ready for requantizing.
+ */
+static auto scalarInteger(std::span<const std::byte> bytes) -> int32_t {
+  int depth = bytes.size();
+  int32_t val = 0;
+  if (depth == 1) {
+    return sample::FromUnsigned((uint8_t)bytes[0], 8);
+  }
+  switch (depth) {
+    case 4:
+      val = (uint8_t)bytes[3];
+      [[fallthrough]];
+    case 3:
+      val = (val << 8) | (uint8_t)bytes[2];
+      [[fallthrough]];
+    case 2:
+      val = (val << 8) | (uint8_t)bytes[1];
+      [[fallthrough]];
+    case 1:
+      val = (val << 8) | (uint8_t)bytes[0];
+  }
+  if (depth == 2) {
+    return sample::FromSigned(val, 16);
+  }
+  return static_cast<int32_t>(static_cast<uint32_t>(val) << (32 - depth * 8));
+}
+
+static auto widenDouble(double val) -> int32_t {
+  return std::clamp<double>(val, -1.0, 1.0) * static_cast<double>(INT32_MAX);
+}
+
+static auto scalarFloat32(std::span<const std::byte> bytes) -> int32_t {
+  uint64_t val = 0;
+  val = (uint8_t)bytes[3];
+  val = (val << 8) | (uint8_t)bytes[2];
+  val = (val << 8) | (uint8_t)bytes[1];
+  val = (val << 8) | (uint8_t)bytes[0];
+  uint64_t sign = val >> 31;
+  val -= (sign << 31);
+  uint64_t exp = (val >> 23);
+  val -= (exp << 23);
+  exp = exp - 127 + 1023;
+  uint64_t dval = (sign << 63) + (exp << 52) + (val << 29);
+  return widenDouble(std::bit_cast<double>(dval));
+}
+
+static auto scalarFloat64(std::span<const std::byte> bytes) -> int32_t {
+  uint64_t val = 0;
+  for (int i = 7; i >= 0; i--) {
+    val = (val << 8) | (uint8_t)bytes[i];
+  }
+  return widenDouble(std::bit_cast<double>(val));
+}
+
+static constexpr uint32_t kSeed = 0xc0ffee;
+static constexpr uint8_t kChannels = 2;
+
+static auto newRequantizer() -> sample::Requantizer {
+  sample::Requantizer requantizer{kSeed};
+  requantizer.Reset(kChannels, sample::Requantizer::Shaping::kSecondOrder);
+  return requantizer;
+}
+
+static auto scalarConvert(PcmFormat format,
+                          size_t bytes_per_sample,
+                          std::span<const std::byte> in)
+    -> std::vector<int16_t> {
+  std::vector<int32_t> values;
+  for (size_t i = 0; i < in.size(); i += bytes_per_sample) {
+    auto data = in.subspan(i, bytes_per_sample);
+    if (format == PcmFormat::kInteger) {
+      values.push_back(scalarInteger(data));
+    } else if (bytes_per_sample == 4) {
+      values.push_back(scalarFloat32(data));
+    } else {
+      values.push_back(scalarFloat64(data));
+    }
+  }
+
+  std::vector<int16_t> out(values.size());
+  if (format == PcmFormat::kInteger && bytes_per_sample <= 2) {
+    std::copy(values.begin(), values.end(), out.begin());
+  } else {
+    auto requantizer = newRequantizer();
+    requantizer.Requantize(values, out);
+  }
+  return out;
+}
+
+/* Generates little-endian samples, including every awkward edge case. */
+static auto randomSamples(PcmFormat format,
+                          size_t bytes_per_sample,
+                          size_t count) -> std::vector<std::byte> {
+  std::minstd_rand rng{0x3a7};
+  std::vector<std::byte> out(count * bytes_per_sample);
+  for (size_t i = 0; i < count; i++) {
+    std::byte* dest = out.data() + i * bytes_per_sample;
+    if (format == PcmFormat::kInteger) {
+      for (size_t b = 0; b < bytes_per_sample; b++) {
+        dest[b] = static_cast<std::byte>(rng());
+      }
+    } else if (bytes_per_sample == 4) {
+      // Mostly in range, with some clipping, zeroes, and denormals.
+      static const float kSpecial[] = {0.0f, -0.0f, 1.0f, -1.0f, 1e-40f,
+                                       INFINITY, -INFINITY, 3.0f};
+      float val = (i % 16 == 0) ? kSpecial[(i / 16) % 8]
+                                : (rng() / 2147483647.0f) * 2.4f - 1.2f;
+      std::memcpy(dest, &val, 4);
+    } else {
+      static const double kSpecial[] = {0.0, -0.0, 1.0, -1.0, 1e-300, 3.0};
+      double val = (i % 16 == 0) ? kSpecial[(i / 16) % 6]
+                                 : (rng() / 2147483647.0) * 2.4 - 1.2;
+      std::memcpy(dest, &val, 8);
+    }
+  }
+  return out;
+}
+
+static auto swapEndianness(std::span<const std::byte> in,
+                           size_t bytes_per_sample) -> std::vector<std::byte> {
+  std::vector<std::byte> out{in.begin(), in.end()};
+  for (size_t i = 0; i < out.size(); i += bytes_per_sample) {
+    std::reverse(out.begin() + i, out.begin() + i + bytes_per_sample);
+  }
+  return out;
+}
+
+struct Encoding {
+  PcmFormat format;
+  size_t bytes_per_sample;
+};
+
+static const Encoding kEncodings[] = {
+    {PcmFormat::kInteger, 1}, {PcmFormat::kInteger, 2},
+    {PcmFormat::kInteger, 3}, {PcmFormat::kInteger, 4},
+    {PcmFormat::kFloat, 4},   {PcmFormat::kFloat, 8},
+};
+
+TEST_CASE("pcm conversion kernels", "[unit]") {
+  constexpr size_t kSamples = 4099;
+
+  for (const auto& enc : kEncodings) {
+    INFO("format " << static_cast<int>(enc.format) << ", "
+                   << enc.bytes_per_sample << " bytes");
+    auto in = randomSamples(enc.format, enc.bytes_per_sample, kSamples);
+    auto expected = scalarConvert(enc.format, enc.bytes_per_sample, in);
+
+    auto little = PcmConverterFor(enc.format, enc.bytes_per_sample,
+                                  std::endian::little);
+    REQUIRE(little != nullptr);
+    std::vector<int16_t> out(kSamples);
+    auto requantizer = newRequantizer();
+    little(in, out, requantizer);
+    REQUIRE(out == expected);
+
+    auto big =
+        PcmConverterFor(enc.format, enc.bytes_per_sample, std::endian::big);
+    REQUIRE(big != nullptr);
+    auto swapped = swapEndianness(in, enc.bytes_per_sample);
+    std::fill(out.begin(), out.end(), 0);
+    requantizer = newRequantizer();
+    big(swapped, out, requantizer);
+    REQUIRE(out == expected);
+  }
+
+  SECTION("unsupported encodings") {
+    REQUIRE(PcmConverterFor(PcmFormat::kInteger, 5, std::endian::little) ==
+            nullptr);
+    REQUIRE(PcmConverterFor(PcmFormat::kFloat, 2, std::endian::little) ==
+            nullptr);
+  }
+}
+
+TEST_CASE("pcm conversion performance", "[.benchmark]") {
+  constexpr size_t kSamples = 4096;
+  constexpr size_t kIterations = 100;
+
+  for (const auto& enc : kEncodings) {
+    auto in = randomSamples(enc.format, enc.bytes_per_sample, kSamples);
+    std::vector<int16_t> out(kSamples);
+
+    int64_t start = esp_timer_get_time();
+    for (size_t i = 0; i < kIterations; i++) {
+      out = scalarConvert(enc.format, enc.bytes_per_sample, in);
+    }
+    int64_t scalar_us = esp_timer_get_time() - start;
+
+    auto converter = PcmConverterFor(enc.format, enc.bytes_per_sample,
+                                     std::endian::little);
+    auto requantizer = newRequantizer();
+    start = esp_timer_get_time();
+    for (size_t i = 0; i < kIterations; i++) {
+      converter(in, out, requantizer);
+    }
+    int64_t kernel_us = esp_timer_get_time() - start;
+
+    double samples = kSamples * kIterations;
+    std::printf("%s %u bytes: scalar %.1f ns/sample, kernel %.1f ns/sample\n",
+                enc.format == PcmFormat::kInteger ? "int" : "float",
+                static_cast<unsigned>(enc.bytes_per_sample),
+                scalar_us * 1000.0 / samples, kernel_us * 1000.0 / samples);
+  }
+}
+
+}  // namespace codecs
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "requantizer.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+
+#include "sample.hpp"
+
+namespace sample {
+
+using Shaping = Requantizer::Shaping;
+
+static const Shaping kShapings[] = {Shaping::kNone, Shaping::kFirstOrder,
+                                    Shaping::kSecondOrder};
+
+/* Generates 32 bit samples of a quiet sine wave, with a little noise. */
+static auto testSignal(size_t count) -> std::vector<int32_t> {
+  std::minstd_rand rng{0x71};
+  std::vector<int32_t> out(count);
+  for (size_t i = 0; i < count; i++) {
+    double val = 0.25 * std::sin(i * 0.031) + (rng() % 4096) / 1e9;
+    out[i] = static_cast<int32_t>(val * INT32_MAX);
+  }
+  return out;
+}
+
+static auto requantize(std::span<const int32_t> in,
+                       Shaping shaping,
+                       uint32_t seed = Requantizer::kDefaultSeed,
+                       uint8_t channels = 2) -> std::vector<Sample> {
+  Requantizer requantizer{seed};
+  requantizer.Reset(channels, shaping);
+  std::vector<Sample> out(in.size());
+  requantizer.Requantize(in, out);
+  return out;
+}
+
+TEST_CASE("requantizer", "[unit]") {
+  auto in = testSignal(10000);
+
+  SECTION("is deterministic under a seed") {
+    for (auto shaping : kShapings) {
+      REQUIRE(requantize(in, shaping, 1) == requantize(in, shaping, 1));
+      REQUIRE(requantize(in, shaping, 1) != requantize(in, shaping, 2));
+    }
+  }
+
+  SECTION("gives the same result however the input is split up") {
+    for (auto shaping : kShapings) {
+      auto expected = requantize(in, shaping, 7, 3);
+
+      Requantizer requantizer{7};
+      requantizer.Reset(3, shaping);
+      std::vector<Sample> out(in.size());
+      size_t pos = 0;
+      for (size_t len : {1, 2, 64, 5, 1000}) {
+        requantizer.Requantize(std::span{in}.subspan(pos, len),
+                               std::span{out}.subspan(pos, len));
+        pos += len;
+      }
+      requantizer.Requantize(std::span{in}.subspan(pos),
+                             std::span{out}.subspan(pos));
+      REQUIRE(out == expected);
+    }
+  }
+
+  SECTION("stays close to the input without shaping") {
+    auto out = requantize(in, Shaping::kNone);
+    for (size_t i = 0; i < in.size(); i++) {
+      double exact = in[i] / 65536.0;
+      REQUIRE(std::abs(out[i] - exact) <= 1.5);
+    }
+  }
+
+  SECTION("is unbiased") {
+    // A constant input partway between two output values should average out
+    // to that value, rather than always truncating downwards.
+    for (auto shaping : kShapings) {
+      std::vector<int32_t> constant(20000, 1000 * 65536 + 16384);
+      auto out = requantize(constant, shaping);
+      double sum = 0;
+      for (auto s : out) {
+        sum += s;
+      }
+      REQUIRE(std::abs(sum / out.size() - 1000.25) < 0.02);
+    }
+  }
+
+  SECTION("clips full scale signals without wrapping") {
+    for (auto shaping : kShapings) {
+      std::vector<int32_t> full;
+      for (size_t i = 0; i < 1000; i++) {
+        full.push_back(i % 200 < 100 ? INT32_MAX : INT32_MIN);
+      }
+      auto out = requantize(full, shaping);
+      for (size_t i = 0; i < out.size(); i++) {
+        // Allow for the dither at the very edges.
+        REQUIRE(out[i] * (full[i] > 0 ? 1 : -1) >= INT16_MAX - 4);
+      }
+    }
+  }
+
+  SECTION("shapes noise towards high frequencies") {
+    // Compare the energy of the error below and above a quarter of the sample
+    // rate, using the sum and difference of neighbouring samples as crude
+    // low and high pass filters.
+    auto lowToHigh = [&](Shaping shaping) {
+      auto out = requantize(in, shaping, Requantizer::kDefaultSeed, 1);
+      double low = 0, high = 0, prev = 0;
+      for (size_t i = 0; i < in.size(); i++) {
+        double error = out[i] - in[i] / 65536.0;
+        low += (error + prev) * (error + prev);
+        high += (error - prev) * (error - prev);
+        prev = error;
+      }
+      return low / high;
+    };
+    // For white noise passed through each shaping filter, these ratios work
+    // out to 1, 1/3, and 1/5.
+    REQUIRE(std::abs(lowToHigh(Shaping::kNone) - 1.0) < 0.05);
+    REQUIRE(std::abs(lowToHigh(Shaping::kFirstOrder) - 1 / 3.0) < 0.05);
+    REQUIRE(std::abs(lowToHigh(Shaping::kSecondOrder) - 1 / 5.0) < 0.05);
+  }
+}
+
+TEST_CASE("requantizer performance", "[.benchmark]") {
+  constexpr size_t kSamples = 4096;
+  constexpr size_t kIterations = 100;
+  auto in = testSignal(kSamples);
+  std::vector<Sample> out(kSamples);
+
+  int64_t start = esp_timer_get_time();
+  for (size_t i = 0; i < kIterations; i++) {
+    for (size_t s = 0; s < kSamples; s++) {
+      out[s] = shiftWithDither(in[s], 16);
+    }
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  double samples = kSamples * kIterations;
+  std::printf("shiftWithDither: %.1f ns/sample\n", elapsed * 1000.0 / samples);
+
+  const char* names[] = {"none", "first order", "second order"};
+  for (auto shaping : kShapings) {
+    Requantizer requantizer;
+    requantizer.Reset(2, shaping);
+    start = esp_timer_get_time();
+    for (size_t i = 0; i < kIterations; i++) {
+      requantizer.Requantize(in, out);
+    }
+    elapsed = esp_timer_get_time() - start;
+    std::printf("requantizer, %s shaping: %.1f ns/sample\n",
+                names[static_cast<int>(shaping)], elapsed * 1000.0 / samples);
+  }
+}
+
+}  // namespace sample
@@ -0,0 +1,446 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "ogg/ogg.h"
+#include "opus.h"
+
+#include "codec.hpp"
+#include "dr_flac.hpp"
+#include "mad.hpp"
+#include "memory_stream.hpp"
+#include "opus.hpp"
+#include "sample.hpp"
+#include "test.mp3.hpp"
+#include "types.hpp"
+#include "wav.hpp"
+
+namespace codecs {
+
+/*
+ * We have no encoders for most formats on hand, so these fixtures are built
+ * here from a synthetic signal instead. It's a pair of tones that drift apart,
+ * plus a little noise, so that no two stretches of it look alike.
+ */
+static auto signal(size_t frames, uint8_t channels, uint32_t rate)
+    -> std::vector<int16_t> {
+  std::vector<int16_t> out;
+  uint32_t noise = 1;
+  for (size_t i = 0; i < frames; i++) {
+    double t = static_cast<double>(i) / rate;
+    for (uint8_t c = 0; c < channels; c++) {
+      noise = noise * 1664525 + 1013904223;
+      double tone = std::sin(2 * M_PI * (300 + 200 * c) * t * (1 + t)) +
+                    std::sin(2 * M_PI * 1234 * t);
+      out.push_back(static_cast<int16_t>(tone * 8000 + (noise >> 24) - 128));
+    }
+  }
+  return out;
+}
+
+static auto append16le(std::vector<std::byte>& out, uint32_t val) -> void {
+  out.push_back(static_cast<std::byte>(val));
+  out.push_back(static_cast<std::byte>(val >> 8));
+}
+
+static auto append32le(std::vector<std::byte>& out, uint32_t val) -> void {
+  append16le(out, val);
+  append16le(out, val >> 16);
+}
+
+static auto appendStr(std::vector<std::byte>& out, const char* str) -> void {
+  for (; *str; str++) {
+    out.push_back(static_cast<std::byte>(*str));
+  }
+}
+
+static auto makeWav(std::span<const int16_t> samples,
+                    uint8_t channels,
+                    uint32_t rate) -> std::vector<std::byte> {
+  std::vector<std::byte> out;
+  appendStr(out, "RIFF");
+  append32le(out, 36 + samples.size_bytes());
+  appendStr(out, "WAVEfmt ");
+  append32le(out, 16);
+  append16le(out, 1);  // PCM
+  append16le(out, channels);
+  append32le(out, rate);
+  append32le(out, rate * channels * 2);
+  append16le(out, channels * 2);
+  append16le(out, 16);
+  appendStr(out, "data");
+  append32le(out, samples.size_bytes());
+  for (int16_t s : samples) {
+    append16le(out, s);
+  }
+  return out;
+}
+
+/* Big-endian bit writer, for the FLAC fixture. */
+class BitWriter {
+ public:
+  auto bits(uint64_t val, int count) -> void {
+    for (int i = count - 1; i >= 0; i--) {
+      acc_ = acc_ << 1 | ((val >> i) & 1);
+      if (++len_ == 8) {
+        out_.push_back(static_cast<std::byte>(acc_));
+        acc_ = 0;
+        len_ = 0;
+      }
+    }
+  }
+  auto bytes() -> std::vector<std::byte>& { return out_; }
+
+ private:
+  std::vector<std::byte> out_;
+  uint8_t acc_ = 0;
+  int len_ = 0;
+};
+
+static auto crc(std::span<const std::byte> data, int width, uint32_t poly)
+    -> uint32_t {
+  uint32_t top = 1u << (width - 1);
+  uint32_t mask = (top << 1) - 1;
+  uint32_t crc = 0;
+  for (std::byte b : data) {
+    crc ^= static_cast<uint32_t>(b) << (width - 8);
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & top) ? (crc << 1) ^ poly : crc << 1;
+    }
+    crc &= mask;
+  }
+  return crc;
+}
+
+/*
+ * Produces a FLAC stream with every sample stored verbatim. It's no smaller
+ * than a WAV, but it has real frames and no seek table, so seeking has to
+ * find its way by frame headers.
+ */
+static auto makeFlac(std::span<const int16_t> samples,
+                     uint8_t channels,
+                     uint32_t rate) -> std::vector<std::byte> {
+  constexpr uint32_t kBlockSize = 1152;
+  size_t frames = samples.size() / channels;
+
+  BitWriter w;
+  w.bits(0x664c6143, 32);  // fLaC
+  w.bits(1, 1);            // Last metadata block
+  w.bits(0, 7);            // STREAMINFO
+  w.bits(34, 24);
+  w.bits(kBlockSize, 16);
+  w.bits(kBlockSize, 16);
+  w.bits(0, 24);
+  w.bits(0, 24);
+  w.bits(rate, 20);
+  w.bits(channels - 1, 3);
+  w.bits(15, 5);
+  w.bits(frames, 36);
+  w.bits(0, 64);
+  w.bits(0, 64);
+
+  for (size_t n = 0; n * kBlockSize < frames; n++) {
+    size_t start = w.bytes().size();
+    uint32_t len = std::min<size_t>(kBlockSize, frames - n * kBlockSize);
+    w.bits(0xfff8, 16);          // Sync, fixed block size
+    w.bits(0x7, 4);              // Block size at the end of the header
+    w.bits(0x0, 4);              // Sample rate from STREAMINFO
+    w.bits(channels - 1, 4);     // Independent channels
+    w.bits(0x4, 3);              // 16 bit samples
+    w.bits(0, 1);
+    if (n < 0x80) {  // Frame number, UTF-8 style
+      w.bits(n, 8);
+    } else {
+      w.bits(0xe0 | n >> 12, 8);
+      w.bits(0x80 | (n >> 6 & 0x3f), 8);
+      w.bits(0x80 | (n & 0x3f), 8);
+    }
+    w.bits(len - 1, 16);
+    w.bits(crc(std::span{w.bytes()}.subspan(start), 8, 0x07), 8);
+
+    for (uint8_t c = 0; c < channels; c++) {
+      w.bits(0x02, 8);  // Verbatim subframe
+      for (size_t i = 0; i < len; i++) {
+        w.bits(static_cast<uint16_t>(
+                   samples[(n * kBlockSize + i) * channels + c]),
+               16);
+      }
+    }
+    w.bits(crc(std::span{w.bytes()}.subspan(start), 16, 0x8005), 16);
+  }
+  return w.bytes();
+}
+
+static auto makeOpus(std::span<const int16_t> samples)
+    -> std::vector<std::byte> {
+  constexpr int kFrameSize = 960;
+  int err;
+  OpusEncoder* enc =
+      opus_encoder_create(48000, 2, OPUS_APPLICATION_AUDIO, &err);
+  REQUIRE(err == OPUS_OK);
+  opus_int32 preskip;
+  opus_encoder_ctl(enc, OPUS_GET_LOOKAHEAD(&preskip));
+
+  std::vector<std::byte> out;
+  ogg_stream_state ogg;
+  ogg_stream_init(&ogg, 1);
+  auto write_pages = [&](bool flush) {
+    ogg_page page;
+    while (flush ? ogg_stream_flush(&ogg, &page)
+                 : ogg_stream_pageout(&ogg, &page)) {
+      auto* header = reinterpret_cast<std::byte*>(page.header);
+      auto* body = reinterpret_cast<std::byte*>(page.body);
+      out.insert(out.end(), header, header + page.header_len);
+      out.insert(out.end(), body, body + page.body_len);
+    }
+  };
+  auto add_packet = [&](std::vector<std::byte> data, int64_t granule,
+                        bool bos, bool eos) {
+    ogg_packet packet{
+        .packet = reinterpret_cast<unsigned char*>(data.data()),
+        .bytes = static_cast<long>(data.size()),
+        .b_o_s = bos,
+        .e_o_s = eos,
+        .granulepos = granule,
+        .packetno = 0,
+    };
+    ogg_stream_packetin(&ogg, &packet);
+  };
+
+  std::vector<std::byte> head;
+  appendStr(head, "OpusHead");
+  head.push_back(std::byte{1});
+  head.push_back(std::byte{2});
+  append16le(head, preskip);
+  append32le(head, 48000);
+  append16le(head, 0);
+  head.push_back(std::byte{0});
+  add_packet(head, 0, true, false);
+  write_pages(true);
+
+  std::vector<std::byte> tags;
+  appendStr(tags, "OpusTags");
+  append32le(tags, 0);
+  append32le(tags, 0);
+  add_packet(tags, 0, false, false);
+  write_pages(true);
+
+  // Pad out the end of the signal to cover the encoder's lookahead, and to
+  // fill the last frame.
+  size_t frames = samples.size() / 2;
+  std::vector<int16_t> padded{samples.begin(), samples.end()};
+  padded.resize((frames + preskip + kFrameSize) / kFrameSize * kFrameSize * 2);
+
+  for (size_t pos = 0; pos < padded.size() / 2; pos += kFrameSize) {
+    std::vector<std::byte> packet(1500);
+    int len = opus_encode(enc, padded.data() + pos * 2, kFrameSize,
+                          reinterpret_cast<unsigned char*>(packet.data()),
+                          packet.size());
+    REQUIRE(len > 0);
+    packet.resize(len);
+    bool last = pos + kFrameSize >= padded.size() / 2;
+    int64_t granule = last ? frames + preskip : pos + kFrameSize;
+    add_packet(packet, granule, false, last);
+    write_pages(false);
+  }
+  write_pages(true);
+
+  ogg_stream_clear(&ogg);
+  opus_encoder_destroy(enc);
+  return out;
+}
+
+struct Fixture {
+  StreamType type;
+  std::function<ICodec*()> make_codec;
+  std::vector<std::byte> data;
+  size_t repeats;
+  // How far apart a seek's output may be from the same part of a complete
+  // decode, since some of our decoders dither. Others carry state from frame
+  // to frame that a seek can only approximate; for those, we only check that
+  // the output lines up.
+  std::optional<int> tolerance;
+};
+
+/* Decodes from the codec's current position, up to `max` samples. */
+static auto decode(ICodec& codec, size_t max)
+    -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out;
+  std::vector<sample::Sample> buf(4096);
+  while (out.size() < max) {
+    auto res = codec.DecodeTo(buf);
+    REQUIRE(res.has_value());
+    out.insert(out.end(), buf.begin(), buf.begin() + res->samples_written);
+    if (res->is_stream_finished) {
+      break;
+    }
+  }
+  out.resize(std::min(out.size(), max));
+  return out;
+}
+
+/* The largest difference between the two spans. */
+static auto distance(std::span<const sample::Sample> a,
+                     std::span<const sample::Sample> b) -> int {
+  REQUIRE(a.size() == b.size());
+  int max = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    max = std::max(max, std::abs(a[i] - b[i]));
+  }
+  return max;
+}
+
+/*
+ * Finds how many frames `got` is offset from the given frame of `reference`,
+ * by looking for the nearby alignment with the least error.
+ */
+static auto alignment(std::span<const sample::Sample> got,
+                      std::span<const sample::Sample> reference,
+                      size_t frame,
+                      size_t channels) -> int {
+  constexpr int kMaxLag = 16;
+  size_t len = std::min<size_t>(got.size(), 1000 * channels);
+  int best_lag = 0;
+  int64_t best_error = INT64_MAX;
+  for (int lag = -kMaxLag; lag <= kMaxLag; lag++) {
+    int64_t start = (static_cast<int64_t>(frame) + lag) * channels;
+    if (start < 0 || start + len > reference.size()) {
+      continue;
+    }
+    int64_t error = 0;
+    for (size_t i = 0; i < len; i++) {
+      int64_t diff = got[i] - reference[start + i];
+      error += diff * diff;
+    }
+    if (error < best_error) {
+      best_error = error;
+      best_lag = lag;
+    }
+  }
+  return best_lag;
+}
+
+static auto checkSeeking(const Fixture& fixture) -> void {
+  auto open = [&](std::unique_ptr<ICodec>& codec, uint32_t offset) {
+    codec.reset(fixture.make_codec());
+    auto stream = std::make_shared<MemoryStream>(fixture.type, fixture.data,
+                                                 fixture.repeats);
+    auto res = codec->OpenStream(stream, offset);
+    REQUIRE(res.has_value());
+    return *res;
+  };
+
+  // Decode the whole stream in one go to compare against.
+  std::unique_ptr<ICodec> codec;
+  auto format = open(codec, 0);
+  auto reference = decode(*codec, SIZE_MAX);
+  size_t channels = format.num_channels;
+  size_t frames = reference.size() / channels;
+  REQUIRE(frames > format.sample_rate_hz);
+
+  constexpr size_t kCheckFrames = 3000;
+  auto check_from = [&](ICodec& codec, size_t frame) {
+    auto got = decode(codec, kCheckFrames * channels);
+    auto expected = std::span{reference}.subspan(
+        frame * channels, std::min(kCheckFrames, frames - frame) * channels);
+    REQUIRE(got.size() == expected.size());
+    INFO("seeking to frame " << frame);
+    REQUIRE(alignment(got, reference, frame, channels) == 0);
+    if (fixture.tolerance) {
+      REQUIRE(distance(got, expected) <= *fixture.tolerance);
+    }
+  };
+
+  SECTION("seeks an open stream to exact frames") {
+    open(codec, 0);
+    // Frame and block boundaries, and either side of them, in both
+    // directions, and with some decoding in between.
+    std::vector<size_t> targets = {0,    1,    575,  576,   577,  1151, 1152,
+                                   1153, 9999, 4000, 12345, 3,    frames / 2,
+                                   frames - 10,     100,   frames - 2500};
+    for (size_t target : targets) {
+      auto res = codec->Seek(target);
+      REQUIRE(res.has_value());
+      check_from(*codec, target);
+    }
+  }
+
+  SECTION("begins at an offset when opened") {
+    auto format = open(codec, 1);
+    check_from(*codec, format.sample_rate_hz);
+  }
+
+  SECTION("seeking doesn't disturb the end of the stream") {
+    open(codec, 0);
+    REQUIRE(codec->Seek(frames - 1000).has_value());
+    auto rest = decode(*codec, SIZE_MAX);
+    REQUIRE(rest.size() == 1000 * channels);
+  }
+}
+
+TEST_CASE("SeekableDecoder", "[unit]") {
+  SECTION("wav") {
+    auto samples = signal(22050 * 3 / 2, 2, 22050);
+    checkSeeking({
+        .type = StreamType::kWav,
+        .make_codec = []() { return new WavDecoder(); },
+        .data = makeWav(samples, 2, 22050),
+        .repeats = 1,
+        .tolerance = 0,
+    });
+  }
+
+  SECTION("flac") {
+    auto samples = signal(22050 * 3 / 2, 2, 22050);
+    checkSeeking({
+        .type = StreamType::kFlac,
+        .make_codec = []() { return new DrFlacDecoder(); },
+        .data = makeFlac(samples, 2, 22050),
+        .repeats = 1,
+        .tolerance = 0,
+    });
+  }
+
+  SECTION("opus") {
+    auto samples = signal(48000 * 3 / 2, 2, 48000);
+    checkSeeking({
+        .type = StreamType::kOpus,
+        .make_codec = []() { return new XiphOpusDecoder(); },
+        .data = makeOpus(samples),
+        .repeats = 1,
+        .tolerance = {},
+    });
+  }
+
+  SECTION("mp3") {
+    // The fixture's two audio frames, repeated without its Xing header. The
+    // second of them keeps most of its data in the first's bit reservoir.
+    constexpr size_t kFirstAudioFrame = 417;
+    std::span<const std::byte> all{reinterpret_cast<std::byte*>(test_mp3),
+                                   test_mp3_len};
+    auto frames = all.subspan(kFirstAudioFrame);
+    checkSeeking({
+        .type = StreamType::kMp3,
+        .make_codec = []() { return new MadMp3Decoder(); },
+        .data = {frames.begin(), frames.end()},
+        .repeats = 40,
+        .tolerance = 8,
+    });
+  }
+}
+
+}  // namespace codecs
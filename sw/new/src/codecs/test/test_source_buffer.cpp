@@ -0,0 +1,208 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "source_buffer.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "mad.h"
+
+#include "codec.hpp"
+#include "mad.hpp"
+#include "memory_stream.hpp"
+#include "sample.hpp"
+#include "test.mp3.hpp"
+#include "types.hpp"
+
+namespace codecs {
+
+// The fixture begins with a Xing header frame, followed by two audio frames.
+static constexpr size_t kFirstAudioFrame = 417;
+
+static auto audioFrames() -> std::span<const std::byte> {
+  std::span<const std::byte> all{reinterpret_cast<std::byte*>(test_mp3),
+                                 test_mp3_len};
+  return all.subspan(kFirstAudioFrame);
+}
+
+TEST_CASE("source buffer", "[unit]") {
+  std::vector<std::byte> data(100000);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<std::byte>(i % 251);
+  }
+  MemoryStream stream{StreamType::kWav, data};
+  SourceBuffer buffer;
+  std::minstd_rand rng{0x5b};
+
+  size_t consumed = 0;
+  size_t short_reads = 0;
+  while (consumed < data.size()) {
+    buffer.Refill(&stream);
+    buffer.ConsumeBytes([&](std::span<std::byte> buf) -> size_t {
+      // At least one frame's worth of bytes should be contiguous, except just
+      // after a refill that only reached the end of the ring. The next refill
+      // should always fix that.
+      if (buf.size() < std::min<size_t>(data.size() - consumed, 2048)) {
+        REQUIRE(short_reads++ == 0);
+        return 0;
+      }
+      short_reads = 0;
+
+      size_t len = std::min<size_t>(buf.size(), rng() % 3000);
+      REQUIRE(std::equal(buf.begin(), buf.begin() + len,
+                         data.begin() + consumed));
+      consumed += len;
+      return len;
+    });
+  }
+
+  REQUIRE(buffer.Refill(&stream));
+  // Only the mirrored part of each lap around the ring should be copied.
+  REQUIRE(buffer.BytesMoved() <= data.size() / 3);
+}
+
+TEST_CASE("mp3 decoding through a source buffer", "[unit]") {
+  // The Xing header would limit decoding to just the first two frames, so
+  // repeat only the audio frames.
+  auto input = std::make_shared<MemoryStream>(StreamType::kMp3, audioFrames(),
+                                              100);
+  MadMp3Decoder decoder;
+  auto format = decoder.OpenStream(input, 0);
+  REQUIRE(format.has_value());
+  REQUIRE(format->num_channels == 1);
+  REQUIRE(format->sample_rate_hz == 44100);
+
+  std::vector<sample::Sample> output(2048);
+  size_t samples = 0;
+  bool finished = false;
+  for (size_t i = 0; i < 10000 && !finished; i++) {
+    auto res = decoder.DecodeTo(output);
+    REQUIRE(res.has_value());
+    samples += res->samples_written;
+    finished = res->is_stream_finished;
+  }
+  REQUIRE(finished);
+  REQUIRE(samples > 0);
+}
+
+/*
+ * The previous SourceBuffer implementation, which moved any leftover bytes to
+ * the front of the buffer whenever it was refilled.
+ */
+class LinearSourceBuffer {
+ public:
+  auto Refill(IStream* src) -> bool {
+    if (bytes_in_buffer_ > 1024 * 8) {
+      return false;
+    }
+    bool eof = false;
+    AddBytes([&](std::span<std::byte> buf) -> size_t {
+      ssize_t bytes_read = src->Read(buf);
+      eof = bytes_read <= 0;
+      return std::max<ssize_t>(bytes_read, 0);
+    });
+    return eof;
+  }
+
+  auto AddBytes(std::function<size_t(std::span<std::byte>)> writer) -> void {
+    if (offset_of_bytes_ > 0) {
+      std::memmove(buffer_.data(), buffer_.data() + offset_of_bytes_,
+                   bytes_in_buffer_);
+      bytes_moved_ += bytes_in_buffer_;
+      offset_of_bytes_ = 0;
+    }
+    bytes_in_buffer_ += std::invoke(
+        writer, std::span{buffer_}.subspan(bytes_in_buffer_));
+  }
+
+  auto ConsumeBytes(std::function<size_t(std::span<std::byte>)> reader)
+      -> void {
+    size_t bytes_consumed = std::invoke(
+        reader,
+        std::span{buffer_}.subspan(offset_of_bytes_, bytes_in_buffer_));
+    bytes_in_buffer_ -= bytes_consumed;
+    offset_of_bytes_ =
+        bytes_in_buffer_ == 0 ? 0 : offset_of_bytes_ + bytes_consumed;
+  }
+
+  auto BytesMoved() const -> uint64_t { return bytes_moved_; }
+
+ private:
+  std::vector<std::byte> buffer_ = std::vector<std::byte>(1024 * 16);
+  size_t bytes_in_buffer_ = 0;
+  size_t offset_of_bytes_ = 0;
+  uint64_t bytes_moved_ = 0;
+};
+
+/*
+ * Decodes every frame in the stream in the same way as MadMp3Decoder, minus
+ * synthesis, and reports how many bytes the buffer moved around to do so.
+ */
+template <typename Buffer>
+static auto decodeFrames(const char* name, Buffer& buffer) -> void {
+  constexpr size_t kRepeats = 200;
+  MemoryStream input{StreamType::kMp3, audioFrames(), kRepeats};
+
+  mad_stream stream;
+  mad_frame frame;
+  mad_stream_init(&stream);
+  mad_frame_init(&frame);
+
+  int64_t start = esp_timer_get_time();
+  size_t frames = 0;
+  bool eof = false;
+  bool eos = false;
+  while (!eos) {
+    eof = buffer.Refill(&input) || eof;
+    buffer.ConsumeBytes([&](std::span<std::byte> buf) -> size_t {
+      mad_stream_buffer(&stream,
+                        reinterpret_cast<const unsigned char*>(buf.data()),
+                        buf.size());
+      while (mad_frame_decode(&frame, &stream) < 0) {
+        if (MAD_RECOVERABLE(stream.error)) {
+          continue;
+        }
+        eos = eof || stream.error != MAD_ERROR_BUFLEN;
+        return stream.next_frame ? stream.next_frame - stream.buffer : 0;
+      }
+      frames++;
+      return stream.next_frame ? stream.next_frame - stream.buffer : 0;
+    });
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  mad_frame_finish(&frame);
+  mad_stream_finish(&stream);
+
+  double seconds = frames * 1152.0 / 44100.0;
+  std::printf("%s: %u frames, %.0f bytes moved per decoded second, %lld us\n",
+              name, static_cast<unsigned>(frames),
+              buffer.BytesMoved() / seconds, elapsed);
+}
+
+TEST_CASE("source buffer performance", "[.benchmark]") {
+  {
+    LinearSourceBuffer buffer;
+    decodeFrames("memmove", buffer);
+  }
+  {
+    SourceBuffer buffer;
+    decodeFrames("ring", buffer);
+  }
+}
+
+}  // namespace codecs
@@ -124,8 +124,11 @@ auto TremorVorbisDecoder::OpenStream(std::shared_ptr<IStream> input,
     bitrate_kbps = b / 1024;
   }
 
-  if (offset && ov_time_seek(vorbis_.get(), offset * 1000) != 0) {
-    return cpp::fail(Error::kInternalError);
+  if (offset) {
+    auto res = Seek(static_cast<uint64_t>(offset) * info->rate);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
+    }
   }
 
   return OutputFormat{
@@ -136,6 +139,16 @@ auto TremorVorbisDecoder::OpenStream(std::shared_ptr<IStream> input,
   };
 }
 
+auto TremorVorbisDecoder::Seek(uint64_t pcm_frame)
+    -> cpp::result<void, Error> {
+  // Unlike ov_time_seek, this decodes forward from the nearest page to land
+  // on exactly the requested frame.
+  if (ov_pcm_seek(vorbis_.get(), pcm_frame) != 0) {
+    return cpp::fail(Error::kInternalError);
+  }
+  return {};
+}
+
 auto TremorVorbisDecoder::DecodeTo(std::span<sample::Sample> output)
     -> cpp::result<OutputInfo, Error> {
   int unused = 0;
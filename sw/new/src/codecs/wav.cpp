@@ -9,24 +9,34 @@
 #include <sys/_stdint.h>
 
 #include <algorithm>
+#include <bit>
 #include <cstdlib>
 #include <string>
 
 #include "debug.hpp"
 #include "esp_log.h"
+#include "pcm_convert.hpp"
+#include "requantizer.hpp"
 #include "sample.hpp"
 
 namespace codecs {
 
 [[maybe_unused]] static const char kTag[] = "wav";
 
-static inline auto bytes_to_u16(std::span<std::byte const, 2> bytes)
-    -> uint16_t {
+static inline auto bytes_to_u16(std::span<std::byte const, 2> bytes,
+                                std::endian order) -> uint16_t {
+  if (order == std::endian::big) {
+    return (uint16_t)bytes[0] << 8 | (uint16_t)bytes[1];
+  }
   return (uint16_t)bytes[0] | (uint16_t)bytes[1] << 8;
 }
 
-static inline auto bytes_to_u32(std::span<std::byte const, 4> bytes)
-    -> uint32_t {
+static inline auto bytes_to_u32(std::span<std::byte const, 4> bytes,
+                                std::endian order) -> uint32_t {
+  if (order == std::endian::big) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 |
+           (uint32_t)bytes[2] << 8 | (uint32_t)bytes[3];
+  }
   return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
          (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
 }
@@ -37,67 +47,12 @@ static inline auto bytes_to_str(std::span<std::byte const> bytes)
                      bytes.size_bytes());
 }
 
-static int16_t convert_f32_to_16_bit(std::span<const std::byte> bytes) {
-  uint64_t val = 0;
-  val = (uint8_t)bytes[3];
-  val = (val << 8) | (uint8_t)bytes[2];
-  val = (val << 8) | (uint8_t)bytes[1];
-  val = (val << 8) | (uint8_t)bytes[0];
-  // Isolate the sign and remove from the value
-  uint64_t sign = val >> 31;
-  val -= (sign << 31);
-  // Isolate the exponent and remove from the value
-  uint64_t exp = (val >> 23);
-  val -= (exp << 23);
-  // Remove old bias and add new bias
-  exp = exp - 127 + 1023;
-  // Reconstruct the bits in the correct order and convert to double
-  uint64_t dval = (sign << 63) + (exp << 52) + (val << 29);
-  double* fval = reinterpret_cast<double*>(&dval);
-  return sample::FromDouble(*fval);
-}
-
-static int16_t convert_f64_to_16_bit(std::span<const std::byte> bytes) {
-  uint64_t val = 0;
-  val = (uint8_t)bytes[7];
-  val = (val << 8) | (uint8_t)bytes[6];
-  val = (val << 8) | (uint8_t)bytes[5];
-  val = (val << 8) | (uint8_t)bytes[4];
-  val = (val << 8) | (uint8_t)bytes[3];
-  val = (val << 8) | (uint8_t)bytes[2];
-  val = (val << 8) | (uint8_t)bytes[1];
-  val = (val << 8) | (uint8_t)bytes[0];
-  double* fval = reinterpret_cast<double*>(&val);
-  return sample::FromDouble(*fval);
-}
-
-static int16_t convert_to_16_bit(std::span<const std::byte> bytes) {
-  int depth = bytes.size();
-  int32_t val = 0;
-  // If 8-bit Assume Unsigned
-  if (depth == 1) {
-    return sample::FromUnsigned((uint8_t)bytes[0], 8);
-  }
-  // Otherwise, build the signed int of the right depth
-  switch (depth) {
-    case 4:
-      val = (uint8_t)bytes[3];
-      [[fallthrough]];
-    case 3:
-      val = (val << 8) | (uint8_t)bytes[2];
-      [[fallthrough]];
-    case 2:
-      val = (val << 8) | (uint8_t)bytes[1];
-      [[fallthrough]];
-    case 1:
-      val = (val << 8) | (uint8_t)bytes[0];
-  }
-  // Convert to sample
-  int16_t result = sample::FromSigned(val, depth * 8);
-  return result;
-}
-
-WavDecoder::WavDecoder() : input_(), buffer_() {}
+WavDecoder::WavDecoder()
+    : input_(),
+      buffer_(),
+      data_start_(0),
+      converter_(nullptr),
+      requantizer_() {}
 
 WavDecoder::~WavDecoder() {}
 
@@ -128,8 +83,15 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
 
   auto buffer_span = std::span{buf};
 
+  // RIFX files are identical to RIFF files, except that every field and
+  // sample is big-endian.
   std::string riff = bytes_to_str(buffer_span.subspan(0, 4));
-  if (riff != "RIFF") {
+  std::endian order;
+  if (riff == "RIFF") {
+    order = std::endian::little;
+  } else if (riff == "RIFX") {
+    order = std::endian::big;
+  } else {
     ESP_LOGW(kTag, "file is not RIFF");
     return cpp::fail(Error::kMalformedData);
   }
@@ -145,7 +107,7 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   // Size of the fmt header, should be 16, 18 or 40
   // uint32_t fmt_header_size = bytes_to_u32(buffer_span.subspan(16, 4));
 
-  wave_format_ = bytes_to_u16(buffer_span.subspan<20, 2>());
+  wave_format_ = bytes_to_u16(buffer_span.subspan<20, 2>(), order);
   if (wave_format_ == kWaveFormatPCM) {
     ESP_LOGD(kTag, "wave format: PCM");
   } else if (wave_format_ == kWaveFormatExtensible) {
@@ -157,13 +119,14 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
     return cpp::fail(Error::kUnsupportedFormat);
   }
 
-  num_channels_ = bytes_to_u16(buffer_span.subspan<22, 2>());
+  num_channels_ = bytes_to_u16(buffer_span.subspan<22, 2>(), order);
 
-  uint32_t samples_per_second = bytes_to_u32(buffer_span.subspan<24, 4>());
+  uint32_t samples_per_second =
+      bytes_to_u32(buffer_span.subspan<24, 4>(), order);
 
   // uint32_t avg_bytes_per_second = bytes_to_u32(buffer_span.subspan(28, 4));
 
-  uint16_t block_align = bytes_to_u16(buffer_span.subspan<32, 2>());
+  uint16_t block_align = bytes_to_u16(buffer_span.subspan<32, 2>(), order);
 
   bytes_per_sample_ = block_align / num_channels_;
 
@@ -181,7 +144,8 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   int data_chunk_index = std::distance(buffer_span.begin(), data_loc.begin());
 
   uint32_t data_chunk_size =
-      bytes_to_u32(buffer_span.subspan(data_chunk_index + 4, 4).first<4>());
+      bytes_to_u32(buffer_span.subspan(data_chunk_index + 4, 4).first<4>(),
+                   order);
 
   // calculate number of samples
   int number_of_samples = data_chunk_size / bytes_per_sample_;
@@ -189,7 +153,7 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
   // extension to the fmt chunk size (0 or 22)
   uint16_t extension_size = 0;
   if (wave_format_ == kWaveFormatExtensible) {
-    extension_size = bytes_to_u16(buffer_span.subspan<36, 2>());
+    extension_size = bytes_to_u16(buffer_span.subspan<36, 2>(), order);
   }
 
   // Parse extension if applicable
@@ -201,27 +165,56 @@ auto WavDecoder::OpenStream(std::shared_ptr<IStream> input, uint32_t offset)
     // uint32_t speaker_mask = bytes_to_u32(buffer_span.subspan(40, 4));
 
     // Parse subformat
-    subformat_ = bytes_to_u16(buffer_span.subspan<44, 2>());
+    subformat_ = bytes_to_u16(buffer_span.subspan<44, 2>(), order);
     if (!(subformat_ == kWaveFormatPCM || subformat_ == kWaveFormatIEEEFloat)) {
       ESP_LOGW(kTag, "WAVE extensible subformat_ not supported");
       return cpp::fail(Error::kUnsupportedFormat);
     }
   }
 
-  int64_t data_offset = offset * samples_per_second * bytes_per_sample_;
-
-  // Seek track to start of data
-  input->SeekTo(data_chunk_index + 8 + data_offset,
-                IStream::SeekFrom::kStartOfStream);
+  converter_ = PcmConverterFor(GetFormat() == kWaveFormatIEEEFloat
+                                   ? PcmFormat::kFloat
+                                   : PcmFormat::kInteger,
+                               bytes_per_sample_, order);
+  if (converter_ == nullptr) {
+    ESP_LOGW(kTag, "%u byte samples not supported", bytes_per_sample_);
+    return cpp::fail(Error::kUnsupportedFormat);
+  }
+  requantizer_.Reset(num_channels_,
+                     sample::Requantizer::ShapingFor(samples_per_second));
 
   output_format_ = {.num_channels = (uint8_t)num_channels_,
                     .sample_rate_hz = samples_per_second,
                     .total_samples = number_of_samples,
                     .bitrate_kbps = samples_per_second * num_channels_ * bytes_per_sample_ * 8 / 1024};
 
+  // Seek track to start of data
+  data_start_ = data_chunk_index + 8;
+  if (offset > 0) {
+    auto res = Seek(static_cast<uint64_t>(offset) * samples_per_second);
+    if (res.has_error()) {
+      return cpp::fail(res.error());
+    }
+  } else {
+    input->SeekTo(data_start_, IStream::SeekFrom::kStartOfStream);
+  }
+
   return output_format_;
 }
 
+auto WavDecoder::Seek(uint64_t pcm_frame) -> cpp::result<void, Error> {
+  if (!input_->CanSeek()) {
+    return cpp::fail(Error::kUnsupportedFormat);
+  }
+  // Every frame is the same size, so this is simple arithmetic.
+  input_->SeekTo(data_start_ + pcm_frame * num_channels_ * bytes_per_sample_,
+                 IStream::SeekFrom::kStartOfStream);
+  buffer_.Empty();
+  requantizer_.Reset(num_channels_, sample::Requantizer::ShapingFor(
+                                        output_format_.sample_rate_hz));
+  return {};
+}
+
 auto WavDecoder::DecodeTo(std::span<sample::Sample> output)
     -> cpp::result<OutputInfo, Error> {
   bool is_eof = buffer_.Refill(input_.get());
@@ -237,22 +230,8 @@ auto WavDecoder::DecodeTo(std::span<sample::Sample> output)
                          output.size() / output_format_.num_channels) *
         output_format_.num_channels;
 
-    // For each sample that we're going to write
-    for (size_t i = 0; i < samples_written; i++) {
-      auto data = buf.subspan(i * bytes_per_sample_, bytes_per_sample_);
-      if (GetFormat() == kWaveFormatPCM) {
-        // PCM
-        output[i] = convert_to_16_bit(data);
-      } else if (GetFormat() == kWaveFormatIEEEFloat) {
-        // 32-Bit Float
-        if (bytes_per_sample_ == 4) {
-          output[i] = convert_f32_to_16_bit(data);
-        }
-        if (bytes_per_sample_ == 8) {
-          output[i] = convert_f64_to_16_bit(data);
-        }
-      }
-    }
+    converter_(buf.first(samples_written * bytes_per_sample_),
+               output.first(samples_written), requantizer_);
 
     return samples_written * bytes_per_sample_;
   });
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "drivers/audio_telemetry.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_attr.h"
+
+#include "drivers/pcm_buffer.hpp"
+
+namespace drivers {
+namespace telemetry {
+
+// Outputs record into this from their ISRs, so it must not live in PSRAM.
+DRAM_ATTR Audio sAudio;
+
+auto Histogram::count() const -> uint32_t {
+  uint32_t total = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    total += bucket(i);
+  }
+  return total;
+}
+
+auto Histogram::percentile(uint32_t pct) const -> uint32_t {
+  uint64_t target = static_cast<uint64_t>(count()) * pct;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets - 1; i++) {
+    seen += bucket(i) * 100ull;
+    if (seen >= target) {
+      return i == 0 ? 0 : (1u << i) - 1;
+    }
+  }
+  return max();
+}
+
+auto Histogram::reset() -> void {
+  for (auto& b : buckets_) {
+    b.store(0, std::memory_order_relaxed);
+  }
+  max_.store(0, std::memory_order_relaxed);
+}
+
+auto FillHistogram::count() const -> uint32_t {
+  uint32_t total = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    total += bucket(i);
+  }
+  return total;
+}
+
+auto FillHistogram::reset() -> void {
+  for (auto& b : buckets_) {
+    b.store(0, std::memory_order_relaxed);
+  }
+}
+
+auto Audio::reset() -> void {
+  decode_us.reset();
+  resample_us.reset();
+  source_fill.reset();
+  sink_fill.reset();
+  backpressure_waits.reset();
+  backpressure_timeouts.reset();
+  backpressure_us.reset();
+  underruns.reset();
+  padded_samples.reset();
+  decoder_underruns.reset();
+}
+
+IRAM_ATTR auto RecordOutput([[maybe_unused]] PcmBuffer& sink,
+                            [[maybe_unused]] size_t wanted,
+                            [[maybe_unused]] size_t received)
+    -> void {
+#if AUDIO_TELEMETRY
+  if (sink.isSuspended()) {
+    // Playback is paused, so silence is expected.
+    return;
+  }
+  sAudio.sink_fill.record(sink.size() + received, sink.capacity());
+  if (received == wanted || !sAudio.streaming) {
+    return;
+  }
+  sAudio.underruns.add();
+  sAudio.padded_samples.add(wanted - received);
+  if (sAudio.source_samples.load(std::memory_order_relaxed) == 0) {
+    sAudio.decoder_underruns.add();
+  }
+#endif
+}
+
+}  // namespace telemetry
+}  // namespace drivers
@@ -8,8 +8,10 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <iterator>
 #include <mutex>
+#include <span>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -32,9 +34,11 @@
 #include "freertos/timers.h"
 #include "tinyfsm/include/tinyfsm.hpp"
 
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/bluetooth_types.hpp"
 #include "drivers/nvs.hpp"
 #include "drivers/pcm_buffer.hpp"
+#include "drivers/pcm_mix.hpp"
 #include "memory_resource.hpp"
 #include "tasks.hpp"
 
@@ -43,7 +47,9 @@ namespace drivers {
 [[maybe_unused]] static constexpr char kTag[] = "bluetooth";
 
 DRAM_ATTR static OutputBuffers* sStreams = nullptr;
-DRAM_ATTR static std::atomic<float> sVolumeFactor = 1.f;
+DRAM_ATTR static std::atomic<int32_t> sVolumeGain = kUnityGain;
+// Only used from within the A2DP data callback.
+DRAM_ATTR static GainRamp sVolumeRamp;
 
 static tasks::WorkerPool* sBgWorker;
 
@@ -106,17 +112,21 @@ IRAM_ATTR auto a2dp_data_cb(uint8_t* buf, int32_t buf_size) -> int32_t {
     return 0;
   }
 
-  int16_t* samples = reinterpret_cast<int16_t*>(buf);
-  streams->first.receive({samples, static_cast<size_t>(buf_size / 2)}, false,
-                         false);
-  streams->second.receive({samples, static_cast<size_t>(buf_size / 2)}, true,
-                          false);
+  std::span<int16_t> samples{reinterpret_cast<int16_t*>(buf),
+                             static_cast<size_t>(buf_size / 2)};
+  size_t received = streams->first.receive(samples, false);
+  telemetry::RecordOutput(streams->first, samples.size(), received);
 
-  // Apply software volume scaling.
-  float factor = sVolumeFactor.load();
-  for (size_t i = 0; i < buf_size / 2; i++) {
-    samples[i] *= factor;
-  }
+  // Mix in the second stream and apply software volume scaling in the same
+  // pass, then scale whatever the second stream didn't cover.
+  sVolumeRamp.set(sVolumeGain.load());
+  size_t mixed = 0;
+  streams->second.consume(samples.size(), [&](std::span<const int16_t> src) {
+    sVolumeRamp.mixWith(samples.subspan(mixed), src);
+    mixed += src.size();
+    return src.size();
+  });
+  sVolumeRamp.apply(samples.subspan(mixed));
 
   return buf_size;
 }
@@ -159,7 +169,7 @@ auto Bluetooth::sources(OutputBuffers* src) -> void {
 }
 
 auto Bluetooth::softVolume(float f) -> void {
-  sVolumeFactor = f;
+  sVolumeGain = std::lround(std::clamp(f, 0.f, 1.f) * kUnityGain);
 }
 
 auto Bluetooth::connectionState() -> ConnectionState {
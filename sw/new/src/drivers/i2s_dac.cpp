@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <span>
 
 #include "assert.h"
 #include "driver/i2c.h"
@@ -27,6 +28,7 @@
 #include "hal/gpio_types.h"
 #include "hal/i2c_types.h"
 
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/gpios.hpp"
 #include "drivers/i2c.hpp"
 #include "drivers/wm8523.hpp"
@@ -54,10 +56,10 @@ extern "C" IRAM_ATTR auto callback(i2s_chan_handle_t handle,
   uint8_t* buf = reinterpret_cast<uint8_t*>(event->dma_buf);
   auto* src = reinterpret_cast<OutputBuffers*>(user_ctx);
 
-  BaseType_t ret1 = src->first.receive(
-      {reinterpret_cast<int16_t*>(buf), event->size / 2}, false, true);
-  BaseType_t ret2 = src->second.receive(
-      {reinterpret_cast<int16_t*>(buf), event->size / 2}, true, true);
+  std::span<int16_t> samples{reinterpret_cast<int16_t*>(buf), event->size / 2};
+  size_t received = src->first.receive(samples, false);
+  telemetry::RecordOutput(src->first, samples.size(), received);
+  src->second.receive(samples, true);
 
   // The ESP32's I2S peripheral has a different endianness to its processors.
   // ESP-IDF handles this difference for stereo channels, but not for mono
@@ -72,7 +74,8 @@ extern "C" IRAM_ATTR auto callback(i2s_chan_handle_t handle,
     }
   }
 
-  return ret1 || ret2;
+  // Receiving from a PcmBuffer never wakes a task.
+  return false;
 }
 
 auto I2SDac::create(IGpios& expander, OutputBuffers& bufs)
@@ -81,7 +84,7 @@ auto I2SDac::create(IGpios& expander, OutputBuffers& bufs)
   i2s_chan_config_t channel_config{
       .id = kI2SPort,
       .role = I2S_ROLE_MASTER,
-      .dma_desc_num = 2,
+      .dma_desc_num = kI2SBufferCount,
       .dma_frame_num = kI2SBufferLengthFrames,
       .auto_clear = false,
       .intr_priority = 0,
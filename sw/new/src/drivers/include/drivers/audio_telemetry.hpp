@@ -0,0 +1,185 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_timer.h"
+
+#include "drivers/pcm_buffer.hpp"
+
+/*
+ * Audio telemetry is cheap enough to leave on (see the benchmark in
+ * test_audio_telemetry.cpp), but building with -DAUDIO_TELEMETRY=0 turns
+ * every measurement into a no-op. Values then read as zero.
+ */
+#ifndef AUDIO_TELEMETRY
+#define AUDIO_TELEMETRY 1
+#endif
+
+namespace drivers {
+namespace telemetry {
+
+/* A count of events. Safe to add to from any task, or from an ISR. */
+class Counter {
+ public:
+  auto add([[maybe_unused]] uint32_t n = 1) -> void {
+#if AUDIO_TELEMETRY
+    count_.fetch_add(n, std::memory_order_relaxed);
+#endif
+  }
+
+  auto value() const -> uint32_t {
+    return count_.load(std::memory_order_relaxed);
+  }
+  auto reset() -> void { count_.store(0, std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint32_t> count_{0};
+};
+
+/*
+ * Distribution of a duration, or any other value that spans several orders of
+ * magnitude. Bucket 0 counts zeroes, and bucket `i` counts values from
+ * 2^(i-1) up to 2^i - 1. The last bucket also counts anything larger.
+ *
+ * Recording is lock-free, and safe from any task or ISR. Readers may see a
+ * recording that's only partly applied, which is fine for statistics.
+ */
+class Histogram {
+ public:
+  static constexpr size_t kBuckets = 16;
+
+  auto record([[maybe_unused]] uint32_t val) -> void {
+#if AUDIO_TELEMETRY
+    size_t bucket = std::min<size_t>(std::bit_width(val), kBuckets - 1);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = max_.load(std::memory_order_relaxed);
+    while (val > max &&
+           !max_.compare_exchange_weak(max, val, std::memory_order_relaxed)) {
+    }
+#endif
+  }
+
+  /* Records the time since `start`, which should come from Now(). */
+  auto recordSince([[maybe_unused]] int64_t start) -> void {
+#if AUDIO_TELEMETRY
+    record(static_cast<uint32_t>(esp_timer_get_time() - start));
+#endif
+  }
+
+  auto bucket(size_t i) const -> uint32_t {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+  auto count() const -> uint32_t;
+  auto max() const -> uint32_t { return max_.load(std::memory_order_relaxed); }
+
+  /*
+   * An upper bound on the given percentile of recorded values; the largest
+   * value that fits in the bucket the percentile falls in.
+   */
+  auto percentile(uint32_t pct) const -> uint32_t;
+
+  auto reset() -> void;
+
+ private:
+  std::array<std::atomic<uint32_t>, kBuckets> buckets_{};
+  std::atomic<uint32_t> max_{0};
+};
+
+/*
+ * Distribution of how full a buffer is, in tenths of its capacity. Bucket 10
+ * counts times that it was completely full.
+ */
+class FillHistogram {
+ public:
+  static constexpr size_t kBuckets = 11;
+
+  auto record([[maybe_unused]] size_t level,
+              [[maybe_unused]] size_t capacity) -> void {
+#if AUDIO_TELEMETRY
+    if (capacity == 0) {
+      return;
+    }
+    size_t bucket = std::min(level * 10 / capacity, kBuckets - 1);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+#endif
+  }
+
+  auto bucket(size_t i) const -> uint32_t {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+  auto count() const -> uint32_t;
+  auto reset() -> void;
+
+ private:
+  std::array<std::atomic<uint32_t>, kBuckets> buckets_{};
+};
+
+/* A timestamp to pass to Histogram::recordSince. */
+inline auto Now() -> int64_t {
+#if AUDIO_TELEMETRY
+  return esp_timer_get_time();
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Measurements of every stage of the audio pipeline, so that when playback
+ * glitches it's possible to tell which stage fell behind.
+ */
+struct Audio {
+  // Microseconds spent in each call to a codec's DecodeTo.
+  Histogram decode_us;
+  // Microseconds spent in each call to the resampler.
+  Histogram resample_us;
+
+  // How full the processor's input ring is each time the decoder adds to it.
+  FillHistogram source_fill;
+  // How full the track sink is each time the output takes from it.
+  FillHistogram sink_fill;
+
+  // Times the decoder found the processor's input ring full, and had to wait
+  // for space. Timeouts are waits that gave up without any space appearing.
+  Counter backpressure_waits;
+  Counter backpressure_timeouts;
+  Histogram backpressure_us;
+
+  // Times the output ran out of track samples mid-stream, and padded its DMA
+  // buffer with silence instead. Silence whilst paused or between streams
+  // isn't counted.
+  Counter underruns;
+  Counter padded_samples;
+  // Underruns where the processor's input was empty too, meaning that the
+  // decoder was the stage that fell behind. The rest are the processor's.
+  Counter decoder_underruns;
+
+  // Samples waiting in the processor's input ring, as of the last time either
+  // end touched it.
+  std::atomic<uint32_t> source_samples{0};
+  // Whether the processor is between the start and end of a stream.
+  std::atomic<bool> streaming{false};
+
+  auto reset() -> void;
+};
+
+extern Audio sAudio;
+
+/*
+ * Records what happened when an output took `received` of the `wanted`
+ * samples from its track sink. Called from output ISRs and callbacks.
+ */
+auto RecordOutput(PcmBuffer& sink, size_t wanted, size_t received) -> void;
+
+}  // namespace telemetry
+}  // namespace drivers
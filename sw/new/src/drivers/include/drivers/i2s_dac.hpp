@@ -35,6 +35,11 @@ namespace drivers {
 // work the CPU has to do to service the DMA callbacks.
 constexpr size_t kI2SBufferLengthFrames = 1024;
 
+// The number of DMA buffers of the above size to cycle between. Samples sent
+// to the DAC are therefore played after at most this many buffers' worth of
+// delay.
+constexpr size_t kI2SBufferCount = 2;
+
 /**
  * Interface for a DAC that receives PCM samples over I2S.
  */
@@ -140,6 +140,12 @@ class NvsStorage {
   auto AmpLeftBias() -> int_fast8_t;
   auto AmpLeftBias(int_fast8_t) -> void;
 
+  auto ResamplerBudget() -> uint8_t;
+  auto ResamplerBudget(uint8_t) -> void;
+
+  auto ReplayGain() -> uint8_t;
+  auto ReplayGain(uint8_t) -> void;
+
   enum class InputModes : uint8_t {
     kButtonsOnly = 0,
     kButtonsWithWheel = 1,
@@ -187,6 +193,8 @@ class NvsStorage {
   Setting<uint16_t> amp_max_vol_;
   Setting<uint16_t> amp_cur_vol_;
   Setting<int8_t> amp_left_bias_;
+  Setting<uint8_t> resampler_budget_;
+  Setting<uint8_t> replay_gain_;
   Setting<uint8_t> input_mode_;
   Setting<uint8_t> locked_input_mode_;
   Setting<uint8_t> output_mode_;
@@ -7,14 +7,12 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 #include <span>
 
-#include "freertos/FreeRTOS.h"
-
-#include "freertos/ringbuf.h"
-#include "portmacro.h"
+#include "spsc_ring.hpp"
 
 namespace drivers {
 
@@ -22,6 +20,11 @@ namespace drivers {
  * A circular buffer of signed, 16-bit PCM samples. PcmBuffers are the main
  * data structure used for shuffling large amounts of read-to-play samples
  * throughout the system.
+ *
+ * Each PcmBuffer has exactly one producer (a task that sends samples) and one
+ * consumer (usually an output's ISR or callback that receives them). The
+ * consumer's side never blocks or takes a lock, so it's safe to use from
+ * interrupts.
  */
 class PcmBuffer {
  public:
@@ -31,25 +34,73 @@ class PcmBuffer {
   /*
    * Adds samples to the buffer. Returns the number of samples that were added,
    * which may be less than the number of samples given if this PcmBuffer is
-   * close to full.
+   * close to full. If the buffer is completely full, then this waits briefly
+   * for the consumer to make some room.
    */
   auto send(std::span<const int16_t>) -> size_t;
 
   /*
    * Fills the given span with samples. If enough samples are available in
    * the buffer, then the span will be filled with samples from the buffer. Any
-   * shortfall is made up by padding the given span with zeroes.
+   * shortfall is made up by padding the given span with zeroes. Returns the
+   * number of samples that came from the buffer.
    *
    * If `mix` is set to true then, instead of overwriting the destination span,
    * the retrieved samples will be mixed into any existing samples contained
-   * within the destination. This mixing uses a naive sum approach, and so may
-   * introduce clipping.
+   * within the destination. Mixed samples are clipped to the range of a
+   * single sample.
+   */
+  auto receive(std::span<int16_t>, bool mix) -> size_t;
+
+  /*
+   * Hands up to `max` waiting samples to the given function, as spans that
+   * point directly into the buffer's storage. There are at most two spans,
+   * since the samples may wrap around the end of the storage. The function
+   * returns how many samples from the start of each span it has used up; if
+   * it leaves any, then no more spans are given. Returns the total number of
+   * samples used.
+   *
+   * This is for consumers that want to read samples in place rather than
+   * have them copied out. Like receive, it must only be called by the
+   * consumer.
    */
-  auto receive(std::span<int16_t>, bool mix, bool isr) -> BaseType_t;
+  template <typename Fn>
+  auto consume(size_t max, Fn&& fn) -> size_t {
+    if (suspended_ || consuming_.test_and_set(std::memory_order_acquire)) {
+      // Either playback is paused, or the producer is clearing the buffer.
+      // Both look like an empty buffer to the consumer.
+      return 0;
+    }
+    size_t total = 0;
+    for (int i = 0; i < 2 && total < max; i++) {
+      auto span = ring_.readAcquire();
+      span = span.first(std::min(span.size(), max - total));
+      if (span.empty()) {
+        break;
+      }
+      size_t used = fn(std::span<const int16_t>{span});
+      ring_.readCommit(used);
+      total += used;
+      if (used < span.size()) {
+        break;
+      }
+    }
+    consuming_.clear(std::memory_order_release);
+    return total;
+  }
 
+  /*
+   * Discards every sample in the buffer. May be called by the producer, even
+   * if the consumer isn't running.
+   */
   auto clear() -> void;
   auto isEmpty() -> bool;
+  /* The number of samples waiting to be received. */
+  auto size() -> size_t;
+  auto capacity() -> size_t;
+
   auto suspend(bool) -> void;
+  auto isSuspended() -> bool;
 
   /*
    * How many samples have been added to this buffer since it was created. This
@@ -58,8 +109,9 @@ class PcmBuffer {
   auto totalSent() -> uint32_t;
 
   /*
-   * How many samples have been removed from this buffer since it was created.
-   * This method overflows by wrapping around to zero.
+   * How many samples have been removed from this buffer since it was created,
+   * including any that were cleared. This method overflows by wrapping around
+   * to zero.
    */
   auto totalReceived() -> uint32_t;
 
@@ -68,17 +120,13 @@ class PcmBuffer {
   PcmBuffer& operator=(const PcmBuffer&) = delete;
 
  private:
-  auto readSingle(std::span<int16_t>, bool mix, bool isr)
-      -> std::pair<size_t, BaseType_t>;
+  int16_t* buf_;
+  util::SpscRing<int16_t> ring_;
 
-  StaticRingbuffer_t meta_;
-  uint8_t* buf_;
-
-  std::atomic<uint32_t> sent_;
-  std::atomic<uint32_t> received_;
+  // Held by whichever side is currently reading from ring_. The consumer
+  // never waits for this; if clear() holds it, the consumer reads nothing.
+  std::atomic_flag consuming_;
   std::atomic<bool> suspended_;
-
-  RingbufHandle_t ringbuf_;
 };
 
 /*
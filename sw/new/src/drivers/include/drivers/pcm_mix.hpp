@@ -0,0 +1,127 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace drivers {
+
+/*
+ * Kernels for mixing and scaling blocks of 16 bit PCM samples, as the outputs
+ * do when they combine their two PcmBuffers.
+ *
+ * Gains are Q15 fixed point, from 0 (silence) up to kUnityGain (unchanged).
+ * Kernels that don't mix also accept gains up to kMaxGain, for making quiet
+ * tracks louder. Every kernel rounds and saturates its results in exactly the
+ * same way on every target, whether or not it uses packed arithmetic.
+ */
+constexpr int32_t kUnityGain = 1 << 15;
+
+/*
+ * About +6 dB. This is as large as a gain can get before a sample multiplied
+ * by it, or either half of it, no longer fits in 32 (or 16) bits.
+ */
+constexpr int32_t kMaxGain = 2 * kUnityGain - 2;
+
+/* Adds `src` into the start of `dest`, clipping each sum to 16 bits. */
+auto MixSaturating(std::span<int16_t> dest, std::span<const int16_t> src)
+    -> void;
+
+/* Scales every sample by the given gain. */
+auto ApplyGain(std::span<int16_t> samples, int32_t gain) -> void;
+
+/*
+ * Copies `src` into the start of `dest`, scaled by the given gain. The two
+ * spans may be the same.
+ */
+auto CopyWithGain(std::span<int16_t> dest,
+                  std::span<const int16_t> src,
+                  int32_t gain) -> void;
+
+/*
+ * Copies each sample of `src` into a pair of adjacent samples in `dest`,
+ * scaled by the given gain, which turns mono samples into stereo. `dest` must
+ * have room for twice as many samples as `src`. Samples are copied from front
+ * to back, so `src` may also lie anywhere within the back half of `dest`.
+ */
+auto DoubleWithGain(std::span<int16_t> dest,
+                    std::span<const int16_t> src,
+                    int32_t gain) -> void;
+
+/*
+ * Adds `src` into the start of `dest`, then scales the sum by the given gain.
+ * The sum isn't clipped before it's scaled, so quiet mixes of loud samples
+ * don't distort.
+ */
+auto MixWithGain(std::span<int16_t> dest,
+                 std::span<const int16_t> src,
+                 int32_t gain) -> void;
+
+/*
+ * A gain that moves smoothly to each new level it's given, rather than
+ * jumping there and causing an audible click (or, for a series of changes,
+ * 'zipper' noise).
+ *
+ * The gain is held constant across short steps of kStepSamples, so that each
+ * step can use the fixed-gain kernels above. A change takes kRampSteps steps
+ * to complete. Spans given to a GainRamp should contain whole frames.
+ *
+ * When copying at gains above unity, a GainRamp also limits its output rather
+ * than letting loud passages clip. Each step's loudest sample is checked
+ * before it's scaled, and if it would clip, then the gain drops at once to
+ * the most that fits. The gain then recovers by kLimiterRelease each step.
+ */
+class GainRamp {
+ public:
+  static constexpr size_t kStepSamples = 32;
+  static constexpr uint32_t kRampSteps = 64;
+  // Recovers a whole kUnityGain in 512 steps; about 170ms of 48kHz stereo.
+  static constexpr int32_t kLimiterRelease = kUnityGain / 512;
+
+  constexpr explicit GainRamp(int32_t gain = kUnityGain)
+      : gain_(gain),
+        target_(gain),
+        increment_(0),
+        steps_left_(0),
+        step_pos_(0),
+        ceiling_(kMaxGain) {}
+
+  /* Begins moving towards the given gain. */
+  auto set(int32_t target) -> void;
+  /* Moves to the given gain immediately, abandoning any ramp. */
+  auto jump(int32_t gain) -> void;
+
+  /* The gain that the next sample will be scaled by. */
+  auto current() const -> int32_t { return gain_; }
+  auto target() const -> int32_t { return target_; }
+
+  auto apply(std::span<int16_t> samples) -> void;
+  auto mixWith(std::span<int16_t> dest, std::span<const int16_t> src) -> void;
+
+  /* As CopyWithGain and DoubleWithGain, with limiting. */
+  auto copy(std::span<int16_t> dest, std::span<const int16_t> src) -> void;
+  auto copyDoubled(std::span<int16_t> dest, std::span<const int16_t> src)
+      -> void;
+
+ private:
+  template <typename Fn>
+  auto run(size_t samples, Fn&& fn) -> void;
+
+  auto limit(std::span<const int16_t> src, int32_t gain) -> int32_t;
+
+  int32_t gain_;
+  int32_t target_;
+  int32_t increment_;
+  uint32_t steps_left_;
+  size_t step_pos_;
+  // The most gain the limiter currently allows.
+  int32_t ceiling_;
+};
+
+}  // namespace drivers
@@ -34,6 +34,8 @@ static constexpr char kKeyInterfaceTheme[] = "ui_theme";
 static constexpr char kKeyAmpMaxVolume[] = "hp_vol_max";
 static constexpr char kKeyAmpCurrentVolume[] = "hp_vol";
 static constexpr char kKeyAmpLeftBias[] = "hp_bias";
+static constexpr char kKeyResamplerBudget[] = "rs_budget";
+static constexpr char kKeyReplayGain[] = "rg_mode";
 static constexpr char kKeyPrimaryInput[] = "in_pri";
 static constexpr char kKeyLockedInput[] = "in_locked";
 static constexpr char kKeyHaptics[] = "haptic_mode";
@@ -275,6 +277,8 @@ NvsStorage::NvsStorage(nvs_handle_t handle)
       amp_max_vol_(kKeyAmpMaxVolume),
       amp_cur_vol_(kKeyAmpCurrentVolume),
       amp_left_bias_(kKeyAmpLeftBias),
+      resampler_budget_(kKeyResamplerBudget),
+      replay_gain_(kKeyReplayGain),
       input_mode_(kKeyPrimaryInput),
       locked_input_mode_(kKeyLockedInput),
       output_mode_(kKeyOutput),
@@ -306,6 +310,8 @@ auto NvsStorage::Read() -> void {
   amp_max_vol_.read(handle_);
   amp_cur_vol_.read(handle_);
   amp_left_bias_.read(handle_);
+  resampler_budget_.read(handle_);
+  replay_gain_.read(handle_);
   input_mode_.read(handle_);
   locked_input_mode_.read(handle_);
   output_mode_.read(handle_);
@@ -332,6 +338,8 @@ auto NvsStorage::Write() -> bool {
   amp_max_vol_.write(handle_);
   amp_cur_vol_.write(handle_);
   amp_left_bias_.write(handle_);
+  resampler_budget_.write(handle_);
+  replay_gain_.write(handle_);
   input_mode_.write(handle_);
   locked_input_mode_.write(handle_);
   output_mode_.write(handle_);
@@ -601,6 +609,26 @@ auto NvsStorage::AmpLeftBias(int_fast8_t val) -> void {
   amp_left_bias_.set(val);
 }
 
+auto NvsStorage::ResamplerBudget() -> uint8_t {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return resampler_budget_.get().value_or(1);
+}
+
+auto NvsStorage::ResamplerBudget(uint8_t val) -> void {
+  std::lock_guard<std::mutex> lock{mutex_};
+  resampler_budget_.set(val);
+}
+
+auto NvsStorage::ReplayGain() -> uint8_t {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return replay_gain_.get().value_or(0);
+}
+
+auto NvsStorage::ReplayGain(uint8_t val) -> void {
+  std::lock_guard<std::mutex> lock{mutex_};
+  replay_gain_.set(val);
+}
+
 auto NvsStorage::PrimaryInput() -> InputModes {
   std::lock_guard<std::mutex> lock{mutex_};
   switch (input_mode_.get().value_or(3)) {
@@ -11,141 +11,114 @@
 #include <cstddef>
 #include <cstring>
 #include <span>
-#include <tuple>
 
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
-
-#include "esp_heap_caps.h"
 #include "freertos/projdefs.h"
-#include "freertos/ringbuf.h"
-#include "portmacro.h"
+#include "freertos/task.h"
+
+#include "drivers/pcm_mix.hpp"
 
 namespace drivers {
 
 [[maybe_unused]] static const char kTag[] = "pcmbuf";
 
 PcmBuffer::PcmBuffer(size_t size_in_samples)
-    : sent_(0), received_(0), suspended_(false) {
-  size_t size_in_bytes = size_in_samples * sizeof(int16_t);
+    : buf_(reinterpret_cast<int16_t*>(
+          heap_caps_malloc(size_in_samples * sizeof(int16_t),
+                           MALLOC_CAP_SPIRAM))),
+      ring_({buf_, size_in_samples}),
+      consuming_(),
+      suspended_(false) {
   ESP_LOGI(kTag, "allocating pcm buffer of size %u (%uKiB)", size_in_samples,
-           size_in_bytes / 1024);
-  buf_ = reinterpret_cast<uint8_t*>(
-      heap_caps_malloc(size_in_bytes, MALLOC_CAP_SPIRAM));
-  ringbuf_ = xRingbufferCreateStatic(size_in_bytes, RINGBUF_TYPE_BYTEBUF, buf_,
-                                     &meta_);
+           size_in_samples * sizeof(int16_t) / 1024);
 }
 
 PcmBuffer::~PcmBuffer() {
-  vRingbufferDelete(ringbuf_);
   heap_caps_free(buf_);
 }
 
 auto PcmBuffer::send(std::span<const int16_t> data) -> size_t {
-  if (!xRingbufferSend(ringbuf_, data.data(), data.size_bytes(),
-                       pdMS_TO_TICKS(100))) {
-    return 0;
+  size_t sent = 0;
+  for (TickType_t waited = 0;; waited++) {
+    // Free space may wrap around the end of the ring, in which case it takes
+    // two goes to fill.
+    for (int i = 0; i < 2 && sent < data.size(); i++) {
+      auto space = ring_.writeAcquire();
+      size_t count = std::min(space.size(), data.size() - sent);
+      std::copy_n(data.begin() + sent, count, space.begin());
+      ring_.writeCommit(count);
+      sent += count;
+    }
+    if (sent > 0 || data.empty() || waited >= pdMS_TO_TICKS(100)) {
+      return sent;
+    }
+    // The consumer is usually an ISR, which can't cheaply wake us up, so poll
+    // for space instead. Outputs drain a whole DMA buffer at a time, so this
+    // rarely needs more than one go.
+    vTaskDelay(1);
   }
-  sent_ += data.size();
-  return data.size();
 }
 
-IRAM_ATTR auto PcmBuffer::receive(std::span<int16_t> dest, bool mix, bool isr)
-    -> BaseType_t {
-  if (suspended_) {
-    if (!mix) {
-      std::fill_n(dest.begin(), dest.size(), 0);
+IRAM_ATTR auto PcmBuffer::receive(std::span<int16_t> dest, bool mix)
+    -> size_t {
+  size_t read = consume(dest.size(), [&](std::span<const int16_t> src) {
+    if (mix) {
+      MixSaturating(dest, src);
+    } else {
+      std::memcpy(dest.data(), src.data(), src.size_bytes());
     }
-    return false;
-  }
-
-  size_t first_read = 0, second_read = 0;
-  BaseType_t ret1 = false, ret2 = false;
-  std::tie(first_read, ret1) = readSingle(dest, mix, isr);
+    dest = dest.subspan(src.size());
+    return src.size();
+  });
 
-  if (first_read < dest.size()) {
-    std::tie(second_read, ret2) =
-        readSingle(dest.subspan(first_read), mix, isr);
+  if (!mix) {
+    std::fill(dest.begin(), dest.end(), 0);
   }
-
-  size_t total_read = first_read + second_read;
-  if (total_read < dest.size() && !mix) {
-    std::fill_n(dest.begin() + total_read, dest.size() - total_read, 0);
-  }
-
-  received_ += first_read + second_read;
-
-  return ret1 || ret2;
+  return read;
 }
 
 auto PcmBuffer::clear() -> void {
-  while (!isEmpty()) {
-    size_t bytes_cleared = 0;
-    void* data = xRingbufferReceive(ringbuf_, &bytes_cleared, 0);
-    if (data) {
-      vRingbufferReturnItem(ringbuf_, data);
-      received_ += bytes_cleared / sizeof(int16_t);
-    }
+  // Take over the consumer's side of the ring whilst we empty it. The
+  // consumer only ever holds this for the length of a single receive, so
+  // there's no need to do anything more clever than spin.
+  while (consuming_.test_and_set(std::memory_order_acquire)) {
+  }
+  for (auto span = ring_.readAcquire(); !span.empty();
+       span = ring_.readAcquire()) {
+    ring_.readCommit(span.size());
   }
+  consuming_.clear(std::memory_order_release);
 }
 
 auto PcmBuffer::isEmpty() -> bool {
-  return xRingbufferGetMaxItemSize(ringbuf_) ==
-         xRingbufferGetCurFreeSize(ringbuf_);
+  return ring_.empty();
 }
 
-auto PcmBuffer::suspend(bool s) -> void {
-  suspended_ = s;
+IRAM_ATTR auto PcmBuffer::size() -> size_t {
+  return ring_.size();
 }
 
-auto PcmBuffer::totalSent() -> uint32_t {
-  return sent_;
+IRAM_ATTR auto PcmBuffer::capacity() -> size_t {
+  return ring_.capacity();
 }
 
-auto PcmBuffer::totalReceived() -> uint32_t {
-  return received_;
+auto PcmBuffer::suspend(bool s) -> void {
+  suspended_ = s;
 }
 
-IRAM_ATTR auto PcmBuffer::readSingle(std::span<int16_t> dest,
-                                     bool mix,
-                                     bool isr)
-    -> std::pair<size_t, BaseType_t> {
-  BaseType_t ret;
-  size_t read_bytes = 0;
-  void* data;
-  if (isr) {
-    data =
-        xRingbufferReceiveUpToFromISR(ringbuf_, &read_bytes, dest.size_bytes());
-  } else {
-    data = xRingbufferReceiveUpTo(ringbuf_, &read_bytes, 0, dest.size_bytes());
-  }
-
-  size_t read_samples = read_bytes / sizeof(int16_t);
-
-  if (!data) {
-    return {read_samples, ret};
-  }
-
-  if (mix) {
-    for (size_t i = 0; i < read_samples; i++) {
-      // Sum the two samples in a 32 bit field so that the addition is always
-      // safe.
-      int32_t sum = static_cast<int32_t>(dest[i]) +
-                    static_cast<int32_t>(reinterpret_cast<int16_t*>(data)[i]);
-      // Clip back into the range of a single sample.
-      dest[i] = std::clamp<int32_t>(sum, INT16_MIN, INT16_MAX);
-    }
-  } else {
-    std::memcpy(dest.data(), data, read_bytes);
-  }
+IRAM_ATTR auto PcmBuffer::isSuspended() -> bool {
+  return suspended_;
+}
 
-  if (isr) {
-    vRingbufferReturnItem(ringbuf_, data);
-  } else {
-    vRingbufferReturnItemFromISR(ringbuf_, data, &ret);
-  }
+auto PcmBuffer::totalSent() -> uint32_t {
+  return ring_.totalWritten();
+}
 
-  return {read_samples, ret};
+auto PcmBuffer::totalReceived() -> uint32_t {
+  return ring_.totalRead();
 }
 
 }  // namespace drivers
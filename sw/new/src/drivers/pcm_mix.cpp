@@ -0,0 +1,290 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "drivers/pcm_mix.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+
+#include "esp_attr.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PCM_MIX_SSE2 1
+#endif
+
+namespace drivers {
+
+// ESP32's cores have no packed 16 bit arithmetic, so there the portable loops
+// below are all we have; GCC turns their clamps into single CLAMPS
+// instructions. Hosts with SSE2 process eight samples at a time instead, with
+// the portable loops handling any leftovers.
+
+static inline auto clip(int32_t s) -> int16_t {
+  return static_cast<int16_t>(std::clamp<int32_t>(s, INT16_MIN, INT16_MAX));
+}
+
+static inline auto scale(int32_t s, int32_t gain) -> int16_t {
+  return clip((s * gain + (1 << 14)) >> 15);
+}
+
+#if PCM_MIX_SSE2
+/*
+ * Sums each pair of 16 bit lanes into a 32 bit lane, scaled by a Q15 gain and
+ * rounded. Gains of kUnityGain and up don't fit in a 16 bit lane, so the gain
+ * is split in half across two multiplies.
+ */
+static inline auto scalePairs(__m128i pairs, __m128i half_a, __m128i half_b)
+    -> __m128i {
+  __m128i sum = _mm_add_epi32(_mm_madd_epi16(pairs, half_a),
+                              _mm_madd_epi16(pairs, half_b));
+  return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << 14)), 15);
+}
+
+/*
+ * The two halves of a gain, packed into each pair of 16 bit lanes. Multiplying
+ * a sample paired with itself by these scales it by the whole gain.
+ */
+static inline auto gainHalves(int32_t gain) -> __m128i {
+  return _mm_set1_epi32((gain >> 1) | (gain - (gain >> 1)) << 16);
+}
+
+/* Scales eight samples by the gain whose halves are given. */
+static inline auto scaleEight(__m128i v, __m128i halves) -> __m128i {
+  __m128i round = _mm_set1_epi32(1 << 14);
+  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(v, v), halves);
+  __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(v, v), halves);
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 15);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 15);
+  return _mm_packs_epi32(lo, hi);
+}
+#endif
+
+IRAM_ATTR auto MixSaturating(std::span<int16_t> dest,
+                             std::span<const int16_t> src) -> void {
+  size_t count = std::min(dest.size(), src.size());
+  int16_t* d = dest.data();
+  const int16_t* s = src.data();
+  size_t i = 0;
+#if PCM_MIX_SSE2
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_adds_epi16(a, b));
+  }
+#endif
+  for (; i < count; i++) {
+    d[i] = clip(d[i] + s[i]);
+  }
+}
+
+IRAM_ATTR auto ApplyGain(std::span<int16_t> samples, int32_t gain) -> void {
+  if (gain == kUnityGain) {
+    return;
+  }
+  CopyWithGain(samples, samples, gain);
+}
+
+IRAM_ATTR auto CopyWithGain(std::span<int16_t> dest,
+                            std::span<const int16_t> src,
+                            int32_t gain) -> void {
+  size_t count = std::min(dest.size(), src.size());
+  int16_t* d = dest.data();
+  const int16_t* s = src.data();
+  if (gain == kUnityGain) {
+    if (d != s) {
+      std::copy_n(s, count, d);
+    }
+    return;
+  }
+  size_t i = 0;
+#if PCM_MIX_SSE2
+  __m128i halves = gainHalves(gain);
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), scaleEight(v, halves));
+  }
+#endif
+  for (; i < count; i++) {
+    d[i] = scale(s[i], gain);
+  }
+}
+
+IRAM_ATTR auto DoubleWithGain(std::span<int16_t> dest,
+                              std::span<const int16_t> src,
+                              int32_t gain) -> void {
+  size_t count = std::min(dest.size() / 2, src.size());
+  int16_t* d = dest.data();
+  const int16_t* s = src.data();
+  size_t i = 0;
+#if PCM_MIX_SSE2
+  // Each block of eight samples is read before any of its sixteen outputs are
+  // written, so this is as safe as the loop below when `src` overlaps `dest`.
+  __m128i halves = gainHalves(gain);
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    if (gain != kUnityGain) {
+      v = scaleEight(v, halves);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i * 2),
+                     _mm_unpacklo_epi16(v, v));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i * 2 + 8),
+                     _mm_unpackhi_epi16(v, v));
+  }
+#endif
+  if (gain == kUnityGain) {
+    for (; i < count; i++) {
+      int16_t v = s[i];
+      d[i * 2] = v;
+      d[i * 2 + 1] = v;
+    }
+    return;
+  }
+  for (; i < count; i++) {
+    int16_t v = scale(s[i], gain);
+    d[i * 2] = v;
+    d[i * 2 + 1] = v;
+  }
+}
+
+IRAM_ATTR auto MixWithGain(std::span<int16_t> dest,
+                           std::span<const int16_t> src,
+                           int32_t gain) -> void {
+  size_t count = std::min(dest.size(), src.size());
+  int16_t* d = dest.data();
+  const int16_t* s = src.data();
+  size_t i = 0;
+#if PCM_MIX_SSE2
+  // Pair each sample with the one it's being mixed with. Multiplying the pair
+  // by the gain in both lanes then gives the scaled sum.
+  __m128i half_a = _mm_set1_epi16(static_cast<int16_t>(gain >> 1));
+  __m128i half_b = _mm_set1_epi16(static_cast<int16_t>(gain - (gain >> 1)));
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    __m128i lo = scalePairs(_mm_unpacklo_epi16(a, b), half_a, half_b);
+    __m128i hi = scalePairs(_mm_unpackhi_epi16(a, b), half_a, half_b);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i),
+                     _mm_packs_epi32(lo, hi));
+  }
+#endif
+  for (; i < count; i++) {
+    d[i] = scale(d[i] + s[i], gain);
+  }
+}
+
+auto GainRamp::set(int32_t target) -> void {
+  if (target == target_) {
+    return;
+  }
+  target_ = target;
+  increment_ = (target_ - gain_) / static_cast<int32_t>(kRampSteps);
+  steps_left_ = kRampSteps;
+}
+
+auto GainRamp::jump(int32_t gain) -> void {
+  gain_ = gain;
+  target_ = gain;
+  increment_ = 0;
+  steps_left_ = 0;
+}
+
+template <typename Fn>
+IRAM_ATTR auto GainRamp::run(size_t samples, Fn&& fn) -> void {
+  size_t offset = 0;
+  while (offset < samples) {
+    // Work a step at a time whilst ramping, or whilst the limiter may need to
+    // act. Otherwise the whole span can be done at once.
+    bool stepping =
+        steps_left_ > 0 || gain_ > kUnityGain || ceiling_ < kMaxGain;
+    size_t len = samples - offset;
+    if (stepping) {
+      len = std::min(len, kStepSamples - step_pos_);
+    }
+    fn(offset, len, gain_);
+    offset += len;
+
+    if (!stepping) {
+      continue;
+    }
+    step_pos_ += len;
+    if (step_pos_ < kStepSamples) {
+      continue;
+    }
+    step_pos_ = 0;
+    if (ceiling_ < kMaxGain) {
+      ceiling_ = std::min(ceiling_ + kLimiterRelease, kMaxGain);
+    }
+    if (steps_left_ > 0) {
+      // The last step lands exactly on the target, making up for any
+      // rounding in the increment.
+      gain_ = --steps_left_ == 0 ? target_ : gain_ + increment_;
+    }
+  }
+}
+
+IRAM_ATTR auto GainRamp::limit(std::span<const int16_t> src, int32_t gain)
+    -> int32_t {
+  if (gain <= kUnityGain) {
+    // Samples can't get any louder, so they can't clip.
+    return gain;
+  }
+  gain = std::min(gain, ceiling_);
+  int32_t peak = 0;
+  for (int16_t s : src) {
+    peak = std::max(peak, std::abs(static_cast<int32_t>(s)));
+  }
+  if (peak == 0) {
+    return gain;
+  }
+  // The most gain that keeps every sample within 16 bits, after rounding.
+  int32_t most = ((1 << 30) - (1 << 14) - 1) / peak;
+  if (most < gain) {
+    ceiling_ = most;
+    return most;
+  }
+  return gain;
+}
+
+IRAM_ATTR auto GainRamp::apply(std::span<int16_t> samples) -> void {
+  run(samples.size(), [&](size_t offset, size_t len, int32_t gain) {
+    ApplyGain(samples.subspan(offset, len), gain);
+  });
+}
+
+IRAM_ATTR auto GainRamp::mixWith(std::span<int16_t> dest,
+                                 std::span<const int16_t> src) -> void {
+  run(std::min(dest.size(), src.size()),
+      [&](size_t offset, size_t len, int32_t gain) {
+        MixWithGain(dest.subspan(offset, len), src.subspan(offset, len),
+                    gain);
+      });
+}
+
+IRAM_ATTR auto GainRamp::copy(std::span<int16_t> dest,
+                              std::span<const int16_t> src) -> void {
+  run(std::min(dest.size(), src.size()),
+      [&](size_t offset, size_t len, int32_t gain) {
+        auto in = src.subspan(offset, len);
+        CopyWithGain(dest.subspan(offset, len), in, limit(in, gain));
+      });
+}
+
+IRAM_ATTR auto GainRamp::copyDoubled(std::span<int16_t> dest,
+                                     std::span<const int16_t> src) -> void {
+  // Steps are counted in output samples, so that the ramp takes as long as it
+  // would for a stereo stream.
+  run(std::min(dest.size() / 2, src.size()) * 2,
+      [&](size_t offset, size_t len, int32_t gain) {
+        auto in = src.subspan(offset / 2, len / 2);
+        DoubleWithGain(dest.subspan(offset, len), in, limit(in, gain));
+      });
+}
+
+}  // namespace drivers
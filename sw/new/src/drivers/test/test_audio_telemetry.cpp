@@ -0,0 +1,120 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "drivers/audio_telemetry.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+
+#include "drivers/pcm_buffer.hpp"
+
+namespace drivers {
+namespace telemetry {
+
+TEST_CASE("audio telemetry", "[unit]") {
+  SECTION("histograms bucket by powers of two") {
+    Histogram hist;
+    for (uint32_t val : {0, 1, 2, 3, 4, 1000, 70000}) {
+      hist.record(val);
+    }
+    REQUIRE(hist.count() == 7);
+    REQUIRE(hist.bucket(0) == 1);
+    REQUIRE(hist.bucket(1) == 1);
+    REQUIRE(hist.bucket(2) == 2);
+    REQUIRE(hist.bucket(3) == 1);
+    REQUIRE(hist.bucket(10) == 1);
+    // Values too large for any bucket go into the last one.
+    REQUIRE(hist.bucket(Histogram::kBuckets - 1) == 1);
+    REQUIRE(hist.max() == 70000);
+
+    REQUIRE(hist.percentile(50) == 3);
+    REQUIRE(hist.percentile(80) == 1023);
+    REQUIRE(hist.percentile(100) == 70000);
+
+    hist.reset();
+    REQUIRE(hist.count() == 0);
+    REQUIRE(hist.max() == 0);
+  }
+
+  SECTION("fill levels bucket by tenths") {
+    FillHistogram hist;
+    hist.record(0, 100);
+    hist.record(9, 100);
+    hist.record(55, 100);
+    hist.record(100, 100);
+    REQUIRE(hist.count() == 4);
+    REQUIRE(hist.bucket(0) == 2);
+    REQUIRE(hist.bucket(5) == 1);
+    REQUIRE(hist.bucket(10) == 1);
+  }
+
+  SECTION("underruns are blamed on the stage that fell behind") {
+    PcmBuffer sink{64};
+    std::vector<int16_t> samples(32);
+    sAudio.reset();
+
+    // Nothing is counted between streams.
+    sAudio.streaming = false;
+    RecordOutput(sink, samples.size(), sink.receive(samples, false));
+    REQUIRE(sAudio.underruns.value() == 0);
+
+    sAudio.streaming = true;
+    sink.send(std::vector<int16_t>(16, 1));
+    sAudio.source_samples = 100;
+    RecordOutput(sink, samples.size(), sink.receive(samples, false));
+    REQUIRE(sAudio.underruns.value() == 1);
+    REQUIRE(sAudio.padded_samples.value() == 16);
+    REQUIRE(sAudio.decoder_underruns.value() == 0);
+
+    sAudio.source_samples = 0;
+    RecordOutput(sink, samples.size(), sink.receive(samples, false));
+    REQUIRE(sAudio.underruns.value() == 2);
+    REQUIRE(sAudio.padded_samples.value() == 48);
+    REQUIRE(sAudio.decoder_underruns.value() == 1);
+
+    // Nor is silence whilst paused.
+    sink.suspend(true);
+    RecordOutput(sink, samples.size(), sink.receive(samples, false));
+    REQUIRE(sAudio.underruns.value() == 2);
+
+    sAudio.streaming = false;
+    sAudio.reset();
+  }
+}
+
+TEST_CASE("audio telemetry overhead", "[.benchmark]") {
+  constexpr int kIterations = 100000;
+  Histogram hist;
+  Counter counter;
+
+  auto time = [&](const char* name, auto&& fn) {
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < kIterations; i++) {
+      fn(i);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    std::printf("%-22s %8.1f ns\n", name, elapsed * 1000.0 / kIterations);
+  };
+
+  time("counter", [&](int) { counter.add(); });
+  time("histogram", [&](int i) { hist.record(i); });
+  time("timed section", [&](int) { hist.recordSince(Now()); });
+
+  // The whole cost that an output pays per DMA buffer.
+  PcmBuffer sink{4096};
+  std::vector<int16_t> samples(1024);
+  sAudio.streaming = true;
+  time("output", [&](int) { RecordOutput(sink, samples.size(), 0); });
+  sAudio.streaming = false;
+  sAudio.reset();
+}
+
+}  // namespace telemetry
+}  // namespace drivers
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "drivers/pcm_buffer.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+
+namespace drivers {
+
+static auto counting(uint32_t from, size_t count) -> std::vector<int16_t> {
+  std::vector<int16_t> out;
+  for (size_t i = 0; i < count; i++) {
+    out.push_back(static_cast<int16_t>(from + i));
+  }
+  return out;
+}
+
+TEST_CASE("pcm buffer", "[unit]") {
+  PcmBuffer buffer{100};
+
+  SECTION("receives samples in the order they were sent") {
+    int16_t next = 0;
+    // Go around the ring a few times, so that reads and writes wrap.
+    for (int i = 0; i < 10; i++) {
+      auto in = counting(next, 70);
+      REQUIRE(buffer.send(in) == 70);
+
+      std::vector<int16_t> out(70);
+      REQUIRE(buffer.receive(out, false) == 70);
+      REQUIRE(out == in);
+      next += 70;
+    }
+    REQUIRE(buffer.totalSent() == 700);
+    REQUIRE(buffer.totalReceived() == 700);
+  }
+
+  SECTION("only sends as much as fits") {
+    auto in = counting(0, 150);
+    REQUIRE(buffer.send(in) == 100);
+    REQUIRE(buffer.totalSent() == 100);
+  }
+
+  SECTION("pads short reads with silence") {
+    auto in = counting(1, 10);
+    buffer.send(in);
+
+    std::vector<int16_t> out(20, 99);
+    REQUIRE(buffer.receive(out, false) == 10);
+    for (size_t i = 0; i < out.size(); i++) {
+      REQUIRE(out[i] == (i < 10 ? in[i] : 0));
+    }
+  }
+
+  SECTION("mixes into existing samples, clipping the result") {
+    std::vector<int16_t> in = {1, 2, INT16_MAX, INT16_MIN};
+    buffer.send(in);
+
+    std::vector<int16_t> out = {10, 20, 1, -1, 5};
+    REQUIRE(buffer.receive(out, true) == 4);
+    REQUIRE(out == std::vector<int16_t>{11, 22, INT16_MAX, INT16_MIN, 5});
+  }
+
+  SECTION("hands out contiguous spans of the storage") {
+    buffer.send(counting(0, 80));
+    std::vector<int16_t> discard(60);
+    buffer.receive(discard, false);
+    buffer.send(counting(80, 60));
+
+    // The 80 waiting samples wrap around the end of the storage.
+    std::vector<size_t> sizes;
+    std::vector<int16_t> seen;
+    size_t used = buffer.consume(1000, [&](std::span<const int16_t> span) {
+      sizes.push_back(span.size());
+      seen.insert(seen.end(), span.begin(), span.end());
+      return span.size();
+    });
+    REQUIRE(used == 80);
+    REQUIRE(sizes == std::vector<size_t>{40, 40});
+    REQUIRE(seen == counting(60, 80));
+  }
+
+  SECTION("stops consuming when a span isn't used up") {
+    buffer.send(counting(0, 50));
+    size_t calls = 0;
+    size_t used = buffer.consume(1000, [&](std::span<const int16_t> span) {
+      calls++;
+      return size_t{5};
+    });
+    REQUIRE(used == 5);
+    REQUIRE(calls == 1);
+    REQUIRE(buffer.totalReceived() == 5);
+  }
+
+  SECTION("counts cleared samples as received") {
+    buffer.send(counting(0, 42));
+    buffer.clear();
+    REQUIRE(buffer.isEmpty());
+    REQUIRE(buffer.totalReceived() == 42);
+  }
+
+  SECTION("reads nothing whilst suspended") {
+    buffer.send(counting(1, 10));
+    buffer.suspend(true);
+
+    std::vector<int16_t> out(10, 99);
+    REQUIRE(buffer.receive(out, false) == 0);
+    REQUIRE(out == std::vector<int16_t>(10, 0));
+
+    buffer.suspend(false);
+    REQUIRE(buffer.receive(out, false) == 10);
+    REQUIRE(out == counting(1, 10));
+  }
+}
+
+TEST_CASE("pcm buffer across threads", "[unit]") {
+  constexpr size_t kSamples = 2'000'000;
+  PcmBuffer buffer{4096};
+  std::atomic<bool> done{false};
+
+  SECTION("delivers every sample in order") {
+    std::thread producer([&]() {
+      std::minstd_rand rand{1};
+      size_t sent = 0;
+      while (sent < kSamples) {
+        auto in = counting(sent, 1 + rand() % 1500);
+        sent += buffer.send(in);
+      }
+      done = true;
+    });
+
+    std::minstd_rand rand{2};
+    std::vector<int16_t> out(2048);
+    size_t received = 0;
+    bool in_order = true;
+    while (!done || !buffer.isEmpty()) {
+      auto dest = std::span{out}.first(1 + rand() % out.size());
+      size_t read = buffer.receive(dest, false);
+      for (size_t i = 0; i < read; i++) {
+        in_order &= dest[i] == static_cast<int16_t>(received + i);
+      }
+      received += read;
+      if (read == 0) {
+        std::this_thread::yield();
+      }
+    }
+    producer.join();
+
+    REQUIRE(in_order);
+    REQUIRE(buffer.totalSent() == buffer.totalReceived());
+    REQUIRE(buffer.totalReceived() >= kSamples);
+  }
+
+  SECTION("survives being cleared by the producer") {
+    // Clearing may skip any number of samples, so each value here is split
+    // across a pair of samples to keep it from wrapping. Every send, receive
+    // and clear moves a whole number of pairs.
+    auto pairs = [](uint32_t from, size_t count) {
+      std::vector<int16_t> out;
+      for (uint32_t i = from; i < from + count; i++) {
+        out.push_back(static_cast<int16_t>(i >> 16));
+        out.push_back(static_cast<int16_t>(i));
+      }
+      return out;
+    };
+
+    std::thread producer([&]() {
+      std::minstd_rand rand{3};
+      size_t sent = 0;
+      while (sent < kSamples) {
+        auto in = pairs(sent / 2, 1 + rand() % 750);
+        sent += buffer.send(in);
+        if (rand() % 16 == 0) {
+          buffer.clear();
+        }
+      }
+      done = true;
+    });
+
+    // Samples may be skipped, but must never be reordered or repeated.
+    std::vector<int16_t> out(2048);
+    std::optional<uint32_t> last;
+    bool in_order = true;
+    while (!done || !buffer.isEmpty()) {
+      size_t read = buffer.receive(out, false);
+      for (size_t i = 0; i + 1 < read; i += 2) {
+        uint16_t hi = out[i];
+        uint16_t lo = out[i + 1];
+        uint32_t val = static_cast<uint32_t>(hi) << 16 | lo;
+        in_order &= !last || val > *last;
+        last = val;
+      }
+      in_order &= read % 2 == 0;
+      if (read == 0) {
+        std::this_thread::yield();
+      }
+    }
+    producer.join();
+
+    REQUIRE(in_order);
+    REQUIRE(buffer.totalSent() == buffer.totalReceived());
+  }
+}
+
+}  // namespace drivers
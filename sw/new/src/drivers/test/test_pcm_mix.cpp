@@ -0,0 +1,402 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "drivers/pcm_mix.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+
+namespace drivers {
+
+// Straightforward versions of each kernel, one sample at a time. The real
+// kernels must match these exactly.
+
+static auto refClip(int32_t s) -> int16_t {
+  return std::clamp<int32_t>(s, INT16_MIN, INT16_MAX);
+}
+
+static auto refScale(int32_t s, int32_t gain) -> int16_t {
+  int64_t scaled = static_cast<int64_t>(s) * gain + (1 << 14);
+  return refClip(static_cast<int32_t>(scaled >> 15));
+}
+
+static auto noise(size_t count, uint32_t seed) -> std::vector<int16_t> {
+  std::minstd_rand rand{seed};
+  std::vector<int16_t> out;
+  for (size_t i = 0; i < count; i++) {
+    // Mostly random, with plenty of the extremes thrown in.
+    switch (rand() % 8) {
+      case 0:
+        out.push_back(INT16_MAX);
+        break;
+      case 1:
+        out.push_back(INT16_MIN);
+        break;
+      default:
+        out.push_back(static_cast<int16_t>(rand()));
+    }
+  }
+  return out;
+}
+
+static const int32_t kGains[] = {0, 1, 2, 3, 12345, 16384, 32767, kUnityGain};
+// Gains that only the non-mixing kernels accept.
+static const int32_t kBoosts[] = {kUnityGain + 1, 40000, kMaxGain};
+
+TEST_CASE("pcm mixing kernels", "[unit]") {
+  // Lengths that aren't multiples of any packed width, so that every kernel's
+  // leftover handling gets exercised.
+  for (size_t len = 0; len < 70; len += 7) {
+    auto a = noise(len, len);
+    auto b = noise(len, len + 1000);
+
+    SECTION("saturating mix") {
+      auto out = a;
+      MixSaturating(out, b);
+      for (size_t i = 0; i < len; i++) {
+        REQUIRE(out[i] == refClip(a[i] + b[i]));
+      }
+    }
+
+    SECTION("gain") {
+      for (int32_t gain : kGains) {
+        auto out = a;
+        ApplyGain(out, gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i] == refScale(a[i], gain));
+        }
+      }
+    }
+
+    SECTION("copy with gain") {
+      for (int32_t gain : kGains) {
+        std::vector<int16_t> out(len, 0);
+        CopyWithGain(out, a, gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i] == refScale(a[i], gain));
+        }
+      }
+      for (int32_t gain : kBoosts) {
+        auto out = a;
+        CopyWithGain(out, out, gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i] == refScale(a[i], gain));
+        }
+      }
+    }
+
+    SECTION("double with gain") {
+      for (int32_t gain : kGains) {
+        std::vector<int16_t> out(len * 2, 0);
+        DoubleWithGain(out, a, gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i * 2] == refScale(a[i], gain));
+          REQUIRE(out[i * 2 + 1] == refScale(a[i], gain));
+        }
+      }
+      for (int32_t gain : kBoosts) {
+        // In place, from the back half of the output.
+        std::vector<int16_t> out(len * 2, 0);
+        std::copy(a.begin(), a.end(), out.begin() + len);
+        DoubleWithGain(out, std::span{out}.subspan(len), gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i * 2] == refScale(a[i], gain));
+          REQUIRE(out[i * 2 + 1] == refScale(a[i], gain));
+        }
+      }
+    }
+
+    SECTION("mix with gain") {
+      for (int32_t gain : kGains) {
+        auto out = a;
+        MixWithGain(out, b, gain);
+        for (size_t i = 0; i < len; i++) {
+          REQUIRE(out[i] == refScale(a[i] + b[i], gain));
+        }
+      }
+    }
+  }
+
+  SECTION("mixes only as much as both spans hold") {
+    std::vector<int16_t> dest(20, 1);
+    std::vector<int16_t> src(10, 1);
+    MixSaturating(dest, src);
+    MixWithGain(std::span{dest}.subspan(5), src, kUnityGain);
+    for (size_t i = 0; i < dest.size(); i++) {
+      int16_t expected = 1 + (i < 10) + (i >= 5 && i < 15);
+      REQUIRE(dest[i] == expected);
+    }
+  }
+
+  SECTION("unity gain leaves samples alone") {
+    auto a = noise(100, 1);
+    auto out = a;
+    ApplyGain(out, kUnityGain);
+    REQUIRE(out == a);
+  }
+}
+
+TEST_CASE("gain ramp", "[unit]") {
+  constexpr size_t kRampLength =
+      GainRamp::kStepSamples * GainRamp::kRampSteps;
+
+  SECTION("holds a steady gain") {
+    GainRamp ramp{kUnityGain / 2};
+    std::vector<int16_t> samples(100, 1000);
+    ramp.apply(samples);
+    REQUIRE(samples == std::vector<int16_t>(100, 500));
+  }
+
+  SECTION("moves gradually to its target") {
+    GainRamp ramp{0};
+    ramp.set(kUnityGain);
+    std::vector<int16_t> samples(kRampLength + 100, 10000);
+    ramp.apply(samples);
+
+    REQUIRE(samples.front() == 0);
+    for (size_t i = 1; i < kRampLength; i++) {
+      REQUIRE(samples[i] >= samples[i - 1]);
+      // No step is more than a small fraction of the full change.
+      REQUIRE(samples[i] - samples[i - 1] <= 10000 / GainRamp::kRampSteps + 1);
+    }
+    for (size_t i = kRampLength; i < samples.size(); i++) {
+      REQUIRE(samples[i] == 10000);
+    }
+    REQUIRE(ramp.current() == kUnityGain);
+  }
+
+  SECTION("gives the same results however the input is split") {
+    auto a = noise(kRampLength * 2, 7);
+    auto b = noise(kRampLength * 2, 8);
+
+    GainRamp whole{kUnityGain};
+    whole.set(1234);
+    auto expected = a;
+    whole.mixWith(expected, b);
+
+    GainRamp split{kUnityGain};
+    split.set(1234);
+    auto out = a;
+    std::minstd_rand rand{9};
+    for (size_t pos = 0; pos < out.size();) {
+      size_t len = std::min<size_t>(out.size() - pos, 2 * (1 + rand() % 40));
+      split.mixWith(std::span{out}.subspan(pos, len),
+                    std::span{b}.subspan(pos, len));
+      pos += len;
+    }
+    REQUIRE(out == expected);
+  }
+
+  SECTION("changes course when given a new target mid-ramp") {
+    GainRamp ramp{0};
+    ramp.set(kUnityGain);
+    std::vector<int16_t> samples(kRampLength / 2, 0);
+    ramp.apply(samples);
+    int32_t midway = ramp.current();
+    REQUIRE(midway > 0);
+    REQUIRE(midway < kUnityGain);
+
+    ramp.set(0);
+    samples.resize(kRampLength);
+    ramp.apply(samples);
+    REQUIRE(ramp.current() == 0);
+  }
+
+  SECTION("jumps straight to a gain") {
+    GainRamp ramp{0};
+    ramp.set(kUnityGain);
+    ramp.jump(kUnityGain / 2);
+    REQUIRE(ramp.current() == kUnityGain / 2);
+    REQUIRE(ramp.target() == kUnityGain / 2);
+  }
+}
+
+// The limiter, a step at a time. Each step's gain is the most that the step's
+// loudest sample allows, if that's less than both the wanted gain and the
+// ceiling left by earlier steps. The ceiling then recovers a little per step.
+static auto refLimited(std::span<const int16_t> src, int32_t gain)
+    -> std::vector<int16_t> {
+  std::vector<int16_t> out;
+  int32_t ceiling = kMaxGain;
+  for (size_t pos = 0; pos < src.size(); pos += GainRamp::kStepSamples) {
+    auto step = src.subspan(
+        pos, std::min(GainRamp::kStepSamples, src.size() - pos));
+    int32_t peak = 0;
+    for (int16_t s : step) {
+      peak = std::max(peak, std::abs(static_cast<int32_t>(s)));
+    }
+    int32_t g = std::min(gain, ceiling);
+    if (peak > 0 && static_cast<int64_t>(peak) * g + (1 << 14) >= 1 << 30) {
+      g = ((1 << 30) - (1 << 14) - 1) / peak;
+      ceiling = g;
+    }
+    for (int16_t s : step) {
+      out.push_back(refScale(s, g));
+    }
+    ceiling = std::min(ceiling + GainRamp::kLimiterRelease, kMaxGain);
+  }
+  return out;
+}
+
+TEST_CASE("gain ramp limiter", "[unit]") {
+  // Quiet, then loud, then quiet again.
+  std::vector<int16_t> quiet(GainRamp::kStepSamples * 40, 0);
+  std::minstd_rand rand{3};
+  for (auto& s : quiet) {
+    s = static_cast<int16_t>(rand() % 8001) - 4000;
+  }
+  auto loud = noise(GainRamp::kStepSamples * 20, 4);
+  std::vector<int16_t> samples = quiet;
+  samples.insert(samples.end(), loud.begin(), loud.end());
+  samples.insert(samples.end(), quiet.begin(), quiet.end());
+  samples.insert(samples.end(), quiet.begin(), quiet.end());
+
+  SECTION("matches the reference limiter") {
+    for (int32_t gain : kBoosts) {
+      GainRamp ramp{gain};
+      std::vector<int16_t> out(samples.size());
+      ramp.copy(out, samples);
+      REQUIRE(out == refLimited(samples, gain));
+    }
+  }
+
+  SECTION("limits doubled samples in the same way") {
+    for (int32_t gain : kBoosts) {
+      GainRamp ramp{gain};
+      std::vector<int16_t> out(samples.size() * 2);
+      ramp.copyDoubled(out, samples);
+      // Steps are counted in output samples, so each covers half as many
+      // input samples.
+      GainRamp stereo_ramp{gain};
+      std::vector<int16_t> doubled;
+      for (int16_t s : samples) {
+        doubled.push_back(s);
+        doubled.push_back(s);
+      }
+      std::vector<int16_t> expected(doubled.size());
+      stereo_ramp.copy(expected, doubled);
+      REQUIRE(out == expected);
+    }
+  }
+
+  SECTION("never clips") {
+    GainRamp ramp{kMaxGain};
+    auto all = noise(GainRamp::kStepSamples * 100, 5);
+    std::vector<int16_t> out(all.size());
+    ramp.copy(out, all);
+    // Clipping would squash different samples within a step into the same
+    // extreme value.
+    for (size_t pos = 0; pos < all.size(); pos += GainRamp::kStepSamples) {
+      std::optional<int16_t> loudest_pos, loudest_neg;
+      for (size_t i = pos; i < pos + GainRamp::kStepSamples; i++) {
+        if (out[i] == INT16_MAX) {
+          REQUIRE(loudest_pos.value_or(all[i]) == all[i]);
+          loudest_pos = all[i];
+        } else if (out[i] == INT16_MIN) {
+          REQUIRE(loudest_neg.value_or(all[i]) == all[i]);
+          loudest_neg = all[i];
+        }
+      }
+    }
+    REQUIRE(out == refLimited(all, kMaxGain));
+  }
+
+  SECTION("recovers after a loud passage") {
+    // Releasing from the deepest cut takes kUnityGain / kLimiterRelease
+    // steps of quiet.
+    for (int i = 0; i < kUnityGain / GainRamp::kLimiterRelease / 40; i++) {
+      samples.insert(samples.end(), quiet.begin(), quiet.end());
+    }
+    GainRamp ramp{kMaxGain};
+    std::vector<int16_t> out(samples.size());
+    ramp.copy(out, samples);
+    // The first quiet passage is boosted in full, and the last one is again
+    // once the limiter has released.
+    for (size_t i = 0; i < quiet.size(); i++) {
+      REQUIRE(out[i] == refScale(quiet[i], kMaxGain));
+      REQUIRE(out[out.size() - quiet.size() + i] ==
+              refScale(quiet[i], kMaxGain));
+    }
+  }
+
+  SECTION("leaves gains of unity and below alone") {
+    GainRamp ramp{kUnityGain / 3};
+    std::vector<int16_t> out(loud.size());
+    ramp.copy(out, loud);
+    for (size_t i = 0; i < loud.size(); i++) {
+      REQUIRE(out[i] == refScale(loud[i], kUnityGain / 3));
+    }
+  }
+}
+
+TEST_CASE("pcm mixing performance", "[.benchmark]") {
+  // About the size of one I2S DMA buffer.
+  constexpr size_t kSamples = 2048;
+  constexpr int kIterations = 2000;
+  auto a = noise(kSamples, 1);
+  auto b = noise(kSamples, 2);
+  std::vector<int16_t> out(kSamples);
+
+  auto time = [&](const char* name, auto&& fn) {
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < kIterations; i++) {
+      std::copy(a.begin(), a.end(), out.begin());
+      fn();
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    std::printf("%-22s %6.2f ns/sample\n", name,
+                elapsed * 1000.0 / (kSamples * kIterations));
+  };
+
+  // The loops that these kernels replaced, for comparison.
+  time("mix (per sample)", [&]() {
+    for (size_t i = 0; i < kSamples; i++) {
+      out[i] = refClip(static_cast<int32_t>(out[i]) + b[i]);
+    }
+  });
+  time("mix", [&]() { MixSaturating(out, b); });
+
+  float factor = 0.4f;
+  time("gain (float)", [&]() {
+    for (size_t i = 0; i < kSamples; i++) {
+      out[i] *= factor;
+    }
+  });
+  time("gain", [&]() { ApplyGain(out, 13107); });
+
+  GainRamp ramp{kUnityGain};
+  time("gain ramp", [&]() {
+    ramp.set(ramp.target() == 0 ? kUnityGain : 0);
+    ramp.apply(out);
+  });
+
+  std::vector<int16_t> half(a.begin(), a.begin() + kSamples / 2);
+  time("copy with gain", [&]() { CopyWithGain(out, a, 13107); });
+  time("double with gain", [&]() { DoubleWithGain(out, half, 13107); });
+  GainRamp boost{40000};
+  time("boost, limited", [&]() { boost.copy(out, a); });
+
+  time("mix, then gain (float)", [&]() {
+    for (size_t i = 0; i < kSamples; i++) {
+      out[i] = refClip(static_cast<int32_t>(out[i]) + b[i]);
+    }
+    for (size_t i = 0; i < kSamples; i++) {
+      out[i] *= factor;
+    }
+  });
+  time("mix with gain", [&]() { MixWithGain(out, b, 13107); });
+}
+
+}  // namespace drivers
@@ -31,6 +31,7 @@
 #include "ff.h"
 #include "freertos/projdefs.h"
 
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/bluetooth.hpp"
 #include "drivers/bluetooth_types.hpp"
 #include "drivers/haptics.hpp"
@@ -205,6 +206,40 @@ void RegisterDbInit() {
   esp_console_cmd_register(&cmd);
 }
 
+int CmdDbCheck(int argc, char** argv) {
+  static const std::pmr::string usage = "usage: db_check [repair]";
+  if (argc > 2 || (argc == 2 && std::string{argv[1]} != "repair")) {
+    std::cout << usage << std::endl;
+    return 1;
+  }
+
+  auto db = AppConsole::sServices->database().lock();
+  if (!db) {
+    std::cout << "no database open" << std::endl;
+    return 1;
+  }
+
+  bool repair = argc == 2;
+  size_t mismatches = db->checkIndexCounts(repair);
+  std::cout << mismatches << " incorrect index counts";
+  if (repair && mismatches > 0) {
+    std::cout << " (repaired)";
+  }
+  std::cout << std::endl;
+
+  return 0;
+}
+
+void RegisterDbCheck() {
+  esp_console_cmd_t cmd{
+      .command = "db_check",
+      .help = "verifies the database's index counts, optionally fixing them",
+      .hint = "[repair]",
+      .func = &CmdDbCheck,
+      .argtable = NULL};
+  esp_console_cmd_register(&cmd);
+}
+
 int CmdTasks(int argc, char** argv) {
 #if (configUSE_TRACE_FACILITY == 0)
   std::cout
@@ -400,6 +435,67 @@ void RegisterStacks() {
   esp_console_cmd_register(&cmd);
 }
 
+static auto PrintTimes(const char* name,
+                       const drivers::telemetry::Histogram& hist) -> void {
+  std::cout << name << ": " << hist.count() << " calls, p50 <"
+            << hist.percentile(50) << "us, p99 <" << hist.percentile(99)
+            << "us, max " << hist.max() << "us" << std::endl;
+}
+
+static auto PrintFill(const char* name,
+                      const drivers::telemetry::FillHistogram& hist) -> void {
+  std::cout << name << " (% full):";
+  for (size_t i = 0; i < hist.kBuckets; i++) {
+    std::cout << " " << i * 10 << ":" << hist.bucket(i);
+  }
+  std::cout << std::endl;
+}
+
+int CmdAudioStats(int argc, char** argv) {
+  static const std::pmr::string usage = "usage: audio_stats [reset]";
+  auto& stats = drivers::telemetry::sAudio;
+  if (argc == 2 && std::string{argv[1]} == "reset") {
+    stats.reset();
+    return 0;
+  }
+  if (argc != 1) {
+    std::cout << usage << std::endl;
+    return 1;
+  }
+#if !AUDIO_TELEMETRY
+  std::cout << "audio telemetry is disabled in this build" << std::endl;
+  return 0;
+#endif
+
+  PrintTimes("decode", stats.decode_us);
+  PrintTimes("resample", stats.resample_us);
+  PrintFill("source", stats.source_fill);
+  PrintFill("sink", stats.sink_fill);
+
+  std::cout << "backpressure: " << stats.backpressure_waits.value()
+            << " waits, " << stats.backpressure_timeouts.value()
+            << " timeouts" << std::endl;
+  PrintTimes("backpressure wait", stats.backpressure_us);
+
+  uint32_t underruns = stats.underruns.value();
+  uint32_t decoder_underruns = stats.decoder_underruns.value();
+  std::cout << "underruns: " << underruns << " (" << decoder_underruns
+            << " decoder, " << underruns - decoder_underruns
+            << " processor), " << stats.padded_samples.value()
+            << " samples of silence" << std::endl;
+
+  return 0;
+}
+
+void RegisterAudioStats() {
+  esp_console_cmd_t cmd{
+      .command = "audio_stats",
+      .help = "prints timings and buffer levels for each stage of playback",
+      .hint = "[reset]",
+      .func = &CmdAudioStats,
+      .argtable = NULL};
+  esp_console_cmd_register(&cmd);
+}
 #if CONFIG_HEAP_TRACING
 static heap_trace_record_t* sTraceRecords = nullptr;
 static bool sIsTracking = false;
@@ -758,10 +854,12 @@ auto AppConsole::RegisterExtraComponents() -> void {
   RegisterAudioStatus();
   */
   RegisterDbInit();
+  RegisterDbCheck();
   RegisterTasks();
 
   RegisterHeaps();
   RegisterStacks();
+  RegisterAudioStats();
 
 #if CONFIG_HEAP_TRACING
   RegisterAllocs();
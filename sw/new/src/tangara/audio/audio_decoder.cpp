@@ -25,18 +25,17 @@
 #include "freertos/queue.h"
 
 #include "audio/audio_events.hpp"
-#include "audio/audio_fsm.hpp"
 #include "audio/audio_sink.hpp"
 #include "audio/audio_source.hpp"
 #include "audio/processor.hpp"
 #include "codec.hpp"
 #include "database/track.hpp"
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/i2s_dac.hpp"
 #include "events/event_queue.hpp"
 #include "sample.hpp"
 #include "tasks.hpp"
 #include "types.hpp"
-#include "ui/ui_fsm.hpp"
 
 namespace audio {
 
@@ -50,6 +49,15 @@ static const char* kTag = "decoder";
 static constexpr std::size_t kCodecBufferLength =
     drivers::kI2SBufferLengthFrames * 2;
 
+/*
+ * How much of the next stream to decode before the current one has finished.
+ * This only needs to cover the time it takes to switch between the two
+ * streams' codecs; the sink's own buffer covers the rest.
+ */
+static constexpr uint32_t kPrerollMs = 300;
+static constexpr std::size_t kPrerollBufferLength =
+    48000 * 2 * kPrerollMs / 1000;
+
 auto Decoder::Start(std::shared_ptr<SampleProcessor> sink) -> Decoder* {
   Decoder* task = new Decoder(sink);
   tasks::StartPersistent<tasks::Type::kAudioDecoder>([=]() { task->Main(); });
@@ -59,19 +67,59 @@ auto Decoder::Start(std::shared_ptr<SampleProcessor> sink) -> Decoder* {
 auto Decoder::open(std::shared_ptr<TaggedStream> stream) -> void {
   NextStream* next = new NextStream();
   next->stream = stream;
+  next->is_follow_on = false;
   // The decoder services its queue very quickly, so blocking on this write
   // should be fine. If we discover contention here, then adding more space for
   // items to next_stream_ should be fine too.
   xQueueSend(next_stream_, &next, portMAX_DELAY);
 }
 
+auto Decoder::prepareNext(std::shared_ptr<TaggedStream> stream) -> void {
+  NextStream* next = new NextStream();
+  next->stream = stream;
+  next->is_follow_on = true;
+  xQueueSend(next_stream_, &next, portMAX_DELAY);
+}
+
 Decoder::Decoder(std::shared_ptr<SampleProcessor> processor)
-    : processor_(processor), next_stream_(xQueueCreate(1, sizeof(void*))) {
+    : processor_(processor), next_stream_(xQueueCreate(2, sizeof(void*))) {
   ESP_LOGI(kTag, "allocating codec buffer, %u KiB", kCodecBufferLength / 1024);
   codec_buffer_ = {
       reinterpret_cast<sample::Sample*>(heap_caps_calloc(
           kCodecBufferLength, sizeof(sample::Sample), MALLOC_CAP_DMA)),
       kCodecBufferLength};
+  preroll_buffer_ = {
+      reinterpret_cast<sample::Sample*>(heap_caps_calloc(
+          kPrerollBufferLength, sizeof(sample::Sample), MALLOC_CAP_SPIRAM)),
+      kPrerollBufferLength};
+}
+
+/*
+ * Fills out the track info for a stream that its codec has just opened.
+ */
+static auto trackInfoFor(TaggedStream& stream,
+                         const codecs::ICodec::OutputFormat& format)
+    -> std::shared_ptr<TrackInfo> {
+  auto track = std::make_shared<TrackInfo>(TrackInfo{
+      .tags = stream.tags(),
+      .uri = stream.Filepath(),
+      .duration = {},
+      .start_offset = stream.Offset(),
+      .bitrate_kbps = format.bitrate_kbps,
+      .encoding = stream.type(),
+      .format =
+          {
+              .sample_rate = format.sample_rate_hz,
+              .num_channels = format.num_channels,
+              .bits_per_sample = 16,
+          },
+  });
+
+  if (format.total_samples) {
+    track->duration = format.total_samples.value() / format.num_channels /
+                      format.sample_rate_hz;
+  }
+  return track;
 }
 
 /*
@@ -93,8 +141,23 @@ void Decoder::Main() {
     if (xQueueReceive(next_stream_, &next, wait_time)) {
       // Copy the data out of the queue, then clean up the item.
       std::shared_ptr<TaggedStream> new_stream = next->stream;
+      bool is_follow_on = next->is_follow_on;
       delete next;
 
+      if (is_follow_on) {
+        // Hold on to the stream until the current one is nearly done. If
+        // nothing is playing, then there's nothing for it to follow on from;
+        // it'll be opened normally instead.
+        next_.reset();
+        if (new_stream && stream_) {
+          next_ = Upcoming{.stream = new_stream};
+        }
+        continue;
+      }
+
+      // Whatever was due to follow the current stream is no longer wanted.
+      next_.reset();
+
       // If we were already decoding, then make sure we finish up the current
       // file gracefully.
       if (stream_) {
@@ -118,8 +181,16 @@ void Decoder::Main() {
     // receiving a new stream.
     assert(stream_);
 
+    // Once the current stream's codec is finished, its remaining samples are
+    // all buffered downstream of us. Use that time to open the next stream
+    // and stage its first samples, without ever having two codecs open.
+    if (next_ && !next_->track && !codec_ && !isSendingPreroll()) {
+      prerollNext();
+    }
+
     if (!continueDecode()) {
       finishDecode(false);
+      startNext();
     }
   }
 }
@@ -155,28 +226,97 @@ auto Decoder::prepareDecode(std::shared_ptr<TaggedStream> stream) -> void {
   // Decoding started okay! Fill out the rest of the track info for this
   // stream.
   stream_ = stream;
-  track_ = std::make_shared<TrackInfo>(TrackInfo{
-      .tags = stream->tags(),
-      .uri = stream->Filepath(),
-      .duration = {},
-      .start_offset = stream->Offset(),
-      .bitrate_kbps = open_res->bitrate_kbps,
-      .encoding = stream->type(),
-      .format =
-          {
-              .sample_rate = open_res->sample_rate_hz,
-              .num_channels = open_res->num_channels,
-              .bits_per_sample = 16,
-          },
+  track_ = trackInfoFor(*stream, *open_res);
+
+  events::Audio().Dispatch(internal::DecodingStarted{
+      .track = track_,
+      .is_follow_on = false,
   });
+  processor_->beginStream(track_);
+}
+
+/*
+ * Opens the upcoming stream, and decodes its first samples into the preroll
+ * buffer. Streams that fail to open are dropped; they'll be retried, and
+ * their failure reported, when they're opened normally.
+ */
+auto Decoder::prerollNext() -> void {
+  auto codec = std::unique_ptr<codecs::ICodec>{
+      codecs::CreateCodecForType(next_->stream->type()).value_or(nullptr)};
+  if (!codec) {
+    next_.reset();
+    return;
+  }
+  auto open_res = codec->OpenStream(next_->stream, next_->stream->Offset());
+  if (open_res.has_error()) {
+    ESP_LOGW(kTag, "failed to open next stream: %s",
+             codecs::ICodec::ErrorString(open_res.error()).c_str());
+    next_.reset();
+    return;
+  }
 
-  if (open_res->total_samples) {
-    track_->duration = open_res->total_samples.value() /
-                       open_res->num_channels / open_res->sample_rate_hz;
+  // Stage a whole number of frames, so that the stream's channels stay
+  // lined up when it switches from these samples to the codec buffer.
+  size_t target = std::min<size_t>(
+      preroll_buffer_.size(),
+      open_res->sample_rate_hz * open_res->num_channels * kPrerollMs / 1000);
+  target -= target % open_res->num_channels;
+
+  size_t staged = 0;
+  while (codec && staged < target) {
+    auto dest = preroll_buffer_.subspan(staged, target - staged);
+    int64_t start = drivers::telemetry::Now();
+    auto res = codec->DecodeTo(dest.first(std::min(dest.size(),
+                                                   codec_buffer_.size())));
+    drivers::telemetry::sAudio.decode_us.recordSince(start);
+    if (res.has_error()) {
+      codec.reset();
+      break;
+    }
+    staged += res->samples_written;
+    if (res->is_stream_finished) {
+      codec.reset();
+    }
   }
 
-  events::Audio().Dispatch(internal::DecodingStarted{.track = track_});
+  next_->codec = std::move(codec);
+  next_->track = trackInfoFor(*next_->stream, *open_res);
+  next_->samples = preroll_buffer_.first(staged);
+}
+
+/*
+ * Switches to the upcoming stream, if there is one, as soon as the current
+ * stream has finished. Returns false if there was nothing to switch to.
+ */
+auto Decoder::startNext() -> bool {
+  if (next_ && !next_->track) {
+    prerollNext();
+  }
+  if (!next_) {
+    return false;
+  }
+
+  stream_ = std::move(next_->stream);
+  codec_ = std::move(next_->codec);
+  track_ = std::move(next_->track);
+  leftover_samples_ = next_->samples;
+  next_.reset();
+
+  // Everything downstream sees this as a new stream starting immediately
+  // after the old one, exactly as if it had been opened normally.
+  events::Audio().Dispatch(internal::DecodingStarted{
+      .track = track_,
+      .is_follow_on = true,
+  });
   processor_->beginStream(track_);
+  return true;
+}
+
+auto Decoder::isSendingPreroll() -> bool {
+  auto* start = preroll_buffer_.data();
+  auto* pos = leftover_samples_.data();
+  return !leftover_samples_.empty() && pos >= start &&
+         pos < start + preroll_buffer_.size();
 }
 
 auto Decoder::continueDecode() -> bool {
@@ -193,7 +333,9 @@ auto Decoder::continueDecode() -> bool {
     return false;
   }
 
+  int64_t start = drivers::telemetry::Now();
   auto res = codec_->DecodeTo(codec_buffer_);
+  drivers::telemetry::sAudio.decode_us.recordSince(start);
   if (res.has_error()) {
     return false;
   }
@@ -8,6 +8,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <optional>
 
 #include "audio/audio_events.hpp"
 #include "audio/audio_sink.hpp"
@@ -31,6 +32,17 @@ class Decoder {
 
   auto open(std::shared_ptr<TaggedStream>) -> void;
 
+  /*
+   * Gives the decoder the stream that should play once the current one
+   * finishes. The decoder opens it and decodes its first few hundred
+   * milliseconds ahead of time, then moves straight on to it at the end of
+   * the current stream, without waiting to be given it via `open`.
+   *
+   * Replaces any stream previously given to this method. Passing nullptr
+   * means that nothing should follow the current stream.
+   */
+  auto prepareNext(std::shared_ptr<TaggedStream>) -> void;
+
   Decoder(const Decoder&) = delete;
   Decoder& operator=(const Decoder&) = delete;
 
@@ -43,11 +55,18 @@ class Decoder {
   auto continueDecode() -> bool;
   auto finishDecode(bool cancel) -> void;
 
+  auto prerollNext() -> void;
+  auto startNext() -> bool;
+  auto isSendingPreroll() -> bool;
+
   std::shared_ptr<SampleProcessor> processor_;
 
   // Struct used with the next_stream_ queue.
   struct NextStream {
     std::shared_ptr<TaggedStream> stream;
+    // Whether the stream should follow on from the current one, rather than
+    // interrupting it.
+    bool is_follow_on;
   };
   QueueHandle_t next_stream_;
 
@@ -57,6 +76,20 @@ class Decoder {
 
   std::span<sample::Sample> codec_buffer_;
   std::span<sample::Sample> leftover_samples_;
+
+  // The stream that follows the current one. Its codec and track info are
+  // only filled in once it has been opened and pre-rolled.
+  struct Upcoming {
+    std::shared_ptr<TaggedStream> stream;
+    std::unique_ptr<codecs::ICodec> codec;
+    std::shared_ptr<TrackInfo> track;
+    std::span<sample::Sample> samples;
+  };
+  std::optional<Upcoming> next_;
+
+  // Holds the first samples of the upcoming stream, until they can be sent.
+  // This lives in PSRAM, since it's only touched once per track.
+  std::span<sample::Sample> preroll_buffer_;
 };
 
 }  // namespace audio
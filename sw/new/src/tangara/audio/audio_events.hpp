@@ -13,6 +13,8 @@
 #include <string>
 
 #include "audio/audio_sink.hpp"
+#include "audio/replay_gain.hpp"
+#include "audio/resample.hpp"
 #include "tinyfsm.hpp"
 
 #include "database/track.hpp"
@@ -142,6 +144,14 @@ struct SetVolumeLimit : tinyfsm::Event {
   int limit_db;
 };
 
+struct SetResamplerBudget : tinyfsm::Event {
+  ResamplerBudget budget;
+};
+
+struct SetReplayGain : tinyfsm::Event {
+  ReplayGainMode mode;
+};
+
 struct OutputModeChanged : tinyfsm::Event {
   std::optional<drivers::NvsStorage::Output> set_to;
 };
@@ -153,6 +163,9 @@ struct TtsPlaybackChanged : tinyfsm::Event {
 namespace internal {
 struct DecodingStarted : tinyfsm::Event {
   std::shared_ptr<TrackInfo> track;
+  // Whether this track was prepared in advance, and has followed straight on
+  // from the previous one without needing to be opened.
+  bool is_follow_on;
 };
 
 struct DecodingFailedToStart : tinyfsm::Event {
@@ -177,6 +190,15 @@ struct StreamEnded : tinyfsm::Event {
   uint32_t cue_at_sample;
 };
 
+/*
+ * Emitted when the output's format changes part way through a stream, e.g.
+ * because the user switched from headphones to Bluetooth.
+ */
+struct SinkFormatChanged : tinyfsm::Event {
+  IAudioOutput::Format sink_format;
+  uint32_t cue_at_sample;
+};
+
 struct StreamHeartbeat : tinyfsm::Event {};
 
 }  // namespace internal
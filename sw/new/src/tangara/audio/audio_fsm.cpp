@@ -74,6 +74,7 @@ std::unique_ptr<drivers::OutputBuffers> AudioState::sDrainBuffers;
 std::optional<IAudioOutput::Format> AudioState::sDrainFormat;
 
 StreamCues AudioState::sStreamCues;
+std::optional<std::string> AudioState::sFollowOnTrack;
 
 bool AudioState::sIsPaused = true;
 bool AudioState::sIsTtsPlaying = false;
@@ -83,10 +84,8 @@ uint8_t AudioState::sUpdateCounter = 0;
 auto AudioState::emitPlaybackUpdate(bool paused) -> void {
   std::optional<uint32_t> position;
   auto current = sStreamCues.current();
-  if (current.first && sDrainFormat) {
-    position = ((current.second +
-                 (sDrainFormat->num_channels * sDrainFormat->sample_rate / 2)) /
-                (sDrainFormat->num_channels * sDrainFormat->sample_rate)) +
+  if (current.first) {
+    position = (current.second + 500) / 1000 +
                current.first->start_offset.value_or(0);
   }
 
@@ -120,17 +119,33 @@ void AudioState::react(const QueueUpdate& ev) {
   auto current = sServices->track_queue().current();
   cmd.new_track = current;
 
+  // Whether the decoder has already moved on to the new current track by
+  // itself, in which case it mustn't be opened again.
+  auto is_follow_on = [&]() {
+    auto* path = std::get_if<std::string>(&current);
+    bool res = path && sFollowOnTrack == *path;
+    sFollowOnTrack.reset();
+    return res;
+  };
+
   switch (ev.reason) {
     case QueueUpdate::kExplicitUpdate:
       if (!ev.current_changed) {
+        // The current track is unchanged, but the one after it may not be.
+        sServices->bg_worker().Dispatch<void>([]() { prepareNextTrack(); });
         return;
       }
+      sFollowOnTrack.reset();
       break;
     case QueueUpdate::kRepeatingLastTrack:
-      break;
     case QueueUpdate::kTrackFinished:
       if (!ev.current_changed) {
         cmd.new_track = std::monostate{};
+      } else if (is_follow_on()) {
+        // The queue has now caught up with the decoder, so we can work out
+        // what should follow on next.
+        sServices->bg_worker().Dispatch<void>([]() { prepareNextTrack(); });
+        return;
       }
       break;
     case QueueUpdate::kBulkLoadingUpdate:
@@ -173,6 +188,9 @@ void AudioState::react(const SetTrack& ev) {
     // what the user expects to happen when they say "Play this track!", even
     // if the new track has an issue.
     sDecoder->open(stream);
+    if (stream) {
+      prepareNextTrack();
+    }
 
     // ...but if the stream that failed is the front of the queue, then we
     // should advance to the next track in order to keep the tunes flowing.
@@ -211,6 +229,29 @@ void AudioState::react(const TtsPlaybackChanged& ev) {
   updateOutputMode();
 }
 
+void AudioState::react(const internal::DecodingStarted& ev) {
+  if (ev.is_follow_on) {
+    sFollowOnTrack = ev.track->uri;
+  }
+}
+
+/*
+ * Opens whichever track is due to play after the queue's current one, so that
+ * the decoder can move straight on to it without waiting on us or the queue.
+ * Must be called from a background worker, after the decoder has been given
+ * the current track.
+ */
+auto AudioState::prepareNextTrack() -> void {
+  auto next = sServices->track_queue().peekNext();
+  std::shared_ptr<TaggedStream> stream;
+  if (std::holds_alternative<database::TrackId>(next)) {
+    stream = sStreamFactory->create(std::get<database::TrackId>(next));
+  } else if (std::holds_alternative<std::string>(next)) {
+    stream = sStreamFactory->create(std::get<std::string>(next));
+  }
+  sDecoder->prepareNext(stream);
+}
+
 void AudioState::react(const internal::DecodingFinished& ev) {
   // If we just finished playing whatever's at the front of the queue, then we
   // need to advanve and start playing the next one ASAP in order to continue
@@ -240,13 +281,9 @@ void AudioState::react(const internal::DecodingFinished& ev) {
 }
 
 void AudioState::react(const internal::StreamStarted& ev) {
-  if (sDrainFormat != ev.sink_format) {
-    sDrainFormat = ev.sink_format;
-    ESP_LOGI(kTag, "sink_format=%u ch @ %lu hz", sDrainFormat->num_channels,
-             sDrainFormat->sample_rate);
-  }
+  updateDrainFormat(ev.sink_format);
 
-  sStreamCues.addCue(ev.track, ev.cue_at_sample);
+  sStreamCues.addCue(ev.track, ev.cue_at_sample, ev.sink_format);
   sStreamCues.update(sDrainBuffers->first.totalReceived());
 
   if (!sIsPaused && !is_in_state<states::Playback>()) {
@@ -260,7 +297,29 @@ void AudioState::react(const internal::StreamStarted& ev) {
 }
 
 void AudioState::react(const internal::StreamEnded& ev) {
-  sStreamCues.addCue({}, ev.cue_at_sample);
+  sStreamCues.addCue({}, ev.cue_at_sample,
+                     sDrainFormat.value_or(IAudioOutput::Format{}));
+}
+
+void AudioState::react(const internal::SinkFormatChanged& ev) {
+  updateDrainFormat(ev.sink_format);
+
+  sStreamCues.addFormatChange(ev.cue_at_sample, ev.sink_format);
+  sStreamCues.update(sDrainBuffers->first.totalReceived());
+}
+
+auto AudioState::updateDrainFormat(const IAudioOutput::Format& format)
+    -> void {
+  if (sDrainFormat == format) {
+    return;
+  }
+  sDrainFormat = format;
+  ESP_LOGI(kTag, "sink_format=%u ch @ %lu hz", sDrainFormat->num_channels,
+           sDrainFormat->sample_rate);
+
+  // System sounds are mixed in at whatever rate the output is running at.
+  sServices->tts().feed(
+      tts::OutputFormatChanged{.sample_rate_hz = format.sample_rate});
 }
 
 void AudioState::react(const system_fsm::HasPhonesChanged& ev) {
@@ -384,6 +443,16 @@ void AudioState::react(const SetVolumeBalance& ev) {
   });
 }
 
+void AudioState::react(const SetResamplerBudget& ev) {
+  sSampleProcessor->SetResamplerBudget(ev.budget);
+  sServices->nvs().ResamplerBudget(static_cast<uint8_t>(ev.budget));
+}
+
+void AudioState::react(const SetReplayGain& ev) {
+  sSampleProcessor->SetReplayGain(ev.mode);
+  sServices->nvs().ReplayGain(static_cast<uint8_t>(ev.mode));
+}
+
 void AudioState::react(const OutputModeChanged& ev) {
   ESP_LOGI(kTag, "output mode changed");
   auto new_mode = sServices->nvs().OutputMode();
@@ -480,7 +549,8 @@ void Uninitialised::react(const system_fsm::BootComplete& ev) {
   sDrainBuffers->first.suspend(true);
 
   sStreamFactory.reset(
-      new FatfsStreamFactory(sServices->database(), sServices->tag_parser()));
+      new FatfsStreamFactory(sServices->database(), sServices->tag_parser(),
+                             sServices->bg_worker()));
   sI2SOutput.reset(new I2SAudioOutput(sServices->gpios(), *sDrainBuffers));
   sBtOutput.reset(new BluetoothAudioOutput(
       sServices->bluetooth(), *sDrainBuffers, sServices->bg_worker()));
@@ -521,6 +591,10 @@ void Uninitialised::react(const system_fsm::BootComplete& ev) {
 
   sSampleProcessor.reset(new SampleProcessor(sDrainBuffers->first));
   sSampleProcessor->SetOutput(sOutput);
+  sSampleProcessor->SetResamplerBudget(
+      static_cast<ResamplerBudget>(nvs.ResamplerBudget()));
+  sSampleProcessor->SetReplayGain(
+      static_cast<ReplayGainMode>(nvs.ReplayGain()));
 
   sDecoder.reset(Decoder::Start(sSampleProcessor));
 
@@ -552,10 +626,9 @@ void Standby::react(const system_fsm::KeyLockChanged& ev) {
     }
     db->put(kQueueKey, queue.serialise());
 
-    if (current.first && sDrainFormat) {
-      uint32_t seconds = (current.second / (sDrainFormat->num_channels *
-                                            sDrainFormat->sample_rate)) +
-                         current.first->start_offset.value_or(0);
+    if (current.first) {
+      uint32_t seconds =
+          current.second / 1000 + current.first->start_offset.value_or(0);
       cppbor::Array current_track{
           cppbor::Tstr{current.first->uri},
           cppbor::Uint{seconds},
@@ -50,9 +50,11 @@ class AudioState : public tinyfsm::Fsm<AudioState> {
   void react(const TogglePlayPause&);
   void react(const TtsPlaybackChanged&);
 
+  void react(const internal::DecodingStarted&);
   void react(const internal::DecodingFinished&);
   void react(const internal::StreamStarted&);
   void react(const internal::StreamEnded&);
+  void react(const internal::SinkFormatChanged&);
   virtual void react(const internal::StreamHeartbeat&) {}
 
   void react(const StepUpVolume&);
@@ -61,6 +63,8 @@ class AudioState : public tinyfsm::Fsm<AudioState> {
   void react(const SetVolume&);
   void react(const SetVolumeLimit&);
   void react(const SetVolumeBalance&);
+  void react(const SetResamplerBudget&);
+  void react(const SetReplayGain&);
 
   void react(const OutputModeChanged&);
 
@@ -74,6 +78,8 @@ class AudioState : public tinyfsm::Fsm<AudioState> {
   auto updateOutputMode() -> void;
   auto emitPlaybackUpdate(bool paused) -> void;
   auto commitVolume() -> void;
+  auto updateDrainFormat(const IAudioOutput::Format&) -> void;
+  static auto prepareNextTrack() -> void;
 
   auto updateSavedPosition(std::string uri, uint32_t position) -> void;
   auto incrementPlayCount(std::string uri) -> void;
@@ -92,6 +98,10 @@ class AudioState : public tinyfsm::Fsm<AudioState> {
   static StreamCues sStreamCues;
   static std::optional<IAudioOutput::Format> sDrainFormat;
 
+  // The track that the decoder most recently moved on to by itself, which
+  // therefore doesn't need opening once the queue catches up with it.
+  static std::optional<std::string> sFollowOnTrack;
+
   static bool sIsPaused;
   static uint8_t sUpdateCounter;
   static bool sIsTtsPlaying;
@@ -69,7 +69,18 @@ class IAudioOutput {
     bool operator==(const Format&) const = default;
   };
 
+  /*
+   * Returns the format closest to the given one that this output is able to
+   * play. The sample processor negotiates a format with the current output at
+   * the start of every stream, and converts the stream's samples to whatever
+   * format is returned.
+   */
   virtual auto PrepareFormat(const Format&) -> Format = 0;
+
+  /*
+   * Sets the format of the samples this output will be sent from now on.
+   * This is only ever called with formats returned by PrepareFormat.
+   */
   virtual auto Configure(const Format& format) -> void = 0;
 
  protected:
@@ -18,7 +18,8 @@ TaggedStream::TaggedStream(std::shared_ptr<database::TrackTags> t,
       tags_(t),
       wrapped_(std::move(w)),
       filepath_(filepath),
-      offset_(offset) {}
+      offset_(offset),
+      seek_index_() {}
 
 auto TaggedStream::tags() -> std::shared_ptr<database::TrackTags> {
   return tags_;
@@ -56,4 +57,13 @@ auto TaggedStream::SetPreambleFinished() -> void {
   wrapped_->SetPreambleFinished();
 }
 
+auto TaggedStream::SetSeekIndex(std::shared_ptr<const codecs::SeekIndex> i)
+    -> void {
+  seek_index_ = i;
+}
+
+auto TaggedStream::GetSeekIndex() -> std::shared_ptr<const codecs::SeekIndex> {
+  return seek_index_;
+}
+
 }  // namespace audio
@@ -38,11 +38,15 @@ class TaggedStream : public codecs::IStream {
 
   auto SetPreambleFinished() -> void override;
 
+  auto SetSeekIndex(std::shared_ptr<const codecs::SeekIndex>) -> void;
+  auto GetSeekIndex() -> std::shared_ptr<const codecs::SeekIndex> override;
+
  private:
   std::shared_ptr<database::TrackTags> tags_;
   std::unique_ptr<codecs::IStream> wrapped_;
   std::string filepath_;
   int32_t offset_;
+  std::shared_ptr<const codecs::SeekIndex> seek_index_;
 };
 
 class IAudioSource {
@@ -11,6 +11,7 @@
 #include <string>
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "ff.h"
 #include "freertos/portmacro.h"
 #include "freertos/projdefs.h"
@@ -22,6 +23,7 @@
 #include "database/tag_parser.hpp"
 #include "database/track.hpp"
 #include "drivers/spi.hpp"
+#include "mad.hpp"
 #include "tasks.hpp"
 #include "types.hpp"
 
@@ -30,8 +32,9 @@
 namespace audio {
 
 FatfsStreamFactory::FatfsStreamFactory(database::Handle&& handle,
-                                       database::ITagParser& parser)
-    : db_(handle), tag_parser_(parser) {}
+                                       database::ITagParser& parser,
+                                       tasks::WorkerPool& bg_worker)
+    : db_(handle), tag_parser_(parser), bg_worker_(bg_worker) {}
 
 auto FatfsStreamFactory::create(database::TrackId id, uint32_t offset)
     -> std::shared_ptr<TaggedStream> {
@@ -43,7 +46,20 @@ auto FatfsStreamFactory::create(database::TrackId id, uint32_t offset)
   if (!path) {
     return {};
   }
-  return create(*path, offset);
+  auto stream = create(*path, offset);
+  if (!stream || stream->type() != codecs::StreamType::kMp3) {
+    return stream;
+  }
+
+  // MP3s have no index of their own, so seeking within them means walking
+  // every frame from the start of the file. Hand the decoder our own index of
+  // the file's frames if we have one, or build one for next time if we don't.
+  if (auto index = db->getSeekIndex(id)) {
+    stream->SetSeekIndex(index);
+  } else {
+    buildSeekIndex(id, *path);
+  }
+  return stream;
 }
 
 auto FatfsStreamFactory::create(std::string path, uint32_t offset)
@@ -75,6 +91,31 @@ auto FatfsStreamFactory::create(std::string path, uint32_t offset)
       path, offset);
 }
 
+auto FatfsStreamFactory::buildSeekIndex(database::TrackId id, std::string path)
+    -> void {
+  bg_worker_.Dispatch<void>([=, db_handle = db_]() mutable {
+    std::unique_ptr<FIL> file = std::make_unique<FIL>();
+    if (f_open(file.get(), path.c_str(), FA_READ) != FR_OK) {
+      return;
+    }
+    FatfsSource source{codecs::StreamType::kMp3, std::move(file)};
+
+    uint64_t start = esp_timer_get_time();
+    auto index = codecs::MadMp3Decoder::BuildSeekIndex(source);
+    if (!index) {
+      return;
+    }
+    ESP_LOGI(kTag, "indexed %u frames of #%lu in %llu ms",
+             index->positions.size() * index->stride, id,
+             (esp_timer_get_time() - start) / 1000);
+
+    auto db = db_handle.lock();
+    if (db) {
+      db->setSeekIndex(id, *index);
+    }
+  });
+}
+
 auto FatfsStreamFactory::ContainerToStreamType(database::Container enc)
     -> std::optional<codecs::StreamType> {
   switch (enc) {
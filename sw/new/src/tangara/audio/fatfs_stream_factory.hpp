@@ -31,7 +31,9 @@ namespace audio {
  */
 class FatfsStreamFactory {
  public:
-  explicit FatfsStreamFactory(database::Handle&&, database::ITagParser&);
+  explicit FatfsStreamFactory(database::Handle&&,
+                              database::ITagParser&,
+                              tasks::WorkerPool&);
 
   auto create(database::TrackId, uint32_t offset = 0)
       -> std::shared_ptr<TaggedStream>;
@@ -45,8 +47,11 @@ class FatfsStreamFactory {
   auto ContainerToStreamType(database::Container)
       -> std::optional<codecs::StreamType>;
 
+  auto buildSeekIndex(database::TrackId, std::string path) -> void;
+
   database::Handle db_;
   database::ITagParser& tag_parser_;
+  tasks::WorkerPool& bg_worker_;
 };
 
 }  // namespace audio
@@ -11,6 +11,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <variant>
 
 #include "drivers/pcm_buffer.hpp"
@@ -18,6 +19,7 @@
 #include "esp_heap_caps.h"
 #include "freertos/portmacro.h"
 #include "freertos/projdefs.h"
+#include "freertos/task.h"
 
 #include "audio/audio_sink.hpp"
 #include "drivers/gpios.hpp"
@@ -57,6 +59,7 @@ auto I2SAudioOutput::changeMode(Modes mode) -> void {
   if (mode == current_mode_) {
     return;
   }
+  std::lock_guard<std::mutex> lock{dac_mutex_};
   bool was_off = current_mode_ == Modes::kOff;
   current_mode_ = mode;
 
@@ -77,6 +80,9 @@ auto I2SAudioOutput::changeMode(Modes mode) -> void {
         return;
       }
       dac_.reset(*instance);
+      // The new instance starts out in its default format, which may not be
+      // the format we were last asked for.
+      applyConfig();
     }
     // Set up the new instance properly.
     SetVolume(GetVolume());
@@ -160,22 +166,55 @@ auto I2SAudioOutput::AdjustVolumeDown() -> bool {
 }
 
 auto I2SAudioOutput::PrepareFormat(const Format& orig) -> Format {
+  // The DAC can follow the stream's own sample rate, so long as it's one of
+  // the rates it has clock settings for. Samples are always sent as 16 bit
+  // stereo, since that's what system sounds are mixed in as.
+  uint32_t rate;
+  switch (orig.sample_rate) {
+    case drivers::I2SDac::SAMPLE_RATE_8:
+    case drivers::I2SDac::SAMPLE_RATE_32:
+    case drivers::I2SDac::SAMPLE_RATE_44_1:
+    case drivers::I2SDac::SAMPLE_RATE_48:
+    case drivers::I2SDac::SAMPLE_RATE_88_2:
+    case drivers::I2SDac::SAMPLE_RATE_96:
+      rate = orig.sample_rate;
+      break;
+    default:
+      rate = drivers::I2SDac::SAMPLE_RATE_48;
+      break;
+  }
   return Format{
-      .sample_rate = std::clamp<uint32_t>(orig.sample_rate, 8000, 96000),
-      .num_channels = std::min<uint8_t>(orig.num_channels, 2),
-      .bits_per_sample = std::clamp<uint8_t>(orig.bits_per_sample, 16, 32),
+      .sample_rate = rate,
+      .num_channels = 2,
+      .bits_per_sample = 16,
   };
 }
 
 auto I2SAudioOutput::Configure(const Format& fmt) -> void {
-  if (!dac_) {
-    return;
-  }
+  std::lock_guard<std::mutex> lock{dac_mutex_};
   if (current_config_ && fmt == *current_config_) {
     ESP_LOGI(kTag, "ignoring unchanged format");
     return;
   }
 
+  if (dac_ && current_config_ && current_mode_ == Modes::kOnPlaying) {
+    // The last few samples in the old format may still be waiting in the DMA
+    // buffers. Give them a chance to play out before changing the clocks.
+    uint32_t frames =
+        drivers::kI2SBufferLengthFrames * drivers::kI2SBufferCount;
+    vTaskDelay(pdMS_TO_TICKS(frames * 1000 / current_config_->sample_rate + 1));
+  }
+
+  current_config_ = fmt;
+  applyConfig();
+}
+
+auto I2SAudioOutput::applyConfig() -> void {
+  if (!dac_ || !current_config_) {
+    return;
+  }
+  const Format& fmt = *current_config_;
+
   drivers::I2SDac::Channels ch;
   switch (fmt.num_channels) {
     case 1:
@@ -230,8 +269,9 @@ auto I2SAudioOutput::Configure(const Format& fmt) -> void {
       return;
   }
 
+  ESP_LOGI(kTag, "dac format: %u ch, %u bit @ %lu hz", fmt.num_channels,
+           fmt.bits_per_sample, fmt.sample_rate);
   dac_->Reconfigure(ch, bps, sample_rate);
-  current_config_ = fmt;
 }
 
 }  // namespace audio
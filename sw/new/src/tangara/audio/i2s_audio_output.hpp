@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "audio/audio_sink.hpp"
@@ -50,9 +51,14 @@ class I2SAudioOutput : public IAudioOutput {
   auto changeMode(Modes) -> void override;
 
  private:
+  auto applyConfig() -> void;
+
   drivers::IGpios& expander_;
   drivers::OutputBuffers& buffers_;
 
+  // Guards the DAC instance and its format, which are changed from both the
+  // audio FSM and the sample processor.
+  std::mutex dac_mutex_;
   std::unique_ptr<drivers::I2SDac> dac_;
 
   Modes current_mode_;
@@ -22,10 +22,12 @@
 
 #include "audio/audio_events.hpp"
 #include "audio/audio_sink.hpp"
-#include "audio/i2s_audio_output.hpp"
+#include "audio/replay_gain.hpp"
 #include "audio/resample.hpp"
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/i2s_dac.hpp"
 #include "drivers/pcm_buffer.hpp"
+#include "drivers/pcm_mix.hpp"
 #include "events/event_queue.hpp"
 #include "sample.hpp"
 #include "tasks.hpp"
@@ -38,44 +40,76 @@ static const size_t kSourceBufferLength = kSampleBufferLength * 2;
 namespace audio {
 
 /*
- * The output format to convert all sources to. This is currently fixed because
- * the Bluetooth output doesn't support runtime configuration of its input
- * format.
+ * Returns the format we'd like to send a stream to the output in. Samples are
+ * always sent as 16 bit stereo, since that's what the sink buffers hold, but
+ * we'd rather not resample if the output can follow the stream's own rate.
  */
-static const I2SAudioOutput::Format kTargetFormat{
-    .sample_rate = 48000,
-    .num_channels = 2,
-    .bits_per_sample = 16,
-};
+static auto preferredFormat(const IAudioOutput::Format& stream)
+    -> IAudioOutput::Format {
+  return IAudioOutput::Format{
+      .sample_rate = stream.sample_rate,
+      .num_channels = 2,
+      .bits_per_sample = 16,
+  };
+}
 
 SampleProcessor::SampleProcessor(drivers::PcmBuffer& sink)
     : commands_(xQueueCreate(2, sizeof(Args))),
-      source_(xStreamBufferCreateWithCaps(kSourceBufferLength + 1,
-                                          sizeof(sample::Sample),
-                                          MALLOC_CAP_DMA)),
+      source_storage_(reinterpret_cast<sample::Sample*>(
+          heap_caps_calloc(kSourceBufferLength,
+                           sizeof(sample::Sample),
+                           MALLOC_CAP_DMA))),
+      source_({source_storage_, kSourceBufferLength}),
+      unprocessed_samples_(0),
+      source_space_(xSemaphoreCreateBinary()),
       sink_(sink),
-      unprocessed_samples_(0) {
+      resampler_budget_(ResamplerBudget::kMedium),
+      active_budget_(ResamplerBudget::kMedium),
+      resampler_target_rate_(0),
+      resampler_channels_(0),
+      double_samples_(false),
+      passthrough_(false),
+      replay_gain_(ReplayGainMode::kOff),
+      active_replay_gain_(ReplayGainMode::kOff),
+      stream_tags_(),
+      gain_(drivers::kUnityGain),
+      stream_format_(),
+      sink_format_(),
+      awaiting_drain_(false),
+      samples_copied_(0) {
   tasks::StartPersistent<tasks::Type::kAudioConverter>([&]() { Main(); });
 }
 
 SampleProcessor::~SampleProcessor() {
   vQueueDelete(commands_);
-  vStreamBufferDeleteWithCaps(source_);
+  vSemaphoreDelete(source_space_);
+  heap_caps_free(source_storage_);
 }
 
 auto SampleProcessor::SetOutput(std::shared_ptr<IAudioOutput> output) -> void {
-  // Make sure our fixed output format is valid.
-  assert(output->PrepareFormat(kTargetFormat) == kTargetFormat);
-  output->Configure(kTargetFormat);
+  // The output is handed over via the command queue, so that the processor
+  // task is the only one that ever touches output_.
+  Args args{
+      .output = new std::shared_ptr<IAudioOutput>(output),
+      .track = nullptr,
+      .samples_available = 0,
+      .is_end_of_stream = false,
+      .clear_buffers = false,
+  };
+  xQueueSend(commands_, &args, portMAX_DELAY);
+}
 
-  // FIXME: We should add synchronisation here, but we should be careful
-  // about not impacting performance given that the output will change only
-  // very rarely (if ever).
-  output_ = output;
+auto SampleProcessor::SetResamplerBudget(ResamplerBudget budget) -> void {
+  resampler_budget_ = budget;
+}
+
+auto SampleProcessor::SetReplayGain(ReplayGainMode mode) -> void {
+  replay_gain_ = mode;
 }
 
 auto SampleProcessor::beginStream(std::shared_ptr<TrackInfo> track) -> void {
   Args args{
+      .output = nullptr,
       .track = new std::shared_ptr<TrackInfo>(track),
       .samples_available = 0,
       .is_end_of_stream = false,
@@ -86,20 +120,40 @@ auto SampleProcessor::beginStream(std::shared_ptr<TrackInfo> track) -> void {
 
 auto SampleProcessor::continueStream(std::span<sample::Sample> input)
     -> std::span<sample::Sample> {
-  size_t bytes_sent = xStreamBufferSend(source_, input.data(),
-                                        input.size_bytes(), pdMS_TO_TICKS(100));
-  if (!bytes_sent) {
-    // If nothing could be sent, then bail out early. We don't want to send a
-    // samples_available command with zero samples.
-    return input;
-  }
+  auto& stats = drivers::telemetry::sAudio;
+  stats.source_fill.record(source_.size(), source_.capacity());
 
-  // We should only ever be placing whole samples into the buffer. If half
-  // samples start being sent, then this indicates a serious bug somewhere.
-  size_t samples_sent = bytes_sent / sizeof(sample::Sample);
-  assert(samples_sent * sizeof(sample::Sample) == bytes_sent);
+  // Copy in as much as will fit. This takes two goes if the free space wraps
+  // around the end of the ring. If the ring is full, then wait a little while
+  // for the processor to make some room.
+  size_t samples_sent = 0;
+  for (;;) {
+    for (int i = 0; i < 2 && samples_sent < input.size(); i++) {
+      auto space = source_.writeAcquire();
+      size_t count = std::min(space.size(), input.size() - samples_sent);
+      std::copy_n(input.begin() + samples_sent, count, space.begin());
+      source_.writeCommit(count);
+      samples_sent += count;
+    }
+    if (samples_sent > 0) {
+      break;
+    }
+    stats.backpressure_waits.add();
+    int64_t wait_start = drivers::telemetry::Now();
+    bool got_space = xSemaphoreTake(source_space_, pdMS_TO_TICKS(100));
+    stats.backpressure_us.recordSince(wait_start);
+    if (!got_space) {
+      // If nothing could be sent, then bail out early. We don't want to
+      // send a samples_available command with zero samples.
+      stats.backpressure_timeouts.add();
+      return input;
+    }
+  }
+  samples_copied_ += samples_sent;
+  stats.source_samples = source_.size();
 
   Args args{
+      .output = nullptr,
       .track = nullptr,
       .samples_available = samples_sent,
       .is_end_of_stream = false,
@@ -112,6 +166,7 @@ auto SampleProcessor::continueStream(std::span<sample::Sample> input)
 
 auto SampleProcessor::endStream(bool cancelled) -> void {
   Args args{
+      .output = nullptr,
       .track = nullptr,
       .samples_available = 0,
       .is_end_of_stream = true,
@@ -124,8 +179,12 @@ IRAM_ATTR
 auto SampleProcessor::Main() -> void {
   for (;;) {
     // Block indefinitely if the processor is idle. Otherwise check briefly for
-    // new commands, then continue processing.
+    // new commands, then continue processing. If all we're doing is waiting
+    // for the sink to drain, then there's no need to spin.
     TickType_t wait = hasPendingWork() ? 0 : portMAX_DELAY;
+    if (awaiting_drain_) {
+      wait = pdMS_TO_TICKS(5);
+    }
 
     Args args;
     if (xQueueReceive(commands_, &args, wait)) {
@@ -161,8 +220,18 @@ auto SampleProcessor::Main() -> void {
       args = pending_commands_.front();
       pending_commands_.pop_front();
 
+      if (args.output) {
+        handleSetOutput(*args.output);
+        delete args.output;
+        args.output = nullptr;
+      }
       if (args.track) {
-        handleBeginStream(*args.track);
+        if (!handleBeginStream(*args.track)) {
+          // The output must be retuned for this stream, but it's still busy
+          // playing the previous one. Retry handling this command later.
+          pending_commands_.push_front(args);
+          break;
+        }
         delete args.track;
       }
       if (args.samples_available) {
@@ -183,139 +252,215 @@ auto SampleProcessor::Main() -> void {
   }
 }
 
-auto SampleProcessor::handleBeginStream(std::shared_ptr<TrackInfo> track)
+auto SampleProcessor::handleSetOutput(std::shared_ptr<IAudioOutput> output)
     -> void {
-  // If the new stream's sample rate doesn't match our canonical sample rate,
-  // then prepare to start resampling.
-  if (track->format.sample_rate != kTargetFormat.sample_rate) {
-    ESP_LOGI(kTag, "resampling %lu -> %lu", track->format.sample_rate,
-             kTargetFormat.sample_rate);
-    if (!resampler_ || resampler_->sourceRate() != track->format.sample_rate) {
-      // If there's already a resampler instance for this source rate, then
-      // reuse it to help gapless playback work smoothly.
-      resampler_.reset(new Resampler(track->format.sample_rate,
-                                     kTargetFormat.sample_rate,
-                                     track->format.num_channels));
-    }
-  } else {
-    resampler_.reset();
+  output_ = output;
+  if (!stream_format_) {
+    // Nothing has been played yet; the output will be configured when the
+    // first stream begins.
+    sink_format_.reset();
+    return;
   }
 
-  // If the new stream has only one channel, then we double it to get stereo
-  // audio.
-  // FIXME: If the Bluetooth stack allowed us to configure the number of
-  // channels, we could remove this.
-  double_samples_ = track->format.num_channels != kTargetFormat.num_channels;
+  // Switch the current stream over to the new output right away. Any samples
+  // already in the sink were converted for the old output, but there's no
+  // way to play them out on an output that's already been turned off.
+  auto sink_format = output_->PrepareFormat(preferredFormat(*stream_format_));
+  output_->Configure(sink_format);
+  bool changed = sink_format != sink_format_;
+  sink_format_ = sink_format;
+  updateResampler();
+
+  if (changed) {
+    events::Audio().Dispatch(internal::SinkFormatChanged{
+        .sink_format = *sink_format_,
+        .cue_at_sample = sink_.totalSent(),
+    });
+  }
+}
+
+auto SampleProcessor::handleBeginStream(std::shared_ptr<TrackInfo> track)
+    -> bool {
+  auto sink_format = output_->PrepareFormat(preferredFormat(track->format));
+  if (sink_format != sink_format_) {
+    // The output needs retuning for this stream. Samples already in the sink
+    // were produced for the old format though, so hold off until they've all
+    // been played. This costs a brief gap, but only between streams whose
+    // formats differ.
+    if (!sink_.isEmpty()) {
+      awaiting_drain_ = true;
+      return false;
+    }
+    output_->Configure(sink_format);
+    sink_format_ = sink_format;
+  }
+  awaiting_drain_ = false;
+
+  stream_format_ = track->format;
+  stream_tags_ = track->tags;
+  updateResampler();
+  updateGain();
+  if (sink_.isEmpty() && output_buffer_.isEmpty()) {
+    // Nothing of the previous stream is left to ramp from, so start this one
+    // at its own gain.
+    gain_.jump(gain_.target());
+  }
+  drivers::telemetry::sAudio.streaming = true;
 
   events::Audio().Dispatch(internal::StreamStarted{
       .track = track,
-      .sink_format = kTargetFormat,
+      .sink_format = *sink_format_,
       .cue_at_sample = sink_.totalSent(),
   });
+  return true;
 }
 
-IRAM_ATTR
-auto SampleProcessor::processSamples(bool finalise) -> bool {
-  for (;;) {
-    bool out_of_work = true;
+auto SampleProcessor::updateResampler() -> void {
+  // If there's already a resampler instance for this conversion, then reuse
+  // it to help gapless playback work smoothly. Otherwise, prepare to convert
+  // the new stream to the output's sample rate. This is a simple copy if the
+  // output was able to match the stream's rate.
+  ResamplerBudget budget = resampler_budget_;
+  uint32_t source_rate = stream_format_->sample_rate;
+  uint32_t target_rate = sink_format_->sample_rate;
+  uint8_t channels = stream_format_->num_channels;
+  if (!resampler_ || resampler_->sourceRate() != source_rate ||
+      resampler_target_rate_ != target_rate ||
+      resampler_channels_ != channels || budget != active_budget_) {
+    if (source_rate != target_rate) {
+      ESP_LOGI(kTag, "resampling %lu -> %lu", source_rate, target_rate);
+    }
+    resampler_ = CreateResampler(source_rate, target_rate, channels, budget);
+    resampler_target_rate_ = target_rate;
+    resampler_channels_ = channels;
+    active_budget_ = budget;
+  }
 
-    // First, fill up our input buffer with samples.
-    if (unprocessed_samples_ > 0) {
-      out_of_work = false;
-      auto input = input_buffer_.writeAcquire();
+  // If the new stream has only one channel, then we double it to get stereo
+  // audio.
+  double_samples_ = channels != sink_format_->num_channels;
 
-      size_t bytes_received = xStreamBufferReceive(
-          source_, input.data(),
-          std::min(input.size_bytes(),
-                   unprocessed_samples_ * sizeof(sample::Sample)),
-          0);
+  // Streams that are already in the output's format can skip conversion
+  // altogether, so long as they also don't need their gain adjusting.
+  passthrough_ = !double_samples_ && source_rate == target_rate;
+}
 
-      // We should never receive a half sample. Blow up immediately if we do.
-      size_t samples_received = bytes_received / sizeof(sample::Sample);
-      assert(samples_received * sizeof(sample::Sample) == bytes_received);
+auto SampleProcessor::updateGain() -> void {
+  active_replay_gain_ = replay_gain_;
+  // Moving to the new stream's gain is ramped like any other change, since
+  // gapless streams may well run straight into each other.
+  gain_.set(stream_tags_ ? ReplayGainFor(*stream_tags_, active_replay_gain_)
+                         : drivers::kUnityGain);
+}
 
-      unprocessed_samples_ -= samples_received;
-      input_buffer_.writeCommit(samples_received);
+IRAM_ATTR
+auto SampleProcessor::processSamples(bool finalise) -> bool {
+  if (replay_gain_ != active_replay_gain_) {
+    updateGain();
+  }
+  for (;;) {
+    // Converted samples must all reach the sink before we convert any more.
+    if (!flushOutputBuffer()) {
+      // The output is congested. Back off of processing for a moment.
+      return false;
     }
 
-    // Next, push input samples through the resampler. In the best case, this
-    // is a simple copy operation.
-    if (!input_buffer_.isEmpty()) {
-      out_of_work = false;
-      auto resample_input = input_buffer_.readAcquire();
-      auto resample_output = resampled_buffer_.writeAcquire();
-
-      size_t read, wrote;
-      if (resampler_) {
-        std::tie(read, wrote) =
-            resampler_->Process(resample_input, resample_output, finalise);
-      } else {
-        read = wrote = std::min(resample_input.size(), resample_output.size());
-        std::copy_n(resample_input.begin(), read, resample_output.begin());
-      }
-
-      input_buffer_.readCommit(read);
-      resampled_buffer_.writeCommit(wrote);
+    // Work directly from the ring, without copying samples out of it first.
+    // Samples beyond unprocessed_samples_ belong to a stream we haven't been
+    // told about yet.
+    auto input = source_.readAcquire();
+    input = input.first(std::min(input.size(), unprocessed_samples_));
+    if (input.empty()) {
+      return true;
     }
 
-    // Next, we need to make sure the output is in stereo. This is also a simple
-    // copy in the best case.
-    if (!resampled_buffer_.isEmpty()) {
-      out_of_work = false;
-      auto channels_input = resampled_buffer_.readAcquire();
-      auto channels_output = output_buffer_.writeAcquire();
-      size_t read, wrote;
-      if (double_samples_) {
-        wrote = channels_output.size();
-        read = wrote / 2;
-        if (read > channels_input.size()) {
-          read = channels_input.size();
-          wrote = read * 2;
-        }
-        for (size_t i = 0; i < read; i++) {
-          channels_output[i * 2] = channels_input[i];
-          channels_output[(i * 2) + 1] = channels_input[i];
-        }
-      } else {
-        read = wrote = std::min(channels_input.size(), channels_output.size());
-        std::copy_n(channels_input.begin(), read, channels_output.begin());
-      }
-      resampled_buffer_.readCommit(read);
+    size_t read;
+    bool unity = gain_.current() == drivers::kUnityGain &&
+                 gain_.target() == drivers::kUnityGain;
+    if (passthrough_ && unity) {
+      // Nothing to do except send the samples onwards, straight from the
+      // ring.
+      input = input.first(std::min(input.size(), kSampleBufferLength));
+      read = sink_.send(input);
+      samples_copied_ += read;
+    } else {
+      auto [r, wrote] =
+          convertSamples(input, output_buffer_.writeAcquire(), finalise);
+      read = r;
       output_buffer_.writeCommit(wrote);
-    }
-
-    // Finally, flush whatever ended up in the output buffer.
-    if (flushOutputBuffer()) {
-      if (out_of_work) {
+      samples_copied_ += wrote;
+      if (read == 0 && wrote == 0) {
+        // The converter is stuck; likely it needs more input than we have.
         return true;
       }
-    } else {
-      // The output is congested. Back off of processing for a moment.
+    }
+
+    source_.readCommit(read);
+    unprocessed_samples_ -= read;
+    drivers::telemetry::sAudio.source_samples = source_.size();
+    if (read > 0) {
+      xSemaphoreGive(source_space_);
+    }
+
+    if (passthrough_ && unity && read < input.size()) {
       return false;
     }
   }
 }
 
+IRAM_ATTR
+auto SampleProcessor::convertSamples(std::span<sample::Sample> input,
+                                     std::span<sample::Sample> output,
+                                     bool finalise)
+    -> std::pair<size_t, size_t> {
+  // Mono streams are doubled into stereo, so they need to leave room for the
+  // second channel. The resampler writes into the back half of the output, so
+  // that its samples can then be doubled in place from front to back.
+  std::span<sample::Sample> converted = output;
+  if (double_samples_) {
+    converted = output.last(output.size() / 2);
+  }
+
+  bool resample = resampler_->sourceRate() != sink_format_->sample_rate;
+  size_t read, wrote;
+  std::span<const sample::Sample> src;
+  if (resample) {
+    int64_t start = drivers::telemetry::Now();
+    std::tie(read, wrote) = resampler_->Process(input, converted, finalise);
+    drivers::telemetry::sAudio.resample_us.recordSince(start);
+    src = converted.first(wrote);
+  } else {
+    read = wrote = std::min(input.size(), converted.size());
+    src = input.first(read);
+  }
+
+  // The gain is applied by the same copy that doubles the samples, or that
+  // moves them to the output. Only resampled stereo streams are scaled in
+  // place as a separate step.
+  if (double_samples_) {
+    gain_.copyDoubled(output, src);
+    wrote *= 2;
+  } else {
+    gain_.copy(output, src);
+  }
+
+  return {read, wrote};
+}
+
 auto SampleProcessor::handleEndStream(bool clear_bufs) -> void {
+  drivers::telemetry::sAudio.streaming = false;
   if (clear_bufs) {
+    awaiting_drain_ = false;
     sink_.clear();
-
-    input_buffer_.clear();
-    resampled_buffer_.clear();
     output_buffer_.clear();
 
-    size_t bytes_discarded = 0;
-    size_t bytes_to_discard = unprocessed_samples_ * sizeof(sample::Sample);
-    auto scratch_buf = output_buffer_.writeAcquire();
-    while (bytes_discarded < bytes_to_discard) {
-      size_t bytes_read =
-          xStreamBufferReceive(source_, scratch_buf.data(),
-                               std::min(scratch_buf.size_bytes(),
-                                        bytes_to_discard - bytes_discarded),
-                               0);
-      bytes_discarded += bytes_read;
+    while (unprocessed_samples_ > 0) {
+      auto discard = source_.readAcquire();
+      size_t count = std::min(discard.size(), unprocessed_samples_);
+      source_.readCommit(count);
+      unprocessed_samples_ -= count;
     }
-    unprocessed_samples_ = 0;
+    xSemaphoreGive(source_space_);
   }
 
   events::Audio().Dispatch(internal::StreamEnded{
@@ -325,19 +470,28 @@ auto SampleProcessor::handleEndStream(bool clear_bufs) -> void {
 
 auto SampleProcessor::hasPendingWork() -> bool {
   return !pending_commands_.empty() || unprocessed_samples_ > 0 ||
-         !input_buffer_.isEmpty() || !resampled_buffer_.isEmpty() ||
          !output_buffer_.isEmpty();
 }
 
 IRAM_ATTR
 auto SampleProcessor::flushOutputBuffer() -> bool {
+  if (output_buffer_.isEmpty()) {
+    return true;
+  }
   auto samples = output_buffer_.readAcquire();
   size_t sent = sink_.send(samples);
+  samples_copied_ += sent;
   output_buffer_.readCommit(sent);
   return output_buffer_.isEmpty();
 }
 
 auto SampleProcessor::discardCommand(Args& command) -> void {
+  if (command.output) {
+    // Output changes still need to happen, even if the samples around them
+    // are being thrown away.
+    handleSetOutput(*command.output);
+    delete command.output;
+  }
   if (command.track) {
     delete command.track;
   }
@@ -365,14 +519,31 @@ Buffer::~Buffer() {
 }
 
 auto Buffer::writeAcquire() -> std::span<sample::Sample> {
-  return buffer_.subspan(samples_in_buffer_.size());
+  size_t end = samples_in_buffer_.empty()
+                   ? 0
+                   : samples_in_buffer_.data() - buffer_.data() +
+                         samples_in_buffer_.size();
+  if (end == buffer_.size()) {
+    // There's no space left after the samples we're holding. Move them to the
+    // front of the buffer to make some.
+    std::memmove(buffer_.data(), samples_in_buffer_.data(),
+                 samples_in_buffer_.size_bytes());
+    samples_in_buffer_ = buffer_.first(samples_in_buffer_.size());
+    end = samples_in_buffer_.size();
+  }
+  return buffer_.subspan(end);
 }
 
 auto Buffer::writeCommit(size_t samples) -> void {
   if (samples == 0) {
     return;
   }
-  samples_in_buffer_ = buffer_.first(samples + samples_in_buffer_.size());
+  if (samples_in_buffer_.empty()) {
+    samples_in_buffer_ = buffer_.first(samples);
+  } else {
+    samples_in_buffer_ = {samples_in_buffer_.data(),
+                          samples_in_buffer_.size() + samples};
+  }
 }
 
 auto Buffer::readAcquire() -> std::span<sample::Sample> {
@@ -384,14 +555,6 @@ auto Buffer::readCommit(size_t samples) -> void {
     return;
   }
   samples_in_buffer_ = samples_in_buffer_.subspan(samples);
-
-  // Move the leftover samples to the front of the buffer, so that we're setup
-  // for a new write.
-  if (!samples_in_buffer_.empty()) {
-    std::memmove(buffer_.data(), samples_in_buffer_.data(),
-                 samples_in_buffer_.size_bytes());
-    samples_in_buffer_ = buffer_.first(samples_in_buffer_.size());
-  }
 }
 
 auto Buffer::isEmpty() -> bool {
@@ -7,22 +7,39 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 #include <cstdint>
 #include <functional>
 #include <list>
 #include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 #include "audio/audio_events.hpp"
 #include "audio/audio_sink.hpp"
 #include "audio/audio_source.hpp"
+#include "audio/replay_gain.hpp"
 #include "audio/resample.hpp"
 #include "codec.hpp"
+#include "database/track.hpp"
 #include "drivers/pcm_buffer.hpp"
+#include "drivers/pcm_mix.hpp"
 #include "sample.hpp"
+#include "spsc_ring.hpp"
 
 namespace audio {
 
-/* Utility for managing buffering samples between digital filters. */
+/*
+ * Utility for managing buffering samples between digital filters.
+ *
+ * Leftover samples are only moved back to the start of the buffer when a
+ * writer would otherwise have no space at all, so buffers that are always
+ * fully drained before being refilled never move any samples.
+ */
 class Buffer {
  public:
   Buffer(std::span<sample::Sample> storage);
@@ -56,14 +73,39 @@ class Buffer {
  * rate, channels, bits per sample), in order to put samples in the preferred
  * format of the current output device. The resulting samples are forwarded
  * to the output device's sink stream.
+ *
+ * The format is negotiated with the output at the start of each stream, so
+ * outputs that are able to follow the stream's own sample rate are sent its
+ * samples without resampling.
+ *
+ * Each stream's loudness can also be normalised from its ReplayGain tags. The
+ * gain is applied as samples are copied to the output, so that it costs no
+ * extra pass over them.
  */
 class SampleProcessor {
  public:
   SampleProcessor(drivers::PcmBuffer& sink);
   ~SampleProcessor();
 
+  /*
+   * Sets the output that samples are being sent to. If a stream is already
+   * in progress, then its format is renegotiated with the new output
+   * immediately.
+   */
   auto SetOutput(std::shared_ptr<IAudioOutput>) -> void;
 
+  /*
+   * Sets how much CPU time may be spent on resampling. Takes effect from the
+   * next stream that needs a different resampler.
+   */
+  auto SetResamplerBudget(ResamplerBudget) -> void;
+
+  /*
+   * Sets which loudness tags are used to normalise each stream. Takes effect
+   * immediately, with the gain moving smoothly to its new level.
+   */
+  auto SetReplayGain(ReplayGainMode) -> void;
+
   /*
    * Signals to the sample processor that a new discrete stream of audio is now
    * being sent. This will typically represent a new track being played.
@@ -88,21 +130,35 @@ class SampleProcessor {
    */
   auto endStream(bool cancelled) -> void;
 
+  /*
+   * Returns how many times samples have been written to memory on their way
+   * through the processor, including into and out of its own buffers.
+   */
+  auto samplesCopied() const -> uint64_t { return samples_copied_; }
+
   SampleProcessor(const SampleProcessor&) = delete;
   SampleProcessor& operator=(const SampleProcessor&) = delete;
 
  private:
   auto Main() -> void;
 
-  auto handleBeginStream(std::shared_ptr<TrackInfo>) -> void;
+  auto handleSetOutput(std::shared_ptr<IAudioOutput>) -> void;
+  auto handleBeginStream(std::shared_ptr<TrackInfo>) -> bool;
   auto handleEndStream(bool cancel) -> void;
 
+  auto updateResampler() -> void;
+  auto updateGain() -> void;
+
   auto processSamples(bool finalise) -> bool;
+  auto convertSamples(std::span<sample::Sample> input,
+                      std::span<sample::Sample> output,
+                      bool finalise) -> std::pair<size_t, size_t>;
 
   auto hasPendingWork() -> bool;
   auto flushOutputBuffer() -> bool;
 
   struct Args {
+    std::shared_ptr<IAudioOutput>* output;
     std::shared_ptr<TrackInfo>* track;
     size_t samples_available;
     bool is_end_of_stream;
@@ -113,18 +169,46 @@ class SampleProcessor {
 
   auto discardCommand(Args& command) -> void;
 
-  StreamBufferHandle_t source_;
+  // Samples sent to us by the decoder, waiting to be processed. Streams that
+  // need no conversion are passed on to the sink directly from here.
+  sample::Sample* source_storage_;
+  util::SpscRing<sample::Sample> source_;
+  size_t unprocessed_samples_;
+  // Given whenever samples are consumed from source_, so that the decoder can
+  // wait for space without polling.
+  SemaphoreHandle_t source_space_;
+
   drivers::PcmBuffer& sink_;
 
-  Buffer input_buffer_;
-  Buffer resampled_buffer_;
+  // Converted samples that the sink didn't have room for yet. This is only
+  // refilled once it's empty.
   Buffer output_buffer_;
 
-  std::unique_ptr<Resampler> resampler_;
+  std::atomic<ResamplerBudget> resampler_budget_;
+  std::unique_ptr<IResampler> resampler_;
+  ResamplerBudget active_budget_;
+  uint32_t resampler_target_rate_;
+  uint8_t resampler_channels_;
   bool double_samples_;
+  bool passthrough_;
+
+  std::atomic<ReplayGainMode> replay_gain_;
+  ReplayGainMode active_replay_gain_;
+  // The tags of the current stream, from which its gain is worked out.
+  std::shared_ptr<database::TrackTags> stream_tags_;
+  drivers::GainRamp gain_;
 
   std::shared_ptr<IAudioOutput> output_;
-  size_t unprocessed_samples_;
+
+  // The format of the most recently started stream, and the format that the
+  // output has been configured to receive it in.
+  std::optional<IAudioOutput::Format> stream_format_;
+  std::optional<IAudioOutput::Format> sink_format_;
+  // Whether we're holding back the start of a new stream until the sink has
+  // finished playing the samples of the previous one.
+  bool awaiting_drain_;
+
+  std::atomic<uint64_t> samples_copied_;
 };
 
 }  // namespace audio
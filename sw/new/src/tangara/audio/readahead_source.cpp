@@ -6,17 +6,21 @@
 
 #include "audio/readahead_source.hpp"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <mutex>
 
 #include "esp_heap_caps.h"
 #include "esp_log.h"
-#include "ff.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "audio/audio_source.hpp"
 #include "codec.hpp"
-#include "drivers/spi.hpp"
 #include "freertos/portmacro.h"
 #include "tasks.hpp"
 #include "types.hpp"
@@ -24,7 +28,29 @@
 namespace audio {
 
 static constexpr char kTag[] = "readahead";
-static constexpr size_t kBufferSize = 1024 * 512;
+
+// Bounds on the size of the buffer. Until we've seen how quickly the stream is
+// being consumed, assume it's something like a high bitrate FLAC.
+static constexpr size_t kMinBufferSize = 1024 * 32;
+static constexpr size_t kMaxBufferSize = 1024 * 512;
+static constexpr size_t kInitialBufferSize = 1024 * 128;
+
+// Reads from the wrapped stream are kept to multiples of the largest
+// reasonable FAT sector size, for more efficient disk reads.
+static constexpr size_t kReadAlignment = 1024 * 4;
+static constexpr size_t kMaxSingleRead = 1024 * 32;
+
+// How many of the slowest recent reads the buffer should be able to cover,
+// on top of a second's worth of data.
+static constexpr uint32_t kLatencyMultiple = 4;
+
+// How long to measure the reader's consumption over before updating our
+// estimate of it.
+static constexpr int64_t kRateWindowUs = 1'000'000;
+
+static auto alignUp(size_t size) -> size_t {
+  return (size + kReadAlignment - 1) / kReadAlignment * kReadAlignment;
+}
 
 ReadaheadSource::ReadaheadSource(tasks::WorkerPool& worker,
                                  std::unique_ptr<codecs::IStream> wrapped)
@@ -33,46 +59,79 @@ ReadaheadSource::ReadaheadSource(tasks::WorkerPool& worker,
       wrapped_(std::move(wrapped)),
       readahead_enabled_(false),
       is_refilling_(false),
-      buffer_(xStreamBufferCreateWithCaps(kBufferSize, 1, MALLOC_CAP_SPIRAM)),
-      tell_(wrapped_->CurrentPosition()) {}
+      cancel_refill_(false),
+      buffer_(nullptr),
+      buffer_size_(0),
+      start_(wrapped_->CurrentPosition()),
+      end_(start_),
+      is_eof_(false),
+      tell_(start_),
+      rate_(0),
+      latency_us_(0),
+      rate_window_start_us_(0),
+      rate_window_bytes_(0) {}
 
 ReadaheadSource::~ReadaheadSource() {
-  is_refilling_.wait(true);
-  vStreamBufferDeleteWithCaps(buffer_);
+  CancelReadahead();
+  heap_caps_free(buffer_);
 }
 
 auto ReadaheadSource::Read(std::span<std::byte> dest) -> ssize_t {
   size_t bytes_written = 0;
-  // Fill the destination from our buffer, until either the buffer is drained
-  // or the destination is full.
-  while (!dest.empty() && (is_refilling_ || !xStreamBufferIsEmpty(buffer_))) {
-    size_t bytes_read =
-        xStreamBufferReceive(buffer_, dest.data(), dest.size_bytes(), 1);
-    tell_ += bytes_read;
-    bytes_written += bytes_read;
-    dest = dest.subspan(bytes_read);
+  for (;;) {
+    // Only we start refills, so if there isn't one in progress now, then the
+    // buffer can't change underneath us.
+    bool was_refilling = is_refilling_;
+    {
+      // Fill the destination from our buffer, until either the buffer is
+      // drained or the destination is full. The buffered bytes may wrap
+      // around the end of the buffer, in which case this takes two goes.
+      std::lock_guard<std::mutex> lock{mutex_};
+      while (!dest.empty() && tell_ < end_) {
+        size_t offset = tell_ % buffer_size_;
+        size_t len = std::min<size_t>(
+            {dest.size_bytes(), static_cast<size_t>(end_ - tell_),
+             buffer_size_ - offset});
+        std::memcpy(dest.data(), buffer_ + offset, len);
+        tell_ += len;
+        bytes_written += len;
+        dest = dest.subspan(len);
+      }
+    }
+    if (dest.empty() || !was_refilling) {
+      break;
+    }
+    // We've caught up with the refill. Wait for it to make some progress,
+    // rather than competing with it for the wrapped stream.
+    vTaskDelay(1);
   }
 
   // After the loop, we've either written everything that was asked for, or
   // we're out of data.
   if (!dest.empty()) {
     // Out of data in the buffer. Finish using the wrapped stream.
-    size_t extra_bytes = wrapped_->Read(dest);
-    tell_ += extra_bytes;
+    ssize_t extra_bytes = std::max<ssize_t>(wrapped_->Read(dest), 0);
     bytes_written += extra_bytes;
 
-    // Check for EOF in the wrapped stream.
-    if (extra_bytes < dest.size_bytes()) {
-      return bytes_written;
-    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    tell_ += extra_bytes;
+    start_ = end_ = tell_;
+    is_eof_ = static_cast<size_t>(extra_bytes) < dest.size_bytes();
   }
-  // After this point, we're done writing to `dest`. It's either empty, or the
-  // underlying source is EOF.
 
-  // If we're here, then there is more data to be read from the wrapped stream.
-  // Ensure the readahead is running.
-  if (!is_refilling_ && readahead_enabled_ &&
-      xStreamBufferBytesAvailable(buffer_) < kBufferSize / 4) {
+  bool begin_readahead = false;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    UpdateRateLocked(bytes_written);
+    if (!is_refilling_ && is_eof_ && tell_ == end_) {
+      // Everything has been read, so there's no need to hold on to any of it.
+      ReleaseLocked();
+    } else if (!is_refilling_ && !is_eof_ && readahead_enabled_ &&
+               static_cast<size_t>(end_ - tell_) < TargetSizeLocked() / 2) {
+      begin_readahead = true;
+    }
+  }
+  if (begin_readahead) {
     BeginReadahead();
   }
 
@@ -84,20 +143,52 @@ auto ReadaheadSource::CanSeek() -> bool {
 }
 
 auto ReadaheadSource::SeekTo(int64_t destination, SeekFrom from) -> void {
-  // Seeking blows away all of our prefetched data. To do this safely, we
-  // first need to wait for the refill task to finish.
+  std::optional<int64_t> target;
+  switch (from) {
+    case SeekFrom::kStartOfStream:
+      target = destination;
+      break;
+    case SeekFrom::kEndOfStream:
+      if (auto size = wrapped_->Size()) {
+        target = *size + destination;
+      }
+      break;
+    case SeekFrom::kCurrentPosition:
+      target = CurrentPosition() + destination;
+      break;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    // A seek skews our idea of how quickly the stream is being read.
+    rate_window_start_us_ = 0;
+    if (target && *target >= start_ && *target <= end_) {
+      // The destination is already buffered; no need to involve the wrapped
+      // stream at all.
+      tell_ = *target;
+      return;
+    }
+  }
+
+  // Seeking elsewhere blows away all of our prefetched data. To do this
+  // safely, we first need to stop the refill task.
   ESP_LOGI(kTag, "dropping readahead due to seek");
-  is_refilling_.wait(true);
-  // It's now safe to clear out the buffer.
-  xStreamBufferReset(buffer_);
+  CancelReadahead();
 
-  wrapped_->SeekTo(destination, from);
+  if (target) {
+    wrapped_->SeekTo(*target, SeekFrom::kStartOfStream);
+  } else {
+    wrapped_->SeekTo(destination, from);
+  }
 
   // Make sure our tell is up to date with the new location.
-  tell_ = wrapped_->CurrentPosition();
+  std::lock_guard<std::mutex> lock{mutex_};
+  tell_ = start_ = end_ = wrapped_->CurrentPosition();
+  is_eof_ = false;
 }
 
 auto ReadaheadSource::CurrentPosition() -> int64_t {
+  std::lock_guard<std::mutex> lock{mutex_};
   return tell_;
 }
 
@@ -107,34 +198,145 @@ auto ReadaheadSource::Size() -> std::optional<int64_t> {
 
 auto ReadaheadSource::SetPreambleFinished() -> void {
   readahead_enabled_ = true;
-  BeginReadahead();
+  if (!is_refilling_) {
+    BeginReadahead();
+  }
+}
+
+auto ReadaheadSource::BufferSize() -> size_t {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return buffer_size_;
 }
 
 auto ReadaheadSource::BeginReadahead() -> void {
   is_refilling_ = true;
-  std::function<void(void)> refill = [this]() {
-    // Try to keep larger than most reasonable FAT sector sizes for more
-    // efficient disk reads.
-    constexpr size_t kMaxSingleRead = 1024 * 16;
-    std::byte working_buf[kMaxSingleRead];
-    for (;;) {
-      size_t bytes_to_read = std::min<size_t>(
-          kMaxSingleRead, xStreamBufferSpacesAvailable(buffer_));
-      if (bytes_to_read == 0) {
-        break;
+  std::function<void(void)> refill = [this]() { Refill(); };
+  worker_.Dispatch(refill);
+}
+
+auto ReadaheadSource::CancelReadahead() -> void {
+  cancel_refill_ = true;
+  is_refilling_.wait(true);
+  cancel_refill_ = false;
+}
+
+/*
+ * Tops up the buffer from the wrapped stream, one chunk at a time. Reads go
+ * straight into the buffer, outside of the lock. Whilst they're in progress,
+ * the reader only ever touches bytes before end_, and start_ is moved past
+ * any bytes that are about to be overwritten so that seeks can't land there.
+ */
+auto ReadaheadSource::Refill() -> void {
+  while (!cancel_refill_) {
+    std::span<std::byte> space;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      // Only resize when the target has moved a long way, so that the buffer
+      // isn't constantly reallocated as our estimates wobble.
+      size_t target = TargetSizeLocked();
+      if (!buffer_ || target > buffer_size_ * 2 || target < buffer_size_ / 2) {
+        ResizeLocked(target);
       }
-      size_t read = wrapped_->Read({working_buf, bytes_to_read});
-      if (read > 0) {
-        xStreamBufferSend(buffer_, working_buf, read, 0);
+      if (!buffer_) {
+        break;
       }
-      if (read < bytes_to_read) {
+
+      size_t free = buffer_size_ - (end_ - tell_);
+      size_t chunk = ChunkSizeLocked();
+      if (free < chunk) {
         break;
       }
+      size_t offset = end_ % buffer_size_;
+      size_t len = std::min(chunk, buffer_size_ - offset);
+      start_ = std::max<int64_t>(start_, end_ + len - buffer_size_);
+      space = {buffer_ + offset, len};
     }
-    is_refilling_ = false;
-    is_refilling_.notify_all();
-  };
-  worker_.Dispatch(refill);
+
+    int64_t started = esp_timer_get_time();
+    ssize_t read = std::max<ssize_t>(wrapped_->Read(space), 0);
+    uint32_t took = esp_timer_get_time() - started;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    end_ += read;
+    // Remember the slowest recent read, letting older ones gradually fade.
+    latency_us_ = std::max(took, latency_us_ - latency_us_ / 8);
+    if (static_cast<size_t>(read) < space.size_bytes()) {
+      is_eof_ = true;
+      break;
+    }
+  }
+  is_refilling_ = false;
+  is_refilling_.notify_all();
+}
+
+auto ReadaheadSource::UpdateRateLocked(size_t bytes_read) -> void {
+  int64_t now = esp_timer_get_time();
+  if (rate_window_start_us_ == 0) {
+    rate_window_start_us_ = now;
+    rate_window_bytes_ = 0;
+    return;
+  }
+  rate_window_bytes_ += bytes_read;
+  int64_t elapsed = now - rate_window_start_us_;
+  if (elapsed < kRateWindowUs) {
+    return;
+  }
+  uint32_t measured =
+      static_cast<uint64_t>(rate_window_bytes_) * 1'000'000 / elapsed;
+  rate_ = rate_ == 0 ? measured : (rate_ * 3 + measured) / 4;
+  rate_window_start_us_ = now;
+  rate_window_bytes_ = 0;
+}
+
+auto ReadaheadSource::TargetSizeLocked() -> size_t {
+  if (rate_ == 0) {
+    return kInitialBufferSize;
+  }
+  uint64_t cover_us = 1'000'000 + kLatencyMultiple * latency_us_;
+  size_t size = static_cast<uint64_t>(rate_) * cover_us / 1'000'000;
+  return std::clamp(alignUp(size), kMinBufferSize, kMaxBufferSize);
+}
+
+auto ReadaheadSource::ChunkSizeLocked() -> size_t {
+  // Smaller chunks keep the buffer topped up more evenly, but each read has
+  // some fixed cost. An eighth of the buffer is a reasonable middle ground.
+  return std::clamp(buffer_size_ / 8 / kReadAlignment * kReadAlignment,
+                    kReadAlignment, kMaxSingleRead);
+}
+
+auto ReadaheadSource::ResizeLocked(size_t size) -> void {
+  // Keep whatever is buffered ahead of the reader.
+  size_t ahead = end_ - tell_;
+  size = std::max(size, alignUp(ahead));
+
+  auto* buffer =
+      reinterpret_cast<std::byte*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+  if (!buffer) {
+    ESP_LOGW(kTag, "couldn't allocate %u KiB buffer", size / 1024);
+    return;
+  }
+  for (int64_t pos = tell_; pos < end_;) {
+    size_t from = pos % buffer_size_;
+    size_t to = pos % size;
+    size_t len = std::min<size_t>(
+        {static_cast<size_t>(end_ - pos), buffer_size_ - from, size - to});
+    std::memcpy(buffer + to, buffer_ + from, len);
+    pos += len;
+  }
+  ESP_LOGI(kTag, "buffer resized from %u to %u KiB", buffer_size_ / 1024,
+           size / 1024);
+
+  heap_caps_free(buffer_);
+  buffer_ = buffer;
+  buffer_size_ = size;
+  start_ = tell_;
+}
+
+auto ReadaheadSource::ReleaseLocked() -> void {
+  heap_caps_free(buffer_);
+  buffer_ = nullptr;
+  buffer_size_ = 0;
+  start_ = end_ = tell_;
 }
 
 }  // namespace audio
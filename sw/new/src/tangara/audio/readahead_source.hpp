@@ -6,14 +6,11 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
-
-#include "freertos/FreeRTOS.h"
-
-#include "ff.h"
-#include "freertos/stream_buffer.h"
+#include <mutex>
 
 #include "audio/audio_source.hpp"
 #include "codec.hpp"
@@ -24,6 +21,14 @@ namespace audio {
 /*
  * Wraps another stream, proactively buffering large chunks of it into memory
  * at a time.
+ *
+ * The size of the buffer adapts to the stream: it's sized to hold about a
+ * second of data at the rate the stream is being consumed, plus enough to
+ * cover several of the slowest reads recently seen from the wrapped stream.
+ * Data that has already been read is kept until it's overwritten, so that
+ * seeks landing anywhere within the buffer don't touch the wrapped stream.
+ * The buffer is only allocated once the codec has finished with the stream's
+ * headers, and is freed again once the whole stream has been read.
  */
 class ReadaheadSource : public codecs::IStream {
  public:
@@ -42,19 +47,50 @@ class ReadaheadSource : public codecs::IStream {
 
   auto SetPreambleFinished() -> void override;
 
+  /* Returns the size of the buffer currently allocated, in bytes. */
+  auto BufferSize() -> size_t;
+
   ReadaheadSource(const ReadaheadSource&) = delete;
   ReadaheadSource& operator=(const ReadaheadSource&) = delete;
 
  private:
   auto BeginReadahead() -> void;
+  auto Refill() -> void;
+  auto CancelReadahead() -> void;
+
+  auto UpdateRateLocked(size_t bytes_read) -> void;
+  auto TargetSizeLocked() -> size_t;
+  auto ChunkSizeLocked() -> size_t;
+  auto ResizeLocked(size_t size) -> void;
+  auto ReleaseLocked() -> void;
 
   tasks::WorkerPool& worker_;
   std::unique_ptr<codecs::IStream> wrapped_;
 
   bool readahead_enabled_;
   std::atomic<bool> is_refilling_;
-  StreamBufferHandle_t buffer_;
+  std::atomic<bool> cancel_refill_;
+
+  // Guards everything below. The wrapped stream is only ever used by the
+  // refill task whilst is_refilling_ is set, and otherwise by the reader.
+  std::mutex mutex_;
+
+  // Bytes from the wrapped stream, between offsets start_ and end_ in the
+  // stream. The byte at offset `n` lives at `buffer_[n % buffer_size_]`.
+  std::byte* buffer_;
+  size_t buffer_size_;
+  int64_t start_;
+  int64_t end_;
+  bool is_eof_;
+
   int64_t tell_;
+
+  // Recent bytes per second consumed by the reader, and the slowest recent
+  // read from the wrapped stream in microseconds.
+  uint32_t rate_;
+  uint32_t latency_us_;
+  int64_t rate_window_start_us_;
+  size_t rate_window_bytes_;
 };
 
 }  // namespace audio
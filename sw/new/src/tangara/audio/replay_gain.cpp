@@ -0,0 +1,50 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/replay_gain.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+
+#include "database/track.hpp"
+#include "drivers/pcm_mix.hpp"
+
+namespace audio {
+
+auto ReplayGainFor(const database::TrackTags& tags, ReplayGainMode mode)
+    -> int32_t {
+  std::optional<int16_t> gain;
+  std::optional<uint32_t> peak;
+  switch (mode) {
+    case ReplayGainMode::kOff:
+      return drivers::kUnityGain;
+    case ReplayGainMode::kTrack:
+      gain = tags.trackGain() ? tags.trackGain() : tags.albumGain();
+      peak = tags.trackGain() ? tags.trackPeak() : tags.albumPeak();
+      break;
+    case ReplayGainMode::kAlbum:
+      gain = tags.albumGain() ? tags.albumGain() : tags.trackGain();
+      peak = tags.albumGain() ? tags.albumPeak() : tags.trackPeak();
+      break;
+  }
+  if (!gain) {
+    return drivers::kUnityGain;
+  }
+
+  // Gains are in hundredths of a dB. This is only worked out once per track,
+  // so there's no need to avoid floating point here.
+  int64_t res =
+      std::lround(drivers::kUnityGain * std::pow(10.0, *gain / 2000.0));
+  if (peak && *peak > 0) {
+    // Scaling the peak by the gain mustn't take it past full scale.
+    res = std::min<int64_t>(res, (int64_t{1} << 30) / *peak);
+  }
+  return std::clamp<int64_t>(res, 0, drivers::kMaxGain);
+}
+
+}  // namespace audio
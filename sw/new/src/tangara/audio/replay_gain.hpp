@@ -0,0 +1,34 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "database/track.hpp"
+
+namespace audio {
+
+/*
+ * Which of a track's loudness tags are used to even out the difference in
+ * loudness between tracks. Album gains keep the differences between tracks on
+ * the same album, as they were mastered.
+ */
+enum class ReplayGainMode : uint8_t {
+  kOff = 0,
+  kTrack = 1,
+  kAlbum = 2,
+};
+
+/*
+ * Returns the Q15 gain to play a track with the given tags at. If the track
+ * lacks the gain for the given mode, then its other gain is used instead, or
+ * no gain at all if it has neither. Gains are lowered if needed to keep the
+ * track's peak from clipping, and are capped at drivers::kMaxGain.
+ */
+auto ReplayGainFor(const database::TrackTags&, ReplayGainMode) -> int32_t;
+
+}  // namespace audio
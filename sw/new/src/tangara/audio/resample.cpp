@@ -7,12 +7,15 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <numeric>
 
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "speex/speex_resampler.h"
 
@@ -20,36 +23,70 @@
 
 namespace audio {
 
-static constexpr int kQuality = SPEEX_RESAMPLER_QUALITY_MIN;
+[[maybe_unused]] static constexpr char kTag[] = "resample";
 
-Resampler::Resampler(uint32_t source_sample_rate,
+auto CreateResampler(uint32_t source_sample_rate,
                      uint32_t target_sample_rate,
-                     uint8_t num_channels)
+                     uint8_t num_channels,
+                     ResamplerBudget budget) -> std::unique_ptr<IResampler> {
+  if (source_sample_rate == target_sample_rate) {
+    return std::make_unique<BypassResampler>(source_sample_rate);
+  }
+
+  // The fixed-ratio resampler is both cheaper and cleaner than speex's
+  // cheapest mode, so it's the right choice for 44.1kHz audio at any budget.
+  if (source_sample_rate == PolyphaseResampler::kSourceRate &&
+      target_sample_rate == PolyphaseResampler::kTargetRate &&
+      num_channels <= PolyphaseResampler::kMaxChannels) {
+    return std::make_unique<PolyphaseResampler>(num_channels);
+  }
+
+  int quality;
+  switch (budget) {
+    case ResamplerBudget::kLow:
+      quality = SPEEX_RESAMPLER_QUALITY_MIN;
+      break;
+    case ResamplerBudget::kHigh:
+      quality = SPEEX_RESAMPLER_QUALITY_DEFAULT;
+      break;
+    case ResamplerBudget::kMedium:
+    default:
+      quality = 2;
+      break;
+  }
+  return std::make_unique<SpeexResampler>(
+      source_sample_rate, target_sample_rate, num_channels, quality);
+}
+
+SpeexResampler::SpeexResampler(uint32_t source_sample_rate,
+                               uint32_t target_sample_rate,
+                               uint8_t num_channels,
+                               int quality)
     : err_(0),
       resampler_(speex_resampler_init(num_channels,
                                       source_sample_rate,
                                       target_sample_rate,
-                                      kQuality,
+                                      quality,
                                       &err_)),
       num_channels_(num_channels) {
   speex_resampler_skip_zeros(resampler_);
   assert(err_ == 0);
 }
 
-Resampler::~Resampler() {
+SpeexResampler::~SpeexResampler() {
   speex_resampler_destroy(resampler_);
 }
 
-auto Resampler::sourceRate() -> uint32_t {
+auto SpeexResampler::sourceRate() -> uint32_t {
   uint32_t input = 0;
   uint32_t output = 0;
   speex_resampler_get_rate(resampler_, &input, &output);
   return input;
 }
 
-auto Resampler::Process(std::span<sample::Sample> input,
-                        std::span<sample::Sample> output,
-                        bool end_of_data) -> std::pair<size_t, size_t> {
+auto SpeexResampler::Process(std::span<sample::Sample> input,
+                             std::span<sample::Sample> output,
+                             bool end_of_data) -> std::pair<size_t, size_t> {
   uint32_t frames_used = input.size() / num_channels_;
   uint32_t frames_produced = output.size() / num_channels_;
 
@@ -60,4 +97,151 @@ auto Resampler::Process(std::span<sample::Sample> input,
   return {frames_used * num_channels_, frames_produced * num_channels_};
 }
 
+// Enough frames per call to keep the cost of shuffling the history down
+// small, relative to the cost of filtering.
+static constexpr size_t kHistoryFrames = PolyphaseResampler::kTaps + 256;
+
+// Shape parameter for the Kaiser window. This trades the width of the
+// transition band against stopband attenuation; 7 gives about 70dB.
+static constexpr double kKaiserBeta = 7.0;
+
+/* Zeroth order modified Bessel function of the first kind. */
+static auto besselI0(double x) -> double {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+PolyphaseResampler::PolyphaseResampler(uint8_t num_channels)
+    : num_channels_(num_channels),
+      filters_(reinterpret_cast<int16_t*>(
+          heap_caps_malloc(kInterpolation * kTaps * sizeof(int16_t),
+                           MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT))),
+      history_(kHistoryFrames * num_channels),
+      frames_in_history_(kTaps / 2 - 1),
+      position_(kTaps / 2 - 1),
+      phase_(0) {
+  assert(num_channels_ > 0 && num_channels_ <= kMaxChannels);
+
+  // Each phase is a windowed sinc, offset by the phase's fraction of an input
+  // frame. The cutoff sits at the input's Nyquist frequency; aliases from the
+  // transition band above it land beyond 20kHz once resampled.
+  constexpr double kHalfWidth = kTaps / 2.0;
+  const double window_scale = 1.0 / besselI0(kKaiserBeta);
+  for (uint32_t phase = 0; phase < kInterpolation; phase++) {
+    double coeffs[kTaps];
+    double sum = 0;
+    for (size_t tap = 0; tap < kTaps; tap++) {
+      double t = static_cast<double>(phase) / kInterpolation + kHalfWidth - 1 -
+                 static_cast<double>(tap);
+      double sinc = t == 0 ? 1.0 : std::sin(M_PI * t) / (M_PI * t);
+      double edge = t / kHalfWidth;
+      double window =
+          edge * edge >= 1.0
+              ? 0.0
+              : besselI0(kKaiserBeta * std::sqrt(1.0 - edge * edge)) *
+                    window_scale;
+      coeffs[tap] = sinc * window;
+      sum += coeffs[tap];
+    }
+
+    // Normalise each phase to unity gain, then put any rounding error back
+    // into the largest tap so that DC passes through exactly.
+    int16_t* filter = filters_ + phase * kTaps;
+    int32_t total = 0;
+    size_t largest = 0;
+    for (size_t tap = 0; tap < kTaps; tap++) {
+      filter[tap] = static_cast<int16_t>(
+          std::clamp<long>(std::lround(coeffs[tap] / sum * 32768.0), INT16_MIN,
+                           INT16_MAX));
+      total += filter[tap];
+      if (std::abs(filter[tap]) > std::abs(filter[largest])) {
+        largest = tap;
+      }
+    }
+    filter[largest] = std::clamp<int32_t>(filter[largest] + 32768 - total,
+                                          INT16_MIN, INT16_MAX);
+  }
+}
+
+PolyphaseResampler::~PolyphaseResampler() {
+  heap_caps_free(filters_);
+}
+
+auto PolyphaseResampler::Process(std::span<sample::Sample> input,
+                                 std::span<sample::Sample> output,
+                                 bool end_of_data)
+    -> std::pair<size_t, size_t> {
+  size_t frames_in = std::min(input.size() / num_channels_,
+                              kHistoryFrames - frames_in_history_);
+  std::copy_n(input.begin(), frames_in * num_channels_,
+              history_.begin() + frames_in_history_ * num_channels_);
+  frames_in_history_ += frames_in;
+
+  size_t frames_out =
+      num_channels_ == 1 ? process<1>(output) : process<2>(output);
+
+  // Drop any frames that have fallen out of reach of the filter.
+  size_t first_needed = position_ + 1 - kTaps / 2;
+  if (first_needed > 0) {
+    std::copy(history_.begin() + first_needed * num_channels_,
+              history_.begin() + frames_in_history_ * num_channels_,
+              history_.begin());
+    frames_in_history_ -= first_needed;
+    position_ -= first_needed;
+  }
+
+  return {frames_in * num_channels_, frames_out * num_channels_};
+}
+
+template <uint8_t kChannels>
+auto PolyphaseResampler::process(std::span<sample::Sample> output) -> size_t {
+  size_t max_frames = output.size() / kChannels;
+  sample::Sample* out = output.data();
+  size_t frames = 0;
+
+  while (frames < max_frames && position_ + kTaps / 2 < frames_in_history_) {
+    const int16_t* filter = filters_ + phase_ * kTaps;
+    const sample::Sample* in =
+        history_.data() + (position_ + 1 - kTaps / 2) * kChannels;
+
+    int32_t acc[kChannels];
+    for (uint8_t c = 0; c < kChannels; c++) {
+      acc[c] = 1 << 14;
+    }
+    for (size_t tap = 0; tap < kTaps; tap++) {
+      for (uint8_t c = 0; c < kChannels; c++) {
+        acc[c] += filter[tap] * in[tap * kChannels + c];
+      }
+    }
+    for (uint8_t c = 0; c < kChannels; c++) {
+      *out++ = std::clamp<int32_t>(acc[c] >> 15, INT16_MIN, INT16_MAX);
+    }
+
+    frames++;
+    phase_ += kDecimation;
+    if (phase_ >= kInterpolation) {
+      phase_ -= kInterpolation;
+      position_++;
+    }
+  }
+
+  return frames;
+}
+
+auto BypassResampler::Process(std::span<sample::Sample> input,
+                              std::span<sample::Sample> output,
+                              bool end_of_data) -> std::pair<size_t, size_t> {
+  size_t samples = std::min(input.size(), output.size());
+  std::copy_n(input.begin(), samples, output.begin());
+  return {samples, samples};
+}
+
 }  // namespace audio
@@ -8,7 +8,9 @@
 
 #include <stdint.h>
 #include <cstdint>
+#include <memory>
 #include <span>
+#include <utility>
 #include <vector>
 
 #include "speex/speex_resampler.h"
@@ -17,19 +19,57 @@
 
 namespace audio {
 
-class Resampler {
+/* Converts a stream of interleaved samples from one sample rate to another. */
+class IResampler {
  public:
-  Resampler(uint32_t source_sample_rate,
-            uint32_t target_sample_rate,
-            uint8_t num_channels);
+  virtual ~IResampler() {}
 
-  ~Resampler();
+  virtual auto sourceRate() -> uint32_t = 0;
 
-  auto sourceRate() -> uint32_t;
+  /*
+   * Resamples as much of the input as will fit into the output. Returns the
+   * number of input samples that were consumed, and the number of output
+   * samples that were produced.
+   */
+  virtual auto Process(std::span<sample::Sample> input,
+                       std::span<sample::Sample> output,
+                       bool end_of_data) -> std::pair<size_t, size_t> = 0;
+};
+
+/*
+ * How much CPU time we're willing to spend on resampling. Higher budgets use
+ * longer filters, with less aliasing and a flatter passband.
+ */
+enum class ResamplerBudget : uint8_t {
+  kLow = 0,
+  kMedium = 1,
+  kHigh = 2,
+};
+
+/*
+ * Returns the best resampler for the given conversion that fits within the
+ * given budget.
+ */
+auto CreateResampler(uint32_t source_sample_rate,
+                     uint32_t target_sample_rate,
+                     uint8_t num_channels,
+                     ResamplerBudget budget) -> std::unique_ptr<IResampler>;
+
+/* General purpose resampler for arbitrary rates, backed by speexdsp. */
+class SpeexResampler : public IResampler {
+ public:
+  SpeexResampler(uint32_t source_sample_rate,
+                 uint32_t target_sample_rate,
+                 uint8_t num_channels,
+                 int quality = SPEEX_RESAMPLER_QUALITY_MIN);
+
+  ~SpeexResampler();
+
+  auto sourceRate() -> uint32_t override;
 
   auto Process(std::span<sample::Sample> input,
                std::span<sample::Sample> output,
-               bool end_of_data) -> std::pair<size_t, size_t>;
+               bool end_of_data) -> std::pair<size_t, size_t> override;
 
  private:
   int err_;
@@ -37,4 +77,69 @@ class Resampler {
   uint8_t num_channels_;
 };
 
+/*
+ * Fixed-ratio resampler for the common case of converting 44.1kHz audio to
+ * 48kHz. Every output frame falls on one of 160 possible phases between input
+ * frames, so the filter for each phase is computed once up front, and each
+ * output sample is then a single short dot product.
+ */
+class PolyphaseResampler : public IResampler {
+ public:
+  static constexpr uint32_t kSourceRate = 44100;
+  static constexpr uint32_t kTargetRate = 48000;
+
+  // 44100:48000 reduces to 147:160.
+  static constexpr uint32_t kInterpolation = 160;
+  static constexpr uint32_t kDecimation = 147;
+
+  static constexpr size_t kTaps = 32;
+  static constexpr uint8_t kMaxChannels = 2;
+
+  explicit PolyphaseResampler(uint8_t num_channels);
+  ~PolyphaseResampler();
+
+  auto sourceRate() -> uint32_t override { return kSourceRate; }
+
+  auto Process(std::span<sample::Sample> input,
+               std::span<sample::Sample> output,
+               bool end_of_data) -> std::pair<size_t, size_t> override;
+
+  PolyphaseResampler(const PolyphaseResampler&) = delete;
+  PolyphaseResampler& operator=(const PolyphaseResampler&) = delete;
+
+ private:
+  template <uint8_t kChannels>
+  auto process(std::span<sample::Sample> output) -> size_t;
+
+  uint8_t num_channels_;
+
+  // Q15 filter coefficients, kTaps for each phase in turn.
+  int16_t* filters_;
+
+  // Input frames that are still within reach of the filter, followed by any
+  // newly arrived frames.
+  std::vector<sample::Sample> history_;
+  size_t frames_in_history_;
+
+  // The input frame that the next output frame is centred on, and how far
+  // past it (in 1/kInterpolation steps) the output frame falls.
+  size_t position_;
+  uint32_t phase_;
+};
+
+/* Passes samples through unchanged, for when no conversion is needed. */
+class BypassResampler : public IResampler {
+ public:
+  explicit BypassResampler(uint32_t sample_rate) : sample_rate_(sample_rate) {}
+
+  auto sourceRate() -> uint32_t override { return sample_rate_; }
+
+  auto Process(std::span<sample::Sample> input,
+               std::span<sample::Sample> output,
+               bool end_of_data) -> std::pair<size_t, size_t> override;
+
+ private:
+  uint32_t sample_rate_;
+};
+
 }  // namespace audio
@@ -31,15 +31,42 @@ auto StreamCues::update(uint32_t sample) -> void {
   }
 }
 
-auto StreamCues::addCue(std::shared_ptr<TrackInfo> track, uint32_t sample)
-    -> void {
-  if (sample == now_) {
-    current_ = {track, now_};
+auto StreamCues::addCue(std::shared_ptr<TrackInfo> track,
+                        uint32_t sample,
+                        const IAudioOutput::Format& format) -> void {
+  push(Cue{
+      .track = track,
+      .start_at = sample,
+      .samples_per_second = format.sample_rate * format.num_channels,
+      .offset_ms = 0,
+  });
+}
+
+auto StreamCues::addFormatChange(uint32_t sample,
+                                 const IAudioOutput::Format& format) -> void {
+  // Cues are added in order, so the track playing at this sample is the one
+  // from the most recent cue.
+  const Cue* prev;
+  if (!upcoming_.empty()) {
+    prev = &upcoming_.back();
+  } else if (current_) {
+    prev = &*current_;
   } else {
-    upcoming_.push_back(Cue{
-        .track = track,
-        .start_at = sample,
-    });
+    return;
+  }
+  push(Cue{
+      .track = prev->track,
+      .start_at = sample,
+      .samples_per_second = format.sample_rate * format.num_channels,
+      .offset_ms = elapsedAt(*prev, sample),
+  });
+}
+
+auto StreamCues::push(Cue cue) -> void {
+  if (cue.start_at == now_) {
+    current_ = cue;
+  } else {
+    upcoming_.push_back(cue);
   }
 }
 
@@ -52,16 +79,17 @@ auto StreamCues::current() -> std::pair<std::shared_ptr<TrackInfo>, uint32_t> {
   if (!current_) {
     return {};
   }
+  return {current_->track, elapsedAt(*current_, now_)};
+}
 
-  uint32_t duration;
-  if (now_ < current_->start_at) {
-    // now_ overflowed since this track started.
-    duration = now_ + (UINT32_MAX - current_->start_at);
-  } else {
-    duration = now_ - current_->start_at;
+auto StreamCues::elapsedAt(const Cue& cue, uint32_t sample) -> uint32_t {
+  if (cue.samples_per_second == 0) {
+    return cue.offset_ms;
   }
-
-  return {current_->track, duration};
+  // Unsigned subtraction gives the right answer even if the sample counter
+  // has overflowed since the cue.
+  uint64_t samples = static_cast<uint32_t>(sample - cue.start_at);
+  return cue.offset_ms + samples * 1000 / cue.samples_per_second;
 }
 
 auto StreamCues::hasStream() -> bool {
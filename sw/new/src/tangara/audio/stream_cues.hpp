@@ -10,8 +10,10 @@
 #include <cstdint>
 #include <deque>
 #include <memory>
+#include <optional>
 
 #include "audio/audio_events.hpp"
+#include "audio/audio_sink.hpp"
 
 namespace audio {
 
@@ -27,12 +29,28 @@ class StreamCues {
   /* Updates the current track given the new most recently played sample. */
   auto update(uint32_t sample) -> void;
 
-  /* Returns the current track, and how long it has been playing for. */
+  /*
+   * Returns the current track, and how long it has been playing for in
+   * milliseconds.
+   */
   auto current() -> std::pair<std::shared_ptr<TrackInfo>, uint32_t>;
 
   auto hasStream() -> bool;
 
-  auto addCue(std::shared_ptr<TrackInfo>, uint32_t start_at) -> void;
+  /*
+   * Adds a cue for a track that begins playing at the given sample, with the
+   * output in the given format. The track may be null, to mark the point at
+   * which playback of the previous track stops.
+   */
+  auto addCue(std::shared_ptr<TrackInfo>,
+              uint32_t start_at,
+              const IAudioOutput::Format&) -> void;
+
+  /*
+   * Adds a cue for the output changing format at the given sample, part way
+   * through whichever track is playing at that point.
+   */
+  auto addFormatChange(uint32_t start_at, const IAudioOutput::Format&) -> void;
 
   auto clear() -> void;
 
@@ -42,8 +60,17 @@ class StreamCues {
   struct Cue {
     std::shared_ptr<TrackInfo> track;
     uint32_t start_at;
+
+    // How quickly samples are played from this cue onwards.
+    uint32_t samples_per_second;
+    // How much of the track had already been played before this cue.
+    uint32_t offset_ms;
   };
 
+  static auto elapsedAt(const Cue&, uint32_t sample) -> uint32_t;
+
+  auto push(Cue) -> void;
+
   std::optional<Cue> current_;
   std::deque<Cue> upcoming_;
 };
@@ -114,6 +114,45 @@ auto TrackQueue::current() const -> TrackItem {
   if (!ready_) {
     return {};
   }
+  return valueLocked();
+}
+
+auto TrackQueue::peekNext() -> TrackItem {
+  const std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (!ready_) {
+    return {};
+  }
+  if (repeatMode_ == RepeatMode::REPEAT_TRACK) {
+    return valueLocked();
+  }
+
+  // Work out where next(...) would take us, using a copy of the shuffler so
+  // that its position is left alone.
+  size_t next;
+  if (shuffle_) {
+    RandomIterator peek = *shuffle_;
+    if (!peek.next(repeatMode_ == RepeatMode::REPEAT_QUEUE)) {
+      return {};
+    }
+    next = peek.current();
+  } else if (position_ + 1 < totalSize()) {
+    next = position_ + 1;
+  } else if (repeatMode_ == RepeatMode::REPEAT_QUEUE) {
+    next = 0;
+  } else {
+    return {};
+  }
+
+  // Playlists can only read the value at their current position, so briefly
+  // move there and back again.
+  size_t current = position_;
+  goTo(next);
+  TrackItem res = valueLocked();
+  goTo(current);
+  return res;
+}
+
+auto TrackQueue::valueLocked() const -> TrackItem {
   std::string val;
   if (opened_playlist_ && position_ < opened_playlist_->size()) {
     val = opened_playlist_->value();
@@ -70,6 +70,13 @@ class TrackQueue {
       std::variant<std::string, database::TrackId, std::monostate>;
   auto current() const -> TrackItem;
 
+  /*
+   * Returns the track that will play once the current one finishes, taking
+   * into account shuffling and the repeat mode. The queue itself is left
+   * unchanged.
+   */
+  auto peekNext() -> TrackItem;
+
   auto currentPosition() const -> size_t;
   auto currentPosition(size_t position) -> bool;
   auto totalSize() const -> size_t;
@@ -127,6 +134,7 @@ class TrackQueue {
  private:
   auto next(QueueUpdate::Reason r) -> void;
   auto goTo(size_t position) -> void;
+  auto valueLocked() const -> TrackItem;
   auto getFilepath(database::TrackId id) -> std::optional<std::string>;
   auto appendAsync(database::TrackIterator i, bool was_empty) -> void;
 
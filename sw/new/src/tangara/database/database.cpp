@@ -11,8 +11,10 @@
 #include <algorithm>
 #include <cctype>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <iomanip>
+#include <iterator>
 #include <iostream>
 #include <memory>
 #include <optional>
@@ -30,6 +32,7 @@
 #include "komihash.h"
 #include "leveldb/cache.h"
 #include "leveldb/db.h"
+#include "leveldb/filter_policy.h"
 #include "leveldb/iterator.h"
 #include "leveldb/options.h"
 #include "leveldb/slice.h"
@@ -41,6 +44,7 @@
 #include "database/db_events.hpp"
 #include "database/env_esp.hpp"
 #include "database/index.hpp"
+#include "database/index_counts.hpp"
 #include "database/records.hpp"
 #include "database/tag_parser.hpp"
 #include "database/track.hpp"
@@ -53,6 +57,10 @@
 namespace database {
 
 static SingletonEnv<leveldb::EspEnv> sEnv;
+
+// The smallest table cache that leveldb allows.
+static constexpr int kMaxOpenFiles = 74;
+
 [[maybe_unused]] static const char* kTag = "DB";
 
 static const char kDbPath[] = "/.tangara-db";
@@ -61,12 +69,37 @@ static const char kKeyDbVersion[] = "schema_version";
 static const char kKeyCustom[] = "U\0";
 static const char kKeyCollator[] = "collator";
 
-static constexpr size_t kMaxParallelism = 2;
+// Library scans are split into stages, so that reading from the SD card can
+// overlap with parsing tags and indexing. The total parallelism across every
+// stage must stay within the size of the worker pool's queue.
+static constexpr TrackFinder::Config kScanConfig{{
+    {.parallelism = 1, .queue_capacity = 0},  // Enumerate
+    {.parallelism = 2, .queue_capacity = 4},  // Read header
+    {.parallelism = 2, .queue_capacity = 4},  // Parse tags
+    {.parallelism = 1, .queue_capacity = 4},  // Index
+    {.parallelism = 1, .queue_capacity = 8},  // Commit
+}};
+
+// The number of existing tracks to verify at once during an update. The task
+// running the update waits on these, so this must leave room in the worker
+// pool for the update itself.
+static constexpr size_t kVerifyParallelism = 2;
+
+// The number of leading bytes of each new file to read before parsing its
+// tags. This covers the tags of most files, short of any embedded artwork.
+static constexpr size_t kScanHeaderSize = 8 * 1024;
+
+// Newly discovered tracks are committed in groups. Keep each group well within
+// the size of the memtable, and make sure new tracks show up promptly even
+// when they're being discovered slowly.
+static constexpr IngestBatch::Limits kIngestLimits{
+    .max_bytes = CONFIG_MMU_PAGE_SIZE / 2,
+    .max_age_us = 1000 * 1000,
+};
 
 static std::atomic<bool> sIsDbOpen(false);
 
 using std::placeholders::_1;
-using std::placeholders::_2;
 
 static auto CreateNewDatabase(leveldb::Options& options,
                               locale::ICollator& col) -> leveldb::DB* {
@@ -128,7 +161,8 @@ static auto CheckDatabase(leveldb::DB& db, locale::ICollator& col) -> bool {
 
 auto Database::Open(ITagParser& parser,
                     locale::ICollator& collator,
-                    tasks::WorkerPool& bg_worker)
+                    tasks::WorkerPool& bg_worker,
+                    const DbTuning& tuning)
     -> cpp::result<Database*, DatabaseError> {
   if (sIsDbOpen.exchange(true)) {
     return cpp::fail(DatabaseError::ALREADY_OPEN);
@@ -143,7 +177,12 @@ auto Database::Open(ITagParser& parser,
           [&]() -> cpp::result<Database*, DatabaseError> {
             leveldb::DB* db;
             std::unique_ptr<leveldb::Cache> cache{
-                leveldb::NewLRUCache(256 * 1024)};
+                leveldb::NewLRUCache(tuning.block_cache_size)};
+            std::unique_ptr<const leveldb::FilterPolicy> filter_policy;
+            if (tuning.bloom_filter_bits_per_key > 0) {
+              filter_policy.reset(leveldb::NewBloomFilterPolicy(
+                  tuning.bloom_filter_bits_per_key));
+            }
 
             leveldb::Options options;
             options.env = sEnv.env();
@@ -151,6 +190,14 @@ auto Database::Open(ITagParser& parser,
             // make most efficient use of PSRAM mapping.
             options.write_buffer_size = CONFIG_MMU_PAGE_SIZE;
             options.block_cache = cache.get();
+            options.block_size = tuning.block_size;
+            options.block_restart_interval = tuning.block_restart_interval;
+            options.filter_policy = filter_policy.get();
+            // Each open table keeps a FatFS handle (and its fast-seek cluster
+            // map) open in our Env, so keep the table cache small.
+            options.max_open_files = kMaxOpenFiles;
+            static_cast<leveldb::EspEnv*>(sEnv.env())
+                ->SetMaxOpenFiles(options.max_open_files);
 
             auto status = leveldb::DB::Open(options, kDbPath, &db);
             if (!status.ok()) {
@@ -171,8 +218,8 @@ auto Database::Open(ITagParser& parser,
             }
 
             ESP_LOGI(kTag, "Database opened successfully");
-            return new Database(db, cache.release(), bg_worker, parser,
-                                collator);
+            return new Database(db, cache.release(), filter_policy.release(),
+                                bg_worker, parser, collator);
           })
       .get();
 }
@@ -185,27 +232,74 @@ auto Database::Destroy() -> void {
 
 Database::Database(leveldb::DB* db,
                    leveldb::Cache* cache,
+                   const leveldb::FilterPolicy* filter_policy,
                    tasks::WorkerPool& pool,
                    ITagParser& tag_parser,
                    locale::ICollator& collator)
     : db_(db),
       cache_(cache),
-      track_finder_(
-          pool,
-          kMaxParallelism,
-          std::bind(&Database::processCandidateCallback, this, _1, _2),
-          std::bind(&Database::indexingCompleteCallback, this)),
+      filter_policy_(filter_policy),
+      cursors_(std::make_shared<CursorRegistry>(*db)),
+      track_finder_(pool,
+                    kScanConfig,
+                    {
+                        .read_header =
+                            std::bind(&Database::scanReadHeader, this, _1),
+                        .parse_tags =
+                            std::bind(&Database::scanParseTags, this, _1),
+                        .index = std::bind(&Database::scanIndex, this, _1),
+                        .commit = std::bind(&Database::scanCommit, this, _1),
+                    },
+                    std::bind(&Database::indexingCompleteCallback, this)),
+      bg_worker_(pool),
       tag_parser_(tag_parser),
       collator_(collator),
-      is_updating_(false) {
+      is_updating_(false),
+      update_cancelled_(false),
+      ingest_(*db, kIngestLimits),
+      ingest_timer_state_(new IngestTimerState{.pool = pool, .db = this}),
+      ingest_timer_(xTimerCreate(
+          "ingest",
+          pdMS_TO_TICKS(kIngestLimits.max_age_us / 1000),
+          false,
+          // The timer's own reference to the state; freed by
+          // releaseIngestTimerState once the timer is gone.
+          new std::shared_ptr<IngestTimerState>(ingest_timer_state_),
+          onIngestTimer)) {
   dbCalculateNextTrackId();
 }
 
 Database::~Database() {
+  // Any cursors still held by Lua or the track queue must let go of their
+  // snapshots before the db is closed.
+  cursors_->close();
+
+  // The timer task may be partway through our callback right now, so the
+  // timer's reference to its state is released on that task, after the timer
+  // has been deleted.
+  void* timer_state = pvTimerGetTimerID(ingest_timer_);
+  xTimerStop(ingest_timer_, portMAX_DELAY);
+  xTimerDelete(ingest_timer_, portMAX_DELAY);
+  xTimerPendFunctionCall(releaseIngestTimerState, timer_state, 0,
+                         portMAX_DELAY);
+
+  {
+    // Waits for any flush the timer has already queued to finish, and stops
+    // any that haven't started yet from touching us.
+    std::scoped_lock<std::mutex> lock{ingest_timer_state_->mutex};
+    ingest_timer_state_->db = nullptr;
+  }
+
+  {
+    std::scoped_lock<std::mutex> lock{indexes_mutex_};
+    ingest_.flush();
+  }
+
   // Delete db_ first so that any outstanding background work finishes before
   // the background task is killed.
   delete db_;
   delete cache_;
+  delete filter_policy_;
 
   sIsDbOpen.store(false);
 }
@@ -265,8 +359,7 @@ auto Database::getTrack(TrackId id) -> std::shared_ptr<Track> {
   if (!data || data->is_tombstoned) {
     return {};
   }
-  std::shared_ptr<TrackTags> tags = tag_parser_.ReadAndParseTags(
-      {data->filepath.data(), data->filepath.size()});
+  std::shared_ptr<TrackTags> tags = dbGetTrackTags(*data);
   if (!tags) {
     return {};
   }
@@ -291,6 +384,29 @@ auto Database::setTrackData(TrackId id, const TrackData& data) -> void {
   }
 }
 
+auto Database::getSeekIndex(TrackId id) -> std::shared_ptr<codecs::SeekIndex> {
+  auto data = dbGetTrackData(leveldb::ReadOptions(), id);
+  if (!data || data->is_tombstoned) {
+    return {};
+  }
+  std::string raw_val;
+  if (!db_->Get(leveldb::ReadOptions(), EncodeSeekIndexKey(id), &raw_val)
+           .ok()) {
+    return {};
+  }
+  return ParseSeekIndexValue(raw_val, *data);
+}
+
+auto Database::setSeekIndex(TrackId id, const codecs::SeekIndex& index)
+    -> void {
+  auto data = dbGetTrackData(leveldb::ReadOptions(), id);
+  if (!data || data->is_tombstoned) {
+    return;
+  }
+  db_->Put(leveldb::WriteOptions(), EncodeSeekIndexKey(id),
+           EncodeSeekIndexValue(*data, index));
+}
+
 auto Database::getIndexes() -> std::vector<IndexInfo> {
   // TODO(jacqueline): This probably needs to be async? When we have runtime
   // configurable indexes, they will need to come from somewhere.
@@ -301,7 +417,8 @@ auto Database::getIndexes() -> std::vector<IndexInfo> {
 Database::UpdateTracker::UpdateTracker()
     : num_old_tracks_(0),
       num_new_tracks_(0),
-      start_time_(esp_timer_get_time()) {
+      start_time_(esp_timer_get_time()),
+      scan_stats_() {
   events::Ui().Dispatch(event::UpdateStarted{});
   events::System().Dispatch(event::UpdateStarted{});
 }
@@ -325,6 +442,20 @@ Database::UpdateTracker::~UpdateTracker() {
       num_old_tracks_, num_new_tracks_, (end_time - start_time_) / 1000000,
       time_per_old / 1000, time_per_new / 1000);
 
+  for (size_t i = 0; i < TrackFinder::kNumStages; i++) {
+    const auto& stats = scan_stats_[i];
+    uint32_t files = stats.processed + stats.dropped;
+    uint64_t per_second = 0;
+    if (stats.busy_us > 0) {
+      per_second = files * 1000000ull / stats.busy_us;
+    }
+    ESP_LOGI(kTag,
+             "scan stage '%s': %lu files (%lu dropped), %llu files/s whilst "
+             "busy, max queue depth %lu",
+             TrackFinder::stageName(static_cast<TrackFinder::Stage>(i)), files,
+             stats.dropped, per_second, stats.max_queue_depth);
+  }
+
   events::Ui().Dispatch(event::UpdateFinished{});
   events::System().Dispatch(event::UpdateFinished{});
 }
@@ -344,25 +475,48 @@ auto Database::UpdateTracker::onTrackAdded() -> void {
   num_new_tracks_++;
 }
 
+auto Database::UpdateTracker::onScanProgress(const TrackFinder::Stats& stats)
+    -> void {
+  scan_stats_ = stats;
+  events::Ui().Dispatch(event::UpdateProgress{
+      .stage = event::UpdateProgress::Stage::kScanningForNewTracks,
+      .val = stats[static_cast<size_t>(TrackFinder::Stage::kEnumerate)]
+                 .processed,
+  });
+}
+
 auto Database::updateIndexes() -> void {
   if (is_updating_.exchange(true)) {
     return;
   }
+  update_cancelled_ = false;
   update_tracker_ = std::make_unique<UpdateTracker>();
 
   tag_parser_.ClearCaches();
 
+  // Stage 0: work out which directories have changed since the previous
+  // update. Tracks in unchanged directories can't have changed either, so
+  // there's no need to look at each one individually.
+  ESP_LOGI(kTag, "checking for changed directories");
+  manifest_ = ManifestDiff::Compute(*db_, "");
+
   leveldb::ReadOptions read_options;
   read_options.fill_cache = false;
   read_options.verify_checksums = true;
 
-  // Stage 1: verify all existing tracks are still valid.
+  // Stage 1: verify all existing tracks are still valid. Each track that may
+  // have changed is verified on the worker pool, so that reading one track's
+  // tags overlaps with reindexing another.
   ESP_LOGI(kTag, "verifying existing tracks");
   {
+    std::deque<std::future<void>> in_flight;
     std::unique_ptr<leveldb::Iterator> it{db_->NewIterator(read_options)};
     std::string prefix = EncodeDataPrefix();
     for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
          it->Next()) {
+      if (update_cancelled_) {
+        break;
+      }
       update_tracker_->onTrackVerified();
 
       std::shared_ptr<TrackData> track = ParseDataValue(it->value());
@@ -377,147 +531,340 @@ auto Database::updateIndexes() -> void {
         continue;
       }
 
-      std::shared_ptr<TrackTags> tags;
-      FILINFO info;
-      FRESULT res = f_stat(track->filepath.c_str(), &info);
-      if (res == FR_OK) {
-        std::pair<uint16_t, uint16_t> modified_at{info.fdate, info.ftime};
-        if (modified_at == track->modified_at) {
-          continue;
-        } else {
-          // Will be written out later; we make sure we update the track's
-          // modification time and tags in the same batch so that interrupted
-          // reindexes don't cause a big mess.
-          track->modified_at = modified_at;
-        }
-
-        tags = tag_parser_.ReadAndParseTags(
-            {track->filepath.data(), track->filepath.size()});
+      if (manifest_->isUnchanged(DirectoryOf(track->filepath))) {
+        continue;
       }
 
-      if (!tags || tags->encoding() == Container::kUnsupported) {
-        // We couldn't read the tags for this track. Either they were
-        // malformed, or perhaps the file is missing. Either way, tombstone
-        // this record.
-        ESP_LOGI(kTag, "entombing missing #%lx", track->id);
-
-        // Remove the indexes first, so that interrupted operations don't leave
-        // dangling index records.
-        dbRemoveIndexes(track);
+      if (in_flight.size() >= kVerifyParallelism) {
+        in_flight.front().get();
+        in_flight.pop_front();
+      }
+      in_flight.push_back(bg_worker_.Dispatch<void>(
+          [this, track]() { verifyTrack(track); }));
+    }
 
-        // Do the rest of the tombstoning as one atomic write.
-        leveldb::WriteBatch batch;
-        track->is_tombstoned = true;
-        batch.Put(EncodeDataKey(track->id), EncodeDataValue(*track));
-        batch.Delete(EncodePathKey(track->filepath));
+    while (!in_flight.empty()) {
+      in_flight.front().get();
+      in_flight.pop_front();
+    }
+  }
 
-        db_->Write(leveldb::WriteOptions(), &batch);
-        continue;
-      }
+  update_tracker_->onVerificationFinished();
 
-      // At this point, we know that the track still exists in its original
-      // location. All that's left to do is update any metadata about it.
+  if (update_cancelled_) {
+    indexingCompleteCallback();
+    return;
+  }
 
-      // Remove the old index records first so has to avoid dangling records.
-      dbRemoveIndexes(track);
+  // Stage 2: search for newly added files within any changed directories.
+  ESP_LOGI(kTag, "scanning for new tracks");
+  track_finder_.launch(manifest_->changed());
 
-      // Atomically correct the hash + create the new index records.
-      leveldb::WriteBatch batch;
+  // Catch any cancellation that arrived whilst the scan was starting up.
+  if (update_cancelled_) {
+    track_finder_.cancel();
+  }
+};
 
-      uint64_t new_hash = tags->Hash();
-      if (track->tags_hash != new_hash) {
-        track->tags_hash = new_hash;
-        batch.Put(EncodeHashKey(new_hash), EncodeHashValue(track->id));
-      }
+auto Database::cancelUpdate() -> void {
+  if (!is_updating_) {
+    return;
+  }
+  ESP_LOGI(kTag, "cancelling update");
+  update_cancelled_ = true;
+  track_finder_.cancel();
+}
 
-      track->type = calculateMediaType(*tags, track->filepath);
-      batch.Put(EncodeDataKey(track->id), EncodeDataValue(*track));
+auto Database::verifyTrack(std::shared_ptr<TrackData> track) -> void {
+  if (update_cancelled_) {
+    return;
+  }
 
-      dbIngestTagHashes(*tags, track->individual_tag_hashes, batch);
-      dbCreateIndexesForTrack(*track, *tags, batch);
-      db_->Write(leveldb::WriteOptions(), &batch);
+  std::shared_ptr<TrackTags> tags;
+  std::pair<uint16_t, uint16_t> modified_at;
+  FILINFO info;
+  FRESULT res = f_stat(track->filepath.c_str(), &info);
+  if (res == FR_OK) {
+    modified_at = {info.fdate, info.ftime};
+    if (modified_at == track->modified_at) {
+      return;
     }
+    tags = tag_parser_.ReadAndParseTags(
+        {track->filepath.data(), track->filepath.size()});
   }
 
-  update_tracker_->onVerificationFinished();
+  // Work out which index records this track currently has, before anything
+  // about it is changed.
+  // This has to come from the tag hashes that were written alongside those
+  // records, rather than the stored copy of the tags, which may have been
+  // refreshed from the file since.
+  std::vector<std::pair<IndexKey, std::string>> old_records;
+  if (auto old_tags = dbRecoverTagsFromHashes(track->individual_tag_hashes)) {
+    old_records = dbGetIndexRecords(*track, *old_tags);
+  }
 
-  // Stage 2: search for newly added files.
-  ESP_LOGI(kTag, "scanning for new tracks");
-  track_finder_.launch("");
-};
+  if (!tags || tags->encoding() == Container::kUnsupported) {
+    // We couldn't read the tags for this track. Either they were
+    // malformed, or perhaps the file is missing. Either way, tombstone
+    // this record.
+    ESP_LOGI(kTag, "entombing missing #%lx", track->id);
+
+    // Remove the indexes and do the rest of the tombstoning as one atomic
+    // write, so that interrupted operations don't leave dangling index
+    // records.
+    std::scoped_lock<std::mutex> lock{indexes_mutex_};
+    leveldb::WriteBatch batch;
+    IndexWriter writer{*db_, batch};
+    writer.remove(old_records);
+
+    track->is_tombstoned = true;
+    batch.Put(EncodeDataKey(track->id), EncodeDataValue(*track));
+    batch.Delete(EncodePathKey(track->filepath));
+
+    writer.flush();
+    db_->Write(leveldb::WriteOptions(), &batch);
+    cursors_->invalidate();
+    return;
+  }
+
+  // At this point, we know that the track still exists in its original
+  // location. All that's left to do is update any metadata about it. We make
+  // sure we update the track's modification time and tags in the same batch
+  // so that interrupted reindexes don't cause a big mess.
+  uint64_t new_hash = tags->Hash();
+  bool hash_changed = track->tags_hash != new_hash;
+  track->modified_at = modified_at;
+  track->tags_hash = new_hash;
+  track->type = calculateMediaType(*tags, track->filepath);
+
+  // Collating each tag is fairly expensive, so work out the new index records
+  // before taking the lock.
+  auto new_records = dbGetIndexRecords(*track, *tags);
+
+  // Atomically correct the hash, and replace the old index records with the
+  // new ones.
+  std::scoped_lock<std::mutex> lock{indexes_mutex_};
+  leveldb::WriteBatch batch;
+  IndexWriter writer{*db_, batch};
+  writer.update(old_records, new_records);
+
+  if (hash_changed) {
+    batch.Put(EncodeHashKey(new_hash), EncodeHashValue(track->id));
+  }
+
+  track->individual_tag_hashes.clear();
+  dbIngestTagHashes(*tags, track->individual_tag_hashes, batch);
+  batch.Put(EncodeDataKey(track->id), EncodeDataValue(*track));
+  batch.Put(EncodeTagsKey(track->id), EncodeTagsValue(*track, *tags));
+
+  writer.flush();
+  db_->Write(leveldb::WriteOptions(), &batch);
+  cursors_->invalidate();
+}
+
+auto Database::scanReadHeader(Candidate& c) -> bool {
+  if (!HasSupportedExtension(c.path)) {
+    return false;
+  }
 
-auto Database::processCandidateCallback(FILINFO& info,
-                                        std::string_view path) -> void {
   leveldb::ReadOptions read_options;
   read_options.fill_cache = true;
   read_options.verify_checksums = false;
 
   std::string unused;
-  if (db_->Get(read_options, EncodePathKey(path), &unused).ok()) {
+  if (db_->Get(read_options, EncodePathKey(c.path), &unused).ok()) {
     // This file is already in the database; skip it.
-    return;
+    return false;
   }
 
-  std::shared_ptr<TrackTags> tags = tag_parser_.ReadAndParseTags(path);
-  if (!tags || tags->encoding() == Container::kUnsupported) {
-    // No parseable tags; skip this fiile.
-    return;
+  FIL file;
+  if (f_open(&file, c.path.c_str(), FA_READ) != FR_OK) {
+    return false;
+  }
+  c.header.resize(std::min<uint64_t>(kScanHeaderSize, c.info.fsize));
+  UINT bytes_read = 0;
+  FRESULT res = f_read(&file, c.header.data(), c.header.size(), &bytes_read);
+  f_close(&file);
+  if (res != FR_OK) {
+    return false;
   }
+  c.header.resize(bytes_read);
+  return true;
+}
 
-  // Check for any existing track with the same hash.
-  uint64_t hash = tags->Hash();
-  std::optional<TrackId> existing_id;
-  std::string raw_entry;
-  if (db_->Get(read_options, EncodeHashKey(hash), &raw_entry).ok()) {
-    existing_id = ParseHashValue(raw_entry);
+auto Database::scanParseTags(Candidate& c) -> bool {
+  c.tags = tag_parser_.ParseTags(c.path, c.info.fsize, c.header);
+
+  // Don't hold onto the header whilst waiting for the later stages.
+  c.header.clear();
+  c.header.shrink_to_fit();
+
+  if (!c.tags || c.tags->encoding() == Container::kUnsupported) {
+    // No parseable tags; skip this fiile.
+    return false;
   }
+  return true;
+}
+
+auto Database::scanIndex(Candidate& c) -> bool {
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = true;
+  read_options.verify_checksums = false;
+
+  TrackTags& tags = *c.tags;
+  std::string_view path = c.path;
+  uint64_t hash = tags.Hash();
 
   std::shared_ptr<TrackData> data;
-  if (existing_id) {
-    // Do we have any existing data for this track? This could be the case if
-    // this is a tombstoned entry. In such as case, we want to reuse the
-    // previous TrackData so that any extra metadata is preserved.
-    data = dbGetTrackData(read_options, *existing_id);
-    if (!data) {
-      data = std::make_shared<TrackData>();
-      data->id = *existing_id;
-    } else if (data->filepath != path && !data->is_tombstoned) {
+  {
+    // Deduping must see a consistent view of the db, the ingest batch, and of
+    // any other new tracks that are still making their way to the batch.
+    std::scoped_lock<std::mutex> lock{indexes_mutex_};
+
+    if (ingest_.pendingPath(path)) {
+      return false;
+    }
+    if (ingest_.pendingHash(hash) || scan_hashes_.contains(hash)) {
+      // Another file with identical tags was found earlier in this scan. This
+      // is the same situation as a hash collision with a track already in the
+      // db.
       ESP_LOGW(kTag, "hash collision: %s, %s, %s",
-               tags->title().value_or("no title").c_str(),
-               tags->artist().value_or("no artist").c_str(),
-               tags->album().value_or("no album").c_str());
-      // Don't commit anything if there's a hash collision, since we're
-      // likely to make a big mess.
-      return;
+               tags.title().value_or("no title").c_str(),
+               tags.artist().value_or("no artist").c_str(),
+               tags.album().value_or("no album").c_str());
+      return false;
     }
-  } else {
-    update_tracker_->onTrackAdded();
-    data = std::make_shared<TrackData>();
-    data->id = dbMintNewTrackId();
+
+    // Check for any existing track with the same hash.
+    std::optional<TrackId> existing_id;
+    std::string raw_entry;
+    if (db_->Get(read_options, EncodeHashKey(hash), &raw_entry).ok()) {
+      existing_id = ParseHashValue(raw_entry);
+    }
+
+    if (existing_id) {
+      // Do we have any existing data for this track? This could be the case if
+      // this is a tombstoned entry. In such as case, we want to reuse the
+      // previous TrackData so that any extra metadata is preserved.
+      data = dbGetTrackData(read_options, *existing_id);
+      if (!data) {
+        data = std::make_shared<TrackData>();
+        data->id = *existing_id;
+      } else if (data->filepath != path && !data->is_tombstoned) {
+        ESP_LOGW(kTag, "hash collision: %s, %s, %s",
+                 tags.title().value_or("no title").c_str(),
+                 tags.artist().value_or("no artist").c_str(),
+                 tags.album().value_or("no album").c_str());
+        // Don't commit anything if there's a hash collision, since we're
+        // likely to make a big mess.
+        return false;
+      }
+    } else {
+      update_tracker_->onTrackAdded();
+      data = std::make_shared<TrackData>();
+      data->id = dbMintNewTrackId();
+    }
+
+    scan_hashes_.insert(hash);
   }
 
   // Make sure the file-based metadata on the TrackData is up to date.
   data->filepath = path;
   data->tags_hash = hash;
-  data->modified_at = {info.fdate, info.ftime};
+  data->modified_at = {c.info.fdate, c.info.ftime};
   data->is_tombstoned = false;
-  data->type = calculateMediaType(*tags, path);
+  data->type = calculateMediaType(tags, path);
 
-  // Apply all the actual database changes as one atomic batch. This makes
-  // the whole 'new track' operation atomic, and also reduces the amount of
-  // lock contention when adding many tracks at once.
-  leveldb::WriteBatch batch;
-  dbIngestTagHashes(*tags, data->individual_tag_hashes, batch);
+  // Work out the index records now, outside of the lock, since collating each
+  // tag can be fairly expensive.
+  c.index_records = dbGetIndexRecords(*data, tags);
 
-  dbCreateIndexesForTrack(*data, *tags, batch);
-  batch.Put(EncodeDataKey(data->id), EncodeDataValue(*data));
-  batch.Put(EncodeHashKey(data->tags_hash), EncodeHashValue(data->id));
-  batch.Put(EncodePathKey(path), TrackIdToBytes(data->id));
+  c.data = data;
+  return true;
+}
 
-  db_->Write(leveldb::WriteOptions(), &batch);
+auto Database::scanCommit(Candidate& c) -> void {
+  TrackData& data = *c.data;
+
+  // Add all the actual database changes to the ingest batch. Each track's
+  // records are committed atomically along with the rest of its group, and
+  // committing many tracks at once greatly reduces the number of writes (and
+  // the amount of lock contention) during a scan.
+  {
+    std::scoped_lock<std::mutex> lock{indexes_mutex_};
+    leveldb::WriteBatch& batch = ingest_.batch();
+    dbIngestTagHashes(*c.tags, data.individual_tag_hashes, batch);
+
+    ingest_.writer().add(c.index_records);
+    batch.Put(EncodeDataKey(data.id), EncodeDataValue(data));
+    batch.Put(EncodeTagsKey(data.id), EncodeTagsValue(data, *c.tags));
+    batch.Put(EncodeHashKey(data.tags_hash), EncodeHashValue(data.id));
+    batch.Put(EncodePathKey(data.filepath), TrackIdToBytes(data.id));
+    ingest_.trackAdded(data.filepath, data.tags_hash, data.id);
+    scan_hashes_.erase(data.tags_hash);
+
+    if (ingest_.size() == 1) {
+      // This track started a new batch. Make sure it's written in good time,
+      // even if it turns out to be the last new track for a while.
+      xTimerReset(ingest_timer_, 0);
+    }
+
+    if (ingest_.isFull()) {
+      ingest_.flush();
+      cursors_->invalidate();
+    }
+  }
+
+  update_tracker_->onScanProgress(track_finder_.stats());
+}
+
+auto Database::flushStaleIngest() -> void {
+  std::scoped_lock<std::mutex> lock{indexes_mutex_};
+  // Every new batch restarts the timer, so whatever is pending now is at
+  // least as old as the limit (give or take a tick). Don't re-check the age
+  // with isFull(), since tick rounding can leave it a hair short.
+  if (ingest_.size() > 0) {
+    ingest_.flush();
+    cursors_->invalidate();
+  }
+}
+
+auto Database::onIngestTimer(TimerHandle_t timer) -> void {
+  // Timer callbacks mustn't block, so do the write on the worker pool.
+  std::shared_ptr<IngestTimerState> state =
+      *reinterpret_cast<std::shared_ptr<IngestTimerState>*>(
+          pvTimerGetTimerID(timer));
+  state->pool.Dispatch<void>([=]() {
+    std::scoped_lock<std::mutex> lock{state->mutex};
+    if (state->db) {
+      state->db->flushStaleIngest();
+    }
+  });
+}
+
+auto Database::releaseIngestTimerState(void* state, uint32_t) -> void {
+  delete reinterpret_cast<std::shared_ptr<IngestTimerState>*>(state);
 }
 
 auto Database::indexingCompleteCallback() -> void {
+  {
+    std::scoped_lock<std::mutex> lock{indexes_mutex_};
+    if (ingest_.flush()) {
+      cursors_->invalidate();
+    }
+  }
+  update_tracker_->onScanProgress(track_finder_.stats());
+
+  // Everything that changed has now been indexed, so remember the current
+  // state of each directory for next time. Cancelled updates may have skipped
+  // some changes, so the next update must look at everything again.
+  if (update_cancelled_) {
+    ESP_LOGI(kTag, "update cancelled");
+  } else {
+    manifest_->commit(*db_);
+  }
+  manifest_.reset();
+
   update_tracker_.reset();
   is_updating_ = false;
 }
@@ -646,81 +993,43 @@ auto Database::dbGetTrackData(leveldb::ReadOptions options,
   return ParseDataValue(raw_val);
 }
 
-auto Database::dbCreateIndexesForTrack(const Track& track,
-                                       leveldb::WriteBatch& batch) -> void {
-  dbCreateIndexesForTrack(track.data(), track.tags(), batch);
-}
-
-auto Database::dbCreateIndexesForTrack(const TrackData& data,
-                                       const TrackTags& tags,
-                                       leveldb::WriteBatch& batch) -> void {
-  for (const IndexInfo& index : getIndexes()) {
-    auto entries = Index(collator_, index, data, tags);
-    for (const auto& it : entries) {
-      batch.Put(EncodeIndexKey(it.first), {it.second.data(), it.second.size()});
+auto Database::dbGetTrackTags(const TrackData& data)
+    -> std::shared_ptr<TrackTags> {
+  std::string raw_val;
+  if (db_->Get(leveldb::ReadOptions(), EncodeTagsKey(data.id), &raw_val)
+          .ok()) {
+    if (auto tags = ParseTagsValue(raw_val, data)) {
+      return tags;
     }
   }
-}
 
-auto Database::dbRemoveIndexes(std::shared_ptr<TrackData> data) -> void {
-  auto tags = dbRecoverTagsFromHashes(data->individual_tag_hashes);
-  if (!tags) {
-    return;
+  // The tags either haven't been stored yet (e.g. this track was indexed by an
+  // older version), or the file has changed since they were. Parse them from
+  // the file again.
+  FILINFO info;
+  bool unchanged = f_stat(data.filepath.c_str(), &info) == FR_OK &&
+                   std::make_pair(info.fdate, info.ftime) == data.modified_at;
+  std::shared_ptr<TrackTags> tags = tag_parser_.ReadAndParseTags(
+      {data.filepath.data(), data.filepath.size()});
+
+  // Only keep the result around for next time if the file is the same one we
+  // indexed. Otherwise these tags don't match the track's index records, and
+  // storing them would hide that from the next rescan.
+  if (unchanged && tags && tags->encoding() != Container::kUnsupported) {
+    db_->Put(leveldb::WriteOptions(), EncodeTagsKey(data.id),
+             EncodeTagsValue(data, *tags));
   }
-  for (const IndexInfo& index : getIndexes()) {
-    auto entries = Index(collator_, index, *data, *tags);
-    std::optional<uint8_t> preserve_depth{};
-
-    // Iterate through the index records backwards, so that we start deleting
-    // records from the highest depth. This allows us to work out what depth to
-    // stop at as we go.
-    // e.g. if the last track of an album is being deleted, we need to delete
-    // the album index record at n-1 depth. But if there are still other tracks
-    // in the album, then we should only clear records at depth n.
-    for (auto it = entries.rbegin(); it != entries.rend(); it++) {
-      if (preserve_depth) {
-        if (it->first.header.components_hash.size() < *preserve_depth) {
-          // Some records deeper than this were not removed, so don't try to
-          // remove this one.
-          continue;
-        }
-        // A record weren't removed, but the current record is either a
-        // sibling of that record, or a leaf belonging to a sibling of that
-        // record. Either way, we can start deleting records again.
-        // preserve_depth will be set to a new value if we start encountering
-        // siblings again.
-        preserve_depth.reset();
-      }
-
-      auto key = EncodeIndexKey(it->first);
-      auto status = db_->Delete(leveldb::WriteOptions{}, key);
-      if (!status.ok()) {
-        return;
-      }
-
-      // Are any sibling records left at this depth? If two index records have
-      // matching headers, they are siblings (same depth, same selections at
-      // lower depths)
-      std::unique_ptr<leveldb::Iterator> cursor{db_->NewIterator({})};
-
-      // Check the record before the one we just deleted.
-      cursor->Seek(key);
-      cursor->Prev();
-      auto prev_key = ParseIndexKey(cursor->key());
-      if (prev_key && prev_key->header == it->first.header) {
-        preserve_depth = it->first.header.components_hash.size();
-        continue;
-      }
+  return tags;
+}
 
-      // Check the record after.
-      cursor->Next();
-      auto next_key = ParseIndexKey(cursor->key());
-      if (next_key && next_key->header == it->first.header) {
-        preserve_depth = it->first.header.components_hash.size();
-        continue;
-      }
-    }
+auto Database::dbGetIndexRecords(const TrackData& data, const TrackTags& tags)
+    -> std::vector<std::pair<IndexKey, std::string>> {
+  std::vector<std::pair<IndexKey, std::string>> out;
+  for (const IndexInfo& index : getIndexes()) {
+    auto records = Index(collator_, index, data, tags);
+    std::move(records.begin(), records.end(), std::back_inserter(out));
   }
+  return out;
 }
 
 auto Database::dbIngestTagHashes(const TrackTags& tags,
@@ -763,29 +1072,11 @@ auto seekToOffset(leveldb::Iterator* it, int offset) {
   }
 }
 
-auto Database::getRecord(const SearchKey& c)
-    -> std::optional<std::pair<std::pmr::string, Record>> {
-  std::unique_ptr<leveldb::Iterator> it{
-      db_->NewIterator(leveldb::ReadOptions{})};
-
-  it->Seek(c.startKey());
-  seekToOffset(it.get(), c.offset);
-  if (!it->Valid() || !it->key().starts_with(std::string_view{c.prefix})) {
-    return {};
-  }
-
-  std::optional<IndexKey> key = ParseIndexKey(it->key());
-  if (!key) {
-    ESP_LOGW(kTag, "parsing index key failed");
-    return {};
-  }
-
-  return std::make_pair(std::pmr::string{it->key().data(), it->key().size(),
-                                         &memory::kSpiRamResource},
-                        Record{*key, it->value()});
+auto Database::countRecords(const IndexKey::Header& header) -> IndexCounts {
+  return GetIndexCounts(*db_, leveldb::ReadOptions{}, header);
 }
 
-auto Database::countRecords(const SearchKey& c) -> size_t {
+auto Database::countRemaining(const SearchKey& c) -> size_t {
   std::unique_ptr<leveldb::Iterator> it{
       db_->NewIterator(leveldb::ReadOptions{})};
 
@@ -804,6 +1095,14 @@ auto Database::countRecords(const SearchKey& c) -> size_t {
   return count;
 }
 
+auto Database::checkIndexCounts(bool repair) -> size_t {
+  std::scoped_lock<std::mutex> lock{indexes_mutex_};
+  if (ingest_.flush()) {
+    cursors_->invalidate();
+  }
+  return CheckIndexCounts(*db_, repair);
+}
+
 Handle::Handle(std::shared_ptr<Database>& db) : db_(db) {}
 
 auto Handle::lock() -> std::shared_ptr<Database> {
@@ -817,12 +1116,12 @@ auto SearchKey::startKey() const -> std::string_view {
   return prefix;
 }
 
-Record::Record(const IndexKey& key, const leveldb::Slice& t)
+Record::Record(const IndexKeyView& key, const leveldb::Slice& t)
     : text_(t.data(), t.size(), &memory::kSpiRamResource) {
   if (key.track) {
     contents_ = *key.track;
   } else {
-    contents_ = ExpandHeader(key.header, key.item);
+    contents_ = ExpandHeader(key.header(), key.item);
   }
 }
 
@@ -835,6 +1134,132 @@ auto Record::contents() const
   return contents_;
 }
 
+CursorRegistry::CursorRegistry(leveldb::DB& db) : db_(&db), cursors_() {}
+
+auto CursorRegistry::invalidate() -> void {
+  std::scoped_lock<std::mutex> lock{mutex_};
+  for (auto* cursor : cursors_) {
+    cursor->release();
+  }
+}
+
+auto CursorRegistry::close() -> void {
+  std::scoped_lock<std::mutex> lock{mutex_};
+  for (auto* cursor : cursors_) {
+    cursor->release();
+  }
+  db_ = nullptr;
+}
+
+Cursor::Cursor(std::shared_ptr<CursorRegistry> registry, size_t batch_size)
+    : registry_(registry),
+      batch_size_(std::max<size_t>(batch_size, 1)),
+      snapshot_(nullptr),
+      it_(),
+      batch_(&memory::kSpiRamResource) {
+  std::scoped_lock<std::mutex> lock{registry_->mutex_};
+  registry_->cursors_.insert(this);
+}
+
+Cursor::~Cursor() {
+  std::scoped_lock<std::mutex> lock{registry_->mutex_};
+  release();
+  registry_->cursors_.erase(this);
+}
+
+auto Cursor::get(const SearchKey& key)
+    -> std::optional<std::pair<std::pmr::string, Record>> {
+  std::scoped_lock<std::mutex> lock{registry_->mutex_};
+  if (!registry_->db_) {
+    return {};
+  }
+
+  // Serve directly from the current batch if we can.
+  if (key.key && !batch_.empty()) {
+    std::string_view start = *key.key;
+    auto it = std::lower_bound(
+        batch_.begin(), batch_.end(), start,
+        [](const auto& entry, std::string_view k) { return entry.first < k; });
+    if (it != batch_.end() && it->first == start) {
+      auto pos = std::distance(batch_.begin(), it) + key.offset;
+      if (pos >= 0 && static_cast<size_t>(pos) < batch_.size()) {
+        return batch_[pos];
+      }
+    }
+  }
+
+  return fill(*registry_->db_, key);
+}
+
+auto Cursor::fill(leveldb::DB& db, const SearchKey& key)
+    -> std::optional<std::pair<std::pmr::string, Record>> {
+  batch_.clear();
+
+  if (!it_) {
+    snapshot_ = db.GetSnapshot();
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot_;
+    it_.reset(db.NewIterator(options));
+  }
+
+  // The iterator is left parked on the edge of the previous batch, so moving
+  // on to the next batch in either direction doesn't need a fresh seek.
+  leveldb::Slice start{key.startKey().data(), key.startKey().size()};
+  if (!it_->Valid() || it_->key() != start) {
+    it_->Seek(start);
+  }
+  seekToOffset(it_.get(), key.offset);
+
+  bool forwards = key.offset >= 0;
+  std::string_view prefix = key.prefix;
+  while (batch_.size() < batch_size_ && it_->Valid() &&
+         it_->key().starts_with(prefix)) {
+    // Parse in place; the key is only copied once, into the batch.
+    std::optional<IndexKeyView> parsed =
+        ParseIndexKeyView({it_->key().data(), it_->key().size()});
+    if (!parsed) {
+      ESP_LOGW(kTag, "parsing index key failed");
+      break;
+    }
+    batch_.emplace_back(std::pmr::string{it_->key().data(), it_->key().size(),
+                                         &memory::kSpiRamResource},
+                        Record{*parsed, it_->value()});
+    if (forwards) {
+      it_->Next();
+    } else {
+      it_->Prev();
+    }
+  }
+
+  if (batch_.empty()) {
+    return {};
+  }
+
+  // Step back onto the last record we buffered.
+  if (it_->Valid()) {
+    if (forwards) {
+      it_->Prev();
+    } else {
+      it_->Next();
+    }
+  }
+
+  if (forwards) {
+    return batch_.front();
+  }
+  std::reverse(batch_.begin(), batch_.end());
+  return batch_.back();
+}
+
+auto Cursor::release() -> void {
+  batch_.clear();
+  it_.reset();
+  if (snapshot_) {
+    registry_->db_->ReleaseSnapshot(snapshot_);
+    snapshot_ = nullptr;
+  }
+}
+
 Iterator::Iterator(std::shared_ptr<Database> db, IndexId idx)
     : Iterator(db,
                IndexKey::Header{
@@ -843,7 +1268,7 @@ Iterator::Iterator(std::shared_ptr<Database> db, IndexId idx)
                }) {}
 
 Iterator::Iterator(std::shared_ptr<Database> db, const IndexKey::Header& header)
-    : db_(db), key_{}, current_() {
+    : db_(db), header_(header), key_{}, current_(), cursor_() {
   std::string prefix = EncodeIndexPrefix(header);
   key_ = {
       .prefix = {prefix.data(), prefix.size(), &memory::kSpiRamResource},
@@ -878,7 +1303,10 @@ auto Iterator::iterate(const SearchKey& key) -> void {
     ESP_LOGW(kTag, "iterate with dead db");
     return;
   }
-  auto res = db->getRecord(key);
+  if (!cursor_) {
+    cursor_ = std::make_shared<Cursor>(db->cursors_, Cursor::kDefaultBatchSize);
+  }
+  auto res = cursor_->get(key);
   if (res) {
     key_ = {
         .prefix = key_.prefix,
@@ -898,15 +1326,36 @@ auto Iterator::count() const -> size_t {
     ESP_LOGW(kTag, "count with dead db");
     return 0;
   }
-  return db->countRecords(key_);
+  if (!key_.key) {
+    // Iteration hasn't started yet, so every record is still to come.
+    return db->countRecords(header_).children;
+  }
+  return db->countRemaining(key_);
+}
+
+auto Iterator::total() const -> size_t {
+  auto db = db_.lock();
+  if (!db) {
+    ESP_LOGW(kTag, "count with dead db");
+    return 0;
+  }
+  return db->countRecords(header_).children;
 }
 
-TrackIterator::TrackIterator(const Iterator& it) : db_(it.db_), levels_() {
+TrackIterator::TrackIterator(const Iterator& it)
+    : db_(it.db_),
+      root_(it.header_),
+      from_start_(!it.key_.key),
+      passed_(0),
+      levels_() {
   levels_.push_back(it);
   next();
 }
 
 auto TrackIterator::next() -> void {
+  if (value()) {
+    passed_++;
+  }
   while (!levels_.empty()) {
     levels_.back().next();
 
@@ -945,6 +1394,15 @@ auto TrackIterator::value() const -> std::optional<TrackId> {
 }
 
 auto TrackIterator::count() const -> size_t {
+  if (from_start_) {
+    // Tracks are visited in order, so every track that we haven't yet moved
+    // past is still to come.
+    size_t total = this->total();
+    return total > passed_ ? total - passed_ : 0;
+  }
+
+  // We were created partway through root_, so its total includes tracks that
+  // we never visited. Count what's left of each level instead.
   size_t size = 0;
   TrackIterator copy{*this};
   while (!copy.levels_.empty()) {
@@ -955,4 +1413,13 @@ auto TrackIterator::count() const -> size_t {
   return size;
 }
 
+auto TrackIterator::total() const -> size_t {
+  auto db = db_.lock();
+  if (!db) {
+    ESP_LOGW(kTag, "count with dead db");
+    return 0;
+  }
+  return db->countRecords(root_).tracks;
+}
+
 }  // namespace database
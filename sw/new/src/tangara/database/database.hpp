@@ -11,23 +11,32 @@
 #include <cstdint>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <stack>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include "codec.hpp"
 #include "collation.hpp"
 #include "cppbor.h"
+#include "database/dir_manifest.hpp"
 #include "database/index.hpp"
+#include "database/ingest_batch.hpp"
+#include "database/index_counts.hpp"
 #include "database/records.hpp"
 #include "database/tag_parser.hpp"
 #include "database/track.hpp"
 #include "database/track_finder.hpp"
 #include "ff.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
 #include "leveldb/cache.h"
 #include "leveldb/db.h"
+#include "leveldb/filter_policy.h"
 #include "leveldb/iterator.h"
 #include "leveldb/options.h"
 #include "leveldb/slice.h"
@@ -38,11 +47,37 @@
 
 namespace database {
 
-const uint8_t kCurrentDbVersion = 10;
+const uint8_t kCurrentDbVersion = 12;
+
+/*
+ * Tuning for the leveldb instance backing the database. leveldb records the
+ * table settings within each table as it is written, so changing them doesn't
+ * require a schema version bump; older tables are rewritten with the new
+ * settings as they are compacted.
+ */
+struct DbTuning {
+  // Size in bytes of the in-memory cache of uncompressed table blocks.
+  size_t block_cache_size = 256 * 1024;
+
+  // Approximate size of each block within a table. Point lookups read a whole
+  // block from the SD card, so this is kept small.
+  size_t block_size = 4 * 1024;
+
+  // Number of keys between restart points within a block. Keys within the
+  // same index share long prefixes, so fewer restarts pack more records into
+  // each block.
+  int block_restart_interval = 32;
+
+  // Bits per key of the bloom filter stored within each table, which lets
+  // lookups of missing keys skip reading data blocks altogether. Zero disables
+  // the filter.
+  int bloom_filter_bits_per_key = 10;
+};
 
 struct SearchKey;
 class Record;
 class Iterator;
+class CursorRegistry;
 
 /*
  * Handle to an open database. This can be used to store large amounts of
@@ -60,7 +95,8 @@ class Database {
   };
   static auto Open(ITagParser& tag_parser,
                    locale::ICollator& collator,
-                   tasks::WorkerPool& bg_worker)
+                   tasks::WorkerPool& bg_worker,
+                   const DbTuning& tuning = {})
       -> cpp::result<Database*, DatabaseError>;
 
   static auto Destroy() -> void;
@@ -83,25 +119,52 @@ class Database {
 
   auto setTrackData(TrackId id, const TrackData& data) -> void;
 
+  /*
+   * Returns the SeekIndex stored for the given track, provided the track's
+   * file hasn't changed since the index was built.
+   */
+  auto getSeekIndex(TrackId id) -> std::shared_ptr<codecs::SeekIndex>;
+  auto setSeekIndex(TrackId id, const codecs::SeekIndex&) -> void;
+
   auto getIndexes() -> std::vector<IndexInfo>;
   auto updateIndexes() -> void;
   auto isUpdating() -> bool;
 
+  /*
+   * Stops any in-progress index update as soon as possible. Tracks that were
+   * already verified or added stay as they are; the next update picks up from
+   * wherever this one stopped.
+   */
+  auto cancelUpdate() -> void;
+
+  /*
+   * Verifies that the maintained count of records beneath every index header
+   * matches the index records actually present, optionally correcting any
+   * counts that don't. Returns the number of incorrect counts found.
+   */
+  auto checkIndexCounts(bool repair) -> size_t;
+
   // Cannot be copied or moved.
   Database(const Database&) = delete;
   Database& operator=(const Database&) = delete;
 
  private:
   friend class Iterator;
+  friend class TrackIterator;
 
   // Owned. Dumb pointers because destruction needs to be done in an explicit
   // order.
   leveldb::DB* db_;
   leveldb::Cache* cache_;
+  const leveldb::FilterPolicy* filter_policy_;
+
+  // Shared with any outstanding Iterators, which may outlive us.
+  std::shared_ptr<CursorRegistry> cursors_;
 
   TrackFinder track_finder_;
 
   // Not owned.
+  tasks::WorkerPool& bg_worker_;
   ITagParser& tag_parser_;
   locale::ICollator& collator_;
 
@@ -114,27 +177,68 @@ class Database {
     auto onTrackVerified() -> void;
     auto onVerificationFinished() -> void;
     auto onTrackAdded() -> void;
+    auto onScanProgress(const TrackFinder::Stats&) -> void;
 
    private:
     uint32_t num_old_tracks_;
     uint32_t num_new_tracks_;
     uint64_t start_time_;
     uint64_t verification_finish_time_;
+    TrackFinder::Stats scan_stats_;
   };
 
   std::atomic<bool> is_updating_;
+  std::atomic<bool> update_cancelled_;
   std::unique_ptr<UpdateTracker> update_tracker_;
+  // Which directories have changed since the previous update. Only present
+  // whilst an update is in progress.
+  std::unique_ptr<ManifestDiff> manifest_;
 
   std::atomic<TrackId> next_track_id_;
 
+  // Held whilst any index records are being modified. This must be held from
+  // the creation of an IndexWriter until its batch is written, so that
+  // concurrent writers don't clobber each other's index counts.
+  std::mutex indexes_mutex_;
+
+  // Newly discovered tracks that haven't yet been committed. Guarded by
+  // indexes_mutex_. Only written to whilst scanning for new files, which never
+  // overlaps with the verification of existing tracks.
+  IngestBatch ingest_;
+
+  // Shared with the ingest timer, so that a flush it has already queued on the
+  // worker pool can tell whether the database still exists once it runs. `db`
+  // is cleared by our destructor, with `mutex` held.
+  struct IngestTimerState {
+    tasks::WorkerPool& pool;
+    std::mutex mutex;
+    Database* db;
+  };
+  std::shared_ptr<IngestTimerState> ingest_timer_state_;
+  // Fires once the oldest track in the ingest batch has waited long enough to
+  // be flushed, even if no more tracks are committed in the meantime.
+  TimerHandle_t ingest_timer_;
+
+  // Hashes of new tracks that have been assigned an id, but haven't yet been
+  // added to the ingest batch. Guarded by indexes_mutex_.
+  std::set<uint64_t> scan_hashes_;
+
   Database(leveldb::DB* db,
            leveldb::Cache* cache,
+           const leveldb::FilterPolicy* filter_policy,
            tasks::WorkerPool& pool,
            ITagParser& tag_parser,
            locale::ICollator& collator);
 
-  auto processCandidateCallback(FILINFO&, std::string_view) -> void;
+  auto scanReadHeader(Candidate&) -> bool;
+  auto scanParseTags(Candidate&) -> bool;
+  auto scanIndex(Candidate&) -> bool;
+  auto scanCommit(Candidate&) -> void;
+  auto flushStaleIngest() -> void;
+  static auto onIngestTimer(TimerHandle_t) -> void;
+  static auto releaseIngestTimerState(void*, uint32_t) -> void;
   auto indexingCompleteCallback() -> void;
+  auto verifyTrack(std::shared_ptr<TrackData>) -> void;
   auto calculateMediaType(TrackTags&, std::string_view) -> MediaType;
 
   auto dbCalculateNextTrackId() -> void;
@@ -142,13 +246,10 @@ class Database {
 
   auto dbGetTrackData(leveldb::ReadOptions, TrackId id)
       -> std::shared_ptr<TrackData>;
+  auto dbGetTrackTags(const TrackData&) -> std::shared_ptr<TrackTags>;
 
-  auto dbCreateIndexesForTrack(const Track&, leveldb::WriteBatch&) -> void;
-  auto dbCreateIndexesForTrack(const TrackData&,
-                               const TrackTags&,
-                               leveldb::WriteBatch&) -> void;
-
-  auto dbRemoveIndexes(std::shared_ptr<TrackData>) -> void;
+  auto dbGetIndexRecords(const TrackData&, const TrackTags&)
+      -> std::vector<std::pair<IndexKey, std::string>>;
 
   auto dbIngestTagHashes(const TrackTags&,
                          std::pmr::unordered_map<Tag, uint64_t>&,
@@ -156,9 +257,8 @@ class Database {
   auto dbRecoverTagsFromHashes(const std::pmr::unordered_map<Tag, uint64_t>&)
       -> std::shared_ptr<TrackTags>;
 
-  auto getRecord(const SearchKey& c)
-      -> std::optional<std::pair<std::pmr::string, Record>>;
-  auto countRecords(const SearchKey& c) -> size_t;
+  auto countRecords(const IndexKey::Header&) -> IndexCounts;
+  auto countRemaining(const SearchKey&) -> size_t;
 };
 
 class Handle {
@@ -192,7 +292,7 @@ struct SearchKey {
  */
 class Record {
  public:
-  Record(const IndexKey&, const leveldb::Slice&);
+  Record(const IndexKeyView&, const leveldb::Slice&);
 
   Record(const Record&) = default;
   Record& operator=(const Record& other) = default;
@@ -205,6 +305,81 @@ class Record {
   std::variant<TrackId, IndexKey::Header> contents_;
 };
 
+class Cursor;
+
+/*
+ * Bookkeeping for every Cursor that is currently open against a database.
+ * Cursors hold live leveldb state, which must all be released before the db
+ * itself is closed. Since cursors may outlive the Database that created them,
+ * the registry is reference counted and shared between the two.
+ */
+class CursorRegistry {
+ public:
+  CursorRegistry(leveldb::DB&);
+
+  /*
+   * Releases the snapshots and buffered records of every open cursor, so that
+   * they observe any writes made since they were last used.
+   */
+  auto invalidate() -> void;
+
+  /* Releases every open cursor, and disallows creating new ones. */
+  auto close() -> void;
+
+  CursorRegistry(const CursorRegistry&) = delete;
+  CursorRegistry& operator=(const CursorRegistry&) = delete;
+
+ private:
+  friend class Cursor;
+
+  std::mutex mutex_;
+  leveldb::DB* db_;
+  std::set<Cursor*> cursors_;
+};
+
+/*
+ * A live position within one of the database's indexes. Cursors keep a leveldb
+ * iterator pinned to a snapshot, and decode records from it in batches, so
+ * that stepping through an index touches leveldb once per batch rather than
+ * once per record. The iterator is only re-seeked if the cursor is invalidated
+ * by a write, or if it's asked for a record outside of its current batch.
+ *
+ * Cursors are safe to share between tasks.
+ */
+class Cursor {
+ public:
+  static constexpr size_t kDefaultBatchSize = 16;
+
+  Cursor(std::shared_ptr<CursorRegistry>, size_t batch_size);
+  ~Cursor();
+
+  /*
+   * Returns the record that `key` refers to, along with the full leveldb key
+   * of that record.
+   */
+  auto get(const SearchKey& key)
+      -> std::optional<std::pair<std::pmr::string, Record>>;
+
+  Cursor(const Cursor&) = delete;
+  Cursor& operator=(const Cursor&) = delete;
+
+ private:
+  friend class CursorRegistry;
+
+  auto fill(leveldb::DB&, const SearchKey&)
+      -> std::optional<std::pair<std::pmr::string, Record>>;
+  auto release() -> void;
+
+  std::shared_ptr<CursorRegistry> registry_;
+  const size_t batch_size_;
+
+  const leveldb::Snapshot* snapshot_;
+  std::unique_ptr<leveldb::Iterator> it_;
+
+  // Contiguous run of records, in ascending key order.
+  std::pmr::vector<std::pair<std::pmr::string, Record>> batch_;
+};
+
 /*
  * Utility for accessing a large set of database records, one record at a time.
  */
@@ -241,16 +416,32 @@ class Iterator {
     return val;
   }
 
+  /*
+   * Returns the number of records from this iterator's current position to the
+   * end of its level of the index, including the current record.
+   */
   auto count() const -> size_t;
 
+  /*
+   * Returns the total number of records at this iterator's level of the index,
+   * regardless of its current position. Unlike count(), this never needs to
+   * walk the index.
+   */
+  auto total() const -> size_t;
+
  private:
   auto iterate(const SearchKey& key) -> void;
 
   friend class TrackIterator;
 
   std::weak_ptr<Database> db_;
+  IndexKey::Header header_;
   SearchKey key_;
   std::optional<Record> current_;
+
+  // Created lazily, on the first call to iterate(). Shared between copies of
+  // this iterator.
+  std::shared_ptr<Cursor> cursor_;
 };
 
 class TrackIterator {
@@ -275,13 +466,29 @@ class TrackIterator {
     return val;
   }
 
+  /*
+   * Returns the number of tracks from this iterator's current position to the
+   * end, including the current track.
+   */
   auto count() const -> size_t;
 
+  /*
+   * Returns the total number of tracks beneath the header this iterator was
+   * created from, regardless of its current position.
+   */
+  auto total() const -> size_t;
+
  private:
   TrackIterator(std::weak_ptr<Database>);
   auto next(bool advance) -> void;
 
   std::weak_ptr<Database> db_;
+  IndexKey::Header root_;
+  // Whether the iterator we were created from hadn't yet started, so that
+  // root_'s total is exactly the tracks we will visit.
+  bool from_start_;
+  // How many tracks this iterator has moved past.
+  size_t passed_;
   std::vector<Iterator> levels_;
 };
 
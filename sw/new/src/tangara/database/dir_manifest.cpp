@@ -0,0 +1,151 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/dir_manifest.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "esp_log.h"
+#include "ff.h"
+#include "komihash.h"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+
+#include "database/records.hpp"
+#include "memory_resource.hpp"
+
+namespace database {
+
+[[maybe_unused]] static const char* kTag = "manifest";
+
+/*
+ * Reads every entry directly within the given directory, adding any
+ * subdirectories to `to_explore`. Hidden and system entries are skipped in the
+ * same way as in CandidateIterator.
+ */
+static auto summarise(const std::pmr::string& dir,
+                      std::pmr::deque<std::pmr::string>& to_explore)
+    -> std::optional<DirectorySummary> {
+  FF_DIR handle;
+  if (f_opendir(&handle, dir.c_str()) != FR_OK) {
+    return {};
+  }
+
+  DirectorySummary summary{.num_entries = 0, .digest = 0};
+  FILINFO info;
+  while (f_readdir(&handle, &info) == FR_OK && info.fname[0] != 0) {
+    if (info.fattrib & (AM_HID | AM_SYS) || info.fname[0] == '.') {
+      continue;
+    }
+
+    uint64_t stamp[] = {
+        static_cast<uint64_t>(info.fsize),
+        static_cast<uint64_t>(info.fdate) << 16 | info.ftime,
+        info.fattrib,
+    };
+    summary.digest =
+        komihash(info.fname, std::strlen(info.fname), summary.digest);
+    summary.digest = komihash(stamp, sizeof(stamp), summary.digest);
+    summary.num_entries++;
+
+    if (info.fattrib & AM_DIR) {
+      std::pmr::string child{&memory::kSpiRamResource};
+      child += dir;
+      child += "/";
+      child += info.fname;
+      to_explore.push_back(std::move(child));
+    }
+  }
+  f_closedir(&handle);
+
+  return summary;
+}
+
+ManifestDiff::ManifestDiff()
+    : changed_(&memory::kSpiRamResource),
+      unchanged_(&memory::kSpiRamResource),
+      vanished_(&memory::kSpiRamResource) {}
+
+auto ManifestDiff::Compute(leveldb::DB& db, std::string_view root)
+    -> std::unique_ptr<ManifestDiff> {
+  std::unique_ptr<ManifestDiff> diff{new ManifestDiff()};
+
+  // Start by assuming that every directory has changed.
+  std::pmr::deque<std::pmr::string> to_explore{&memory::kSpiRamResource};
+  to_explore.emplace_back(root);
+  while (!to_explore.empty()) {
+    std::pmr::string dir = std::move(to_explore.front());
+    to_explore.pop_front();
+    if (auto summary = summarise(dir, to_explore)) {
+      diff->changed_.emplace(std::move(dir), *summary);
+    }
+  }
+
+  // Now compare against what was stored last time.
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  std::unique_ptr<leveldb::Iterator> it{db.NewIterator(options)};
+  std::string prefix = EncodeAllManifestsPrefix();
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    std::string_view dir = ParseManifestKey(it->key());
+    auto current = diff->changed_.find(dir);
+    if (current == diff->changed_.end()) {
+      diff->vanished_.emplace_back(dir);
+      continue;
+    }
+    auto previous = ParseManifestValue(it->value());
+    if (previous && *previous == current->second) {
+      diff->unchanged_.insert(current->first);
+      diff->changed_.erase(current);
+    }
+  }
+
+  ESP_LOGI(kTag, "%u directories unchanged, %u changed, %u removed",
+           diff->unchanged_.size(), diff->changed_.size(),
+           diff->vanished_.size());
+  return diff;
+}
+
+auto ManifestDiff::isUnchanged(std::string_view dir) const -> bool {
+  return unchanged_.find(dir) != unchanged_.end();
+}
+
+auto ManifestDiff::changed() const -> std::pmr::vector<std::pmr::string> {
+  std::pmr::vector<std::pmr::string> out{&memory::kSpiRamResource};
+  for (const auto& [dir, summary] : changed_) {
+    out.push_back(dir);
+  }
+  return out;
+}
+
+auto ManifestDiff::commit(leveldb::DB& db) -> void {
+  leveldb::WriteBatch batch;
+  for (const auto& [dir, summary] : changed_) {
+    batch.Put(EncodeManifestKey(dir), EncodeManifestValue(summary));
+  }
+  for (const auto& dir : vanished_) {
+    batch.Delete(EncodeManifestKey(dir));
+  }
+  db.Write(leveldb::WriteOptions{}, &batch);
+}
+
+auto DirectoryOf(std::string_view path) -> std::string_view {
+  auto slash = path.find_last_of('/');
+  if (slash == std::string_view::npos) {
+    return {};
+  }
+  return path.substr(0, slash);
+}
+
+}  // namespace database
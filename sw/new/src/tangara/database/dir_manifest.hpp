@@ -0,0 +1,83 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "leveldb/db.h"
+
+#include "memory_resource.hpp"
+
+namespace database {
+
+/*
+ * Summary of the entries directly within a directory, used to tell whether the
+ * directory has changed since the library was last scanned.
+ */
+struct DirectorySummary {
+  uint32_t num_entries;
+  // Hash of the name, size, attributes, and modification time of every entry.
+  uint64_t digest;
+
+  bool operator==(const DirectorySummary&) const = default;
+};
+
+/*
+ * The differences between the directories currently on the SD card, and the
+ * summaries of them that were stored in the database by the previous scan.
+ *
+ * FAT doesn't reliably update a directory's own modification time when its
+ * contents change, so every directory must still be read in order to
+ * summarise it. This is one sequential read per directory, however, rather
+ * than a lookup per track.
+ */
+class ManifestDiff {
+ public:
+  /* Summarises every directory beneath `root`, and compares them to the db. */
+  static auto Compute(leveldb::DB&, std::string_view root)
+      -> std::unique_ptr<ManifestDiff>;
+
+  /*
+   * Returns whether the entries directly within the given directory are all
+   * the same as they were during the previous scan.
+   */
+  auto isUnchanged(std::string_view dir) const -> bool;
+
+  /* Returns every directory that is new, or whose entries have changed. */
+  auto changed() const -> std::pmr::vector<std::pmr::string>;
+
+  /*
+   * Stores the summaries of every changed directory, and removes those of any
+   * directories that no longer exist. This should only be called once every
+   * change has been indexed.
+   */
+  auto commit(leveldb::DB&) -> void;
+
+  ManifestDiff(const ManifestDiff&) = delete;
+  ManifestDiff& operator=(const ManifestDiff&) = delete;
+
+ private:
+  ManifestDiff();
+
+  std::pmr::map<std::pmr::string, DirectorySummary, std::less<>> changed_;
+  std::pmr::set<std::pmr::string, std::less<>> unchanged_;
+  std::pmr::vector<std::pmr::string> vanished_;
+};
+
+/*
+ * Returns the directory containing the given file, in the same form as paths
+ * produced by CandidateIterator.
+ */
+auto DirectoryOf(std::string_view path) -> std::string_view;
+
+}  // namespace database
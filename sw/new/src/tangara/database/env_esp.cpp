@@ -6,6 +6,7 @@
 
 #include "database/env_esp.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <cstddef>
@@ -130,50 +131,163 @@ class EspSequentialFile final : public SequentialFile {
   const std::string filename_;
 };
 
-// Implements random read access in a file using pread().
+// The number of files that leveldb keeps open outside of its table cache. See
+// `TableCacheSize` in db_impl.cc.
+static constexpr int kNumNonTableCacheFiles = 10;
+
+FileHandleCache::FileHandleCache(size_t capacity) : capacity_(capacity) {}
+
+FileHandleCache::~FileHandleCache() {
+  for (Handle* handle : idle_) {
+    Close(handle);
+  }
+}
+
+void FileHandleCache::SetCapacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock{mu_};
+  capacity_ = capacity;
+  while (idle_.size() > capacity_) {
+    Close(idle_.back());
+    idle_.pop_back();
+  }
+}
+
+FileHandleCache::Handle* FileHandleCache::Acquire(const std::string& filename,
+                                                  FRESULT* err) {
+  {
+    std::lock_guard<std::mutex> lock{mu_};
+    for (auto it = idle_.begin(); it != idle_.end(); it++) {
+      if ((*it)->filename == filename) {
+        Handle* handle = *it;
+        idle_.erase(it);
+        in_use_.insert(handle);
+        return handle;
+      }
+    }
+  }
+
+  // Nothing cached. Open a new handle without holding the lock, since this
+  // involves disk i/o.
+  Handle* handle = new Handle{
+      .filename = filename,
+      .file = {},
+      .is_stale = false,
+  };
+  FRESULT res = f_open(&handle->file, filename.c_str(), FA_READ);
+  if (res != FR_OK) {
+    delete handle;
+    *err = res;
+    return nullptr;
+  }
+
+#if CONFIG_FATFS_USE_FASTSEEK
+  // Table files are never modified once written, so we can build a map of
+  // their cluster chain once, and then seek anywhere in them without reading
+  // the FAT.
+  handle->cluster_map[0] = handle->cluster_map.size();
+  handle->file.cltbl = handle->cluster_map.data();
+  if (f_lseek(&handle->file, CREATE_LINKMAP) != FR_OK) {
+    // The file is too fragmented for our map. Fall back to regular seeks.
+    handle->file.cltbl = nullptr;
+  }
+#endif
+
+  std::lock_guard<std::mutex> lock{mu_};
+  in_use_.insert(handle);
+  return handle;
+}
+
+void FileHandleCache::Release(Handle* handle) {
+  std::lock_guard<std::mutex> lock{mu_};
+  in_use_.erase(handle);
+  if (handle->is_stale || capacity_ == 0) {
+    Close(handle);
+    return;
+  }
+  idle_.push_front(handle);
+  while (idle_.size() > capacity_) {
+    Close(idle_.back());
+    idle_.pop_back();
+  }
+}
+
+void FileHandleCache::Discard(Handle* handle) {
+  std::lock_guard<std::mutex> lock{mu_};
+  in_use_.erase(handle);
+  Close(handle);
+}
+
+void FileHandleCache::Evict(const std::string& filename) {
+  std::lock_guard<std::mutex> lock{mu_};
+  for (auto it = idle_.begin(); it != idle_.end();) {
+    if ((*it)->filename == filename) {
+      Close(*it);
+      it = idle_.erase(it);
+    } else {
+      it++;
+    }
+  }
+  for (Handle* handle : in_use_) {
+    if (handle->filename == filename) {
+      handle->is_stale = true;
+    }
+  }
+}
+
+void FileHandleCache::Close(Handle* handle) {
+  f_close(&handle->file);
+  delete handle;
+}
+
+// Implements random read access in a file using handles from a shared
+// FileHandleCache.
 //
 // Instances of this class are thread-safe, as required by the RandomAccessFile
-// API. Instances are immutable and Read() only calls thread-safe library
-// functions.
+// API. Each Read() uses its own exclusively held file handle.
 class EspRandomAccessFile final : public RandomAccessFile {
  public:
-  // The new instance takes ownership of |fd|. |fd_limiter| must outlive this
-  // instance, and will be used to determine if .
-  explicit EspRandomAccessFile(const std::string& filename)
-      : filename_(std::move(filename)) {}
+  // |handles| must outlive this instance.
+  EspRandomAccessFile(const std::string& filename, FileHandleCache& handles)
+      : filename_(std::move(filename)), handles_(handles) {}
 
-  ~EspRandomAccessFile() override {}
+  // leveldb only destroys a RandomAccessFile once it is evicted from its table
+  // cache, so there's no point keeping its handles around afterwards.
+  ~EspRandomAccessFile() override { handles_.Evict(filename_); }
 
   Status Read(uint64_t offset,
               size_t n,
               Slice* result,
               char* scratch) const override {
-    FIL file;
-    FRESULT res = f_open(&file, filename_.c_str(), FA_READ);
-    if (res != FR_OK) {
+    FRESULT res = FR_OK;
+    FileHandleCache::Handle* handle = handles_.Acquire(filename_, &res);
+    if (handle == nullptr) {
       return EspError(filename_, res);
     }
 
-    res = f_lseek(&file, offset);
+    res = f_lseek(&handle->file, offset);
     if (res != FR_OK) {
+      handles_.Discard(handle);
       return EspError(filename_, res);
     }
 
-    Status status;
     UINT read_size = 0;
-    res = f_read(&file, scratch, n, &read_size);
-    if (res != FR_OK || read_size == 0) {
+    res = f_read(&handle->file, scratch, n, &read_size);
+    if (res != FR_OK) {
+      handles_.Discard(handle);
       return EspError(filename_, res);
     }
-    *result = Slice(scratch, read_size);
+    handles_.Release(handle);
 
-    f_close(&file);
-
-    return status;
+    if (read_size == 0) {
+      return EspError(filename_, res);
+    }
+    *result = Slice(scratch, read_size);
+    return Status::OK();
   }
 
  private:
   const std::string filename_;
+  FileHandleCache& handles_;
 };
 
 // TODO(jacqueline): LevelDB expects writes to this class to be buffered in
@@ -301,7 +415,7 @@ Status EspEnv::NewRandomAccessFile(const std::string& filename,
     return EspError(filename, res);
   }
 
-  *result = new EspRandomAccessFile(filename);
+  *result = new EspRandomAccessFile(filename, handles_);
   return Status::OK();
 }
 
@@ -367,6 +481,7 @@ Status EspEnv::GetChildren(const std::string& directory_path,
 }
 
 Status EspEnv::RemoveFile(const std::string& filename) {
+  handles_.Evict(filename);
   FRESULT res = f_unlink(filename.c_str());
   if (res != FR_OK) {
     return EspError(filename, res);
@@ -405,6 +520,7 @@ Status EspEnv::RenameFile(const std::string& from, const std::string& to) {
       return s;
     }
   }
+  handles_.Evict(from);
   FRESULT res = f_rename(from.c_str(), to.c_str());
   if (res != FR_OK) {
     return EspError(from, res);
@@ -464,7 +580,12 @@ void EspEnv::SleepForMicroseconds(int micros) {
   vTaskDelay(pdMS_TO_TICKS(micros / 1000));
 }
 
-EspEnv::EspEnv() {}
+EspEnv::EspEnv() : handles_(0) {}
+
+void EspEnv::SetMaxOpenFiles(int max_open_files) {
+  handles_.SetCapacity(
+      std::max(max_open_files - kNumNonTableCacheFiles, 1));
+}
 
 void EspEnv::Schedule(
     void (*background_work_function)(void* background_work_arg),
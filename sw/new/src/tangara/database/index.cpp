@@ -23,6 +23,7 @@
 
 #include "database/records.hpp"
 #include "database/track.hpp"
+#include "memory_resource.hpp"
 
 namespace database {
 
@@ -236,11 +237,27 @@ auto Index(locale::ICollator& collator,
 }
 
 auto ExpandHeader(const IndexKey::Header& header,
-                  const std::pmr::string& component) -> IndexKey::Header {
+                  std::string_view component) -> IndexKey::Header {
   IndexKey::Header ret{header};
   ret.components_hash.push_back(
       komihash(component.data(), component.size(), 0));
   return ret;
 }
 
+auto IndexKeyView::header() const -> IndexKey::Header {
+  return {
+      .id = id,
+      .components_hash = {components_hash.begin(),
+                          components_hash.begin() + depth},
+  };
+}
+
+auto IndexKeyView::toKey() const -> IndexKey {
+  return {
+      .header = header(),
+      .item = {item.data(), item.size(), &memory::kSpiRamResource},
+      .track = track,
+  };
+}
+
 }  // namespace database
@@ -8,8 +8,11 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -57,13 +60,52 @@ struct IndexKey {
   std::optional<TrackId> track;
 };
 
+/*
+ * Non-owning view of an encoded IndexKey. Decoding a key into a view doesn't
+ * allocate; the item refers directly to the bytes of the encoded key, and so
+ * the view must not outlive them.
+ */
+struct IndexKeyView {
+  // The deepest header that a view can represent. This is comfortably more
+  // than the number of components in any index.
+  static constexpr size_t kMaxDepth = 8;
+
+  IndexId id;
+  size_t depth;
+  std::array<uint64_t, kMaxDepth> components_hash;
+
+  std::string_view item;
+  std::optional<TrackId> track;
+
+  /* Copies out the header of this key. */
+  auto header() const -> IndexKey::Header;
+
+  /* Copies this key into an owning IndexKey. */
+  auto toKey() const -> IndexKey;
+};
+
+/*
+ * Aggregate counts of the index records beneath a single header. These are
+ * maintained alongside the index records themselves, so that the size of any
+ * level of an index can be found without walking it.
+ */
+struct IndexCounts {
+  // The number of records, both branches and leaves, directly beneath the
+  // header.
+  uint32_t children;
+  // The number of leaf records at any depth beneath the header.
+  uint32_t tracks;
+
+  bool operator==(const IndexCounts&) const = default;
+};
+
 auto Index(locale::ICollator&,
            const IndexInfo&,
            const TrackData&,
            const TrackTags&) -> std::vector<std::pair<IndexKey, std::string>>;
 
 auto ExpandHeader(const IndexKey::Header&,
-                  const std::pmr::string&) -> IndexKey::Header;
+                  std::string_view component) -> IndexKey::Header;
 
 // Predefined indexes
 // TODO(jacqueline): Make these defined at runtime! :)
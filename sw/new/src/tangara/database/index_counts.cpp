@@ -0,0 +1,281 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/index_counts.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "esp_log.h"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+
+#include "database/index.hpp"
+#include "database/records.hpp"
+#include "memory_resource.hpp"
+
+namespace database {
+
+[[maybe_unused]] static const char* kTag = "counts";
+
+/*
+ * Invokes the callback for the given header, and for every header above it in
+ * the same index.
+ */
+static auto forEachAncestor(
+    const IndexKey::Header& header,
+    std::function<void(const IndexKey::Header&)> cb) -> void {
+  IndexKey::Header ancestor{header};
+  for (;;) {
+    std::invoke(cb, ancestor);
+    if (ancestor.components_hash.empty()) {
+      break;
+    }
+    ancestor.components_hash.pop_back();
+  }
+}
+
+static auto decrement(uint32_t& val) -> void {
+  if (val == 0) {
+    ESP_LOGW(kTag, "index count underflow");
+    return;
+  }
+  val--;
+}
+
+IndexWriter::IndexWriter(leveldb::DB& db, leveldb::WriteBatch& batch)
+    : db_(db), batch_(batch), counts_(&memory::kSpiRamResource) {}
+
+auto IndexWriter::add(
+    const std::vector<std::pair<IndexKey, std::string>>& entries) -> void {
+  // A track may produce the same record more than once (e.g. if it has
+  // duplicate genre tags), so be careful to only count each record once.
+  std::set<std::string> seen;
+
+  // Handle branches first, since we can use the counts of the next level down
+  // to tell whether the branch already exists.
+  for (const auto& [key, value] : entries) {
+    if (key.track) {
+      continue;
+    }
+    std::string encoded = EncodeIndexKey(key);
+    if (!seen.insert(encoded).second) {
+      continue;
+    }
+    if (counts(ExpandHeader(key.header, key.item)).tracks == 0) {
+      counts(key.header).children++;
+    }
+    batch_.Put(encoded, value);
+  }
+
+  for (const auto& [key, value] : entries) {
+    if (!key.track) {
+      continue;
+    }
+    std::string encoded = EncodeIndexKey(key);
+    if (!seen.insert(encoded).second) {
+      continue;
+    }
+    counts(key.header).children++;
+    forEachAncestor(key.header,
+                    [&](const auto& header) { counts(header).tracks++; });
+    batch_.Put(encoded, value);
+  }
+}
+
+auto IndexWriter::remove(
+    const std::vector<std::pair<IndexKey, std::string>>& entries) -> void {
+  std::set<std::string> seen;
+
+  for (const auto& [key, value] : entries) {
+    if (!key.track) {
+      continue;
+    }
+    std::string encoded = EncodeIndexKey(key);
+    if (!seen.insert(encoded).second) {
+      continue;
+    }
+    decrement(counts(key.header).children);
+    forEachAncestor(key.header, [&](const auto& header) {
+      decrement(counts(header).tracks);
+    });
+    batch_.Delete(encoded);
+  }
+
+  // Index records are ordered such that each branch comes before the records
+  // beneath it. Go backwards so that we see the deepest branches first, since
+  // removing them may leave their parents empty.
+  for (auto it = entries.rbegin(); it != entries.rend(); it++) {
+    const IndexKey& key = it->first;
+    if (key.track) {
+      continue;
+    }
+    std::string encoded = EncodeIndexKey(key);
+    if (!seen.insert(encoded).second) {
+      continue;
+    }
+    if (counts(ExpandHeader(key.header, key.item)).tracks > 0) {
+      // Other tracks still live beneath this branch.
+      continue;
+    }
+    decrement(counts(key.header).children);
+    batch_.Delete(encoded);
+  }
+}
+
+auto IndexWriter::update(
+    const std::vector<std::pair<IndexKey, std::string>>& before,
+    const std::vector<std::pair<IndexKey, std::string>>& after) -> void {
+  // Every key is encoded exactly once, into a scratch arena that is released
+  // in one go once we're done comparing.
+  std::pmr::monotonic_buffer_resource arena{&memory::kSpiRamResource};
+  std::pmr::vector<std::string_view> before_keys{&arena};
+  std::pmr::map<std::string_view, const std::string*> old_values{&arena};
+  for (const auto& [key, value] : before) {
+    auto encoded = EncodeIndexKey(key, arena);
+    before_keys.push_back(encoded);
+    old_values.emplace(encoded, &value);
+  }
+  std::pmr::vector<std::string_view> after_keys{&arena};
+  std::pmr::set<std::string_view> new_keys{&arena};
+  for (const auto& [key, value] : after) {
+    auto encoded = EncodeIndexKey(key, arena);
+    after_keys.push_back(encoded);
+    new_keys.insert(encoded);
+  }
+
+  // Filter each set of records whilst preserving their order, since remove()
+  // relies on branches coming before the records beneath them.
+  std::vector<std::pair<IndexKey, std::string>> removed;
+  for (size_t i = 0; i < before.size(); i++) {
+    if (!new_keys.contains(before_keys[i])) {
+      removed.push_back(before[i]);
+    }
+  }
+  std::vector<std::pair<IndexKey, std::string>> added;
+  for (size_t i = 0; i < after.size(); i++) {
+    auto old = old_values.find(after_keys[i]);
+    if (old == old_values.end()) {
+      added.push_back(after[i]);
+    } else if (*old->second != after[i].second) {
+      // Same position within the index, but e.g. with different casing. This
+      // doesn't affect any counts.
+      leveldb::Slice encoded{after_keys[i].data(), after_keys[i].size()};
+      batch_.Put(encoded, after[i].second);
+    }
+  }
+
+  remove(removed);
+  add(added);
+}
+
+auto IndexWriter::flush() -> void {
+  for (const auto& [key, entry] : counts_) {
+    if (entry.current == entry.original) {
+      continue;
+    }
+    if (entry.current.children == 0 && entry.current.tracks == 0) {
+      batch_.Delete(key);
+    } else {
+      batch_.Put(key, EncodeCountValue(entry.current));
+    }
+  }
+  counts_.clear();
+}
+
+auto IndexWriter::counts(const IndexKey::Header& header) -> IndexCounts& {
+  std::string key = EncodeCountKey(header);
+  auto it = counts_.find(key);
+  if (it == counts_.end()) {
+    IndexCounts existing = GetIndexCounts(db_, leveldb::ReadOptions{}, header);
+    it = counts_
+             .emplace(key, Entry{
+                               .original = existing,
+                               .current = existing,
+                           })
+             .first;
+  }
+  return it->second.current;
+}
+
+auto GetIndexCounts(leveldb::DB& db,
+                    const leveldb::ReadOptions& options,
+                    const IndexKey::Header& header) -> IndexCounts {
+  std::string raw;
+  if (!db.Get(options, EncodeCountKey(header), &raw).ok()) {
+    return {};
+  }
+  return ParseCountValue(raw).value_or(IndexCounts{});
+}
+
+auto CheckIndexCounts(leveldb::DB& db, bool repair) -> size_t {
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  std::unique_ptr<leveldb::Iterator> it{db.NewIterator(options)};
+
+  // Work out what every count *should* be.
+  std::pmr::map<std::string, IndexCounts> expected{&memory::kSpiRamResource};
+  std::string index_prefix = EncodeAllIndexesPrefix();
+  for (it->Seek(index_prefix);
+       it->Valid() && it->key().starts_with(index_prefix); it->Next()) {
+    auto key = ParseIndexKey(it->key());
+    if (!key) {
+      continue;
+    }
+    expected[EncodeCountKey(key->header)].children++;
+    if (key->track) {
+      forEachAncestor(key->header, [&](const auto& header) {
+        expected[EncodeCountKey(header)].tracks++;
+      });
+    }
+  }
+
+  // Compare against what is actually stored.
+  size_t mismatches = 0;
+  leveldb::WriteBatch fixes;
+  std::string count_prefix = EncodeAllCountsPrefix();
+  for (it->Seek(count_prefix);
+       it->Valid() && it->key().starts_with(count_prefix); it->Next()) {
+    auto stored = ParseCountValue(it->value());
+    auto match = expected.find(it->key().ToString());
+    if (match == expected.end()) {
+      // Counts for a header that no longer has any records.
+      mismatches++;
+      fixes.Delete(it->key());
+      continue;
+    }
+    if (!stored || *stored != match->second) {
+      mismatches++;
+      fixes.Put(it->key(), EncodeCountValue(match->second));
+    }
+    expected.erase(match);
+  }
+
+  // Anything left over is a header that has records, but no counts.
+  for (const auto& [key, counts] : expected) {
+    mismatches++;
+    fixes.Put(key, EncodeCountValue(counts));
+  }
+
+  if (mismatches > 0) {
+    ESP_LOGW(kTag, "found %u incorrect index counts", mismatches);
+    if (repair) {
+      db.Write(leveldb::WriteOptions{}, &fixes);
+    }
+  }
+
+  return mismatches;
+}
+
+}  // namespace database
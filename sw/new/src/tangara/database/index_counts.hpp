@@ -0,0 +1,97 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "leveldb/db.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+
+#include "database/index.hpp"
+#include "memory_resource.hpp"
+
+namespace database {
+
+/*
+ * Adds and removes index records within a WriteBatch, whilst keeping the
+ * IndexCounts of every header they belong to up to date within the same batch.
+ *
+ * Each count record is read at most once per writer. Counts are read from the
+ * db rather than the batch, so callers must ensure that no other writes to the
+ * same indexes are committed between creating a writer and writing its batch.
+ */
+class IndexWriter {
+ public:
+  IndexWriter(leveldb::DB&, leveldb::WriteBatch&);
+
+  /*
+   * Adds the given index records, as returned by `Index`, to the batch. Branch
+   * records that already exist are overwritten without being counted twice,
+   * but leaf records must not already exist.
+   */
+  auto add(const std::vector<std::pair<IndexKey, std::string>>&) -> void;
+
+  /*
+   * Removes the given index records, as returned by `Index`, from the batch.
+   * Branch records are only removed once there are no leaves left beneath
+   * them.
+   */
+  auto remove(const std::vector<std::pair<IndexKey, std::string>>&) -> void;
+
+  /*
+   * Replaces the index records previously added for a track with a new set of
+   * records. Only records that appear in one set but not the other are added
+   * or removed, so retagging a track only touches the parts of each index
+   * that actually changed.
+   */
+  auto update(const std::vector<std::pair<IndexKey, std::string>>& before,
+              const std::vector<std::pair<IndexKey, std::string>>& after)
+      -> void;
+
+  /*
+   * Adds every count record modified by this writer to the batch. This must be
+   * called before the batch is written.
+   */
+  auto flush() -> void;
+
+  IndexWriter(const IndexWriter&) = delete;
+  IndexWriter& operator=(const IndexWriter&) = delete;
+
+ private:
+  auto counts(const IndexKey::Header&) -> IndexCounts&;
+
+  leveldb::DB& db_;
+  leveldb::WriteBatch& batch_;
+
+  struct Entry {
+    IndexCounts original;
+    IndexCounts current;
+  };
+  std::pmr::map<std::string, Entry> counts_;
+};
+
+/* Returns the counts for the given header, or zeroes if it has no records. */
+auto GetIndexCounts(leveldb::DB&,
+                    const leveldb::ReadOptions&,
+                    const IndexKey::Header&) -> IndexCounts;
+
+/*
+ * Walks every index record in the database and compares what it finds against
+ * the stored IndexCounts. If `repair` is set, any incorrect counts are
+ * rewritten. Returns the number of incorrect counts that were found.
+ *
+ * This is expensive, and callers must ensure the indexes are not being written
+ * to whilst it runs.
+ */
+auto CheckIndexCounts(leveldb::DB&, bool repair) -> size_t;
+
+}  // namespace database
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/ingest_batch.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include "database/index_counts.hpp"
+#include "database/track.hpp"
+#include "memory_resource.hpp"
+
+namespace database {
+
+[[maybe_unused]] static const char* kTag = "ingest";
+
+IngestBatch::IngestBatch(leveldb::DB& db, const Limits& limits)
+    : db_(db),
+      limits_(limits),
+      batch_(),
+      writer_(db, batch_),
+      paths_(&memory::kSpiRamResource),
+      hashes_(&memory::kSpiRamResource),
+      oldest_track_at_(0) {}
+
+auto IngestBatch::pendingPath(std::string_view path) -> std::optional<TrackId> {
+  auto it = paths_.find(path);
+  if (it == paths_.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+auto IngestBatch::pendingHash(uint64_t hash) -> std::optional<TrackId> {
+  auto it = hashes_.find(hash);
+  if (it == hashes_.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+auto IngestBatch::trackAdded(std::string_view path,
+                             uint64_t hash,
+                             TrackId id) -> void {
+  if (paths_.empty()) {
+    oldest_track_at_ = esp_timer_get_time();
+  }
+  paths_.emplace(std::pmr::string{path.data(), path.size()}, id);
+  hashes_[hash] = id;
+}
+
+auto IngestBatch::isFull() -> bool {
+  if (paths_.empty()) {
+    return false;
+  }
+  return batch_.ApproximateSize() >= limits_.max_bytes ||
+         esp_timer_get_time() - oldest_track_at_ >= limits_.max_age_us;
+}
+
+auto IngestBatch::flush() -> bool {
+  if (paths_.empty()) {
+    return false;
+  }
+
+  writer_.flush();
+  auto status = db_.Write(leveldb::WriteOptions{}, &batch_);
+  if (!status.ok()) {
+    ESP_LOGE(kTag, "failed to write %u tracks: %s", paths_.size(),
+             status.ToString().c_str());
+  }
+
+  batch_.Clear();
+  paths_.clear();
+  hashes_.clear();
+  return true;
+}
+
+}  // namespace database
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include "database/index_counts.hpp"
+#include "database/track.hpp"
+#include "memory_resource.hpp"
+
+namespace database {
+
+/*
+ * Accumulates the records for many newly discovered tracks into a single
+ * WriteBatch, so that a library scan commits them in large groups rather than
+ * with one write per file.
+ *
+ * Records in the batch aren't visible to reads of the db until the batch is
+ * flushed, so the batch also keeps track of the paths and hashes of every
+ * track within it, so that callers can dedupe new tracks against them.
+ *
+ * As with IndexWriter, callers must ensure that no other writes to the
+ * indexes are committed whilst the batch has anything in it.
+ */
+class IngestBatch {
+ public:
+  struct Limits {
+    // The batch is full once its records take up at least this many bytes.
+    size_t max_bytes;
+    // The batch is full once its oldest track has been waiting this long.
+    uint64_t max_age_us;
+  };
+
+  IngestBatch(leveldb::DB&, const Limits&);
+
+  auto batch() -> leveldb::WriteBatch& { return batch_; }
+  auto writer() -> IndexWriter& { return writer_; }
+
+  /* Returns the id of the track in this batch with the given path, if any. */
+  auto pendingPath(std::string_view) -> std::optional<TrackId>;
+
+  /* Returns the id of the track in this batch with the given hash, if any. */
+  auto pendingHash(uint64_t) -> std::optional<TrackId>;
+
+  /*
+   * Notes that the records for the given track have been added to the batch.
+   */
+  auto trackAdded(std::string_view path, uint64_t hash, TrackId) -> void;
+
+  /* Returns the number of tracks waiting in the batch. */
+  auto size() -> size_t { return paths_.size(); }
+
+  /* Returns whether the batch has reached either of its limits. */
+  auto isFull() -> bool;
+
+  /*
+   * Writes everything in the batch to the db. Returns true if anything was
+   * written.
+   */
+  auto flush() -> bool;
+
+  IngestBatch(const IngestBatch&) = delete;
+  IngestBatch& operator=(const IngestBatch&) = delete;
+
+ private:
+  leveldb::DB& db_;
+  const Limits limits_;
+
+  leveldb::WriteBatch batch_;
+  IndexWriter writer_;
+
+  std::pmr::map<std::pmr::string, TrackId, std::less<>> paths_;
+  std::pmr::map<uint64_t, TrackId> hashes_;
+  uint64_t oldest_track_at_;
+};
+
+}  // namespace database
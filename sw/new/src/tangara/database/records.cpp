@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <sys/_stdint.h>
 
+#include <algorithm>
 #include <functional>
 #include <iomanip>
 #include <iostream>
@@ -18,10 +19,12 @@
 #include <vector>
 
 #include "cppbor.h"
+#include "codec.hpp"
 #include "cppbor_parse.h"
 #include "debug.hpp"
 #include "esp_log.h"
 
+#include "database/dir_manifest.hpp"
 #include "database/index.hpp"
 #include "database/track.hpp"
 #include "komihash.h"
@@ -53,6 +56,10 @@ static const char kDataPrefix = 'D';
 static const char kHashPrefix = 'H';
 static const char kTagHashPrefix = 'T';
 static const char kIndexPrefix = 'I';
+static const char kCountPrefix = 'C';
+static const char kManifestPrefix = 'M';
+static const char kTagsPrefix = 'G';
+static const char kSeekIndexPrefix = 'S';
 static const char kFieldSeparator = '\0';
 
 static constexpr auto makePrefix(char p) -> std::string {
@@ -178,18 +185,144 @@ auto EncodeAllIndexesPrefix() -> std::string {
   return makePrefix(kIndexPrefix);
 }
 
-auto EncodeIndexPrefix(const IndexKey::Header& header) -> std::string {
-  std::ostringstream out;
-  out << makePrefix(kIndexPrefix);
+// Index keys are read and written far more often than any other kind of
+// record, so rather than going through cppbor, their headers and trailers are
+// encoded by hand. The few parts of cbor that they use are simple: unsigned
+// integers, and the headers of arrays. Both are always encoded in their
+// shortest form, exactly as cppbor does.
+static constexpr uint8_t kCborUint = 0 << 5;
+static constexpr uint8_t kCborArray = 4 << 5;
+
+static constexpr auto cborHeaderSize(uint64_t val) -> size_t {
+  if (val < 24) {
+    return 1;
+  } else if (val <= 0xff) {
+    return 2;
+  } else if (val <= 0xffff) {
+    return 3;
+  } else if (val <= 0xffffffff) {
+    return 5;
+  }
+  return 9;
+}
 
-  cppbor::Array components{};
+static auto writeCborHeader(uint8_t major, uint64_t val, char* out) -> char* {
+  size_t size = cborHeaderSize(val);
+  switch (size) {
+    case 1:
+      *out++ = static_cast<char>(major | val);
+      return out;
+    case 2:
+      *out++ = static_cast<char>(major | 24);
+      break;
+    case 3:
+      *out++ = static_cast<char>(major | 25);
+      break;
+    case 5:
+      *out++ = static_cast<char>(major | 26);
+      break;
+    default:
+      *out++ = static_cast<char>(major | 27);
+      break;
+  }
+  for (size_t i = size - 1; i > 0; i--) {
+    *out++ = static_cast<char>(val >> ((i - 1) * 8));
+  }
+  return out;
+}
+
+/*
+ * Reads a cbor header of the given major type from the front of `in`, and
+ * removes it. Returns nullopt if the header is of a different type, is
+ * truncated, or isn't in its shortest form.
+ */
+static auto readCborHeader(uint8_t major, std::string_view& in)
+    -> std::optional<uint64_t> {
+  if (in.empty() || (static_cast<uint8_t>(in[0]) & 0xe0) != major) {
+    return {};
+  }
+  uint8_t info = static_cast<uint8_t>(in[0]) & 0x1f;
+  size_t size;
+  if (info < 24) {
+    size = 1;
+  } else if (info <= 27) {
+    size = 1 + (1 << (info - 24));
+  } else {
+    return {};
+  }
+  if (in.size() < size) {
+    return {};
+  }
+  uint64_t val = info < 24 ? info : 0;
+  for (size_t i = 1; i < size; i++) {
+    val = val << 8 | static_cast<uint8_t>(in[i]);
+  }
+  if (cborHeaderSize(val) != size) {
+    return {};
+  }
+  in.remove_prefix(size);
+  return val;
+}
+
+static auto indexPrefixSize(const IndexKey::Header& header) -> size_t {
+  size_t size = 2 + cborHeaderSize(2) + cborHeaderSize(header.id) +
+                cborHeaderSize(header.components_hash.size()) + 1;
   for (auto hash : header.components_hash) {
-    components.add(cppbor::Uint{hash});
+    size += cborHeaderSize(hash);
   }
+  return size;
+}
 
-  cppbor::Array val{cppbor::Uint{header.id}, std::move(components)};
-  out << val.toString() << kFieldSeparator;
-  return out.str();
+static auto writeIndexPrefix(const IndexKey::Header& header, char* out)
+    -> char* {
+  *out++ = kIndexPrefix;
+  *out++ = kFieldSeparator;
+  out = writeCborHeader(kCborArray, 2, out);
+  out = writeCborHeader(kCborUint, header.id, out);
+  out = writeCborHeader(kCborArray, header.components_hash.size(), out);
+  for (auto hash : header.components_hash) {
+    out = writeCborHeader(kCborUint, hash, out);
+  }
+  *out++ = kFieldSeparator;
+  return out;
+}
+
+static auto indexKeySize(const IndexKey& key) -> size_t {
+  size_t size = indexPrefixSize(key.header);
+  if (!key.item.empty()) {
+    size += key.item.size() + 1;
+  }
+  if (key.track) {
+    size += cborHeaderSize(*key.track);
+  }
+  return size;
+}
+
+static auto writeIndexKey(const IndexKey& key, char* out) -> char* {
+  out = writeIndexPrefix(key.header, out);
+  // The component should already be UTF-8 encoded, so just write it.
+  if (!key.item.empty()) {
+    out = std::copy(key.item.begin(), key.item.end(), out);
+    *out++ = kFieldSeparator;
+  }
+  if (key.track) {
+    out = writeCborHeader(kCborUint, *key.track, out);
+  }
+  return out;
+}
+
+auto EncodeIndexPrefix(const IndexKey::Header& header) -> std::string {
+  std::string out(indexPrefixSize(header), '\0');
+  writeIndexPrefix(header, out.data());
+  return out;
+}
+
+auto EncodeIndexPrefix(const IndexKey::Header& header,
+                       std::pmr::memory_resource& arena) -> std::string_view {
+  size_t size = indexPrefixSize(header);
+  char* out = static_cast<char*>(arena.allocate(size, 1));
+  writeIndexPrefix(header, out);
+  return {out, size};
 }
 
 /*
@@ -207,67 +340,455 @@ auto EncodeIndexPrefix(const IndexKey::Header& header) -> std::string {
  *  id for now, but could reasonably be something like 'release year' as well.
  */
 auto EncodeIndexKey(const IndexKey& key) -> std::string {
-  std::ostringstream out{};
+  std::string out(indexKeySize(key), '\0');
+  writeIndexKey(key, out.data());
+  return out;
+}
 
-  out << EncodeIndexPrefix(key.header);
+auto EncodeIndexKey(const IndexKey& key, std::pmr::memory_resource& arena)
+    -> std::string_view {
+  size_t size = indexKeySize(key);
+  char* out = static_cast<char*>(arena.allocate(size, 1));
+  writeIndexKey(key, out);
+  return {out, size};
+}
 
-  // The component should already be UTF-8 encoded, so just write it.
-  if (!key.item.empty()) {
-    out << key.item << kFieldSeparator;
+/*
+ * Returns whether the given bytes could be the item of a leaf record. These are
+ * either collated text, which never contains a null byte, or a single cbor
+ * integer (e.g. album order).
+ */
+static auto isLeafItem(std::string_view item) -> bool {
+  if (item.find(kFieldSeparator) == std::string_view::npos) {
+    return true;
   }
+  return readCborHeader(kCborUint, item) && item.empty();
+}
 
-  if (key.track) {
-    out << TrackIdToBytes(*key.track);
+/*
+ * Splits the part of an index key after its header into the item, and the
+ * track id of leaf records. The item of a leaf record may itself contain null
+ * bytes, as may the encoded track id, so the trailer is found by looking for a
+ * canonical track id at the end of the key that is preceded by a separator.
+ */
+static auto parseIndexTrailer(std::string_view rest, IndexKeyView& out)
+    -> bool {
+  if (rest.empty()) {
+    return true;
+  }
+  // A track id whose final bytes look like a separator and a shorter track id
+  // is rejected by isLeafItem, since the item would then contain a stray null
+  // byte. Trying the shortest trailer first means that an album order whose
+  // final bytes look like a longer track id is also read correctly.
+  for (size_t size : {1, 2, 3, 5}) {
+    if (rest.size() < size + 1 ||
+        rest[rest.size() - size - 1] != kFieldSeparator) {
+      continue;
+    }
+    std::string_view trailer = rest.substr(rest.size() - size);
+    auto id = readCborHeader(kCborUint, trailer);
+    std::string_view item = rest.substr(0, rest.size() - size - 1);
+    if (!id || !trailer.empty() || *id > UINT32_MAX || !isLeafItem(item)) {
+      continue;
+    }
+    out.item = item;
+    out.track = *id;
+    return true;
   }
+  // Otherwise, this is either a branch record (an item and a separator), or a
+  // leaf record with an empty item, and so no separator before its track id.
+  if (rest.back() == kFieldSeparator) {
+    out.item = rest.substr(0, rest.size() - 1);
+    return true;
+  }
+  auto id = readCborHeader(kCborUint, rest);
+  if (!id || !rest.empty() || *id > UINT32_MAX) {
+    return false;
+  }
+  out.track = *id;
+  return true;
+}
 
-  return out.str();
+auto ParseIndexKeyView(std::string_view key) -> std::optional<IndexKeyView> {
+  if (key.size() < 2 || key[0] != kIndexPrefix || key[1] != kFieldSeparator) {
+    return {};
+  }
+  key.remove_prefix(2);
+
+  IndexKeyView result{};
+  auto size = readCborHeader(kCborArray, key);
+  if (!size || *size != 2) {
+    return {};
+  }
+  auto id = readCborHeader(kCborUint, key);
+  if (!id || *id > UINT8_MAX) {
+    return {};
+  }
+  result.id = *id;
+  auto depth = readCborHeader(kCborArray, key);
+  if (!depth || *depth > IndexKeyView::kMaxDepth) {
+    return {};
+  }
+  result.depth = *depth;
+  for (size_t i = 0; i < result.depth; i++) {
+    auto hash = readCborHeader(kCborUint, key);
+    if (!hash) {
+      return {};
+    }
+    result.components_hash[i] = *hash;
+  }
+
+  if (key.empty() || key[0] != kFieldSeparator) {
+    return {};
+  }
+  key.remove_prefix(1);
+
+  if (!parseIndexTrailer(key, result)) {
+    return {};
+  }
+  return result;
 }
 
 auto ParseIndexKey(const leveldb::Slice& slice) -> std::optional<IndexKey> {
-  IndexKey result{};
-
-  auto prefix = EncodeAllIndexesPrefix();
-  if (!slice.starts_with(prefix)) {
+  auto view = ParseIndexKeyView({slice.data(), slice.size()});
+  if (!view) {
     return {};
   }
+  return view->toKey();
+}
 
-  std::string key_data = slice.ToString().substr(prefix.size());
-  auto [key, end_of_key, err] = cppbor::parseWithViews(
-      reinterpret_cast<const uint8_t*>(key_data.data()), key_data.size());
-  if (!key || key->type() != cppbor::ARRAY) {
+/* 'C/' */
+auto EncodeAllCountsPrefix() -> std::string {
+  return makePrefix(kCountPrefix);
+}
+
+/* 'C/0xa2' */
+auto EncodeCountKey(const IndexKey::Header& header) -> std::string {
+  cppbor::Array components{};
+  for (auto hash : header.components_hash) {
+    components.add(cppbor::Uint{hash});
+  }
+  cppbor::Array val{cppbor::Uint{header.id}, std::move(components)};
+  return EncodeAllCountsPrefix() + val.toString();
+}
+
+auto EncodeCountValue(const IndexCounts& counts) -> std::string {
+  cppbor::Array val{
+      cppbor::Uint{counts.children},
+      cppbor::Uint{counts.tracks},
+  };
+  return val.toString();
+}
+
+auto ParseCountValue(const leveldb::Slice& slice)
+    -> std::optional<IndexCounts> {
+  auto [item, unused, err] = cppbor::parseWithViews(
+      reinterpret_cast<const uint8_t*>(slice.data()), slice.size());
+  if (!item || item->type() != cppbor::ARRAY) {
     return {};
   }
-  auto as_array = key->asArray();
-  if (as_array->size() != 2 || as_array->get(0)->type() != cppbor::UINT ||
-      as_array->get(1)->type() != cppbor::ARRAY) {
+  auto vals = item->asArray();
+  if (vals->size() < 2 || vals->get(0)->type() != cppbor::UINT ||
+      vals->get(1)->type() != cppbor::UINT) {
     return {};
   }
-  result.header.id = as_array->get(0)->asUint()->unsignedValue();
-  auto components_array = as_array->get(1)->asArray();
-  for (int i = 0; i < components_array->size(); i++) {
-    result.header.components_hash.push_back(
-        components_array->get(i)->asUint()->unsignedValue());
+  return IndexCounts{
+      .children =
+          static_cast<uint32_t>(vals->get(0)->asUint()->unsignedValue()),
+      .tracks = static_cast<uint32_t>(vals->get(1)->asUint()->unsignedValue()),
+  };
+}
+
+/* 'G/ 0xACAB' */
+auto EncodeTagsKey(TrackId id) -> std::string {
+  return makePrefix(kTagsPrefix) + TrackIdToBytes(id);
+}
+
+auto EncodeTagsValue(const TrackData& data, const TrackTags& tags)
+    -> std::string {
+  auto* vals = new cppbor::Map{};  // Free'd by Array's dtor.
+  auto add_string = [&](Tag t, const std::optional<std::pmr::string>& s) {
+    if (s) {
+      vals->add(cppbor::Uint{static_cast<uint32_t>(t)}, cppbor::Tstr{*s});
+    }
+  };
+  auto add_list = [&](Tag t, const std::pmr::vector<std::pmr::string>& l) {
+    if (l.empty()) {
+      return;
+    }
+    auto* list = new cppbor::Array{};  // Free'd by Map's dtor.
+    for (const auto& s : l) {
+      list->add(cppbor::Tstr{s});
+    }
+    vals->add(cppbor::Uint{static_cast<uint32_t>(t)}, list);
+  };
+
+  add_string(Tag::kTitle, tags.title_);
+  add_string(Tag::kArtist, tags.artist_);
+  add_list(Tag::kAllArtists, tags.allArtists_);
+  add_string(Tag::kAlbum, tags.album_);
+  add_string(Tag::kAlbumArtist, tags.album_artist_);
+  if (tags.disc_) {
+    vals->add(cppbor::Uint{static_cast<uint32_t>(Tag::kDisc)},
+              cppbor::Uint{*tags.disc_});
   }
+  if (tags.track_) {
+    vals->add(cppbor::Uint{static_cast<uint32_t>(Tag::kTrack)},
+              cppbor::Uint{*tags.track_});
+  }
+  add_list(Tag::kGenres, tags.genres_);
+
+  // Loudness tags aren't Tags, so they're kept in a map of their own, keyed by
+  // their position within this list.
+  auto* loudness = new cppbor::Map{};  // Free'd by Array's dtor.
+  auto add_loudness = [&](int key, auto opt) {
+    if (opt) {
+      loudness->add(key, static_cast<int64_t>(*opt));
+    }
+  };
+  add_loudness(0, tags.track_gain_);
+  add_loudness(1, tags.track_peak_);
+  add_loudness(2, tags.album_gain_);
+  add_loudness(3, tags.album_peak_);
 
-  size_t header_length =
-      reinterpret_cast<const char*>(end_of_key) - key_data.data();
+  cppbor::Array val{
+      cppbor::Uint{data.modified_at.first},
+      cppbor::Uint{data.modified_at.second},
+      cppbor::Uint{static_cast<uint32_t>(tags.encoding_)},
+      vals,
+      loudness,
+  };
+  return val.toString();
+}
+
+auto ParseTagsValue(const leveldb::Slice& slice, const TrackData& data)
+    -> std::shared_ptr<TrackTags> {
+  auto [item, unused, err] = cppbor::parseWithViews(
+      reinterpret_cast<const uint8_t*>(slice.data()), slice.size());
+  if (!item || item->type() != cppbor::ARRAY) {
+    return {};
+  }
+  auto vals = item->asArray();
+  if (vals->size() < 4 || vals->get(0)->type() != cppbor::UINT ||
+      vals->get(1)->type() != cppbor::UINT ||
+      vals->get(2)->type() != cppbor::UINT ||
+      vals->get(3)->type() != cppbor::MAP) {
+    return {};
+  }
 
-  if (header_length == 0 || header_length >= key_data.size()) {
+  std::pair<uint16_t, uint16_t> modified_at{
+      vals->get(0)->asUint()->unsignedValue(),
+      vals->get(1)->asUint()->unsignedValue()};
+  if (modified_at != data.modified_at) {
+    // The file has changed since these tags were parsed.
     return {};
   }
 
-  key_data = key_data.substr(header_length + 1);
-  size_t last_sep = key_data.find_last_of('\0');
+  auto res = TrackTags::create();
+  res->encoding_ =
+      static_cast<Container>(vals->get(2)->asUint()->unsignedValue());
+
+  auto to_string = [](const cppbor::Item& i) -> std::pmr::string {
+    auto view = i.asViewTstr()->view();
+    return {view.data(), view.size(), &memory::kSpiRamResource};
+  };
 
-  if (last_sep > 0) {
-    result.item = key_data.substr(0, last_sep);
+  for (const auto& [key, val] : *vals->get(3)->asMap()) {
+    if (key->type() != cppbor::UINT) {
+      return {};
+    }
+    auto tag = static_cast<Tag>(key->asUint()->unsignedValue());
+    switch (val->type()) {
+      case cppbor::TSTR:
+        if (tag == Tag::kTitle) {
+          res->title_ = to_string(*val);
+        } else if (tag == Tag::kArtist) {
+          res->artist_ = to_string(*val);
+        } else if (tag == Tag::kAlbum) {
+          res->album_ = to_string(*val);
+        } else if (tag == Tag::kAlbumArtist) {
+          res->album_artist_ = to_string(*val);
+        }
+        break;
+      case cppbor::UINT:
+        if (tag == Tag::kDisc) {
+          res->disc_ = val->asUint()->unsignedValue();
+        } else if (tag == Tag::kTrack) {
+          res->track_ = val->asUint()->unsignedValue();
+        }
+        break;
+      case cppbor::ARRAY: {
+        std::pmr::vector<std::pmr::string>* list = nullptr;
+        if (tag == Tag::kAllArtists) {
+          list = &res->allArtists_;
+        } else if (tag == Tag::kGenres) {
+          list = &res->genres_;
+        } else {
+          break;
+        }
+        for (const auto& s : *val->asArray()) {
+          if (s->type() == cppbor::TSTR) {
+            list->push_back(to_string(*s));
+          }
+        }
+        break;
+      }
+      default:
+        break;
+    }
   }
 
-  if (last_sep + 1 < key_data.size()) {
-    result.track = BytesToTrackId(key_data.substr(last_sep + 1));
+  // Tags stored by older versions have no loudness map.
+  if (vals->size() < 5 || vals->get(4)->type() != cppbor::MAP) {
+    return res;
+  }
+  for (const auto& [key, val] : *vals->get(4)->asMap()) {
+    if (key->type() != cppbor::UINT || !val->asInt()) {
+      continue;
+    }
+    int64_t v = val->asInt()->value();
+    switch (key->asUint()->unsignedValue()) {
+      case 0:
+        res->track_gain_ = v;
+        break;
+      case 1:
+        res->track_peak_ = v;
+        break;
+      case 2:
+        res->album_gain_ = v;
+        break;
+      case 3:
+        res->album_peak_ = v;
+        break;
+    }
   }
 
-  return result;
+  return res;
+}
+
+/* 'S/ 0xACAB' */
+auto EncodeSeekIndexKey(TrackId id) -> std::string {
+  return makePrefix(kSeekIndexPrefix) + TrackIdToBytes(id);
+}
+
+auto EncodeSeekIndexValue(const TrackData& data, const codecs::SeekIndex& index)
+    -> std::string {
+  // Long tracks have thousands of entries, so rather than encoding each one as
+  // its own cbor item, pack the gaps between them into a single byte string.
+  // Frames are rarely more than a couple of kilobytes apart, so most gaps fit
+  // in two bytes.
+  std::string positions;
+  uint32_t previous = 0;
+  for (uint32_t pos : index.positions) {
+    uint32_t delta = pos - previous;
+    previous = pos;
+    do {
+      uint8_t byte = delta & 0x7f;
+      delta >>= 7;
+      positions.push_back(static_cast<char>(delta > 0 ? byte | 0x80 : byte));
+    } while (delta > 0);
+  }
+
+  cppbor::Array val{
+      cppbor::Uint{data.modified_at.first},
+      cppbor::Uint{data.modified_at.second},
+      cppbor::Uint{index.stride},
+      cppbor::Bstr{positions},
+  };
+  return val.toString();
+}
+
+auto ParseSeekIndexValue(const leveldb::Slice& slice, const TrackData& data)
+    -> std::shared_ptr<codecs::SeekIndex> {
+  auto [item, unused, err] = cppbor::parseWithViews(
+      reinterpret_cast<const uint8_t*>(slice.data()), slice.size());
+  if (!item || item->type() != cppbor::ARRAY) {
+    return {};
+  }
+  auto vals = item->asArray();
+  if (vals->size() < 4 || vals->get(0)->type() != cppbor::UINT ||
+      vals->get(1)->type() != cppbor::UINT ||
+      vals->get(2)->type() != cppbor::UINT || !vals->get(3)->asViewBstr()) {
+    return {};
+  }
+
+  std::pair<uint16_t, uint16_t> modified_at{
+      vals->get(0)->asUint()->unsignedValue(),
+      vals->get(1)->asUint()->unsignedValue()};
+  if (modified_at != data.modified_at) {
+    // The file has changed since this index was built.
+    return {};
+  }
+
+  auto res = std::make_shared<codecs::SeekIndex>(codecs::SeekIndex{
+      .stride = static_cast<uint32_t>(vals->get(2)->asUint()->unsignedValue()),
+      .positions = std::pmr::vector<uint32_t>{&memory::kSpiRamResource},
+  });
+  uint32_t position = 0;
+  uint32_t delta = 0;
+  int shift = 0;
+  for (uint8_t byte : vals->get(3)->asViewBstr()->view()) {
+    if (shift > 28) {
+      return {};
+    }
+    delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    shift += 7;
+    if (byte & 0x80) {
+      continue;
+    }
+    position += delta;
+    res->positions.push_back(position);
+    delta = 0;
+    shift = 0;
+  }
+  if (shift > 0) {
+    // Truncated partway through an entry.
+    return {};
+  }
+  return res;
+}
+
+/* 'M/ dirpath' */
+auto EncodeAllManifestsPrefix() -> std::string {
+  return makePrefix(kManifestPrefix);
+}
+
+auto EncodeManifestKey(std::string_view dir) -> std::string {
+  std::string out = EncodeAllManifestsPrefix();
+  out += dir;
+  return out;
+}
+
+auto ParseManifestKey(const leveldb::Slice& slice) -> std::string_view {
+  std::string_view key{slice.data(), slice.size()};
+  return key.substr(std::min<size_t>(key.size(), 2));
+}
+
+auto EncodeManifestValue(const DirectorySummary& summary) -> std::string {
+  cppbor::Array val{
+      cppbor::Uint{summary.num_entries},
+      cppbor::Uint{summary.digest},
+  };
+  return val.toString();
+}
+
+auto ParseManifestValue(const leveldb::Slice& slice)
+    -> std::optional<DirectorySummary> {
+  auto [item, unused, err] = cppbor::parseWithViews(
+      reinterpret_cast<const uint8_t*>(slice.data()), slice.size());
+  if (!item || item->type() != cppbor::ARRAY) {
+    return {};
+  }
+  auto vals = item->asArray();
+  if (vals->size() < 2 || vals->get(0)->type() != cppbor::UINT ||
+      vals->get(1)->type() != cppbor::UINT) {
+    return {};
+  }
+  return DirectorySummary{
+      .num_entries =
+          static_cast<uint32_t>(vals->get(0)->asUint()->unsignedValue()),
+      .digest = vals->get(1)->asUint()->unsignedValue(),
+  };
 }
 
 auto TrackIdToBytes(TrackId id) -> std::string {
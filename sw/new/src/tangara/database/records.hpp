@@ -8,13 +8,18 @@
 
 #include <stdint.h>
 
+#include <memory_resource>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 #include "leveldb/db.h"
 #include "leveldb/slice.h"
 
+#include "codec.hpp"
+#include "database/dir_manifest.hpp"
 #include "database/index.hpp"
 #include "database/track.hpp"
 #include "memory_resource.hpp"
@@ -70,9 +75,100 @@ auto EncodeAllIndexesPrefix() -> std::string;
  */
 auto EncodeIndexPrefix(const IndexKey::Header&) -> std::string;
 
+/*
+ * Encodes a prefix that matches all index keys with the given header, into
+ * memory allocated from the given arena. The returned view remains valid for
+ * as long as the arena does.
+ */
+auto EncodeIndexPrefix(const IndexKey::Header&,
+                       std::pmr::memory_resource& arena) -> std::string_view;
+
 auto EncodeIndexKey(const IndexKey&) -> std::string;
+
+/*
+ * Encodes an index key into memory allocated from the given arena, with
+ * exactly one allocation. The returned view remains valid for as long as the
+ * arena does.
+ */
+auto EncodeIndexKey(const IndexKey&, std::pmr::memory_resource& arena)
+    -> std::string_view;
+
 auto ParseIndexKey(const leveldb::Slice&) -> std::optional<IndexKey>;
 
+/*
+ * Parses an index key without copying it. The returned view refers to the
+ * given bytes, and must not outlive them. Returns nullopt if parsing fails.
+ */
+auto ParseIndexKeyView(std::string_view) -> std::optional<IndexKeyView>;
+
+/* Encodes a prefix that matches all index count keys. */
+auto EncodeAllCountsPrefix() -> std::string;
+
+/* Encodes the key for the IndexCounts of the given header. */
+auto EncodeCountKey(const IndexKey::Header&) -> std::string;
+
+auto EncodeCountValue(const IndexCounts&) -> std::string;
+
+/*
+ * Parses bytes previously encoded via EncodeCountValue back into an
+ * IndexCounts. May return nullopt if parsing fails.
+ */
+auto ParseCountValue(const leveldb::Slice&) -> std::optional<IndexCounts>;
+
+/* Encodes the key for the cached TrackTags of the track with the given id. */
+auto EncodeTagsKey(TrackId id) -> std::string;
+
+/*
+ * Encodes a track's parsed tags into bytes, so that they can be served from the
+ * database instead of being parsed from the track's file again. The encoding
+ * includes the file's modification time at the point the tags were parsed.
+ */
+auto EncodeTagsValue(const TrackData&, const TrackTags&) -> std::string;
+
+/*
+ * Parses bytes previously encoded via EncodeTagsValue back into a TrackTags.
+ * Returns null if parsing fails, or if the tags were parsed from a version of
+ * the file older than the given TrackData's modification time.
+ */
+auto ParseTagsValue(const leveldb::Slice&, const TrackData&)
+    -> std::shared_ptr<TrackTags>;
+
+/* Encodes the key for the SeekIndex of the track with the given id. */
+auto EncodeSeekIndexKey(TrackId id) -> std::string;
+
+/*
+ * Encodes a track's SeekIndex into bytes. As with tags, the encoding includes
+ * the file's modification time at the point the index was built.
+ */
+auto EncodeSeekIndexValue(const TrackData&, const codecs::SeekIndex&)
+    -> std::string;
+
+/*
+ * Parses bytes previously encoded via EncodeSeekIndexValue back into a
+ * SeekIndex. Returns null if parsing fails, or if the index was built from a
+ * version of the file older than the given TrackData's modification time.
+ */
+auto ParseSeekIndexValue(const leveldb::Slice&, const TrackData&)
+    -> std::shared_ptr<codecs::SeekIndex>;
+
+/* Encodes a prefix that matches all directory manifest keys. */
+auto EncodeAllManifestsPrefix() -> std::string;
+
+/* Encodes the key for the DirectorySummary of the given directory. */
+auto EncodeManifestKey(std::string_view dir) -> std::string;
+
+/* Returns the directory that a key from EncodeManifestKey refers to. */
+auto ParseManifestKey(const leveldb::Slice&) -> std::string_view;
+
+auto EncodeManifestValue(const DirectorySummary&) -> std::string;
+
+/*
+ * Parses bytes previously encoded via EncodeManifestValue back into a
+ * DirectorySummary. May return nullopt if parsing fails.
+ */
+auto ParseManifestValue(const leveldb::Slice&)
+    -> std::optional<DirectorySummary>;
+
 /* Encodes a TrackId as bytes. */
 auto TrackIdToBytes(TrackId id) -> std::string;
 
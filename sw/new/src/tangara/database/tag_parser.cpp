@@ -7,6 +7,7 @@
 #include "database/tag_parser.hpp"
 
 #include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -14,6 +15,8 @@
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <span>
+#include <string_view>
 
 #include "database/track.hpp"
 #include "debug.hpp"
@@ -27,6 +30,19 @@
 
 namespace database {
 
+static const std::size_t kBufSize = 1024;
+[[maybe_unused]] static const char* kTag = "TAGS";
+
+/* Stats the given file, returning its size. */
+static auto fileSize(std::string_view p) -> std::optional<uint64_t> {
+  std::string path{p};
+  FILINFO info;
+  if (f_stat(path.c_str(), &info) != FR_OK) {
+    return {};
+  }
+  return info.fsize;
+}
+
 static auto convert_tag(int tag) -> std::optional<Tag> {
   switch (tag) {
     case Ttitle:
@@ -73,45 +89,172 @@ static auto convert_vorbis_tag(const std::string_view name)
   return {};
 }
 
+/*
+ * Loudness tags aren't indexed like the others, so they're stored separately
+ * from them. These return whether the given tag was a loudness tag.
+ */
+static auto set_loudness_tag(TrackTags& tags, int tag, std::string_view val)
+    -> bool {
+  switch (tag) {
+    case Ttrackgain:
+      tags.trackGain(val);
+      return true;
+    case Ttrackpeak:
+      tags.trackPeak(val);
+      return true;
+    case Talbumgain:
+      tags.albumGain(val);
+      return true;
+    case Talbumpeak:
+      tags.albumPeak(val);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static auto set_loudness_comment(TrackTags& tags,
+                                 const std::string_view name,
+                                 std::string_view val) -> bool {
+  std::string name_upper{name};
+  std::transform(name.begin(), name.end(), name_upper.begin(), ::toupper);
+  if (name_upper == "REPLAYGAIN_TRACK_GAIN") {
+    return set_loudness_tag(tags, Ttrackgain, val);
+  } else if (name_upper == "REPLAYGAIN_TRACK_PEAK") {
+    return set_loudness_tag(tags, Ttrackpeak, val);
+  } else if (name_upper == "REPLAYGAIN_ALBUM_GAIN") {
+    return set_loudness_tag(tags, Talbumgain, val);
+  } else if (name_upper == "REPLAYGAIN_ALBUM_PEAK") {
+    return set_loudness_tag(tags, Talbumpeak, val);
+  } else if (name_upper == "R128_TRACK_GAIN") {
+    tags.r128TrackGain(val);
+    return true;
+  } else if (name_upper == "R128_ALBUM_GAIN") {
+    tags.r128AlbumGain(val);
+    return true;
+  }
+  return false;
+}
+
+// Supported file extensions for parsing tags, derived from the list of
+// supported audio formats here:
+// https://cooltech.zone/tangara/docs/music-library/
+static constexpr std::string_view kSupportedExts[] = {"flac", "mp3",  "ogg",
+                                                      "ogx",  "opus", "wav"};
+
+auto HasSupportedExtension(std::string_view path) -> bool {
+  for (const auto& ext : kSupportedExts) {
+    // Case-insensitive file extension check
+    if (path.size() >= ext.size() &&
+        std::equal(ext.rbegin(), ext.rend(), path.rbegin(),
+                   [](char a, char b) {
+                     return std::tolower(a) == std::tolower(b);
+                   })) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Read-only view of a file whose leading bytes may have already been read into
+ * memory. The file itself is only opened if reads go beyond those bytes.
+ */
+class PrefetchedFile {
+ public:
+  PrefetchedFile(std::string_view path,
+                 uint64_t size,
+                 std::span<const std::byte> header)
+      : path_(path), size_(size), header_(header), pos_(0), is_open_(false) {}
+
+  ~PrefetchedFile() {
+    if (is_open_) {
+      f_close(&file_);
+    }
+  }
+
+  /* Returns the number of bytes read, 0 at the end of the file, or -1. */
+  auto read(void* buf, size_t len) -> int {
+    if (pos_ >= size_) {
+      return 0;
+    }
+    len = std::min<uint64_t>(len, size_ - pos_);
+
+    size_t done = 0;
+    if (pos_ < header_.size()) {
+      done = std::min<uint64_t>(len, header_.size() - pos_);
+      std::memcpy(buf, header_.data() + pos_, done);
+      pos_ += done;
+    }
+    if (done < len) {
+      if (!open() || (file_.fptr != pos_ && f_lseek(&file_, pos_) != FR_OK)) {
+        return done > 0 ? done : -1;
+      }
+      UINT bytes_read;
+      if (f_read(&file_, static_cast<std::byte*>(buf) + done, len - done,
+                 &bytes_read) != FR_OK) {
+        return done > 0 ? done : -1;
+      }
+      done += bytes_read;
+      pos_ += bytes_read;
+    }
+    return done;
+  }
+
+  auto seek(uint64_t pos) -> void { pos_ = std::min(pos, size_); }
+  auto tell() const -> uint64_t { return pos_; }
+  auto size() const -> uint64_t { return size_; }
+
+  PrefetchedFile(const PrefetchedFile&) = delete;
+  PrefetchedFile& operator=(const PrefetchedFile&) = delete;
+
+ private:
+  auto open() -> bool {
+    if (!is_open_) {
+      is_open_ = f_open(&file_, path_.c_str(), FA_READ) == FR_OK;
+      if (!is_open_) {
+        ESP_LOGW(kTag, "failed to open file '%s'", path_.c_str());
+      }
+    }
+    return is_open_;
+  }
+
+  const std::string path_;
+  const uint64_t size_;
+  const std::span<const std::byte> header_;
+  uint64_t pos_;
+  bool is_open_;
+  FIL file_;
+};
+
 namespace libtags {
 
 struct Aux {
-  FIL file;
-  FILINFO info;
+  PrefetchedFile* file;
   TrackTags* tags;
 };
 
 static int read(Tagctx* ctx, void* buf, int cnt) {
   Aux* aux = reinterpret_cast<Aux*>(ctx->aux);
-  if (f_eof(&aux->file)) {
-    return 0;
-  }
-  UINT bytes_read;
-  if (f_read(&aux->file, buf, cnt, &bytes_read) != FR_OK) {
-    return -1;
-  }
-  return bytes_read;
+  return aux->file->read(buf, cnt);
 }
 
 static int seek(Tagctx* ctx, int offset, int whence) {
   Aux* aux = reinterpret_cast<Aux*>(ctx->aux);
-  FRESULT res;
+  PrefetchedFile& file = *aux->file;
   if (whence == 0) {
-    // Seek from the start of the file. This is f_lseek's behaviour.
-    res = f_lseek(&aux->file, offset);
+    // Seek from the start of the file.
+    file.seek(offset);
   } else if (whence == 1) {
     // Seek from current offset.
-    res = f_lseek(&aux->file, aux->file.fptr + offset);
+    file.seek(file.tell() + offset);
   } else if (whence == 2) {
     // Seek from the end of the file
-    res = f_lseek(&aux->file, aux->info.fsize + offset);
+    file.seek(file.size() + offset);
   } else {
     return -1;
   }
-  if (res != FR_OK) {
-    return -1;
-  }
-  return aux->file.fptr;
+  return file.tell();
 }
 
 static void tag(Tagctx* ctx,
@@ -122,6 +265,12 @@ static void tag(Tagctx* ctx,
                 int size,
                 Tagread f) {
   Aux* aux = reinterpret_cast<Aux*>(ctx->aux);
+  if (v && set_loudness_tag(*aux->tags, t, v)) {
+    return;
+  }
+  if (t == Tunknown && k && v && set_loudness_comment(*aux->tags, k, v)) {
+    return;
+  }
   std::optional<Tag> tag;
   if (t == Tunknown && k && v) {
     // Sometimes 'unknown' tags are vorbis comments shoved into a generic tag
@@ -144,8 +293,6 @@ static void toc(Tagctx* ctx, int ms, int offset) {}
 
 }  // namespace libtags
 
-static const std::size_t kBufSize = 1024;
-[[maybe_unused]] static const char* kTag = "TAGS";
 
 TagParserImpl::TagParserImpl() {
   parsers_.emplace_back(new OggTagParser());
@@ -168,10 +315,35 @@ auto TagParserImpl::ReadAndParseTags(std::string_view path)
     }
   }
 
+  auto size = fileSize(path);
+  if (!size) {
+    return {};
+  }
+  return ParseTags(path, *size, {});
+}
+
+auto TagParserImpl::ParseTags(std::string_view path,
+                              uint64_t file_size,
+                              std::span<const std::byte> header)
+    -> std::shared_ptr<TrackTags> {
+  if (path.empty()) {
+    return {};
+  }
+
+  // Check the cache first to see if we can skip parsing this file completely.
+  {
+    std::lock_guard<std::mutex> lock{cache_mutex_};
+    std::optional<std::shared_ptr<TrackTags>> cached =
+        cache_.Get({path.data(), path.size()});
+    if (cached) {
+      return *cached;
+    }
+  }
+
   // Nothing in the cache; try each of our parsers.
   std::shared_ptr<TrackTags> tags;
   for (auto& parser : parsers_) {
-    tags = parser->ReadAndParseTags(path);
+    tags = parser->ParseTags(path, file_size, header);
     if (tags) {
       break;
     }
@@ -219,6 +391,20 @@ auto OggTagParser::ReadAndParseTags(std::string_view p)
   if (!p.ends_with(".ogg") && !p.ends_with(".opus") && !p.ends_with(".ogx")) {
     return {};
   }
+  auto size = fileSize(p);
+  if (!size) {
+    return {};
+  }
+  return ParseTags(p, *size, {});
+}
+
+auto OggTagParser::ParseTags(std::string_view p,
+                             uint64_t file_size,
+                             std::span<const std::byte> header)
+    -> std::shared_ptr<TrackTags> {
+  if (!p.ends_with(".ogg") && !p.ends_with(".opus") && !p.ends_with(".ogx")) {
+    return {};
+  }
   ogg_sync_state sync;
   ogg_sync_init(&sync);
 
@@ -226,12 +412,7 @@ auto OggTagParser::ReadAndParseTags(std::string_view p)
   ogg_stream_state stream;
   bool stream_init = false;
 
-  std::string path{p};
-  FIL file;
-  if (f_open(&file, path.c_str(), FA_READ) != FR_OK) {
-    ESP_LOGW(kTag, "failed to open file '%s'", path.c_str());
-    return {};
-  }
+  PrefetchedFile file{p, file_size, header};
 
   std::shared_ptr<TrackTags> tags;
 
@@ -245,9 +426,8 @@ auto OggTagParser::ReadAndParseTags(std::string_view p)
     while (ogg_sync_pageout(&sync, &page) != 1) {
       char* buffer = ogg_sync_buffer(&sync, 512);
 
-      UINT br;
-      FRESULT fres = f_read(&file, buffer, 512, &br);
-      if (fres != FR_OK || br == 0) {
+      int br = file.read(buffer, 512);
+      if (br <= 0) {
         goto finish;
       }
 
@@ -301,7 +481,6 @@ finish:
     ogg_stream_clear(&stream);
   }
   ogg_sync_clear(&sync);
-  f_close(&file);
 
   return tags;
 }
@@ -331,6 +510,8 @@ auto OggTagParser::parseComments(TrackTags& res, std::span<unsigned char> data)
       auto tag = convert_vorbis_tag(key);
       if (tag && !val.empty()) {
         res.set(*tag, val);
+      } else if (!val.empty()) {
+        set_loudness_comment(res, key, val);
       }
     }
 
@@ -347,34 +528,36 @@ auto OggTagParser::parseLength(std::span<unsigned char> data) -> uint64_t {
 
 auto GenericTagParser::ReadAndParseTags(std::string_view p)
     -> std::shared_ptr<TrackTags> {
+  if (!HasSupportedExtension(p)) {
+    return {};
+  }
+  auto size = fileSize(p);
+  if (!size) {
+    return {};
+  }
+  return ParseTags(p, *size, {});
+}
+
+auto GenericTagParser::ParseTags(std::string_view p,
+                                 uint64_t file_size,
+                                 std::span<const std::byte> header)
+    -> std::shared_ptr<TrackTags> {
   std::string path{p};
-  libtags::Aux aux;
 
   // Fail fast if trying to parse a file that doesn't appear to be a supported
   // audio format For context, see:
   // https://codeberg.org/cool-tech-zone/tangara-fw/issues/149
-  bool found = false;
-  for (const auto& ext : supported_exts) {
-    // Case-insensitive file extension check
-    if (std::equal(ext.rbegin(), ext.rend(), path.rbegin(), [](char a, char b) {
-          return std::tolower(a) == std::tolower(b);
-        })) {
-      found = true;
-      break;
-    }
-  }
-  if (!found) {
+  if (!HasSupportedExtension(path)) {
     ESP_LOGD(kTag, "skipping unsupported file: %s", path.c_str());
     return {};
   }
 
   auto out = TrackTags::create();
-  aux.tags = out.get();
-
-  if (f_stat(path.c_str(), &aux.info) != FR_OK ||
-      f_open(&aux.file, path.c_str(), FA_READ) != FR_OK) {
-    return {};
-  }
+  PrefetchedFile file{path, file_size, header};
+  libtags::Aux aux{
+      .file = &file,
+      .tags = out.get(),
+  };
 
   // Fine to have this on the stack; this is only called on tasks with large
   // stacks anyway, due to all the string handling.
@@ -389,7 +572,6 @@ auto GenericTagParser::ReadAndParseTags(std::string_view p)
   ctx.bufsz = kBufSize;
 
   int res = tagsget(&ctx);
-  f_close(&aux.file);
 
   if (res != 0) {
     // Parsing failed.
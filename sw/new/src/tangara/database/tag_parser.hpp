@@ -7,6 +7,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <cstddef>
+#include <span>
 #include <string>
 
 #include "database/track.hpp"
@@ -14,12 +16,30 @@
 
 namespace database {
 
+/*
+ * Returns whether the given path has the file extension of an audio format
+ * that we know how to parse tags from.
+ */
+auto HasSupportedExtension(std::string_view path) -> bool;
+
 class ITagParser {
  public:
   virtual ~ITagParser() {}
   virtual auto ReadAndParseTags(std::string_view path)
       -> std::shared_ptr<TrackTags> = 0;
 
+  /*
+   * Parses tags from the given file, whose leading bytes have already been
+   * read into `header`. Parsers only go back to the SD card for any bytes
+   * beyond those.
+   */
+  virtual auto ParseTags(std::string_view path,
+                         uint64_t file_size,
+                         std::span<const std::byte> header)
+      -> std::shared_ptr<TrackTags> {
+    return ReadAndParseTags(path);
+  }
+
   virtual auto ClearCaches() -> void {}
 };
 
@@ -28,6 +48,10 @@ class TagParserImpl : public ITagParser {
   TagParserImpl();
   auto ReadAndParseTags(std::string_view path)
       -> std::shared_ptr<TrackTags> override;
+  auto ParseTags(std::string_view path,
+                 uint64_t file_size,
+                 std::span<const std::byte> header)
+      -> std::shared_ptr<TrackTags> override;
 
   auto ClearCaches() -> void override;
 
@@ -47,6 +71,10 @@ class OggTagParser : public ITagParser {
   OggTagParser();
   auto ReadAndParseTags(std::string_view path)
       -> std::shared_ptr<TrackTags> override;
+  auto ParseTags(std::string_view path,
+                 uint64_t file_size,
+                 std::span<const std::byte> header)
+      -> std::shared_ptr<TrackTags> override;
 
  private:
   auto parseComments(TrackTags&, std::span<unsigned char> data) -> void;
@@ -57,13 +85,10 @@ class GenericTagParser : public ITagParser {
  public:
   auto ReadAndParseTags(std::string_view path)
       -> std::shared_ptr<TrackTags> override;
-
- private:
-  // Supported file extensions for parsing tags, derived from the list of
-  // supported audio formats here:
-  // https://cooltech.zone/tangara/docs/music-library/
-  static constexpr std::string supported_exts[] = {"flac", "mp3",  "ogg",
-                                                   "ogx",  "opus", "wav"};
+  auto ParseTags(std::string_view path,
+                 uint64_t file_size,
+                 std::span<const std::byte> header)
+      -> std::shared_ptr<TrackTags> override;
 };
 
 }  // namespace database
@@ -6,6 +6,9 @@
 
 #include "database/track.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
 #include <memory_resource>
@@ -23,6 +26,82 @@ namespace database {
 static constexpr char kAllArtistDelimiters[] = ";";
 static constexpr char kGenreDelimiters[] = ",;";
 
+// How much louder ReplayGain's reference level is than EBU R128's, in
+// hundredths of a dB.
+static constexpr int64_t kR128Offset = 500;
+
+/*
+ * Parses a decimal such as "-6.54 dB" or "0.988541", returning it multiplied
+ * by `scale` and rounded to the nearest integer. This is done by hand rather
+ * than with strtof, so that the result is exactly the same on every target.
+ */
+static auto parseScaled(std::string_view s, int64_t scale)
+    -> std::optional<int64_t> {
+  auto is_digit = [&](size_t i) {
+    return i < s.size() && std::isdigit(static_cast<unsigned char>(s[i]));
+  };
+  size_t i = 0;
+  while (i < s.size() && s[i] == ' ') {
+    i++;
+  }
+  bool negative = false;
+  if (i < s.size() && (s[i] == '-' || s[i] == '+')) {
+    negative = s[i] == '-';
+    i++;
+  }
+  bool any_digits = false;
+  int64_t whole = 0;
+  for (; is_digit(i); i++) {
+    whole = std::min<int64_t>(whole * 10 + (s[i] - '0'), INT32_MAX);
+    any_digits = true;
+  }
+  int64_t frac = 0;
+  int64_t frac_scale = 1;
+  if (i < s.size() && s[i] == '.') {
+    // Digits past the ninth are far too small to matter.
+    for (i++; is_digit(i); i++) {
+      if (frac_scale < 1'000'000'000) {
+        frac = frac * 10 + (s[i] - '0');
+        frac_scale *= 10;
+      }
+      any_digits = true;
+    }
+  }
+  if (!any_digits) {
+    return {};
+  }
+  int64_t res = whole * scale + (frac * scale * 2 + frac_scale) /
+                                    (frac_scale * 2);
+  return negative ? -res : res;
+}
+
+static auto parseGain(std::string_view s) -> std::optional<int16_t> {
+  auto val = parseScaled(s, 100);
+  if (!val) {
+    return {};
+  }
+  return std::clamp<int64_t>(*val, INT16_MIN, INT16_MAX);
+}
+
+static auto parsePeak(std::string_view s) -> std::optional<uint32_t> {
+  auto val = parseScaled(s, 1 << 15);
+  if (!val || *val < 0) {
+    return {};
+  }
+  return std::min<int64_t>(*val, UINT32_MAX);
+}
+
+static auto parseR128Gain(std::string_view s) -> std::optional<int16_t> {
+  auto val = parseScaled(s, 1);
+  if (!val) {
+    return {};
+  }
+  // Q7.8 dB to hundredths of a dB, rounding halves away from zero.
+  int64_t hundredths = *val * 100;
+  hundredths = (hundredths + (hundredths < 0 ? -128 : 128)) / 256;
+  return std::clamp<int64_t>(hundredths + kR128Offset, INT16_MIN, INT16_MAX);
+}
+
 auto tagName(Tag t) -> std::string {
   switch (t) {
     case Tag::kTitle:
@@ -294,6 +373,46 @@ auto TrackTags::track(const std::string_view s) -> void {
   track_ = std::strtol(s.data(), nullptr, 10);
 }
 
+auto TrackTags::trackGain() const -> const std::optional<int16_t>& {
+  return track_gain_;
+}
+
+auto TrackTags::trackGain(const std::string_view s) -> void {
+  track_gain_ = parseGain(s);
+}
+
+auto TrackTags::trackPeak() const -> const std::optional<uint32_t>& {
+  return track_peak_;
+}
+
+auto TrackTags::trackPeak(const std::string_view s) -> void {
+  track_peak_ = parsePeak(s);
+}
+
+auto TrackTags::albumGain() const -> const std::optional<int16_t>& {
+  return album_gain_;
+}
+
+auto TrackTags::albumGain(const std::string_view s) -> void {
+  album_gain_ = parseGain(s);
+}
+
+auto TrackTags::albumPeak() const -> const std::optional<uint32_t>& {
+  return album_peak_;
+}
+
+auto TrackTags::albumPeak(const std::string_view s) -> void {
+  album_peak_ = parsePeak(s);
+}
+
+auto TrackTags::r128TrackGain(const std::string_view s) -> void {
+  track_gain_ = parseR128Gain(s);
+}
+
+auto TrackTags::r128AlbumGain(const std::string_view s) -> void {
+  album_gain_ = parseR128Gain(s);
+}
+
 auto TrackTags::albumOrder() const -> uint32_t {
   return (disc_.value_or(0) << 16) | track_.value_or(0);
 }
@@ -81,6 +81,8 @@ using TagValue = std::variant<std::monostate,
                               uint32_t,
                               std::span<const std::pmr::string>>;
 
+struct TrackData;
+
 auto tagName(Tag) -> std::string;
 auto tagHash(const TagValue&) -> uint64_t;
 auto tagToString(const TagValue&) -> std::string;
@@ -136,6 +138,28 @@ class TrackTags {
   auto genres() const -> std::span<const std::pmr::string>;
   auto genres(const std::string_view) -> void;
 
+  /*
+   * Loudness normalisation values, from ReplayGain tags. Gains are in
+   * hundredths of a dB, and bring the track (or its album) to ReplayGain's
+   * reference loudness. Peaks are the loudest sample relative to full scale,
+   * in Q15; lossy encoding means that these can be a little over 1.
+   */
+  auto trackGain() const -> const std::optional<int16_t>&;
+  auto trackGain(const std::string_view) -> void;
+  auto trackPeak() const -> const std::optional<uint32_t>&;
+  auto trackPeak(const std::string_view) -> void;
+  auto albumGain() const -> const std::optional<int16_t>&;
+  auto albumGain(const std::string_view) -> void;
+  auto albumPeak() const -> const std::optional<uint32_t>&;
+  auto albumPeak(const std::string_view) -> void;
+
+  /*
+   * Sets the gains from EBU R128 tags instead, as Opus files use. These are in
+   * Q7.8 dB, relative to a reference loudness 5 dB quieter than ReplayGain's.
+   */
+  auto r128TrackGain(const std::string_view) -> void;
+  auto r128AlbumGain(const std::string_view) -> void;
+
   /*
    * Returns a hash of the 'identifying' tags of this track. That is, a hash
    * that can be used to determine if one track is likely the same as another,
@@ -145,6 +169,13 @@ class TrackTags {
   auto Hash() const -> uint64_t;
 
  private:
+  // Serialisation into the database needs to see exactly which tags were
+  // present, without any of the fallbacks applied by the getters.
+  friend auto EncodeTagsValue(const TrackData&, const TrackTags&)
+      -> std::string;
+  friend auto ParseTagsValue(const leveldb::Slice&, const TrackData&)
+      -> std::shared_ptr<TrackTags>;
+
   Container encoding_;
 
   std::optional<std::pmr::string> title_;
@@ -155,6 +186,10 @@ class TrackTags {
   std::optional<uint8_t> disc_;
   std::optional<uint16_t> track_;
   std::pmr::vector<std::pmr::string> genres_;
+  std::optional<int16_t> track_gain_;
+  std::optional<uint32_t> track_peak_;
+  std::optional<int16_t> album_gain_;
+  std::optional<uint32_t> album_peak_;
 };
 
 /*
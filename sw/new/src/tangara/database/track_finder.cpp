@@ -6,6 +6,8 @@
 
 #include "database/track_finder.hpp"
 
+#include <algorithm>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <memory>
@@ -13,8 +15,10 @@
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
-#include "database/track_finder.hpp"
+#include "esp_timer.h"
 #include "ff.h"
 
 #include "drivers/spi.hpp"
@@ -25,10 +29,14 @@ namespace database {
 static_assert(sizeof(TCHAR) == sizeof(char), "TCHAR must be CHAR");
 
 CandidateIterator::CandidateIterator(std::string_view root)
-    : to_explore_(&memory::kSpiRamResource) {
+    : recursive_(true), to_explore_(&memory::kSpiRamResource) {
   to_explore_.push_back({root.data(), root.size()});
 }
 
+CandidateIterator::CandidateIterator(std::span<const std::pmr::string> dirs)
+    : recursive_(false),
+      to_explore_(dirs.begin(), dirs.end(), &memory::kSpiRamResource) {}
+
 auto CandidateIterator::next(FILINFO& info) -> std::optional<std::string> {
   std::scoped_lock<std::mutex> lock{mut_};
   while (!to_explore_.empty() || current_) {
@@ -67,7 +75,9 @@ auto CandidateIterator::next(FILINFO& info) -> std::optional<std::string> {
 
       if (info.fattrib & AM_DIR) {
         // This is a directory. Add it to the explore queue.
-        to_explore_.push_back(full_path);
+        if (recursive_) {
+          to_explore_.push_back(full_path);
+        }
       } else {
         // This is a file! We can return now.
         return {{full_path.data(), full_path.size()}};
@@ -79,40 +89,216 @@ auto CandidateIterator::next(FILINFO& info) -> std::optional<std::string> {
   return {};
 }
 
-TrackFinder::TrackFinder(
-    tasks::WorkerPool& pool,
-    size_t parallelism,
-    std::function<void(FILINFO&, std::string_view)> processor,
-    std::function<void()> complete_cb)
+auto TrackFinder::stageName(Stage s) -> const char* {
+  switch (s) {
+    case Stage::kEnumerate:
+      return "enumerate";
+    case Stage::kReadHeader:
+      return "read header";
+    case Stage::kParseTags:
+      return "parse tags";
+    case Stage::kIndex:
+      return "index";
+    case Stage::kCommit:
+      return "commit";
+  }
+  return "";
+}
+
+TrackFinder::TrackFinder(tasks::WorkerPool& pool,
+                         const Config& config,
+                         const Stages& stages,
+                         std::function<void()> complete_cb)
     : pool_{pool},
-      parallelism_(parallelism),
-      processor_(processor),
-      complete_cb_(complete_cb) {}
+      config_(config),
+      stages_(stages),
+      complete_cb_(complete_cb),
+      is_enumerating_(false),
+      reserved_(),
+      active_(),
+      stats_() {}
 
 auto TrackFinder::launch(std::string_view root) -> void {
-  iterator_ = std::make_unique<CandidateIterator>(root);
-  num_workers_ = parallelism_;
-  for (size_t i = 0; i < parallelism_; i++) {
-    schedule();
+  start(std::make_unique<CandidateIterator>(root));
+}
+
+auto TrackFinder::launch(std::span<const std::pmr::string> dirs) -> void {
+  start(std::make_unique<CandidateIterator>(dirs));
+}
+
+auto TrackFinder::start(std::unique_ptr<CandidateIterator> it) -> void {
+  std::vector<Work> work;
+  {
+    std::scoped_lock<std::mutex> lock{mutex_};
+    iterator_ = std::move(it);
+    is_enumerating_ = true;
+    stats_ = {};
+    schedule(work);
   }
+  dispatch(work);
+}
+
+auto TrackFinder::stats() -> Stats {
+  std::scoped_lock<std::mutex> lock{mutex_};
+  return stats_;
 }
 
-auto TrackFinder::schedule() -> void {
-  pool_.Dispatch<void>([&]() {
-    FILINFO info;
-    auto next = iterator_->next(info);
-    if (next) {
-      std::invoke(processor_, info, *next);
-      schedule();
+auto TrackFinder::run(Stage stage, std::unique_ptr<Candidate> candidate)
+    -> void {
+  size_t idx = static_cast<size_t>(stage);
+  bool is_last = idx + 1 == kNumStages;
+
+  uint64_t start = esp_timer_get_time();
+  bool keep = runStage(stage, *candidate);
+  uint64_t busy = esp_timer_get_time() - start;
+
+  std::vector<Work> work;
+  bool finished = false;
+  {
+    std::scoped_lock<std::mutex> lock{mutex_};
+    active_[idx]--;
+    stats_[idx].busy_us += busy;
+
+    if (stage == Stage::kEnumerate && !keep) {
+      // Nothing left to enumerate; this isn't a dropped file.
+      is_enumerating_ = false;
+    } else if (!keep) {
+      stats_[idx].dropped++;
     } else {
-      std::scoped_lock<std::mutex> lock{workers_mutex_};
-      num_workers_ -= 1;
-      if (num_workers_ == 0) {
-        iterator_.reset();
-        std::invoke(complete_cb_);
+      stats_[idx].processed++;
+    }
+
+    if (!is_last) {
+      reserved_[idx + 1]--;
+      if (keep) {
+        queues_[idx + 1].push_back(std::move(candidate));
+        auto& next = stats_[idx + 1];
+        next.queue_depth = queues_[idx + 1].size();
+        next.max_queue_depth = std::max(next.max_queue_depth, next.queue_depth);
+      }
+    }
+
+    schedule(work);
+
+    finished = work.empty() && checkFinished();
+  }
+
+  dispatch(work);
+  if (finished) {
+    std::invoke(complete_cb_);
+  }
+}
+
+auto TrackFinder::cancel() -> void {
+  bool finished;
+  {
+    std::scoped_lock<std::mutex> lock{mutex_};
+    if (!iterator_) {
+      // Not currently scanning.
+      return;
+    }
+    is_enumerating_ = false;
+
+    // Files waiting to be committed have already been assigned ids, so they
+    // must be allowed through. Everything before that can be dropped.
+    for (size_t i = 1; i < static_cast<size_t>(Stage::kCommit); i++) {
+      stats_[i].dropped += queues_[i].size();
+      stats_[i].queue_depth = 0;
+      queues_[i].clear();
+    }
+
+    finished = checkFinished();
+  }
+
+  if (finished) {
+    // Completing a scan can mean flushing writes to the database, which the
+    // caller (often the UI) shouldn't be made to wait for.
+    pool_.Dispatch<void>(complete_cb_);
+  }
+}
+
+auto TrackFinder::checkFinished() -> bool {
+  if (is_enumerating_ || !iterator_) {
+    return false;
+  }
+  for (size_t i = 0; i < kNumStages; i++) {
+    if (active_[i] > 0 || !queues_[i].empty()) {
+      return false;
+    }
+  }
+  iterator_.reset();
+  return true;
+}
+
+auto TrackFinder::runStage(Stage stage, Candidate& candidate) -> bool {
+  switch (stage) {
+    case Stage::kEnumerate: {
+      auto next = iterator_->next(candidate.info);
+      if (!next) {
+        return false;
       }
+      candidate.path = {next->data(), next->size()};
+      return true;
     }
-  });
+    case Stage::kReadHeader:
+      return std::invoke(stages_.read_header, candidate);
+    case Stage::kParseTags:
+      return std::invoke(stages_.parse_tags, candidate);
+    case Stage::kIndex:
+      return std::invoke(stages_.index, candidate);
+    case Stage::kCommit:
+      std::invoke(stages_.commit, candidate);
+      return true;
+  }
+  return false;
+}
+
+auto TrackFinder::schedule(std::vector<Work>& out) -> void {
+  // Start from the end of the pipeline, so that files already in progress are
+  // favoured over finding new ones.
+  for (size_t i = kNumStages; i-- > 0;) {
+    Stage stage = static_cast<Stage>(i);
+    bool is_last = i + 1 == kNumStages;
+    while (active_[i] < config_[i].parallelism) {
+      if (stage == Stage::kEnumerate ? !is_enumerating_ : queues_[i].empty()) {
+        break;
+      }
+      if (!is_last && queues_[i + 1].size() + reserved_[i + 1] >=
+                          config_[i + 1].queue_capacity) {
+        break;
+      }
+
+      std::unique_ptr<Candidate> candidate;
+      if (stage == Stage::kEnumerate) {
+        candidate = std::make_unique<Candidate>();
+        candidate->path = std::pmr::string{&memory::kSpiRamResource};
+        candidate->header =
+            std::pmr::vector<std::byte>{&memory::kSpiRamResource};
+      } else {
+        candidate = std::move(queues_[i].front());
+        queues_[i].pop_front();
+        stats_[i].queue_depth = queues_[i].size();
+      }
+
+      active_[i]++;
+      if (!is_last) {
+        reserved_[i + 1]++;
+      }
+      out.emplace_back(stage, std::move(candidate));
+    }
+  }
+}
+
+auto TrackFinder::dispatch(std::vector<Work>& work) -> void {
+  for (auto& [stage, candidate] : work) {
+    // std::function must be copyable, so the candidate can't be captured by
+    // unique_ptr.
+    Candidate* raw = candidate.release();
+    pool_.Dispatch<void>([this, stage, raw]() {
+      run(stage, std::unique_ptr<Candidate>{raw});
+    });
+  }
+  work.clear();
 }
 
 }  // namespace database
@@ -6,16 +6,23 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <span>
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "ff.h"
 
+#include "database/index.hpp"
+#include "database/track.hpp"
 #include "tasks.hpp"
 
 namespace database {
@@ -27,6 +34,12 @@ class CandidateIterator {
  public:
   CandidateIterator(std::string_view root);
 
+  /*
+   * Iterates through only the files directly within each of the given
+   * directories, without descending into their subdirectories.
+   */
+  CandidateIterator(std::span<const std::pmr::string> dirs);
+
   /*
    * Returns the next file. The stat result is placed within `out`. If the
    * iterator has finished, returns absent. This method always modifies the
@@ -40,38 +53,140 @@ class CandidateIterator {
 
  private:
   std::mutex mut_;
+  const bool recursive_;
   std::pmr::deque<std::pmr::string> to_explore_;
   std::optional<std::pair<std::pmr::string, FF_DIR>> current_;
 };
 
 /*
- * Utility for iterating through each file within a directory root. Iteration
- * can be sharded across several tasks.
+ * A file found by a TrackFinder, along with everything that has been worked
+ * out about it so far as it moves through each stage of processing.
+ */
+struct Candidate {
+  std::pmr::string path;
+  FILINFO info;
+
+  // The leading bytes of the file. Filled in by the kReadHeader stage.
+  std::pmr::vector<std::byte> header;
+  // Filled in by the kParseTags stage.
+  std::shared_ptr<TrackTags> tags;
+  // Filled in by the kIndex stage.
+  std::shared_ptr<TrackData> data;
+  std::vector<std::pair<IndexKey, std::string>> index_records;
+};
+
+/*
+ * Utility for processing each file within a directory root. Processing is
+ * split into a pipeline of stages, connected by bounded queues, with each
+ * stage able to work on a different number of files at once. This allows
+ * i/o-bound stages, such as reading from the SD card, to overlap with
+ * cpu-bound stages such as tag parsing.
+ *
+ * Workers never block waiting for room in a queue; a stage only takes a new
+ * file once there is guaranteed to be room for it in the next stage's queue.
+ * Any number of stages can therefore safely share the same WorkerPool.
  */
 class TrackFinder {
  public:
+  enum class Stage {
+    kEnumerate,
+    kReadHeader,
+    kParseTags,
+    kIndex,
+    kCommit,
+  };
+  static constexpr size_t kNumStages = 5;
+
+  static auto stageName(Stage) -> const char*;
+
+  /*
+   * The work done for each file. Each stage except the last returns false if
+   * the file should not be processed any further.
+   */
+  struct Stages {
+    std::function<bool(Candidate&)> read_header;
+    std::function<bool(Candidate&)> parse_tags;
+    std::function<bool(Candidate&)> index;
+    std::function<void(Candidate&)> commit;
+  };
+
+  struct StageConfig {
+    // The maximum number of files this stage may work on at once.
+    size_t parallelism;
+    // The maximum number of files waiting to enter this stage.
+    size_t queue_capacity;
+  };
+  using Config = std::array<StageConfig, kNumStages>;
+
+  struct StageStats {
+    // Files that made it through this stage.
+    uint32_t processed;
+    // Files that this stage decided not to process any further.
+    uint32_t dropped;
+    // Total time spent working within this stage, across all workers.
+    uint64_t busy_us;
+    // Files currently waiting to enter this stage.
+    uint32_t queue_depth;
+    // The most files that have been waiting to enter this stage at once.
+    uint32_t max_queue_depth;
+  };
+  using Stats = std::array<StageStats, kNumStages>;
+
   TrackFinder(tasks::WorkerPool&,
-              size_t parallelism,
-              std::function<void(FILINFO&, std::string_view)> processor,
+              const Config&,
+              const Stages&,
               std::function<void()> complete_cb);
 
+  /* Processes every file beneath the given root. */
   auto launch(std::string_view root) -> void;
 
+  /* Processes every file directly within each of the given directories. */
+  auto launch(std::span<const std::pmr::string> dirs) -> void;
+
+  /*
+   * Stops looking for new files, and drops any files that haven't yet been
+   * indexed. Files that are already being committed are allowed to finish.
+   * The completion callback is still invoked once the scan has wound down, on
+   * the worker pool rather than on the caller's task.
+   */
+  auto cancel() -> void;
+
+  /* Returns a snapshot of the throughput of each stage of the current scan. */
+  auto stats() -> Stats;
+
   // Cannot be copied or moved.
   TrackFinder(const TrackFinder&) = delete;
   TrackFinder& operator=(const TrackFinder&) = delete;
 
  private:
+  using Work = std::pair<Stage, std::unique_ptr<Candidate>>;
+
+  auto start(std::unique_ptr<CandidateIterator>) -> void;
+  auto run(Stage, std::unique_ptr<Candidate>) -> void;
+  auto runStage(Stage, Candidate&) -> bool;
+  auto schedule(std::vector<Work>& out) -> void;
+  auto dispatch(std::vector<Work>&) -> void;
+  // Returns true exactly once per scan, after every stage has gone idle.
+  // Must be called with mutex_ held.
+  auto checkFinished() -> bool;
+
   tasks::WorkerPool& pool_;
-  const size_t parallelism_;
-  const std::function<void(FILINFO&, std::string_view)> processor_;
+  const Config config_;
+  const Stages stages_;
   const std::function<void()> complete_cb_;
 
-  std::mutex workers_mutex_;
   std::unique_ptr<CandidateIterator> iterator_;
-  size_t num_workers_;
 
-  auto schedule() -> void;
+  // Guards all of the below.
+  std::mutex mutex_;
+  bool is_enumerating_;
+  // Files waiting to enter each stage. The queue for kEnumerate is unused.
+  std::array<std::deque<std::unique_ptr<Candidate>>, kNumStages> queues_;
+  // Queue slots held by workers in the previous stage, so that they have
+  // somewhere to put their file once they are done.
+  std::array<size_t, kNumStages> reserved_;
+  std::array<size_t, kNumStages> active_;
+  Stats stats_;
 };
 
 }  // namespace database
@@ -165,6 +165,16 @@ static auto update(lua_State* L) -> int {
   return 0;
 }
 
+static auto cancel_update(lua_State* L) -> int {
+  Bridge* instance = Bridge::Get(L);
+  auto db = instance->services().database().lock();
+  if (!db) {
+    return 0;
+  }
+  db->cancelUpdate();
+  return 0;
+}
+
 static auto track_by_id(lua_State* L) -> int {
   auto id = luaL_checkinteger(L, -1);
 
@@ -185,9 +195,13 @@ static auto track_by_id(lua_State* L) -> int {
 }
 
 static const struct luaL_Reg kDatabaseFuncs[] = {
-    {"indexes", indexes}, {"version", version},
-    {"size", size},       {"recreate", recreate},
-    {"update", update},   {"track_by_id", track_by_id},
+    {"indexes", indexes},
+    {"version", version},
+    {"size", size},
+    {"recreate", recreate},
+    {"update", update},
+    {"cancel_update", cancel_update},
+    {"track_by_id", track_by_id},
     {NULL, NULL}};
 
 static auto push_lua_record(lua_State* state,
@@ -269,6 +283,12 @@ static auto db_iterator_clone(lua_State* state) -> int {
   return 1;
 }
 
+static auto db_iterator_total(lua_State* state) -> int {
+  database::Iterator* it = db_check_iterator(state, 1);
+  lua_pushinteger(state, it->total());
+  return 1;
+}
+
 static auto db_iterator_gc(lua_State* state) -> int {
   database::Iterator* it = db_check_iterator(state, 1);
   delete it;
@@ -279,7 +299,7 @@ static const struct luaL_Reg kDbIteratorFuncs[] = {
     {"next", db_iterate},         {"prev", db_iterate_prev},
     {"clone", db_iterator_clone}, {"__call", db_iterate},
     {"__gc", db_iterator_gc},     {"value", db_iterator_value},
-    {NULL, NULL}};
+    {"total", db_iterator_total}, {NULL, NULL}};
 
 static auto record_text(lua_State* state) -> int {
   database::Record* rec = db_check_record(state, 1);
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/audio_decoder.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "audio/audio_sink.hpp"
+#include "audio/audio_source.hpp"
+#include "audio/processor.hpp"
+#include "codec.hpp"
+#include "database/track.hpp"
+#include "drivers/pcm_buffer.hpp"
+#include "memory_stream.hpp"
+#include "sample.hpp"
+
+namespace audio {
+
+static constexpr uint32_t kRate = 48000;
+
+// Much smaller than the real sink, so that any delay in starting the next
+// track shows up as silence.
+static constexpr size_t kSinkSamples = kRate * 2 / 10;
+
+/* Output that accepts any format, and plays nothing. */
+class StubOutput : public IAudioOutput {
+ public:
+  auto SetVolumeImbalance(int_fast8_t) -> void override {}
+  auto SetVolume(uint16_t) -> void override {}
+  auto GetVolume() -> uint16_t override { return 0; }
+  auto GetVolumePct() -> uint_fast8_t override { return 0; }
+  auto GetVolumeDb() -> int_fast16_t override { return 0; }
+  auto SetVolumePct(uint_fast8_t) -> bool override { return true; }
+  auto SetVolumeDb(int_fast16_t) -> bool override { return true; }
+  auto AdjustVolumeUp() -> bool override { return true; }
+  auto AdjustVolumeDown() -> bool override { return true; }
+
+  auto PrepareFormat(const Format& f) -> Format override {
+    return Format{
+        .sample_rate = f.sample_rate,
+        .num_channels = 2,
+        .bits_per_sample = 16,
+    };
+  }
+  auto Configure(const Format&) -> void override {}
+
+ protected:
+  auto changeMode(Modes) -> void override {}
+};
+
+/*
+ * The decoder and processor tasks run for the life of the firmware, so tests
+ * share a single pipeline that's never destroyed.
+ */
+static auto pipeline() -> std::pair<Decoder&, drivers::PcmBuffer&> {
+  static auto* sink = new drivers::PcmBuffer(kSinkSamples);
+  static auto* decoder = []() {
+    auto processor = std::make_shared<SampleProcessor>(*sink);
+    processor->SetOutput(std::make_shared<StubOutput>());
+    return Decoder::Start(processor);
+  }();
+  return {*decoder, *sink};
+}
+
+static auto append16le(std::vector<std::byte>& out, uint32_t val) -> void {
+  out.push_back(static_cast<std::byte>(val));
+  out.push_back(static_cast<std::byte>(val >> 8));
+}
+
+static auto append32le(std::vector<std::byte>& out, uint32_t val) -> void {
+  append16le(out, val);
+  append16le(out, val >> 16);
+}
+
+static auto appendStr(std::vector<std::byte>& out, const char* str) -> void {
+  for (; *str; str++) {
+    out.push_back(static_cast<std::byte>(*str));
+  }
+}
+
+/*
+ * A stereo wav file whose every sample has the same value, so that each
+ * track's samples can be told apart from the others', and from silence.
+ */
+static auto makeWav(int16_t value, size_t frames) -> std::vector<std::byte> {
+  std::vector<std::byte> out;
+  appendStr(out, "RIFF");
+  append32le(out, 36 + frames * 4);
+  appendStr(out, "WAVEfmt ");
+  append32le(out, 16);
+  append16le(out, 1);  // PCM
+  append16le(out, 2);
+  append32le(out, kRate);
+  append32le(out, kRate * 4);
+  append16le(out, 4);
+  append16le(out, 16);
+  appendStr(out, "data");
+  append32le(out, frames * 4);
+  for (size_t i = 0; i < frames * 2; i++) {
+    append16le(out, value);
+  }
+  return out;
+}
+
+static auto track(std::span<const std::byte> wav, const char* path)
+    -> std::shared_ptr<TaggedStream> {
+  return std::make_shared<TaggedStream>(
+      std::make_shared<database::TrackTags>(),
+      std::make_unique<MemoryStream>(codecs::StreamType::kWav, wav), path);
+}
+
+/*
+ * Plays from the sink in real time, as an output would, until `samples` of
+ * audio have been heard. Records everything that comes out of the sink,
+ * including silence for whenever the sink ran dry. `on_tick` is called once
+ * per tick, before each block is played.
+ */
+static auto listen(drivers::PcmBuffer& sink,
+                   size_t samples,
+                   std::function<void(void)> on_tick = {})
+    -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out;
+  std::vector<sample::Sample> block(kRate * 2 * portTICK_PERIOD_MS / 1000);
+  size_t heard = 0;
+  for (int idle = 0; heard < samples && idle < 1000;) {
+    vTaskDelay(1);
+    if (on_tick) {
+      on_tick();
+    }
+    size_t received = sink.receive(block, false);
+    heard += received;
+    idle = received > 0 ? 0 : idle + 1;
+    // Ignore silence from before the first track began.
+    if (heard > 0) {
+      out.insert(out.end(), block.begin(), block.end());
+    }
+  }
+  return out;
+}
+
+/* Counts the silent samples between the end of one track and the next. */
+static auto gapBetween(const std::vector<sample::Sample>& out,
+                       sample::Sample first,
+                       sample::Sample second) -> size_t {
+  auto last_of_first = std::find(out.rbegin(), out.rend(), first).base();
+  auto first_of_second = std::find(out.begin(), out.end(), second);
+  REQUIRE(last_of_first <= first_of_second);
+  return first_of_second - last_of_first;
+}
+
+TEST_CASE("gapless playback", "[unit]") {
+  auto [decoder, sink] = pipeline();
+
+  auto first = makeWav(1000, kRate / 2);
+  auto second = makeWav(2000, kRate / 4);
+  auto other = makeWav(3000, kRate / 4);
+  size_t first_samples = kRate;
+  size_t second_samples = kRate / 2;
+
+  SECTION("the next track follows on without any gap") {
+    decoder.open(track(first, "first.wav"));
+    decoder.prepareNext(track(second, "second.wav"));
+
+    auto out = listen(sink, first_samples + second_samples);
+    REQUIRE(std::count(out.begin(), out.end(), 1000) == first_samples);
+    REQUIRE(std::count(out.begin(), out.end(), 2000) == second_samples);
+    REQUIRE(gapBetween(out, 1000, 2000) == 0);
+  }
+
+  SECTION("the next track can be replaced") {
+    decoder.open(track(first, "first.wav"));
+    decoder.prepareNext(track(other, "other.wav"));
+    decoder.prepareNext(track(second, "second.wav"));
+
+    auto out = listen(sink, first_samples + second_samples);
+    REQUIRE(std::count(out.begin(), out.end(), 3000) == 0);
+    REQUIRE(std::count(out.begin(), out.end(), 2000) == second_samples);
+    REQUIRE(gapBetween(out, 1000, 2000) == 0);
+  }
+
+  SECTION("opening a track forgets the next track") {
+    decoder.open(track(first, "first.wav"));
+    decoder.prepareNext(track(second, "second.wav"));
+    decoder.open(track(other, "other.wav"));
+
+    auto out = listen(sink, second_samples + kRate);
+    REQUIRE(std::count(out.begin(), out.end(), 3000) == second_samples);
+    REQUIRE(std::count(out.begin(), out.end(), 2000) == 0);
+  }
+}
+
+TEST_CASE("gap between tracks", "[.benchmark]") {
+  auto [decoder, sink] = pipeline();
+
+  auto first = makeWav(1000, kRate);
+  auto second = makeWav(2000, kRate / 4);
+  size_t first_samples = kRate * 2;
+  size_t second_samples = kRate / 2;
+
+  std::printf("%12s %12s\n", "latency ms", "gap samples");
+
+  // Opening the next track only once the first has been decoded, as the audio
+  // fsm would without the decoder's help. How long it takes the fsm to react
+  // depends on how busy it and the sd card are.
+  for (uint32_t latency_ms : {0, 50, 100, 200}) {
+    uint32_t start = sink.totalSent();
+    TickType_t open_at = 0;
+    TickType_t ticks = 0;
+    decoder.open(track(first, "first.wav"));
+
+    auto out = listen(sink, first_samples + second_samples, [&]() {
+      ticks++;
+      if (!open_at && sink.totalSent() - start >= first_samples) {
+        open_at = ticks + pdMS_TO_TICKS(latency_ms) + 1;
+      }
+      if (ticks == open_at) {
+        decoder.open(track(second, "second.wav"));
+      }
+    });
+    std::printf("%12lu %12zu\n", static_cast<unsigned long>(latency_ms),
+                gapBetween(out, 1000, 2000));
+  }
+
+  decoder.open(track(first, "first.wav"));
+  decoder.prepareNext(track(second, "second.wav"));
+  auto out = listen(sink, first_samples + second_samples);
+  std::printf("%12s %12zu\n", "follow on", gapBetween(out, 1000, 2000));
+}
+
+}  // namespace audio
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/processor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "audio/audio_events.hpp"
+#include "audio/audio_sink.hpp"
+#include "drivers/pcm_buffer.hpp"
+#include "sample.hpp"
+
+namespace audio {
+
+/*
+ * Output that plays nothing. It either accepts any sample rate, like the I2S
+ * output, or insists on 48kHz, like the Bluetooth output.
+ */
+class FakeOutput : public IAudioOutput {
+ public:
+  FakeOutput(std::optional<uint32_t> fixed_rate) : fixed_rate_(fixed_rate) {}
+
+  auto SetVolumeImbalance(int_fast8_t) -> void override {}
+  auto SetVolume(uint16_t) -> void override {}
+  auto GetVolume() -> uint16_t override { return 0; }
+  auto GetVolumePct() -> uint_fast8_t override { return 0; }
+  auto GetVolumeDb() -> int_fast16_t override { return 0; }
+  auto SetVolumePct(uint_fast8_t) -> bool override { return true; }
+  auto SetVolumeDb(int_fast16_t) -> bool override { return true; }
+  auto AdjustVolumeUp() -> bool override { return true; }
+  auto AdjustVolumeDown() -> bool override { return true; }
+
+  auto PrepareFormat(const Format& f) -> Format override {
+    return Format{
+        .sample_rate = fixed_rate_.value_or(f.sample_rate),
+        .num_channels = 2,
+        .bits_per_sample = 16,
+    };
+  }
+  auto Configure(const Format&) -> void override {}
+
+ protected:
+  auto changeMode(Modes) -> void override {}
+
+ private:
+  std::optional<uint32_t> fixed_rate_;
+};
+
+/*
+ * The processor's task runs for the life of the firmware, so tests share a
+ * single instance that's never destroyed.
+ */
+static auto processor() -> std::pair<SampleProcessor&, drivers::PcmBuffer&> {
+  static auto* sink = new drivers::PcmBuffer(48000 * 2);
+  static auto* instance = new SampleProcessor(*sink);
+  return {*instance, *sink};
+}
+
+static auto sine(uint32_t rate, uint8_t channels, size_t frames)
+    -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out;
+  for (size_t i = 0; i < frames; i++) {
+    double val = 0.5 * std::sin(2 * M_PI * 1000 * i / rate);
+    for (uint8_t c = 0; c < channels; c++) {
+      out.push_back(std::lround(val * INT16_MAX) + c);
+    }
+  }
+  return out;
+}
+
+/*
+ * Streams the given samples through the processor, in chunks about the size
+ * that decoders produce, and collects everything that comes out of the other
+ * end.
+ */
+static auto play(std::shared_ptr<IAudioOutput> output,
+                 uint32_t rate,
+                 uint8_t channels,
+                 std::span<sample::Sample> samples,
+                 int64_t* finished_at = nullptr)
+    -> std::vector<sample::Sample> {
+  auto [proc, sink] = processor();
+  proc.SetOutput(output);
+
+  auto track = std::make_shared<TrackInfo>();
+  track->format = IAudioOutput::Format{
+      .sample_rate = rate,
+      .num_channels = channels,
+      .bits_per_sample = 16,
+  };
+  proc.beginStream(track);
+
+  std::vector<sample::Sample> out;
+  sample::Sample chunk[2048];
+  auto drain = [&]() {
+    while (!sink.isEmpty()) {
+      size_t received = sink.receive(chunk, false);
+      out.insert(out.end(), chunk, chunk + received);
+      if (finished_at) {
+        *finished_at = esp_timer_get_time();
+      }
+    }
+  };
+
+  while (!samples.empty()) {
+    auto chunk_in =
+        samples.first(std::min<size_t>(samples.size(), 1152 * channels));
+    auto left = proc.continueStream(chunk_in);
+    samples = samples.subspan(chunk_in.size() - left.size());
+    drain();
+  }
+  proc.endStream(false);
+
+  // Keep collecting until the processor has clearly finished.
+  for (int idle = 0; idle < 5;) {
+    size_t before = out.size();
+    vTaskDelay(pdMS_TO_TICKS(10));
+    drain();
+    idle = out.size() == before ? idle + 1 : 0;
+  }
+  return out;
+}
+
+TEST_CASE("sample processor", "[unit]") {
+  auto any_rate = std::make_shared<FakeOutput>(std::nullopt);
+  auto fixed_rate = std::make_shared<FakeOutput>(48000);
+
+  SECTION("passes streams in the output's format through untouched") {
+    auto input = sine(44100, 2, 10000);
+    uint64_t copies_before = processor().first.samplesCopied();
+    auto out = play(any_rate, 44100, 2, input);
+    REQUIRE(out == input);
+
+    // Once into the processor's ring, and once out into the sink.
+    uint64_t copies = processor().first.samplesCopied() - copies_before;
+    REQUIRE(copies == input.size() * 2);
+  }
+
+  SECTION("doubles mono streams into stereo") {
+    auto input = sine(48000, 1, 10000);
+    auto out = play(any_rate, 48000, 1, input);
+    REQUIRE(out.size() == input.size() * 2);
+    for (size_t i = 0; i < input.size(); i++) {
+      REQUIRE(out[i * 2] == input[i]);
+      REQUIRE(out[i * 2 + 1] == input[i]);
+    }
+  }
+
+  SECTION("resamples for outputs with a fixed rate") {
+    for (uint8_t channels : {1, 2}) {
+      auto input = sine(44100, channels, 44100);
+      auto out = play(fixed_rate, 44100, channels, input);
+      REQUIRE(out.size() / 2 <= 48000);
+      REQUIRE(out.size() / 2 >= 48000 - 32);
+    }
+  }
+}
+
+TEST_CASE("sample processor performance", "[.benchmark]") {
+  struct Case {
+    const char* name;
+    std::shared_ptr<IAudioOutput> output;
+    uint32_t rate;
+    uint8_t channels;
+  };
+  const Case cases[] = {
+      {"passthrough", std::make_shared<FakeOutput>(std::nullopt), 44100, 2},
+      {"mono", std::make_shared<FakeOutput>(std::nullopt), 44100, 1},
+      {"resample", std::make_shared<FakeOutput>(48000), 44100, 2},
+      {"resample mono", std::make_shared<FakeOutput>(48000), 44100, 1},
+  };
+
+  for (const auto& c : cases) {
+    auto input = sine(c.rate, c.channels, c.rate * 5);
+    uint64_t copies_before = processor().first.samplesCopied();
+
+    int64_t start = esp_timer_get_time();
+    int64_t end;
+    auto out = play(c.output, c.rate, c.channels, input, &end);
+    int64_t elapsed = end - start;
+
+    uint64_t copies = processor().first.samplesCopied() - copies_before;
+    std::printf("%-14s %6.1f ns/sample, %.2f copies/sample\n", c.name,
+                elapsed * 1000.0 / out.size(),
+                static_cast<double>(copies) / out.size());
+  }
+}
+
+}  // namespace audio
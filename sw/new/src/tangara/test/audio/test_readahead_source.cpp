@@ -0,0 +1,139 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/readahead_source.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "codec.hpp"
+#include "memory_stream.hpp"
+#include "tasks.hpp"
+
+namespace audio {
+
+// The size of ReadaheadSource's buffer before it was made adaptive.
+static constexpr size_t kFixedBufferSize = 1024 * 512;
+
+/*
+ * Stream that's as slow to read from as an sd card that's also being used by
+ * other tasks: every read takes a few milliseconds, and every so often one
+ * stalls for much longer.
+ */
+class SlowStream : public MemoryStream {
+ public:
+  SlowStream(std::span<const std::byte> data)
+      : MemoryStream(codecs::StreamType::kNative, data),
+        reads(0),
+        seeks(0) {}
+
+  auto Read(std::span<std::byte> dest) -> ssize_t override {
+    vTaskDelay(pdMS_TO_TICKS(++reads % 8 == 0 ? 150 : 10));
+    return MemoryStream::Read(dest);
+  }
+
+  auto SeekTo(int64_t destination, SeekFrom from) -> void override {
+    seeks++;
+    MemoryStream::SeekTo(destination, from);
+  }
+
+  std::atomic<size_t> reads;
+  std::atomic<size_t> seeks;
+};
+
+static auto worker() -> tasks::WorkerPool& {
+  static auto* instance = new tasks::WorkerPool();
+  return *instance;
+}
+
+static auto pattern(size_t size) -> std::vector<std::byte> {
+  std::vector<std::byte> out(size);
+  for (size_t i = 0; i < size; i++) {
+    out[i] = static_cast<std::byte>(i * 7 + i / 251);
+  }
+  return out;
+}
+
+TEST_CASE("readahead source", "[unit]") {
+  auto data = pattern(1024 * 384);
+  auto* slow = new SlowStream(data);
+  ReadaheadSource source{worker(), std::unique_ptr<codecs::IStream>{slow}};
+
+  // Codecs read their headers before readahead begins.
+  std::vector<std::byte> out(data.size());
+  REQUIRE(source.Read(std::span{out}.first(64)) == 64);
+  source.SetPreambleFinished();
+
+  SECTION("keeps up with a steady reader") {
+    // About 100 KiB/s; a little faster than 16 bit CD audio compressed by
+    // FLAC. Reads that have to wait on the slow stream are underruns.
+    size_t pos = 64;
+    size_t underruns = 0;
+    size_t peak_buffer_size = 0;
+    while (pos < out.size()) {
+      vTaskDelay(pdMS_TO_TICKS(10));
+      size_t len = std::min<size_t>(1024, out.size() - pos);
+      int64_t start = esp_timer_get_time();
+      REQUIRE(source.Read(std::span{out}.subspan(pos, len)) == len);
+      // The very first read necessarily waits for the first chunk.
+      if (pos > 64 && esp_timer_get_time() - start > 5000) {
+        underruns++;
+      }
+      pos += len;
+      peak_buffer_size = std::max(peak_buffer_size, source.BufferSize());
+    }
+
+    REQUIRE(out == data);
+    REQUIRE(underruns == 0);
+    REQUIRE(peak_buffer_size < kFixedBufferSize);
+
+    // Everything has been read, so the buffer is no longer needed.
+    REQUIRE(source.Read(std::span{out}.first(1)) == 0);
+    REQUIRE(source.BufferSize() == 0);
+  }
+
+  SECTION("serves seeks within the buffer from memory") {
+    while (source.BufferSize() == 0) {
+      vTaskDelay(1);
+    }
+    REQUIRE(source.Read(std::span{out}.subspan(64, 4096)) == 4096);
+
+    source.SeekTo(100, codecs::IStream::SeekFrom::kStartOfStream);
+    REQUIRE(source.CurrentPosition() == 100);
+    REQUIRE(source.Read(std::span{out}.subspan(100, 1000)) == 1000);
+    REQUIRE(std::equal(out.begin() + 100, out.begin() + 1100,
+                       data.begin() + 100));
+
+    source.SeekTo(2000, codecs::IStream::SeekFrom::kCurrentPosition);
+    REQUIRE(source.CurrentPosition() == 3100);
+    REQUIRE(source.Read(std::span{out}.subspan(3100, 1000)) == 1000);
+    REQUIRE(std::equal(out.begin() + 3100, out.begin() + 4100,
+                       data.begin() + 3100));
+
+    // Dropping the buffer would have meant seeking the wrapped stream.
+    REQUIRE(slow->seeks == 0);
+  }
+
+  SECTION("seeks beyond the buffer") {
+    source.SeekTo(-1000, codecs::IStream::SeekFrom::kEndOfStream);
+    REQUIRE(slow->seeks == 1);
+    REQUIRE(source.CurrentPosition() == data.size() - 1000);
+    REQUIRE(source.Read(out) == 1000);
+    REQUIRE(std::equal(out.begin(), out.begin() + 1000, data.end() - 1000));
+  }
+}
+
+}  // namespace audio
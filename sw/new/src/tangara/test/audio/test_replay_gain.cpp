@@ -0,0 +1,126 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/replay_gain.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "catch2/catch.hpp"
+
+#include "database/track.hpp"
+#include "drivers/pcm_mix.hpp"
+
+namespace audio {
+
+using database::TrackTags;
+
+TEST_CASE("loudness tags", "[unit]") {
+  TrackTags tags;
+
+  SECTION("reads gains in hundredths of a dB") {
+    tags.trackGain("-6.54 dB");
+    tags.albumGain("+3.2 dB");
+    REQUIRE(tags.trackGain() == -654);
+    REQUIRE(tags.albumGain() == 320);
+
+    tags.trackGain("  0.005");
+    REQUIRE(tags.trackGain() == 1);
+    tags.trackGain("-0.005 dB");
+    REQUIRE(tags.trackGain() == -1);
+    tags.trackGain("12");
+    REQUIRE(tags.trackGain() == 1200);
+  }
+
+  SECTION("reads peaks in Q15") {
+    tags.trackPeak("0.988541");
+    tags.albumPeak("1.000000");
+    REQUIRE(tags.trackPeak() == 32393u);
+    REQUIRE(tags.albumPeak() == 32768u);
+
+    // Lossy encoding can take peaks past full scale.
+    tags.trackPeak("1.2");
+    REQUIRE(tags.trackPeak() == 39322u);
+  }
+
+  SECTION("converts R128 gains to ReplayGain's reference level") {
+    tags.r128TrackGain("-1234");
+    tags.r128AlbumGain("256");
+    // -1234 / 256 dB, rounded to hundredths, plus 5 dB.
+    REQUIRE(tags.trackGain() == 18);
+    REQUIRE(tags.albumGain() == 600);
+    REQUIRE(!tags.trackPeak());
+  }
+
+  SECTION("reads only as far as the view goes") {
+    std::string_view gain{"-6.5432 dB", 4};
+    tags.trackGain(gain);
+    REQUIRE(tags.trackGain() == -650);
+  }
+
+  SECTION("ignores malformed values") {
+    tags.trackGain("dB");
+    tags.albumGain("");
+    tags.trackPeak("-0.5");
+    tags.albumPeak(".");
+    REQUIRE(!tags.trackGain());
+    REQUIRE(!tags.albumGain());
+    REQUIRE(!tags.trackPeak());
+    REQUIRE(!tags.albumPeak());
+  }
+
+  SECTION("saturates huge values") {
+    tags.trackGain("-99999");
+    REQUIRE(tags.trackGain() == INT16_MIN);
+  }
+}
+
+TEST_CASE("replaygain gains", "[unit]") {
+  TrackTags tags;
+
+  SECTION("is unity without tags") {
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kTrack) == drivers::kUnityGain);
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kAlbum) == drivers::kUnityGain);
+  }
+
+  SECTION("is unity when turned off") {
+    tags.trackGain("-6.54 dB");
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kOff) == drivers::kUnityGain);
+  }
+
+  SECTION("converts decibels to Q15") {
+    tags.trackGain("-6.54 dB");
+    tags.albumGain("-10 dB");
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kTrack) == 15433);
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kAlbum) == 10362);
+  }
+
+  SECTION("falls back to the other gain") {
+    tags.albumGain("-10 dB");
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kTrack) == 10362);
+
+    TrackTags track_only;
+    track_only.trackGain("-6.54 dB");
+    REQUIRE(ReplayGainFor(track_only, ReplayGainMode::kAlbum) == 15433);
+  }
+
+  SECTION("uses the peak that goes with the gain") {
+    tags.trackGain("+6 dB");
+    tags.albumGain("+6 dB");
+    tags.albumPeak("0.9");
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kTrack) == 65381);
+    // 0.9 of full scale may only be boosted by 1 / 0.9.
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kAlbum) == 36409);
+  }
+
+  SECTION("is capped at the most the mixer can apply") {
+    tags.trackGain("+12 dB");
+    REQUIRE(ReplayGainFor(tags, ReplayGainMode::kTrack) == drivers::kMaxGain);
+  }
+}
+
+}  // namespace audio
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/resample.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "speex/speex_resampler.h"
+
+#include "sample.hpp"
+
+namespace audio {
+
+/* Generates interleaved samples of a sine wave on every channel. */
+static auto sine(double freq_hz,
+                 uint32_t rate_hz,
+                 size_t frames,
+                 uint8_t channels,
+                 double amplitude = 0.9) -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out;
+  for (size_t i = 0; i < frames; i++) {
+    double val = amplitude * std::sin(2 * M_PI * freq_hz * i / rate_hz);
+    for (uint8_t c = 0; c < channels; c++) {
+      out.push_back(static_cast<sample::Sample>(std::lround(val * INT16_MAX)));
+    }
+  }
+  return out;
+}
+
+/*
+ * Feeds all of the input through the resampler in chunks of the given size,
+ * in the same way that SampleProcessor does.
+ */
+static auto resampleAll(IResampler& resampler,
+                        std::span<sample::Sample> input,
+                        size_t chunk) -> std::vector<sample::Sample> {
+  std::vector<sample::Sample> out;
+  std::vector<sample::Sample> buf(chunk);
+  for (;;) {
+    auto [read, wrote] =
+        resampler.Process(input.first(std::min(chunk, input.size())), buf,
+                          false);
+    out.insert(out.end(), buf.begin(), buf.begin() + wrote);
+    input = input.subspan(read);
+    // Keep going after the input runs out, until the resampler has emptied
+    // any buffers of its own.
+    if (read == 0 && wrote == 0) {
+      break;
+    }
+  }
+  return out;
+}
+
+/*
+ * Measures total harmonic distortion plus noise, in dB relative to the
+ * fundamental, of the first channel of a resampled sine wave. The fundamental
+ * is found with a least squares fit, and everything else counts as noise.
+ */
+static auto thdPlusNoise(std::span<const sample::Sample> samples,
+                         uint8_t channels,
+                         double freq_hz,
+                         uint32_t rate_hz) -> double {
+  // Skip the start, where the filters are still filling up.
+  size_t start = 2048;
+  size_t frames = samples.size() / channels;
+  double w = 2 * M_PI * freq_hz / rate_hz;
+
+  // Solve the normal equations for a*sin + b*cos + c.
+  double m[3][4] = {};
+  for (size_t i = start; i < frames; i++) {
+    double basis[3] = {std::sin(w * i), std::cos(w * i), 1.0};
+    double y = samples[i * channels];
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        m[r][c] += basis[r] * basis[c];
+      }
+      m[r][3] += basis[r] * y;
+    }
+  }
+  for (int p = 0; p < 3; p++) {
+    for (int r = 0; r < 3; r++) {
+      if (r == p) {
+        continue;
+      }
+      double f = m[r][p] / m[p][p];
+      for (int c = 0; c < 4; c++) {
+        m[r][c] -= f * m[p][c];
+      }
+    }
+  }
+  double a = m[0][3] / m[0][0];
+  double b = m[1][3] / m[1][1];
+  double dc = m[2][3] / m[2][2];
+
+  // Any constant delay in the output is absorbed by the phase of the fit.
+  double signal = 0;
+  double noise = 0;
+  for (size_t i = start; i < frames; i++) {
+    double fit = a * std::sin(w * i) + b * std::cos(w * i) + dc;
+    double err = samples[i * channels] - fit;
+    signal += fit * fit;
+    noise += err * err;
+  }
+  return 10 * std::log10(noise / signal);
+}
+
+TEST_CASE("polyphase resampler", "[unit]") {
+  SECTION("passes DC through unchanged") {
+    PolyphaseResampler resampler{1};
+    std::vector<sample::Sample> input(4410, 12345);
+    auto out = resampleAll(resampler, input, 1000);
+    REQUIRE(out.size() > 4700);
+    for (size_t i = PolyphaseResampler::kTaps; i < out.size(); i++) {
+      REQUIRE(out[i] == 12345);
+    }
+  }
+
+  SECTION("produces 160 frames for every 147") {
+    PolyphaseResampler resampler{2};
+    auto input = sine(1000, 44100, 44100, 2);
+    auto out = resampleAll(resampler, input, 2048);
+    // All but the last half filter's worth of input should be resampled.
+    REQUIRE(out.size() / 2 <= 48000);
+    REQUIRE(out.size() / 2 >= 48000 - PolyphaseResampler::kTaps);
+  }
+
+  SECTION("gives the same output however the input is split up") {
+    auto input = sine(440, 44100, 10000, 2);
+    PolyphaseResampler a{2};
+    PolyphaseResampler b{2};
+    auto expected = resampleAll(a, input, 4096);
+    auto out = resampleAll(b, input, 14);
+    REQUIRE(out == expected);
+  }
+
+  SECTION("treats each channel independently") {
+    auto mono = sine(3000, 44100, 10000, 1);
+    std::vector<sample::Sample> stereo;
+    for (auto s : mono) {
+      stereo.push_back(s);
+      stereo.push_back(-s);
+    }
+    PolyphaseResampler a{1};
+    PolyphaseResampler b{2};
+    auto mono_out = resampleAll(a, mono, 1024);
+    auto stereo_out = resampleAll(b, stereo, 2048);
+    REQUIRE(stereo_out.size() == mono_out.size() * 2);
+    for (size_t i = 0; i < mono_out.size(); i++) {
+      REQUIRE(stereo_out[i * 2] == mono_out[i]);
+      REQUIRE(std::abs(stereo_out[i * 2 + 1] + mono_out[i]) <= 1);
+    }
+  }
+
+  SECTION("resamples cleanly") {
+    for (double freq : {100.0, 1000.0, 10000.0, 18000.0}) {
+      INFO(freq << "Hz");
+      PolyphaseResampler resampler{2};
+      auto input = sine(freq, 44100, 44100, 2);
+      auto out = resampleAll(resampler, input, 2048);
+      REQUIRE(thdPlusNoise(out, 2, freq, 48000) < -70);
+    }
+  }
+}
+
+TEST_CASE("resampler selection", "[unit]") {
+  for (auto budget : {ResamplerBudget::kLow, ResamplerBudget::kMedium,
+                      ResamplerBudget::kHigh}) {
+    auto input = sine(1000, 44100, 4410, 2);
+
+    auto same = CreateResampler(44100, 44100, 2, budget);
+    REQUIRE(same->sourceRate() == 44100);
+    REQUIRE(resampleAll(*same, input, 1024) == input);
+
+    auto fixed = CreateResampler(44100, 48000, 2, budget);
+    PolyphaseResampler reference{2};
+    REQUIRE(fixed->sourceRate() == 44100);
+    REQUIRE(resampleAll(*fixed, input, 1024) ==
+            resampleAll(reference, input, 1024));
+
+    auto other = CreateResampler(32000, 48000, 2, budget);
+    REQUIRE(other->sourceRate() == 32000);
+    auto out = resampleAll(*other, input, 1024);
+    REQUIRE(out.size() / 2 > 4410 * 3 / 2 - 100);
+  }
+}
+
+TEST_CASE("resampler performance", "[.benchmark]") {
+  struct Tier {
+    const char* name;
+    uint32_t source_rate;
+    std::function<std::unique_ptr<IResampler>()> make;
+  };
+  const Tier tiers[] = {
+      {"bypass", 48000,
+       [] { return std::make_unique<BypassResampler>(48000); }},
+      {"polyphase", 44100,
+       [] { return std::make_unique<PolyphaseResampler>(2); }},
+      {"speex q0", 44100,
+       [] { return std::make_unique<SpeexResampler>(44100, 48000, 2, 0); }},
+      {"speex q2", 44100,
+       [] { return std::make_unique<SpeexResampler>(44100, 48000, 2, 2); }},
+      {"speex q4", 44100,
+       [] { return std::make_unique<SpeexResampler>(44100, 48000, 2, 4); }},
+      {"speex q6", 44100,
+       [] { return std::make_unique<SpeexResampler>(44100, 48000, 2, 6); }},
+  };
+
+  for (const auto& tier : tiers) {
+    for (double freq : {1000.0, 10000.0}) {
+      auto input = sine(freq, tier.source_rate, tier.source_rate * 2, 2);
+      auto resampler = tier.make();
+
+      int64_t start = esp_timer_get_time();
+      auto out = resampleAll(*resampler, input, 2048);
+      int64_t elapsed = esp_timer_get_time() - start;
+
+      std::printf("%-10s %5.0fHz: %6.1f ns/frame, THD+N %6.1f dB\n", tier.name,
+                  freq, elapsed * 1000.0 / (out.size() / 2),
+                  thdPlusNoise(out, 2, freq, 48000));
+    }
+  }
+}
+
+}  // namespace audio
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "audio/stream_cues.hpp"
+
+#include <cstdint>
+#include <memory>
+
+#include "catch2/catch.hpp"
+
+#include "audio/audio_events.hpp"
+#include "audio/audio_sink.hpp"
+
+namespace audio {
+
+static const IAudioOutput::Format k44 = {
+    .sample_rate = 44100,
+    .num_channels = 2,
+    .bits_per_sample = 16,
+};
+static const IAudioOutput::Format k48 = {
+    .sample_rate = 48000,
+    .num_channels = 2,
+    .bits_per_sample = 16,
+};
+
+TEST_CASE("stream cues", "[unit]") {
+  StreamCues cues;
+  auto first = std::make_shared<TrackInfo>();
+  auto second = std::make_shared<TrackInfo>();
+
+  SECTION("tracks position in the output's format") {
+    cues.addCue(first, 0, k44);
+    cues.update(44100 * 2 * 3);
+
+    auto [track, ms] = cues.current();
+    REQUIRE(track == first);
+    REQUIRE(ms == 3000);
+  }
+
+  SECTION("switches tracks once their cue is reached") {
+    cues.addCue(first, 0, k44);
+    cues.addCue(second, 44100 * 2 * 10, k48);
+
+    cues.update(44100 * 2 * 10 - 2);
+    REQUIRE(cues.current().first == first);
+
+    cues.update(44100 * 2 * 10 + 48000 * 2);
+    auto [track, ms] = cues.current();
+    REQUIRE(track == second);
+    REQUIRE(ms == 1000);
+  }
+
+  SECTION("carries position across format changes") {
+    cues.addCue(first, 0, k44);
+    cues.addFormatChange(44100 * 2 * 5, k48);
+
+    cues.update(44100 * 2 * 5 + 48000 * 2 * 2);
+    auto [track, ms] = cues.current();
+    REQUIRE(track == first);
+    REQUIRE(ms == 7000);
+  }
+
+  SECTION("applies format changes to the most recently cued track") {
+    cues.addCue(first, 0, k48);
+    cues.addCue(second, 48000 * 2, k44);
+    cues.addFormatChange(48000 * 2 + 44100 * 2, k48);
+
+    cues.update(48000 * 2 + 44100 * 2 + 48000);
+    auto [track, ms] = cues.current();
+    REQUIRE(track == second);
+    REQUIRE(ms == 1500);
+  }
+
+  SECTION("handles the sample counter overflowing") {
+    uint32_t start = UINT32_MAX - 44100;
+    cues.update(start);
+    cues.addCue(first, start, k44);
+    cues.update(start + 44100 * 2);
+
+    auto [track, ms] = cues.current();
+    REQUIRE(track == first);
+    REQUIRE(ms == 1000);
+  }
+
+  SECTION("ends when an empty cue is reached") {
+    cues.addCue(first, 0, k44);
+    cues.addCue({}, 1000, k44);
+    REQUIRE(cues.hasStream());
+
+    cues.update(2000);
+    REQUIRE(cues.current().first == nullptr);
+    REQUIRE(!cues.hasStream());
+  }
+}
+
+}  // namespace audio
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "helpers/memenv/memenv.h"
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/options.h"
+
+#include "database/database.hpp"
+#include "database/env_esp.hpp"
+#include "tasks.hpp"
+
+namespace database {
+
+/*
+ * Wraps another Env, counting every read made through its random access files.
+ * Table files are only read through random access files, so this is the number
+ * of blocks that would have been read from the SD card.
+ */
+class ReadCountingEnv : public leveldb::EnvWrapper {
+ public:
+  explicit ReadCountingEnv(leveldb::Env* target) : EnvWrapper(target) {}
+
+  leveldb::Status NewRandomAccessFile(
+      const std::string& fname,
+      leveldb::RandomAccessFile** result) override {
+    leveldb::RandomAccessFile* file;
+    auto status = target()->NewRandomAccessFile(fname, &file);
+    *result = status.ok() ? new File(file, reads_) : nullptr;
+    return status;
+  }
+
+  auto reads() -> size_t { return reads_; }
+
+ private:
+  class File : public leveldb::RandomAccessFile {
+   public:
+    File(leveldb::RandomAccessFile* f, std::atomic<size_t>& reads)
+        : file_(f), reads_(reads) {}
+
+    leveldb::Status Read(uint64_t offset,
+                         size_t n,
+                         leveldb::Slice* result,
+                         char* scratch) const override {
+      reads_++;
+      return file_->Read(offset, n, result, scratch);
+    }
+
+   private:
+    std::unique_ptr<leveldb::RandomAccessFile> file_;
+    std::atomic<size_t>& reads_;
+  };
+
+  std::atomic<size_t> reads_{0};
+};
+
+/*
+ * A leveldb instance held entirely in memory, for exercising the database's
+ * record formats without an SD card. The instance is configured with the same
+ * tuning as the real database.
+ */
+class InMemoryDb {
+ public:
+  explicit InMemoryDb(const DbTuning& tuning = {}) {
+    static SingletonEnv<leveldb::EspEnv> sEnv;
+    if (!leveldb::sBackgroundThread) {
+      // Never freed, since worker pools can't be destroyed.
+      leveldb::sBackgroundThread = new tasks::WorkerPool();
+    }
+    mem_env_.reset(leveldb::NewMemEnv(sEnv.env()));
+    env_ = std::make_unique<ReadCountingEnv>(mem_env_.get());
+    cache_.reset(leveldb::NewLRUCache(tuning.block_cache_size));
+    if (tuning.bloom_filter_bits_per_key > 0) {
+      filter_policy_.reset(
+          leveldb::NewBloomFilterPolicy(tuning.bloom_filter_bits_per_key));
+    }
+
+    leveldb::Options options;
+    options.env = env_.get();
+    options.create_if_missing = true;
+    options.block_cache = cache_.get();
+    options.block_size = tuning.block_size;
+    options.block_restart_interval = tuning.block_restart_interval;
+    options.filter_policy = filter_policy_.get();
+    leveldb::DB::Open(options, "/test-db", &db_);
+
+    registry_ = std::make_shared<CursorRegistry>(*db_);
+  }
+
+  ~InMemoryDb() {
+    registry_->close();
+    delete db_;
+  }
+
+  /*
+   * Pushes everything out of the memtable, so that reads go through the same
+   * table and block cache code paths as they would on the SD card.
+   */
+  auto compact() -> void { db_->CompactRange(nullptr, nullptr); }
+
+  auto db() -> leveldb::DB& { return *db_; }
+  auto env() -> ReadCountingEnv& { return *env_; }
+  auto registry() -> std::shared_ptr<CursorRegistry> { return registry_; }
+
+ private:
+  std::unique_ptr<leveldb::Env> mem_env_;
+  std::unique_ptr<ReadCountingEnv> env_;
+  std::unique_ptr<leveldb::Cache> cache_;
+  std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
+  leveldb::DB* db_;
+  std::shared_ptr<CursorRegistry> registry_;
+};
+
+}  // namespace database
@@ -0,0 +1,311 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/index_counts.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "collation.hpp"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+
+#include "database/index.hpp"
+#include "database/records.hpp"
+#include "database/track.hpp"
+#include "in_memory_db.hpp"
+
+namespace database {
+
+struct TestTrack {
+  TrackId id;
+  std::string artist;
+  std::string album;
+  std::string genres;
+};
+
+static auto indexTrack(locale::ICollator& collator,
+                       const IndexInfo& index,
+                       const TestTrack& track)
+    -> std::vector<std::pair<IndexKey, std::string>> {
+  TrackData data;
+  data.id = track.id;
+  data.filepath = "/Music/" + std::to_string(track.id) + ".mp3";
+  data.type = MediaType::kMusic;
+
+  TrackTags tags;
+  tags.title("Track " + std::to_string(track.id));
+  tags.albumArtist(track.artist);
+  tags.album(track.album);
+  tags.track(std::to_string(track.id));
+  if (!track.genres.empty()) {
+    tags.genres(track.genres);
+  }
+
+  return Index(collator, index, data, tags);
+}
+
+static auto addTracks(leveldb::DB& db,
+                      const IndexInfo& index,
+                      const std::vector<TestTrack>& tracks) -> void {
+  locale::NoopCollator collator;
+  leveldb::WriteBatch batch;
+  IndexWriter writer{db, batch};
+  for (const auto& track : tracks) {
+    writer.add(indexTrack(collator, index, track));
+  }
+  writer.flush();
+  db.Write(leveldb::WriteOptions{}, &batch);
+}
+
+static auto removeTracks(leveldb::DB& db,
+                         const IndexInfo& index,
+                         const std::vector<TestTrack>& tracks) -> void {
+  locale::NoopCollator collator;
+  leveldb::WriteBatch batch;
+  IndexWriter writer{db, batch};
+  for (const auto& track : tracks) {
+    writer.remove(indexTrack(collator, index, track));
+  }
+  writer.flush();
+  db.Write(leveldb::WriteOptions{}, &batch);
+}
+
+static auto headerFor(const IndexInfo& index,
+                      std::vector<std::string> components)
+    -> IndexKey::Header {
+  IndexKey::Header header{.id = index.id, .components_hash = {}};
+  for (const auto& c : components) {
+    header = ExpandHeader(header, {c.data(), c.size()});
+  }
+  return header;
+}
+
+/*
+ * Counts the records beneath a header by walking every level of the index, as
+ * Iterator::count and TrackIterator::count used to.
+ */
+static auto scanCounts(leveldb::DB& db, const IndexKey::Header& header)
+    -> IndexCounts {
+  IndexCounts out{};
+  std::string prefix = EncodeIndexPrefix(header);
+  std::unique_ptr<leveldb::Iterator> it{db.NewIterator({})};
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    out.children++;
+    auto key = ParseIndexKey(it->key());
+    if (!key) {
+      continue;
+    }
+    if (key->track) {
+      out.tracks++;
+    } else {
+      out.tracks += scanCounts(db, ExpandHeader(key->header, key->item)).tracks;
+    }
+  }
+  return out;
+}
+
+/* Counts the number of writes and deletes within a batch. */
+class OpCounter : public leveldb::WriteBatch::Handler {
+ public:
+  size_t puts = 0;
+  size_t deletes = 0;
+  void Put(const leveldb::Slice&, const leveldb::Slice&) override { puts++; }
+  void Delete(const leveldb::Slice&) override { deletes++; }
+};
+
+static auto countsFor(leveldb::DB& db, const IndexKey::Header& header)
+    -> IndexCounts {
+  return GetIndexCounts(db, leveldb::ReadOptions{}, header);
+}
+
+TEST_CASE("index counts", "[unit]") {
+  InMemoryDb mem;
+  leveldb::DB& db = mem.db();
+
+  std::vector<TestTrack> first_album{
+      {1, "Artist", "First", ""},
+      {2, "Artist", "First", ""},
+      {3, "Artist", "First", ""},
+  };
+  std::vector<TestTrack> second_album{
+      {4, "Artist", "Second", ""},
+      {5, "Artist", "Second", ""},
+  };
+  addTracks(db, kAlbumsByArtist, first_album);
+  addTracks(db, kAlbumsByArtist, second_album);
+
+  auto root = headerFor(kAlbumsByArtist, {});
+  auto artist = headerFor(kAlbumsByArtist, {"Artist"});
+  auto album = headerFor(kAlbumsByArtist, {"Artist", "First"});
+
+  SECTION("counts each level") {
+    REQUIRE(countsFor(db, root) == IndexCounts{.children = 1, .tracks = 5});
+    REQUIRE(countsFor(db, artist) == IndexCounts{.children = 2, .tracks = 5});
+    REQUIRE(countsFor(db, album) == IndexCounts{.children = 3, .tracks = 3});
+    REQUIRE(countsFor(db, root) == scanCounts(db, root));
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("removing a whole album removes its branch") {
+    removeTracks(db, kAlbumsByArtist, first_album);
+
+    REQUIRE(countsFor(db, root) == IndexCounts{.children = 1, .tracks = 2});
+    REQUIRE(countsFor(db, artist) == IndexCounts{.children = 1, .tracks = 2});
+    REQUIRE(countsFor(db, album) == IndexCounts{});
+    REQUIRE(scanCounts(db, artist) == countsFor(db, artist));
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("removing everything leaves nothing behind") {
+    removeTracks(db, kAlbumsByArtist, first_album);
+    removeTracks(db, kAlbumsByArtist, second_album);
+
+    REQUIRE(countsFor(db, root) == IndexCounts{});
+
+    std::unique_ptr<leveldb::Iterator> it{db.NewIterator({})};
+    it->SeekToFirst();
+    REQUIRE(!it->Valid());
+  }
+
+  SECTION("removing and re-adding in one batch is a no-op") {
+    locale::NoopCollator collator;
+    leveldb::WriteBatch batch;
+    IndexWriter writer{db, batch};
+    for (const auto& track : first_album) {
+      auto entries = indexTrack(collator, kAlbumsByArtist, track);
+      writer.remove(entries);
+      writer.add(entries);
+    }
+    writer.flush();
+    db.Write(leveldb::WriteOptions{}, &batch);
+
+    REQUIRE(countsFor(db, root) == IndexCounts{.children = 1, .tracks = 5});
+    REQUIRE(countsFor(db, album) == IndexCounts{.children = 3, .tracks = 3});
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("updating a track with the same tags writes nothing") {
+    locale::NoopCollator collator;
+    leveldb::WriteBatch batch;
+    IndexWriter writer{db, batch};
+    auto entries = indexTrack(collator, kAlbumsByArtist, first_album[0]);
+    writer.update(entries, entries);
+    writer.flush();
+
+    OpCounter ops;
+    batch.Iterate(&ops);
+    REQUIRE(ops.puts == 0);
+    REQUIRE(ops.deletes == 0);
+  }
+
+  SECTION("updating a track only touches the records that changed") {
+    locale::NoopCollator collator;
+    leveldb::WriteBatch batch;
+    IndexWriter writer{db, batch};
+    writer.update(
+        indexTrack(collator, kAlbumsByArtist, first_album[2]),
+        indexTrack(collator, kAlbumsByArtist, {3, "Artist", "Second", ""}));
+    writer.flush();
+
+    OpCounter ops;
+    batch.Iterate(&ops);
+    // One leaf moves between albums, and the counts of both albums change.
+    // The existing branch for the new album is rewritten, but neither album
+    // branch is added or removed.
+    REQUIRE(ops.deletes == 1);
+    REQUIRE(ops.puts == 4);
+
+    db.Write(leveldb::WriteOptions{}, &batch);
+    REQUIRE(countsFor(db, root) == IndexCounts{.children = 1, .tracks = 5});
+    REQUIRE(countsFor(db, artist) == IndexCounts{.children = 2, .tracks = 5});
+    REQUIRE(countsFor(db, album) == IndexCounts{.children = 2, .tracks = 2});
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("updating the last track of an album removes its branch") {
+    std::vector<TestTrack> moved{
+        {1, "Artist", "Second", ""},
+        {2, "Artist", "Second", ""},
+        {3, "Artist", "Second", ""},
+    };
+    locale::NoopCollator collator;
+    leveldb::WriteBatch batch;
+    IndexWriter writer{db, batch};
+    for (size_t i = 0; i < moved.size(); i++) {
+      writer.update(indexTrack(collator, kAlbumsByArtist, first_album[i]),
+                    indexTrack(collator, kAlbumsByArtist, moved[i]));
+    }
+    writer.flush();
+    db.Write(leveldb::WriteOptions{}, &batch);
+
+    REQUIRE(countsFor(db, artist) == IndexCounts{.children = 1, .tracks = 5});
+    REQUIRE(countsFor(db, album) == IndexCounts{});
+    REQUIRE(scanCounts(db, root) == countsFor(db, root));
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("duplicate records are only counted once") {
+    addTracks(db, kTracksByGenre, {{6, "Artist", "Third", "Rock;Rock;Jazz"}});
+
+    auto genres = headerFor(kTracksByGenre, {});
+    REQUIRE(countsFor(db, genres) == IndexCounts{.children = 2, .tracks = 2});
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+  }
+
+  SECTION("the checker repairs incorrect counts") {
+    db.Put({}, EncodeCountKey(artist),
+           EncodeCountValue({.children = 7, .tracks = 1}));
+    db.Delete({}, EncodeCountKey(album));
+
+    REQUIRE(CheckIndexCounts(db, true) == 2);
+    REQUIRE(CheckIndexCounts(db, false) == 0);
+    REQUIRE(countsFor(db, artist) == IndexCounts{.children = 2, .tracks = 5});
+  }
+}
+
+TEST_CASE("index count lookups", "[.benchmark]") {
+  InMemoryDb mem;
+  leveldb::DB& db = mem.db();
+
+  // 500 artists, with 10 albums of 10 tracks each.
+  TrackId id = 1;
+  for (int artist = 0; artist < 500; artist++) {
+    std::vector<TestTrack> tracks;
+    for (int album = 0; album < 10; album++) {
+      for (int track = 0; track < 10; track++) {
+        tracks.push_back({id++, "Artist " + std::to_string(artist),
+                          "Album " + std::to_string(album), ""});
+      }
+    }
+    addTracks(db, kAlbumsByArtist, tracks);
+  }
+  mem.compact();
+
+  auto root = headerFor(kAlbumsByArtist, {});
+  auto artist = headerFor(kAlbumsByArtist, {"Artist 250"});
+  REQUIRE(countsFor(db, root).tracks == 50000);
+  REQUIRE(countsFor(db, root) == scanCounts(db, root));
+
+  BENCHMARK("scan, all 50k tracks") {
+    return scanCounts(db, root).tracks;
+  };
+  BENCHMARK("count record, all 50k tracks") {
+    return countsFor(db, root).tracks;
+  };
+  BENCHMARK("scan, one artist") {
+    return scanCounts(db, artist).tracks;
+  };
+  BENCHMARK("count record, one artist") {
+    return countsFor(db, artist).tracks;
+  };
+}
+
+}  // namespace database
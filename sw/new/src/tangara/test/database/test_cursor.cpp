@@ -0,0 +1,217 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+
+#include "database/database.hpp"
+#include "database/index.hpp"
+#include "database/records.hpp"
+#include "in_memory_db.hpp"
+
+namespace database {
+
+static constexpr IndexId kTestIndex = 3;
+
+/* An in-memory db, filled with a flat index of synthetic tracks. */
+class InMemoryIndex : public InMemoryDb {
+ public:
+  InMemoryIndex(size_t num_tracks) {
+    IndexKey::Header header{.id = kTestIndex, .components_hash = {}};
+    leveldb::WriteBatch batch;
+    for (size_t i = 0; i < num_tracks; i++) {
+      char title[16];
+      std::snprintf(title, sizeof(title), "track %05u",
+                    static_cast<unsigned>(i));
+      IndexKey key{
+          .header = header,
+          .item = title,
+          .track = static_cast<TrackId>(i + 1),
+      };
+      batch.Put(EncodeIndexKey(key), title);
+      if (batch.ApproximateSize() > 64 * 1024) {
+        db().Write(leveldb::WriteOptions{}, &batch);
+        batch.Clear();
+      }
+    }
+    db().Write(leveldb::WriteOptions{}, &batch);
+    compact();
+  }
+
+  auto rootKey() -> SearchKey {
+    std::string prefix = EncodeIndexPrefix({.id = kTestIndex});
+    return {
+        .prefix = {prefix.data(), prefix.size()},
+        .key = {},
+        .offset = 0,
+    };
+  }
+};
+
+/* Steps a cursor in the same way that database::Iterator does. */
+static auto step(Cursor& cursor, SearchKey& key, int offset)
+    -> std::optional<Record> {
+  SearchKey next = key;
+  next.offset = offset;
+  auto res = cursor.get(next);
+  if (!res) {
+    return {};
+  }
+  key.key = res->first;
+  key.offset = 0;
+  return res->second;
+}
+
+/* Reference implementation: a fresh leveldb seek for every single step. */
+static auto reseekStep(leveldb::DB& db, SearchKey& key, int offset)
+    -> std::optional<Record> {
+  std::unique_ptr<leveldb::Iterator> it{db.NewIterator({})};
+  it->Seek({key.startKey().data(), key.startKey().size()});
+  while (it->Valid() && offset != 0) {
+    if (offset < 0) {
+      it->Prev();
+      offset++;
+    } else {
+      it->Next();
+      offset--;
+    }
+  }
+  if (!it->Valid() || !it->key().starts_with(std::string_view{key.prefix})) {
+    return {};
+  }
+  auto parsed = ParseIndexKeyView({it->key().data(), it->key().size()});
+  if (!parsed) {
+    return {};
+  }
+  key.key = std::pmr::string{it->key().data(), it->key().size()};
+  key.offset = 0;
+  return Record{*parsed, it->value()};
+}
+
+TEST_CASE("database cursors", "[unit]") {
+  InMemoryIndex index{100};
+  Cursor cursor{index.registry(), 8};
+
+  SECTION("walks forwards across batch boundaries") {
+    SearchKey key = index.rootKey();
+    auto first = step(cursor, key, 0);
+    REQUIRE(first);
+    REQUIRE(first->text() == "track 00000");
+
+    size_t count = 1;
+    while (auto rec = step(cursor, key, 1)) {
+      char expected[16];
+      std::snprintf(expected, sizeof(expected), "track %05u",
+                    static_cast<unsigned>(count));
+      REQUIRE(rec->text() == expected);
+      count++;
+    }
+    REQUIRE(count == 100);
+  }
+
+  SECTION("walks backwards across batch boundaries") {
+    SearchKey key = index.rootKey();
+    step(cursor, key, 0);
+    for (int i = 0; i < 50; i++) {
+      REQUIRE(step(cursor, key, 1));
+    }
+
+    size_t count = 0;
+    while (auto rec = step(cursor, key, -1)) {
+      count++;
+    }
+    REQUIRE(count == 50);
+  }
+
+  SECTION("matches a fresh seek in both directions") {
+    SearchKey cursor_key = index.rootKey();
+    SearchKey reseek_key = index.rootKey();
+    REQUIRE(step(cursor, cursor_key, 0)->text() ==
+            reseekStep(index.db(), reseek_key, 0)->text());
+
+    int pattern[] = {1, 1, 1, -1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1};
+    for (int round = 0; round < 5; round++) {
+      for (int offset : pattern) {
+        auto a = step(cursor, cursor_key, offset);
+        auto b = reseekStep(index.db(), reseek_key, offset);
+        REQUIRE(a.has_value() == b.has_value());
+        if (a) {
+          REQUIRE(a->text() == b->text());
+        }
+      }
+    }
+  }
+
+  SECTION("sees new writes after being invalidated") {
+    SearchKey key = index.rootKey();
+    REQUIRE(step(cursor, key, 0)->text() == "track 00000");
+
+    IndexKey early{
+        .header = {.id = kTestIndex},
+        .item = "track 00000a",
+        .track = 1000,
+    };
+    index.db().Put({}, EncodeIndexKey(early), "inserted");
+
+    // Still pinned to the old snapshot.
+    REQUIRE(step(cursor, key, 1)->text() == "track 00001");
+    REQUIRE(step(cursor, key, -1)->text() == "track 00000");
+
+    index.registry()->invalidate();
+    REQUIRE(step(cursor, key, 1)->text() == "inserted");
+  }
+
+  SECTION("returns nothing once the registry is closed") {
+    SearchKey key = index.rootKey();
+    REQUIRE(step(cursor, key, 0));
+    index.registry()->close();
+    REQUIRE(!step(cursor, key, 1));
+  }
+}
+
+TEST_CASE("database cursor throughput", "[.benchmark]") {
+  InMemoryIndex index{50000};
+
+  // Each benchmark walks the entire 'All Tracks' index; divide the reported
+  // time by 50k for the cost of each row.
+  BENCHMARK("re-seek per row, 50k rows") {
+    SearchKey key = index.rootKey();
+    size_t rows = reseekStep(index.db(), key, 0) ? 1 : 0;
+    while (reseekStep(index.db(), key, 1)) {
+      rows++;
+    }
+    return rows;
+  };
+
+  BENCHMARK("cursor, 50k rows") {
+    Cursor cursor{index.registry(), Cursor::kDefaultBatchSize};
+    SearchKey key = index.rootKey();
+    size_t rows = step(cursor, key, 0) ? 1 : 0;
+    while (step(cursor, key, 1)) {
+      rows++;
+    }
+    return rows;
+  };
+
+  BENCHMARK("cursor, 64 row batches, 50k rows") {
+    Cursor cursor{index.registry(), 64};
+    SearchKey key = index.rootKey();
+    size_t rows = step(cursor, key, 0) ? 1 : 0;
+    while (step(cursor, key, 1)) {
+      rows++;
+    }
+    return rows;
+  };
+}
+
+}  // namespace database
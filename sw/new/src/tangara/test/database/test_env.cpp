@@ -0,0 +1,173 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/env_esp.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+
+#include "drivers/gpios.hpp"
+#include "drivers/storage.hpp"
+#include "i2c_fixture.hpp"
+#include "spi_fixture.hpp"
+
+namespace database {
+
+static const std::string kTestFilePath = "/test_env.ldb";
+static constexpr size_t kTestFileSize = 1024 * 1024;
+static constexpr size_t kBlockSize = 4096;
+static constexpr size_t kNumReads = 500;
+
+static auto env() -> leveldb::EspEnv& {
+  static SingletonEnv<leveldb::EspEnv> sEnv;
+  return *static_cast<leveldb::EspEnv*>(sEnv.env());
+}
+
+/* Read latencies, bucketed by powers of two microseconds. */
+class LatencyHistogram {
+ public:
+  auto add(int64_t us) -> void {
+    size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (1ll << (bucket + 1)) <= us) {
+      bucket++;
+    }
+    buckets_[bucket]++;
+  }
+
+  auto print(const char* name) -> void {
+    std::printf("%s read latency:\n", name);
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      if (buckets_[i] > 0) {
+        std::printf("  >= %6lld us: %u\n", 1ll << i, buckets_[i]);
+      }
+    }
+  }
+
+ private:
+  std::array<unsigned, 20> buckets_{};
+};
+
+static auto fillTestFile() -> void {
+  leveldb::WritableFile* file;
+  REQUIRE(env().NewWritableFile(kTestFilePath, &file).ok());
+  std::string block(kBlockSize, '\0');
+  for (size_t pos = 0; pos < kTestFileSize; pos += kBlockSize) {
+    for (size_t i = 0; i < kBlockSize; i++) {
+      block[i] = static_cast<char>((pos + i) % 251);
+    }
+    REQUIRE(file->Append(block).ok());
+  }
+  REQUIRE(file->Close().ok());
+  delete file;
+}
+
+static auto randomOffsets() -> std::vector<uint64_t> {
+  std::vector<uint64_t> out;
+  for (size_t i = 0; i < kNumReads; i++) {
+    out.push_back(esp_random() % (kTestFileSize / kBlockSize) * kBlockSize);
+  }
+  return out;
+}
+
+TEST_CASE("random access file handle cache", "[integration]") {
+  I2CFixture i2c;
+  SpiFixture spi;
+  std::unique_ptr<drivers::IGpios> gpios{drivers::Gpios::Create(false)};
+
+  if (gpios->Get(drivers::IGpios::Pin::kSdCardDetect)) {
+    // Skip if nothing is inserted.
+    SKIP("no sd card detected; skipping storage tests");
+    return;
+  }
+
+  std::unique_ptr<drivers::SdStorage> storage(
+      drivers::SdStorage::Create(*gpios).value());
+  env().SetMaxOpenFiles(74);
+  fillTestFile();
+
+  std::vector<char> scratch(kBlockSize);
+  leveldb::Slice result;
+
+  SECTION("reads return the right bytes from anywhere in the file") {
+    leveldb::RandomAccessFile* file;
+    REQUIRE(env().NewRandomAccessFile(kTestFilePath, &file).ok());
+
+    for (uint64_t offset : randomOffsets()) {
+      REQUIRE(file->Read(offset + 7, 100, &result, scratch.data()).ok());
+      REQUIRE(result.size() == 100);
+      REQUIRE(static_cast<uint8_t>(result[0]) == (offset + 7) % 251);
+      REQUIRE(static_cast<uint8_t>(result[99]) == (offset + 106) % 251);
+    }
+
+    delete file;
+  }
+
+  SECTION("removing a file closes its cached handles") {
+    leveldb::RandomAccessFile* file;
+    REQUIRE(env().NewRandomAccessFile(kTestFilePath, &file).ok());
+    REQUIRE(file->Read(0, 100, &result, scratch.data()).ok());
+
+    REQUIRE(env().RemoveFile(kTestFilePath).ok());
+    REQUIRE(!file->Read(0, 100, &result, scratch.data()).ok());
+
+    delete file;
+    fillTestFile();
+  }
+
+  SECTION("cached handles are faster than reopening") {
+    auto offsets = randomOffsets();
+
+    LatencyHistogram reopened;
+    int64_t reopened_total = 0;
+    for (uint64_t offset : offsets) {
+      // This is what EspRandomAccessFile used to do for every read.
+      int64_t start = esp_timer_get_time();
+      FIL fil;
+      REQUIRE(f_open(&fil, kTestFilePath.c_str(), FA_READ) == FR_OK);
+      REQUIRE(f_lseek(&fil, offset) == FR_OK);
+      UINT read = 0;
+      REQUIRE(f_read(&fil, scratch.data(), kBlockSize, &read) == FR_OK);
+      f_close(&fil);
+      int64_t elapsed = esp_timer_get_time() - start;
+      reopened.add(elapsed);
+      reopened_total += elapsed;
+    }
+
+    leveldb::RandomAccessFile* file;
+    REQUIRE(env().NewRandomAccessFile(kTestFilePath, &file).ok());
+
+    LatencyHistogram cached;
+    int64_t cached_total = 0;
+    for (uint64_t offset : offsets) {
+      int64_t start = esp_timer_get_time();
+      REQUIRE(file->Read(offset, kBlockSize, &result, scratch.data()).ok());
+      int64_t elapsed = esp_timer_get_time() - start;
+      cached.add(elapsed);
+      cached_total += elapsed;
+    }
+    delete file;
+
+    reopened.print("reopened");
+    std::printf("  mean: %lld us\n", reopened_total / kNumReads);
+    cached.print("cached");
+    std::printf("  mean: %lld us\n", cached_total / kNumReads);
+  }
+
+  env().RemoveFile(kTestFilePath);
+}
+
+}  // namespace database
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/ingest_batch.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "collation.hpp"
+#include "esp_timer.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "sdkconfig.h"
+
+#include "database/index.hpp"
+#include "database/index_counts.hpp"
+#include "database/records.hpp"
+#include "database/track.hpp"
+#include "in_memory_db.hpp"
+
+namespace database {
+
+static constexpr IngestBatch::Limits kNoLimits{
+    .max_bytes = SIZE_MAX,
+    .max_age_us = UINT64_MAX,
+};
+
+static auto trackPath(TrackId id) -> std::string {
+  return "/Music/Album " + std::to_string(id / 10) + "/" + std::to_string(id) +
+         ".mp3";
+}
+
+/*
+ * Adds the records for a synthetic track to the batch, in the same way that
+ * Database::processCandidateCallback does.
+ */
+static auto ingestTrack(locale::ICollator& collator,
+                        leveldb::WriteBatch& batch,
+                        IndexWriter& writer,
+                        TrackId id) -> uint64_t {
+  TrackData data;
+  data.id = id;
+  data.filepath = trackPath(id);
+  data.tags_hash = 0x9e3779b97f4a7c15ull * id;
+  data.type = MediaType::kMusic;
+
+  TrackTags tags;
+  tags.title("Track " + std::to_string(id));
+  tags.albumArtist("Artist " + std::to_string(id / 100));
+  tags.album("Album " + std::to_string(id / 10));
+  tags.track(std::to_string(id % 10));
+  tags.genres("Genre " + std::to_string(id % 7));
+
+  for (const auto& index : {kAllTracks, kAllAlbums, kAllArtists,
+                            kAlbumsByArtist, kTracksByGenre}) {
+    writer.add(Index(collator, index, data, tags));
+  }
+  batch.Put(EncodeDataKey(data.id), EncodeDataValue(data));
+  batch.Put(EncodeHashKey(data.tags_hash), EncodeHashValue(data.id));
+  batch.Put(EncodePathKey(data.filepath), TrackIdToBytes(data.id));
+  return data.tags_hash;
+}
+
+static auto ingest(locale::ICollator& collator, IngestBatch& ingest, TrackId id)
+    -> void {
+  uint64_t hash = ingestTrack(collator, ingest.batch(), ingest.writer(), id);
+  ingest.trackAdded(trackPath(id), hash, id);
+}
+
+TEST_CASE("ingest batches", "[unit]") {
+  InMemoryDb mem;
+  locale::NoopCollator collator;
+
+  SECTION("pending tracks are visible before flushing") {
+    IngestBatch batch{mem.db(), kNoLimits};
+    ingest(collator, batch, 1);
+    ingest(collator, batch, 2);
+
+    REQUIRE(batch.size() == 2);
+    REQUIRE(batch.pendingPath(trackPath(2)) == 2);
+    REQUIRE(batch.pendingHash(0x9e3779b97f4a7c15ull) == 1);
+    REQUIRE(!batch.pendingPath(trackPath(3)));
+    REQUIRE(!batch.isFull());
+
+    std::string unused;
+    REQUIRE(!mem.db().Get({}, EncodePathKey(trackPath(1)), &unused).ok());
+  }
+
+  SECTION("flushing commits every pending track") {
+    IngestBatch batch{mem.db(), kNoLimits};
+    for (TrackId id = 1; id <= 50; id++) {
+      ingest(collator, batch, id);
+    }
+    REQUIRE(batch.flush());
+    REQUIRE(batch.size() == 0);
+    REQUIRE(!batch.pendingPath(trackPath(1)));
+    REQUIRE(!batch.flush());
+
+    std::string unused;
+    for (TrackId id = 1; id <= 50; id++) {
+      REQUIRE(mem.db().Get({}, EncodePathKey(trackPath(id)), &unused).ok());
+    }
+
+    auto root = IndexKey::Header{.id = kAllTracks.id, .components_hash = {}};
+    REQUIRE(GetIndexCounts(mem.db(), {}, root).tracks == 50);
+    REQUIRE(CheckIndexCounts(mem.db(), false) == 0);
+  }
+
+  SECTION("counts stay correct across several flushes") {
+    IngestBatch batch{mem.db(), kNoLimits};
+    for (TrackId id = 1; id <= 50; id++) {
+      ingest(collator, batch, id);
+      if (id % 7 == 0) {
+        batch.flush();
+      }
+    }
+    batch.flush();
+    REQUIRE(CheckIndexCounts(mem.db(), false) == 0);
+  }
+
+  SECTION("fills up once over its size limit") {
+    IngestBatch batch{mem.db(), {.max_bytes = 4096, .max_age_us = UINT64_MAX}};
+    TrackId id = 1;
+    while (!batch.isFull()) {
+      ingest(collator, batch, id++);
+    }
+    REQUIRE(batch.size() > 1);
+    REQUIRE(batch.batch().ApproximateSize() >= 4096);
+  }
+
+  SECTION("fills up once its oldest track is too old") {
+    IngestBatch batch{mem.db(), {.max_bytes = SIZE_MAX, .max_age_us = 0}};
+    REQUIRE(!batch.isFull());
+    ingest(collator, batch, 1);
+    REQUIRE(batch.isFull());
+  }
+}
+
+TEST_CASE("ingest throughput", "[.benchmark]") {
+  constexpr TrackId kNumTracks = 10000;
+  locale::NoopCollator collator;
+
+  // Reports first-scan throughput in tracks per second, excluding the cost of
+  // finding files and parsing their tags.
+  auto report = [](const char* name, int64_t elapsed_us) {
+    std::printf("%s: %u tracks in %lld ms (%lld tracks/s)\n", name,
+                static_cast<unsigned>(kNumTracks), elapsed_us / 1000,
+                kNumTracks * 1000000ll / std::max<int64_t>(elapsed_us, 1));
+  };
+
+  {
+    InMemoryDb mem;
+    int64_t start = esp_timer_get_time();
+    for (TrackId id = 1; id <= kNumTracks; id++) {
+      // One write per track, as each file was previously committed.
+      leveldb::WriteBatch batch;
+      IndexWriter writer{mem.db(), batch};
+      ingestTrack(collator, batch, writer, id);
+      writer.flush();
+      mem.db().Write(leveldb::WriteOptions{}, &batch);
+    }
+    report("one write per track", esp_timer_get_time() - start);
+  }
+
+  {
+    InMemoryDb mem;
+    IngestBatch batch{mem.db(), {.max_bytes = CONFIG_MMU_PAGE_SIZE / 2,
+                                 .max_age_us = UINT64_MAX}};
+    int64_t start = esp_timer_get_time();
+    for (TrackId id = 1; id <= kNumTracks; id++) {
+      ingest(collator, batch, id);
+      if (batch.isFull()) {
+        batch.flush();
+      }
+    }
+    batch.flush();
+    report("group commit", esp_timer_get_time() - start);
+    REQUIRE(CheckIndexCounts(mem.db(), false) == 0);
+  }
+}
+
+}  // namespace database
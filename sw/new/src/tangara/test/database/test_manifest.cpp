@@ -0,0 +1,196 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/dir_manifest.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "ff.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include "database/records.hpp"
+#include "database/track_finder.hpp"
+#include "drivers/gpios.hpp"
+#include "drivers/storage.hpp"
+#include "i2c_fixture.hpp"
+#include "in_memory_db.hpp"
+#include "spi_fixture.hpp"
+
+namespace database {
+
+static const std::string kTestDir = "/test_manifest";
+
+static auto touch(const std::string& path, const std::string& contents = "")
+    -> void {
+  FIL file;
+  REQUIRE(f_open(&file, path.c_str(), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+  UINT written;
+  f_write(&file, contents.data(), contents.size(), &written);
+  f_close(&file);
+}
+
+TEST_CASE("directory manifest", "[integration]") {
+  I2CFixture i2c;
+  SpiFixture spi;
+  std::unique_ptr<drivers::IGpios> gpios{drivers::Gpios::Create(false)};
+
+  if (gpios->Get(drivers::IGpios::Pin::kSdCardDetect)) {
+    // Skip if nothing is inserted.
+    SKIP("no sd card detected; skipping storage tests");
+    return;
+  }
+
+  std::unique_ptr<drivers::SdStorage> storage(
+      drivers::SdStorage::Create(*gpios).value());
+
+  const std::string album_a = kTestDir + "/a";
+  const std::string album_b = kTestDir + "/b";
+  f_mkdir(kTestDir.c_str());
+  f_mkdir(album_a.c_str());
+  f_mkdir(album_b.c_str());
+  touch(album_a + "/1.mp3");
+  touch(album_a + "/2.mp3");
+  touch(album_b + "/1.mp3");
+
+  InMemoryDb mem;
+
+  auto first = ManifestDiff::Compute(mem.db(), kTestDir);
+  REQUIRE(first->changed().size() == 3);
+  REQUIRE(!first->isUnchanged(kTestDir));
+  REQUIRE(!first->isUnchanged(album_a));
+  first->commit(mem.db());
+
+  SECTION("nothing changes between scans") {
+    auto diff = ManifestDiff::Compute(mem.db(), kTestDir);
+    REQUIRE(diff->changed().empty());
+    REQUIRE(diff->isUnchanged(kTestDir));
+    REQUIRE(diff->isUnchanged(album_a));
+    REQUIRE(diff->isUnchanged(album_b));
+    REQUIRE(diff->isUnchanged(DirectoryOf(album_b + "/1.mp3")));
+  }
+
+  SECTION("adding a file changes only its directory") {
+    touch(album_a + "/3.mp3");
+    auto diff = ManifestDiff::Compute(mem.db(), kTestDir);
+    REQUIRE(diff->changed().size() == 1);
+    REQUIRE(std::string_view{diff->changed()[0]} == album_a);
+    REQUIRE(diff->isUnchanged(kTestDir));
+    REQUIRE(diff->isUnchanged(album_b));
+    f_unlink((album_a + "/3.mp3").c_str());
+  }
+
+  SECTION("rewriting a file changes its directory") {
+    touch(album_b + "/1.mp3", "hello");
+    auto diff = ManifestDiff::Compute(mem.db(), kTestDir);
+    REQUIRE(diff->changed().size() == 1);
+    REQUIRE(std::string_view{diff->changed()[0]} == album_b);
+  }
+
+  SECTION("removed directories are forgotten") {
+    f_unlink((album_b + "/1.mp3").c_str());
+    f_unlink(album_b.c_str());
+
+    auto diff = ManifestDiff::Compute(mem.db(), kTestDir);
+    REQUIRE(!diff->isUnchanged(kTestDir));
+    REQUIRE(diff->isUnchanged(album_a));
+    diff->commit(mem.db());
+
+    std::string unused;
+    REQUIRE(!mem.db().Get({}, EncodeManifestKey(album_b), &unused).ok());
+    REQUIRE(mem.db().Get({}, EncodeManifestKey(album_a), &unused).ok());
+  }
+
+  f_unlink((album_a + "/1.mp3").c_str());
+  f_unlink((album_a + "/2.mp3").c_str());
+  f_unlink((album_b + "/1.mp3").c_str());
+  f_unlink(album_a.c_str());
+  f_unlink(album_b.c_str());
+  f_unlink(kTestDir.c_str());
+}
+
+TEST_CASE("no-op rescan", "[.benchmark]") {
+  constexpr size_t kNumDirs = 200;
+  constexpr size_t kFilesPerDir = 100;
+  const std::string root = "/bench_manifest";
+
+  I2CFixture i2c;
+  SpiFixture spi;
+  std::unique_ptr<drivers::IGpios> gpios{drivers::Gpios::Create(false)};
+
+  if (gpios->Get(drivers::IGpios::Pin::kSdCardDetect)) {
+    SKIP("no sd card detected; skipping storage tests");
+    return;
+  }
+
+  std::unique_ptr<drivers::SdStorage> storage(
+      drivers::SdStorage::Create(*gpios).value());
+
+  // Creating 20k files is very slow, so the tree is left in place between
+  // runs.
+  FILINFO info;
+  if (f_stat(root.c_str(), &info) != FR_OK) {
+    f_mkdir(root.c_str());
+    for (size_t d = 0; d < kNumDirs; d++) {
+      std::string dir = root + "/" + std::to_string(d);
+      f_mkdir(dir.c_str());
+      for (size_t f = 0; f < kFilesPerDir; f++) {
+        touch(dir + "/" + std::to_string(f) + ".mp3");
+      }
+    }
+  }
+
+  InMemoryDb mem;
+  {
+    // Populate the db as though the tree had already been indexed.
+    leveldb::WriteBatch batch;
+    CandidateIterator it{root};
+    TrackId id = 1;
+    while (auto path = it.next(info)) {
+      batch.Put(EncodePathKey(*path), TrackIdToBytes(id++));
+    }
+    mem.db().Write(leveldb::WriteOptions{}, &batch);
+    ManifestDiff::Compute(mem.db(), root)->commit(mem.db());
+  }
+
+  {
+    // What a rescan previously had to do even when nothing had changed: stat
+    // every known track, then walk the tree and look up every file's path.
+    int64_t start = esp_timer_get_time();
+    size_t tracks = 0;
+    CandidateIterator stat_it{root};
+    while (auto path = stat_it.next(info)) {
+      FILINFO unused;
+      f_stat(path->c_str(), &unused);
+      tracks++;
+    }
+    CandidateIterator it{root};
+    std::string unused;
+    while (auto path = it.next(info)) {
+      mem.db().Get({}, EncodePathKey(*path), &unused);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    std::printf("per-track: %u tracks in %lld ms\n",
+                static_cast<unsigned>(tracks), elapsed / 1000);
+  }
+
+  {
+    int64_t start = esp_timer_get_time();
+    auto diff = ManifestDiff::Compute(mem.db(), root);
+    int64_t elapsed = esp_timer_get_time() - start;
+    REQUIRE(diff->changed().empty());
+    std::printf("manifest: %u dirs in %lld ms\n",
+                static_cast<unsigned>(kNumDirs + 1), elapsed / 1000);
+  }
+}
+
+}  // namespace database
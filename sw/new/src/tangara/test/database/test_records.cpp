@@ -0,0 +1,125 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/records.hpp"
+
+#include <memory>
+#include <string>
+
+#include "catch2/catch.hpp"
+
+#include "codec.hpp"
+#include "database/track.hpp"
+
+namespace database {
+
+TEST_CASE("track tags records", "[unit]") {
+  TrackData data;
+  data.id = 42;
+  data.filepath = "/Music/Some Album/01.flac";
+  data.modified_at = {0x5a21, 0x7c3e};
+
+  auto tags = TrackTags::create();
+  tags->encoding(Container::kFlac);
+
+  SECTION("round trips every tag") {
+    tags->title("Title");
+    tags->artist("Artist");
+    tags->allArtists("Artist; Someone Else");
+    tags->album("Album");
+    tags->albumArtist("Album Artist");
+    tags->disc("2");
+    tags->track("13");
+    tags->genres("Rock, Jazz");
+    tags->trackGain("-6.54 dB");
+    tags->trackPeak("0.988541");
+    tags->albumGain("+1.20 dB");
+    tags->albumPeak("1.0");
+
+    auto parsed = ParseTagsValue(EncodeTagsValue(data, *tags), data);
+    REQUIRE(parsed);
+    REQUIRE(*parsed == *tags);
+    REQUIRE(parsed->encoding() == Container::kFlac);
+    REQUIRE(parsed->trackGain() == -654);
+    REQUIRE(parsed->albumOrder() == tags->albumOrder());
+    REQUIRE(parsed->genres().size() == 2);
+  }
+
+  SECTION("round trips a track with no tags") {
+    auto parsed = ParseTagsValue(EncodeTagsValue(data, *tags), data);
+    REQUIRE(parsed);
+    REQUIRE(*parsed == *tags);
+    REQUIRE(parsed->allPresent().empty());
+  }
+
+  SECTION("keeps album artist distinct from artist") {
+    tags->artist("Artist");
+
+    auto parsed = ParseTagsValue(EncodeTagsValue(data, *tags), data);
+    REQUIRE(parsed);
+    REQUIRE(parsed->albumArtist() == "Artist");
+    REQUIRE(parsed->allPresent() == tags->allPresent());
+  }
+
+  SECTION("is ignored once the file has been modified") {
+    tags->title("Title");
+    std::string encoded = EncodeTagsValue(data, *tags);
+
+    data.modified_at.second++;
+    REQUIRE(!ParseTagsValue(encoded, data));
+  }
+
+  SECTION("rejects malformed values") {
+    REQUIRE(!ParseTagsValue(std::string{"\x83\x01\x02", 3}, data));
+    REQUIRE(!ParseTagsValue(TrackIdToBytes(3), data));
+  }
+}
+
+TEST_CASE("seek index records", "[unit]") {
+  TrackData data;
+  data.id = 42;
+  data.modified_at = {0x5a21, 0x7c3e};
+
+  codecs::SeekIndex index{.stride = 32, .positions = {}};
+
+  SECTION("round trips every position") {
+    // Gaps of every encoded length, including the largest possible.
+    index.positions = {0, 1, 127, 128, 16511, 16512, 2113663, 0xffffffff};
+    auto parsed =
+        ParseSeekIndexValue(EncodeSeekIndexValue(data, index), data);
+    REQUIRE(parsed);
+    REQUIRE(*parsed == index);
+  }
+
+  SECTION("round trips an empty index") {
+    auto parsed =
+        ParseSeekIndexValue(EncodeSeekIndexValue(data, index), data);
+    REQUIRE(parsed);
+    REQUIRE(*parsed == index);
+  }
+
+  SECTION("is ignored once the file has been modified") {
+    index.positions = {417, 9000};
+    std::string encoded = EncodeSeekIndexValue(data, index);
+
+    data.modified_at.first++;
+    REQUIRE(!ParseSeekIndexValue(encoded, data));
+  }
+
+  SECTION("rejects malformed values") {
+    REQUIRE(!ParseSeekIndexValue(std::string{"\x83\x01\x02", 3}, data));
+    REQUIRE(!ParseSeekIndexValue(EncodeTagsValue(data, *TrackTags::create()),
+                                 data));
+
+    // A position whose last byte is missing.
+    index.positions = {300};
+    std::string encoded = EncodeSeekIndexValue(data, index);
+    encoded.back() = '\x81';
+    REQUIRE(!ParseSeekIndexValue(encoded, data));
+  }
+}
+
+}  // namespace database
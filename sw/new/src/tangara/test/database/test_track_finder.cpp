@@ -0,0 +1,154 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "database/track_finder.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "ff.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "drivers/gpios.hpp"
+#include "drivers/storage.hpp"
+#include "i2c_fixture.hpp"
+#include "spi_fixture.hpp"
+#include "tasks.hpp"
+
+namespace database {
+
+static const std::string kTestDir = "/test_finder";
+static constexpr size_t kNumFiles = 40;
+
+/* Counts how many workers are inside a stage at once. */
+class Occupancy {
+ public:
+  auto enter() -> void {
+    size_t now = ++current_;
+    size_t prev = max_;
+    while (now > prev && !max_.compare_exchange_weak(prev, now)) {
+    }
+  }
+  auto leave() -> void { current_--; }
+  auto max() -> size_t { return max_; }
+
+ private:
+  std::atomic<size_t> current_{0};
+  std::atomic<size_t> max_{0};
+};
+
+TEST_CASE("track finder pipeline", "[integration]") {
+  I2CFixture i2c;
+  SpiFixture spi;
+  std::unique_ptr<drivers::IGpios> gpios{drivers::Gpios::Create(false)};
+
+  if (gpios->Get(drivers::IGpios::Pin::kSdCardDetect)) {
+    // Skip if nothing is inserted.
+    SKIP("no sd card detected; skipping storage tests");
+    return;
+  }
+
+  std::unique_ptr<drivers::SdStorage> storage(
+      drivers::SdStorage::Create(*gpios).value());
+
+  f_mkdir(kTestDir.c_str());
+  for (size_t i = 0; i < kNumFiles; i++) {
+    std::string path = kTestDir + "/" + std::to_string(i) + ".mp3";
+    FIL file;
+    REQUIRE(f_open(&file, path.c_str(), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    f_close(&file);
+  }
+
+  // Worker pools can't be destroyed, so share one between runs.
+  static tasks::WorkerPool* sPool = new tasks::WorkerPool();
+
+  TrackFinder::Config config{{
+      {.parallelism = 1, .queue_capacity = 0},
+      {.parallelism = 2, .queue_capacity = 2},
+      {.parallelism = 2, .queue_capacity = 2},
+      {.parallelism = 1, .queue_capacity = 2},
+      {.parallelism = 1, .queue_capacity = 2},
+  }};
+
+  std::array<Occupancy, TrackFinder::kNumStages> occupancy;
+  std::mutex committed_mutex;
+  std::set<std::string> committed;
+
+  auto stage = [&](TrackFinder::Stage s, auto fn) {
+    return [&, s, fn](Candidate& c) {
+      auto& o = occupancy[static_cast<size_t>(s)];
+      o.enter();
+      // Give the other stages a chance to pile up behind us.
+      vTaskDelay(pdMS_TO_TICKS(2));
+      auto res = fn(c);
+      o.leave();
+      return res;
+    };
+  };
+
+  TrackFinder::Stages stages{
+      .read_header = stage(TrackFinder::Stage::kReadHeader,
+                           [](Candidate& c) {
+                             return c.path.starts_with(kTestDir);
+                           }),
+      .parse_tags = stage(TrackFinder::Stage::kParseTags,
+                          [](Candidate& c) {
+                            // Drop every odd numbered file.
+                            return c.path.ends_with("0.mp3") ||
+                                   c.path.ends_with("2.mp3") ||
+                                   c.path.ends_with("4.mp3") ||
+                                   c.path.ends_with("6.mp3") ||
+                                   c.path.ends_with("8.mp3");
+                          }),
+      .index = stage(TrackFinder::Stage::kIndex,
+                     [](Candidate& c) { return true; }),
+      .commit =
+          [&](Candidate& c) {
+            std::scoped_lock<std::mutex> lock{committed_mutex};
+            committed.insert({c.path.data(), c.path.size()});
+          },
+  };
+
+  std::promise<void> done;
+  TrackFinder finder{*sPool, config, stages, [&]() { done.set_value(); }};
+  finder.launch(kTestDir);
+  REQUIRE(done.get_future().wait_for(std::chrono::seconds(30)) ==
+          std::future_status::ready);
+
+  REQUIRE(committed.size() == kNumFiles / 2);
+
+  auto stats = finder.stats();
+  REQUIRE(stats[0].processed == kNumFiles);
+  REQUIRE(stats[1].processed == kNumFiles);
+  REQUIRE(stats[2].processed == kNumFiles / 2);
+  REQUIRE(stats[2].dropped == kNumFiles / 2);
+  REQUIRE(stats[4].processed == kNumFiles / 2);
+
+  for (size_t i = 1; i < TrackFinder::kNumStages; i++) {
+    INFO("stage " << TrackFinder::stageName(static_cast<TrackFinder::Stage>(i)));
+    REQUIRE(stats[i].max_queue_depth <= config[i].queue_capacity);
+    REQUIRE(stats[i].queue_depth == 0);
+    if (i < 4) {
+      REQUIRE(occupancy[i].max() <= config[i].parallelism);
+    }
+  }
+
+  for (size_t i = 0; i < kNumFiles; i++) {
+    std::string path = kTestDir + "/" + std::to_string(i) + ".mp3";
+    f_unlink(path.c_str());
+  }
+  f_unlink(kTestDir.c_str());
+}
+
+}  // namespace database
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "catch2/catch.hpp"
+#include "esp_timer.h"
+#include "leveldb/db.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+
+#include "database/database.hpp"
+#include "database/records.hpp"
+#include "database/track.hpp"
+#include "in_memory_db.hpp"
+
+namespace database {
+
+// How the database was configured before tuning: leveldb's table defaults,
+// with no filter.
+static const DbTuning kUntuned{
+    .block_cache_size = 256 * 1024,
+    .block_size = 4 * 1024,
+    .block_restart_interval = 16,
+    .bloom_filter_bits_per_key = 0,
+};
+
+static constexpr size_t kTracksPerAlbum = 10;
+
+static auto trackPath(size_t i) -> std::string {
+  return "/Music/Album " + std::to_string(i / kTracksPerAlbum) + "/Track " +
+         std::to_string(i) + ".mp3";
+}
+
+static auto coverPath(size_t album) -> std::string {
+  return "/Music/Album " + std::to_string(album) + "/cover.jpg";
+}
+
+/*
+ * Writes the path, data, and hash records that the database keeps for each
+ * track in a library of the given size.
+ */
+static auto fillLibrary(InMemoryDb& mem, size_t num_tracks) -> void {
+  leveldb::WriteBatch batch;
+  for (size_t i = 0; i < num_tracks; i++) {
+    TrackData data;
+    data.id = i + 1;
+    data.filepath = trackPath(i);
+    data.tags_hash = 0x9e3779b97f4a7c15ull * (i + 1);
+    data.type = MediaType::kMusic;
+
+    batch.Put(EncodePathKey(data.filepath), TrackIdToBytes(data.id));
+    batch.Put(EncodeDataKey(data.id), EncodeDataValue(data));
+    batch.Put(EncodeHashKey(data.tags_hash), EncodeHashValue(data.id));
+    if (batch.ApproximateSize() > 64 * 1024) {
+      mem.db().Write(leveldb::WriteOptions{}, &batch);
+      batch.Clear();
+    }
+  }
+  mem.db().Write(leveldb::WriteOptions{}, &batch);
+  mem.compact();
+}
+
+/*
+ * Performs the lookups that processCandidateCallback makes when rescanning an
+ * unchanged library: every track's path is found, and every other file in the
+ * library (here, one cover image per album) is missed. Returns the number of
+ * paths that were found.
+ */
+static auto rescan(InMemoryDb& mem, size_t num_tracks) -> size_t {
+  leveldb::ReadOptions options;
+  options.fill_cache = true;
+  options.verify_checksums = false;
+
+  size_t found = 0;
+  std::string unused;
+  for (size_t i = 0; i < num_tracks; i++) {
+    if (i % kTracksPerAlbum == 0) {
+      mem.db().Get(options, EncodePathKey(coverPath(i / kTracksPerAlbum)),
+                   &unused);
+    }
+    if (mem.db().Get(options, EncodePathKey(trackPath(i)), &unused).ok()) {
+      found++;
+    }
+  }
+  return found;
+}
+
+TEST_CASE("database tuning", "[unit]") {
+  // Use a tiny block cache so that lookups can't be served from memory.
+  DbTuning untuned_tuning = kUntuned;
+  untuned_tuning.block_cache_size = 8 * 1024;
+  DbTuning tuned_tuning{};
+  tuned_tuning.block_cache_size = 8 * 1024;
+
+  InMemoryDb untuned{untuned_tuning};
+  InMemoryDb tuned{tuned_tuning};
+  fillLibrary(untuned, 2000);
+  fillLibrary(tuned, 2000);
+
+  SECTION("finds the same records") {
+    REQUIRE(rescan(untuned, 2000) == 2000);
+    REQUIRE(rescan(tuned, 2000) == 2000);
+  }
+
+  SECTION("missing keys don't read data blocks") {
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    std::string unused;
+
+    auto lookupCovers = [&](InMemoryDb& mem) {
+      for (size_t album = 0; album < 200; album++) {
+        REQUIRE(!mem.db()
+                     .Get(options, EncodePathKey(coverPath(album)), &unused)
+                     .ok());
+      }
+    };
+
+    // Make sure every table, along with its index and filter, is loaded.
+    lookupCovers(untuned);
+    lookupCovers(tuned);
+
+    size_t untuned_before = untuned.env().reads();
+    size_t tuned_before = tuned.env().reads();
+    lookupCovers(untuned);
+    lookupCovers(tuned);
+    size_t untuned_reads = untuned.env().reads() - untuned_before;
+    size_t tuned_reads = tuned.env().reads() - tuned_before;
+
+    REQUIRE(untuned_reads >= 200);
+    // Allow for the odd bloom filter false positive.
+    REQUIRE(tuned_reads < 20);
+  }
+}
+
+TEST_CASE("database tuning rescan", "[.benchmark]") {
+  constexpr size_t kNumTracks = 20000;
+
+  InMemoryDb untuned{kUntuned};
+  InMemoryDb tuned{};
+  fillLibrary(untuned, kNumTracks);
+  fillLibrary(tuned, kNumTracks);
+
+  // Block reads are what cost time on the SD card, so report those alongside
+  // the in-memory timings.
+  for (auto [name, mem] :
+       {std::pair{"untuned", &untuned}, std::pair{"tuned", &tuned}}) {
+    size_t reads_before = mem->env().reads();
+    int64_t start = esp_timer_get_time();
+    REQUIRE(rescan(*mem, kNumTracks) == kNumTracks);
+    int64_t elapsed = esp_timer_get_time() - start;
+    std::printf("%s: rescan of %u tracks read %u blocks in %lld ms\n", name,
+                kNumTracks, mem->env().reads() - reads_before, elapsed / 1000);
+  }
+
+  BENCHMARK("rescan, untuned") {
+    return rescan(untuned, kNumTracks);
+  };
+  BENCHMARK("rescan, tuned") {
+    return rescan(tuned, kNumTracks);
+  };
+}
+
+}  // namespace database
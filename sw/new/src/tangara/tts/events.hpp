@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <variant>
@@ -45,6 +46,17 @@ struct TtsEnabledChanged {
   bool tts_enabled;
 };
 
-using Event = std::variant<SimpleEvent, SelectionChanged, TtsEnabledChanged>;
+/*
+ * Event emitted by the audio FSM when the output's sample rate changes. Any
+ * further TTS samples must be resampled to the new rate.
+ */
+struct OutputFormatChanged {
+  uint32_t sample_rate_hz;
+};
+
+using Event = std::variant<SimpleEvent,
+                           SelectionChanged,
+                           TtsEnabledChanged,
+                           OutputFormatChanged>;
 
 }  // namespace tts
@@ -29,7 +29,8 @@ Player::Player(tasks::WorkerPool& worker,
       stream_factory_(factory),
       output_(output),
       stream_playing_(false),
-      stream_cancelled_(false) {}
+      stream_cancelled_(false),
+      output_rate_(48000) {}
 
 auto Player::playFile(const std::string& text, const std::string& file)
     -> void {
@@ -58,6 +59,10 @@ auto Player::playFile(const std::string& text, const std::string& file)
   });
 }
 
+auto Player::outputRate(uint32_t sample_rate_hz) -> void {
+  output_rate_ = sample_rate_hz;
+}
+
 auto Player::openAndDecode(const std::string& text, const std::string& path)
     -> void {
   auto stream = stream_factory_.create(path);
@@ -105,10 +110,13 @@ auto Player::decodeToSink(const codecs::ICodec::OutputFormat& format,
   audio::Buffer stereo_buf(stereo_storage);
 
   // Work out what processing the codec's output needs.
-  std::unique_ptr<audio::Resampler> resampler;
-  if (format.sample_rate_hz != 48000) {
-    resampler = std::make_unique<audio::Resampler>(format.sample_rate_hz, 48000,
-                                                   format.num_channels);
+  std::unique_ptr<audio::IResampler> resampler;
+  uint32_t output_rate = output_rate_;
+  if (format.sample_rate_hz != output_rate) {
+    // Prompts are only speech, so there's no need to spend much CPU on them.
+    resampler = audio::CreateResampler(format.sample_rate_hz, output_rate,
+                                       format.num_channels,
+                                       audio::ResamplerBudget::kLow);
   }
   bool double_samples = format.num_channels == 1;
 
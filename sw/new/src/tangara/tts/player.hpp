@@ -6,6 +6,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <mutex>
 #include <string>
 
 #include "audio/fatfs_stream_factory.hpp"
@@ -26,6 +29,12 @@ class Player {
 
   auto playFile(const std::string& text, const std::string& path) -> void;
 
+  /*
+   * Sets the sample rate that the output is currently running at. Takes
+   * effect from the next file to be played.
+   */
+  auto outputRate(uint32_t sample_rate_hz) -> void;
+
   // Not copyable or movable.
   Player(const Player&) = delete;
   Player& operator=(const Player&) = delete;
@@ -38,6 +47,7 @@ class Player {
   std::mutex new_stream_mutex_;
   std::atomic<bool> stream_playing_;
   std::atomic<bool> stream_cancelled_;
+  std::atomic<uint32_t> output_rate_;
 
   auto openAndDecode(const std::string& text, const std::string& path) -> void;
   auto decodeToSink(const codecs::ICodec::OutputFormat&,
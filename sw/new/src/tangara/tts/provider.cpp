@@ -50,6 +50,11 @@ auto Provider::feed(const Event& e) -> void {
   } else if (std::holds_alternative<TtsEnabledChanged>(e)) {
     auto ev = std::get<TtsEnabledChanged>(e);
     tts_enabled_ = ev.tts_enabled;
+  } else if (std::holds_alternative<OutputFormatChanged>(e)) {
+    auto ev = std::get<OutputFormatChanged>(e);
+    if (player_) {
+      player_->outputRate(ev.sample_rate_hz);
+    }
   } else if (std::holds_alternative<SelectionChanged>(e)) {
     auto ev = std::get<SelectionChanged>(e);
     if (!ev.new_selection) {
@@ -41,6 +41,7 @@
 #include "battery/battery.hpp"
 #include "database/database.hpp"
 #include "database/db_events.hpp"
+#include "drivers/audio_telemetry.hpp"
 #include "drivers/bluetooth_types.hpp"
 #include "drivers/display.hpp"
 #include "drivers/display_init.hpp"
@@ -200,6 +201,35 @@ lua::Property UiState::sPlaybackPosition{
       }
       return true;
     }};
+lua::Property UiState::sPlaybackResamplerBudget{
+    1, [](const lua::LuaValue& val) {
+      if (!std::holds_alternative<int>(val)) {
+        return false;
+      }
+      int budget = std::get<int>(val);
+      if (budget < 0 || budget > 2) {
+        return false;
+      }
+      events::Audio().Dispatch(audio::SetResamplerBudget{
+          .budget = static_cast<audio::ResamplerBudget>(budget),
+      });
+      return true;
+    }};
+lua::Property UiState::sPlaybackReplayGain{
+    0, [](const lua::LuaValue& val) {
+      if (!std::holds_alternative<int>(val)) {
+        return false;
+      }
+      int mode = std::get<int>(val);
+      if (mode < 0 || mode > 2) {
+        return false;
+      }
+      events::Audio().Dispatch(audio::SetReplayGain{
+          .mode = static_cast<audio::ReplayGainMode>(mode),
+      });
+      return true;
+    }};
+lua::Property UiState::sPlaybackUnderruns{0};
 
 lua::Property UiState::sQueuePosition{0, [](const lua::LuaValue& val){
                                       if (!std::holds_alternative<int>(val)) {
@@ -469,6 +499,8 @@ void UiState::react(const audio::PlaybackUpdate& ev) {
   }
   sPlaybackPlaying.setDirect(!ev.paused);
   sPlaybackPosition.setDirect(static_cast<int>(ev.track_position.value_or(0)));
+  sPlaybackUnderruns.setDirect(
+      static_cast<int>(drivers::telemetry::sAudio.underruns.value()));
 }
 
 void UiState::react(const audio::VolumeChanged& ev) {
@@ -635,6 +667,10 @@ void Lua::entry() {
             {"playing", &sPlaybackPlaying},
             {"track", &sPlaybackTrack},
             {"position", &sPlaybackPosition},
+            {"resampler_budget", &sPlaybackResamplerBudget},
+            {"replaygain", &sPlaybackReplayGain},
+            {"underruns", &sPlaybackUnderruns},
+            {"stats", [&](lua_State* s) { return PlaybackStats(s); }},
             {"is_playable",
              [&](lua_State* s) {
                size_t len;
@@ -722,6 +758,10 @@ void Lua::entry() {
                                });
 
     sDatabaseAutoUpdate.setDirect(sServices->nvs().DbAutoIndex());
+    sPlaybackResamplerBudget.setDirect(
+        static_cast<int>(sServices->nvs().ResamplerBudget()));
+    sPlaybackReplayGain.setDirect(
+        static_cast<int>(sServices->nvs().ReplayGain()));
 
     auto bt = sServices->bluetooth();
     sBluetoothEnabled.setDirect(bt.enabled());
@@ -809,6 +849,53 @@ auto Lua::QueuePrevious(lua_State*) -> int {
   return 0;
 }
 
+static auto pushField(lua_State* s, const char* name, uint32_t val) -> void {
+  lua_pushstring(s, name);
+  lua_pushinteger(s, val);
+  lua_settable(s, -3);
+}
+
+static auto pushTimes(lua_State* s,
+                      const char* name,
+                      const drivers::telemetry::Histogram& hist) -> void {
+  lua_pushstring(s, name);
+  lua_newtable(s);
+  pushField(s, "count", hist.count());
+  pushField(s, "p50", hist.percentile(50));
+  pushField(s, "p99", hist.percentile(99));
+  pushField(s, "max", hist.max());
+  lua_settable(s, -3);
+}
+
+static auto pushFill(lua_State* s,
+                     const char* name,
+                     const drivers::telemetry::FillHistogram& hist) -> void {
+  // Indexed from 1, in tenths of the buffer's capacity.
+  lua_pushstring(s, name);
+  lua_newtable(s);
+  for (size_t i = 0; i < hist.kBuckets; i++) {
+    lua_pushinteger(s, hist.bucket(i));
+    lua_rawseti(s, -2, i + 1);
+  }
+  lua_settable(s, -3);
+}
+
+auto Lua::PlaybackStats(lua_State* s) -> int {
+  auto& stats = drivers::telemetry::sAudio;
+  lua_newtable(s);
+  pushTimes(s, "decode_us", stats.decode_us);
+  pushTimes(s, "resample_us", stats.resample_us);
+  pushTimes(s, "backpressure_us", stats.backpressure_us);
+  pushFill(s, "source_fill", stats.source_fill);
+  pushFill(s, "sink_fill", stats.sink_fill);
+  pushField(s, "backpressure_waits", stats.backpressure_waits.value());
+  pushField(s, "backpressure_timeouts", stats.backpressure_timeouts.value());
+  pushField(s, "underruns", stats.underruns.value());
+  pushField(s, "decoder_underruns", stats.decoder_underruns.value());
+  pushField(s, "padded_samples", stats.padded_samples.value());
+  return 1;
+}
+
 auto Lua::Ticks(lua_State* s) -> int {
   lua_pushinteger(s, esp_timer_get_time() / 1000);
   return 1;
@@ -116,6 +116,9 @@ class UiState : public tinyfsm::Fsm<UiState> {
 
   static lua::Property sPlaybackTrack;
   static lua::Property sPlaybackPosition;
+  static lua::Property sPlaybackResamplerBudget;
+  static lua::Property sPlaybackReplayGain;
+  static lua::Property sPlaybackUnderruns;
 
   static lua::Property sQueuePosition;
   static lua::Property sQueueSize;
@@ -182,6 +185,8 @@ class Lua : public UiState {
 
   auto QueueNext(lua_State*) -> int;
   auto QueuePrevious(lua_State*) -> int;
+
+  auto PlaybackStats(lua_State*) -> int;
 };
 
 }  // namespace states
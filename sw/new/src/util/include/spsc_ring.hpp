@@ -0,0 +1,126 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace util {
+
+/*
+ * Ring buffer for passing values from exactly one producer task to exactly one
+ * consumer task, without locks.
+ *
+ * Rather than copying values in and out, both sides are handed spans that
+ * point directly into the ring's storage. This lets values be written once,
+ * then read (or even modified) in place. Spans never wrap around the end of
+ * the storage, so a full lap of the ring takes two acquires.
+ *
+ * Each side keeps its own position within the storage to itself; the only
+ * state that is shared between the two is a running total of the values
+ * written and read. These totals wrap around at UINT32_MAX, which is harmless
+ * so long as the capacity is less than half of that.
+ */
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(std::span<T> storage)
+      : storage_(storage), written_(0), write_pos_(0), read_(0), read_pos_(0) {}
+
+  /*
+   * Returns a span of free space within the ring. Only the producer may call
+   * this.
+   */
+  auto writeAcquire() -> std::span<T> {
+    uint32_t used = written_.load(std::memory_order_relaxed) -
+                    read_.load(std::memory_order_acquire);
+    size_t free = storage_.size() - used;
+    return storage_.subspan(write_pos_,
+                            std::min(free, storage_.size() - write_pos_));
+  }
+
+  /*
+   * Makes the given number of values from the start of the last writeAcquire
+   * span available to the consumer.
+   */
+  auto writeCommit(size_t count) -> void {
+    write_pos_ += count;
+    if (write_pos_ == storage_.size()) {
+      write_pos_ = 0;
+    }
+    written_.store(written_.load(std::memory_order_relaxed) + count,
+                   std::memory_order_release);
+  }
+
+  /*
+   * Returns a span of the values waiting to be read. Only the consumer may
+   * call this.
+   */
+  auto readAcquire() -> std::span<T> {
+    size_t available =
+        static_cast<uint32_t>(written_.load(std::memory_order_acquire) -
+                              read_.load(std::memory_order_relaxed));
+    return storage_.subspan(read_pos_,
+                            std::min(available, storage_.size() - read_pos_));
+  }
+
+  /*
+   * Releases the given number of values from the start of the last
+   * readAcquire span back to the producer.
+   */
+  auto readCommit(size_t count) -> void {
+    read_pos_ += count;
+    if (read_pos_ == storage_.size()) {
+      read_pos_ = 0;
+    }
+    read_.store(read_.load(std::memory_order_relaxed) + count,
+                std::memory_order_release);
+  }
+
+  /* The number of values that are waiting to be read. */
+  auto size() const -> size_t {
+    return static_cast<uint32_t>(written_.load(std::memory_order_acquire) -
+                                 read_.load(std::memory_order_acquire));
+  }
+
+  auto empty() const -> bool { return size() == 0; }
+  auto capacity() const -> size_t { return storage_.size(); }
+
+  /* How many values have ever been written. Wraps around to zero. */
+  auto totalWritten() const -> uint32_t {
+    return written_.load(std::memory_order_acquire);
+  }
+
+  /* How many values have ever been read. Wraps around to zero. */
+  auto totalRead() const -> uint32_t {
+    return read_.load(std::memory_order_acquire);
+  }
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+ private:
+  // ESP32's cache lines are 32 bytes. Keeping each side's state on its own
+  // line stops the producer and consumer from invalidating each other's
+  // caches on every access.
+  static constexpr size_t kCacheLineSize = 32;
+
+  const std::span<T> storage_;
+
+  // Owned by the producer.
+  alignas(kCacheLineSize) std::atomic<uint32_t> written_;
+  size_t write_pos_;
+
+  // Owned by the consumer.
+  alignas(kCacheLineSize) std::atomic<uint32_t> read_;
+  size_t read_pos_;
+};
+
+}  // namespace util
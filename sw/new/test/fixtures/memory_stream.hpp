@@ -0,0 +1,70 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "codec.hpp"
+#include "types.hpp"
+
+/*
+ * Stream that reads from a buffer in memory, optionally repeating its contents
+ * some number of times.
+ */
+class MemoryStream : public codecs::IStream {
+ public:
+  MemoryStream(codecs::StreamType type,
+               std::span<const std::byte> data,
+               size_t repeats = 1)
+      : IStream(type),
+        data_(data),
+        size_(data.size() * repeats),
+        pos_(0) {}
+
+  auto Read(std::span<std::byte> dest) -> ssize_t override {
+    size_t total = 0;
+    while (total < dest.size() && pos_ < size_) {
+      size_t offset = pos_ % data_.size();
+      size_t len = std::min({dest.size() - total, data_.size() - offset,
+                             static_cast<size_t>(size_ - pos_)});
+      std::copy_n(data_.begin() + offset, len, dest.begin() + total);
+      total += len;
+      pos_ += len;
+    }
+    return total;
+  }
+
+  auto CanSeek() -> bool override { return true; }
+
+  auto SeekTo(int64_t destination, SeekFrom from) -> void override {
+    switch (from) {
+      case SeekFrom::kStartOfStream:
+        pos_ = destination;
+        break;
+      case SeekFrom::kEndOfStream:
+        pos_ = size_ + destination;
+        break;
+      case SeekFrom::kCurrentPosition:
+        pos_ += destination;
+        break;
+    }
+    pos_ = std::clamp<int64_t>(pos_, 0, size_);
+  }
+
+  auto CurrentPosition() -> int64_t override { return pos_; }
+
+  auto Size() -> std::optional<int64_t> override { return size_; }
+
+ private:
+  const std::span<const std::byte> data_;
+  const int64_t size_;
+  int64_t pos_;
+};
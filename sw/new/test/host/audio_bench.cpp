@@ -0,0 +1,307 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+/*
+ * Decodes each of the given files through the real audio pipeline, as fast as
+ * the host allows, and reports how much faster than real time each format
+ * decoded, along with how much heap decoding it used. See TESTING.md.
+ */
+
+#include <algorithm>
+#include <any>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "alloc_stats.hpp"
+#include "audio/audio_decoder.hpp"
+#include "audio/audio_events.hpp"
+#include "audio/audio_source.hpp"
+#include "audio/processor.hpp"
+#include "database/track.hpp"
+#include "drivers/pcm_buffer.hpp"
+#include "events/event_queue.hpp"
+#include "file_stream.hpp"
+#include "types.hpp"
+#include "wav_sink.hpp"
+
+namespace fs = std::filesystem;
+
+// The same size as the firmware's track sink.
+static constexpr size_t kSinkSamples = 48000 * 2 * 2;
+
+// How long a file may go without producing any samples before we give up on
+// it, e.g. because its codec has hung.
+static constexpr auto kStallTimeout = std::chrono::seconds(10);
+
+namespace {
+
+struct Result {
+  std::string path;
+  codecs::StreamType type;
+  bool ok;
+  double audio_secs;
+  double wall_secs;
+  int64_t peak_bytes;
+  uint64_t allocations;
+};
+
+/* Follows the pipeline's events for the file that's currently decoding. */
+class Progress {
+ public:
+  auto reset() -> void {
+    std::lock_guard<std::mutex> lock{mutex_};
+    failed_ = false;
+    start_cue_.reset();
+    end_cue_.reset();
+    rate_ = 0;
+  }
+
+  auto onEvent(const std::any& ev) -> void {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (auto* started = std::any_cast<audio::internal::StreamStarted>(&ev)) {
+      start_cue_ = started->cue_at_sample;
+      rate_ = started->sink_format.sample_rate;
+    } else if (auto* ended = std::any_cast<audio::internal::StreamEnded>(&ev)) {
+      end_cue_ = ended->cue_at_sample;
+    } else if (std::any_cast<audio::internal::DecodingFailedToStart>(&ev)) {
+      failed_ = true;
+    } else {
+      return;
+    }
+    changed_.notify_all();
+  }
+
+  /*
+   * Waits until every sample of the current file has been played. Returns
+   * how many seconds of audio the file contained, or nothing if it failed.
+   */
+  auto wait(drivers::PcmBuffer& sink) -> std::optional<double> {
+    std::unique_lock<std::mutex> lock{mutex_};
+    uint32_t last_received = sink.totalReceived();
+    auto last_progress = std::chrono::steady_clock::now();
+    for (;;) {
+      if (failed_) {
+        return {};
+      }
+      uint32_t received = sink.totalReceived();
+      if (end_cue_ && static_cast<int32_t>(received - *end_cue_) >= 0) {
+        uint32_t samples = *end_cue_ - start_cue_.value_or(*end_cue_);
+        return rate_ == 0 ? 0.0 : samples / (rate_ * 2.0);
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (received != last_received) {
+        last_received = received;
+        last_progress = now;
+      } else if (now - last_progress > kStallTimeout) {
+        return {};
+      }
+      changed_.wait_for(lock, std::chrono::microseconds(200));
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool failed_;
+  std::optional<uint32_t> start_cue_;
+  std::optional<uint32_t> end_cue_;
+  uint32_t rate_;
+};
+
+}  // namespace
+
+static auto usage(const char* name) -> void {
+  std::fprintf(stderr,
+               "usage: %s [-o DIR] [--rate HZ] [--gain DB] [--min-rtf X] "
+               "FILE|DIR...\n"
+               "  -o DIR       write each decoded file to DIR as a wav\n"
+               "  --rate HZ    resample everything to HZ\n"
+               "  --gain DB    apply a replaygain of DB to every file\n"
+               "  --min-rtf X  fail if any format decodes slower than X times\n"
+               "               real time\n",
+               name);
+}
+
+/* Expands directories into the supported files within them. */
+static auto collect(const std::vector<std::string>& args)
+    -> std::vector<std::string> {
+  std::vector<std::string> out;
+  for (const auto& arg : args) {
+    if (!fs::is_directory(arg)) {
+      out.push_back(arg);
+      continue;
+    }
+    std::vector<std::string> found;
+    for (const auto& entry : fs::recursive_directory_iterator(arg)) {
+      if (entry.is_regular_file() && FileStream::TypeOf(entry.path())) {
+        found.push_back(entry.path());
+      }
+    }
+    std::sort(found.begin(), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+  }
+  return out;
+}
+
+static auto printRow(const char* name,
+                     const char* format,
+                     double audio_secs,
+                     double wall_secs,
+                     int64_t peak_bytes,
+                     uint64_t allocations) -> void {
+  std::printf("%-32.32s %-7s %9.2f %8.3f %8.1f %9lld %8llu\n", name, format,
+              audio_secs, wall_secs, audio_secs / wall_secs,
+              static_cast<long long>(peak_bytes / 1024),
+              static_cast<unsigned long long>(allocations));
+}
+
+auto main(int argc, char** argv) -> int {
+  std::optional<std::string> out_dir;
+  std::optional<uint32_t> rate;
+  std::optional<std::string> gain;
+  double min_rtf = 0;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      out_dir = argv[++i];
+    } else if (arg == "--rate" && i + 1 < argc) {
+      rate = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--gain" && i + 1 < argc) {
+      gain = argv[++i];
+    } else if (arg == "--min-rtf" && i + 1 < argc) {
+      min_rtf = std::strtod(argv[++i], nullptr);
+    } else if (arg.starts_with("-")) {
+      usage(argv[0]);
+      return 2;
+    } else {
+      args.push_back(arg);
+    }
+  }
+  auto files = collect(args);
+  if (files.empty()) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // Like the firmware, the pipeline is started once and lives forever.
+  auto* sink = new drivers::PcmBuffer(kSinkSamples);
+  auto output = std::make_shared<WavSink>(*sink, rate);
+  auto processor = std::make_shared<audio::SampleProcessor>(*sink);
+  processor->SetOutput(output);
+  if (gain) {
+    processor->SetReplayGain(audio::ReplayGainMode::kTrack);
+  }
+  auto* decoder = audio::Decoder::Start(processor);
+
+  Progress progress;
+  events::Audio().listen([&](const std::any& ev) { progress.onEvent(ev); });
+
+  std::printf("%-32s %-7s %9s %8s %8s %9s %8s\n", "file", "format", "audio s",
+              "wall s", "x rt", "peak KiB", "allocs");
+
+  std::vector<Result> results;
+  for (const auto& path : files) {
+    auto stream = FileStream::Open(path);
+    if (!stream) {
+      std::fprintf(stderr, "%s: couldn't open, or unknown type\n",
+                   path.c_str());
+      results.push_back({.path = path, .ok = false});
+      continue;
+    }
+    auto type = stream->type();
+    if (out_dir) {
+      auto wav = fs::path{*out_dir} / fs::path{path}.filename();
+      output->open(wav.replace_extension(".wav"));
+    }
+
+    progress.reset();
+    shim::ResetAllocStats();
+    int64_t baseline = shim::GetAllocStats().in_use;
+    auto start = std::chrono::steady_clock::now();
+
+    auto tags = std::make_shared<database::TrackTags>();
+    if (gain) {
+      tags->trackGain(*gain);
+    }
+    decoder->open(
+        std::make_shared<audio::TaggedStream>(tags, std::move(stream), path));
+    auto audio_secs = progress.wait(*sink);
+
+    std::chrono::duration<double> wall =
+        std::chrono::steady_clock::now() - start;
+    auto allocs = shim::GetAllocStats();
+    output->close();
+
+    Result res{
+        .path = path,
+        .type = type,
+        .ok = audio_secs.has_value(),
+        .audio_secs = audio_secs.value_or(0),
+        .wall_secs = wall.count(),
+        .peak_bytes = allocs.peak - baseline,
+        .allocations = allocs.allocations,
+    };
+    results.push_back(res);
+
+    auto name = fs::path{path}.filename().string();
+    auto format = codecs::StreamTypeToString(type);
+    if (!res.ok) {
+      std::printf("%-32.32s %-7s failed\n", name.c_str(), format.c_str());
+      continue;
+    }
+    printRow(name.c_str(), format.c_str(), res.audio_secs, res.wall_secs,
+             res.peak_bytes, res.allocations);
+  }
+
+  struct Totals {
+    double audio_secs = 0;
+    double wall_secs = 0;
+    int64_t peak_bytes = 0;
+    uint64_t allocations = 0;
+  };
+  std::map<codecs::StreamType, Totals> per_format;
+  bool ok = true;
+  for (const auto& res : results) {
+    if (!res.ok) {
+      ok = false;
+      continue;
+    }
+    auto& totals = per_format[res.type];
+    totals.audio_secs += res.audio_secs;
+    totals.wall_secs += res.wall_secs;
+    totals.peak_bytes = std::max(totals.peak_bytes, res.peak_bytes);
+    totals.allocations += res.allocations;
+  }
+
+  std::printf("\n");
+  for (const auto& [type, totals] : per_format) {
+    auto format = codecs::StreamTypeToString(type);
+    printRow("total", format.c_str(), totals.audio_secs, totals.wall_secs,
+             totals.peak_bytes, totals.allocations);
+    double rtf = totals.audio_secs / totals.wall_secs;
+    if (rtf < min_rtf) {
+      std::fflush(stdout);
+      std::fprintf(stderr, "%s decoded at %.1fx real time, below %.1fx\n",
+                   format.c_str(), rtf, min_rtf);
+      ok = false;
+    }
+  }
+
+  // The pipeline's tasks never exit, so don't wait for them.
+  std::fflush(stdout);
+  std::_Exit(ok ? 0 : 1);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "file_stream.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "codec.hpp"
+#include "types.hpp"
+
+auto FileStream::Open(const std::string& path) -> std::unique_ptr<FileStream> {
+  auto type = TypeOf(path);
+  if (!type) {
+    return {};
+  }
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    return {};
+  }
+  return std::make_unique<FileStream>(*type, file);
+}
+
+auto FileStream::TypeOf(const std::string& path)
+    -> std::optional<codecs::StreamType> {
+  auto dot = path.rfind('.');
+  if (dot == std::string::npos) {
+    return {};
+  }
+  std::string ext = path.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  if (ext == "mp3") {
+    return codecs::StreamType::kMp3;
+  } else if (ext == "ogg" || ext == "oga") {
+    return codecs::StreamType::kVorbis;
+  } else if (ext == "flac") {
+    return codecs::StreamType::kFlac;
+  } else if (ext == "opus") {
+    return codecs::StreamType::kOpus;
+  } else if (ext == "wav") {
+    return codecs::StreamType::kWav;
+  }
+  return {};
+}
+
+FileStream::FileStream(codecs::StreamType type, FILE* file)
+    : IStream(type), file_(file) {}
+
+FileStream::~FileStream() {
+  std::fclose(file_);
+}
+
+auto FileStream::Read(std::span<std::byte> dest) -> ssize_t {
+  size_t bytes_read = std::fread(dest.data(), 1, dest.size(), file_);
+  if (bytes_read == 0 && std::ferror(file_)) {
+    return -1;
+  }
+  return bytes_read;
+}
+
+auto FileStream::CanSeek() -> bool {
+  return true;
+}
+
+auto FileStream::SeekTo(int64_t destination, SeekFrom from) -> void {
+  switch (from) {
+    case SeekFrom::kStartOfStream:
+      fseeko(file_, destination, SEEK_SET);
+      break;
+    case SeekFrom::kEndOfStream:
+      fseeko(file_, destination, SEEK_END);
+      break;
+    case SeekFrom::kCurrentPosition:
+      fseeko(file_, destination, SEEK_CUR);
+      break;
+  }
+}
+
+auto FileStream::CurrentPosition() -> int64_t {
+  return ftello(file_);
+}
+
+auto FileStream::Size() -> std::optional<int64_t> {
+  off_t pos = ftello(file_);
+  fseeko(file_, 0, SEEK_END);
+  off_t size = ftello(file_);
+  fseeko(file_, pos, SEEK_SET);
+  return size;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "codec.hpp"
+#include "types.hpp"
+
+/* Stands in for FatfsSource, reading from a file on the host instead. */
+class FileStream : public codecs::IStream {
+ public:
+  /*
+   * Opens the file at the given path, guessing its type from its extension.
+   * Returns nullptr if the file couldn't be opened, or its type isn't one
+   * that we can decode.
+   */
+  static auto Open(const std::string& path) -> std::unique_ptr<FileStream>;
+
+  /* Guesses a file's type from its extension. */
+  static auto TypeOf(const std::string& path)
+      -> std::optional<codecs::StreamType>;
+
+  FileStream(codecs::StreamType, FILE*);
+  ~FileStream();
+
+  auto Read(std::span<std::byte> dest) -> ssize_t override;
+  auto CanSeek() -> bool override;
+  auto SeekTo(int64_t destination, SeekFrom from) -> void override;
+  auto CurrentPosition() -> int64_t override;
+  auto Size() -> std::optional<int64_t> override;
+
+  FileStream(const FileStream&) = delete;
+  FileStream& operator=(const FileStream&) = delete;
+
+ private:
+  FILE* file_;
+};
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "alloc_stats.hpp"
+
+#include <malloc.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// The linker points every call to malloc and friends in the program at the
+// __wrap_ versions below, which record the allocation then call the real
+// allocator. Sizes come from the allocator itself, so that frees can be
+// accounted for without a header on each allocation.
+extern "C" {
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+void __real_free(void*);
+}
+
+static std::atomic<uint64_t> sAllocations;
+static std::atomic<int64_t> sInUse;
+static std::atomic<int64_t> sPeak;
+
+static auto recordAlloc(void* ptr) -> void {
+  if (!ptr) {
+    return;
+  }
+  sAllocations.fetch_add(1, std::memory_order_relaxed);
+  int64_t size = malloc_usable_size(ptr);
+  int64_t in_use = sInUse.fetch_add(size, std::memory_order_relaxed) + size;
+  int64_t peak = sPeak.load(std::memory_order_relaxed);
+  while (in_use > peak && !sPeak.compare_exchange_weak(
+                              peak, in_use, std::memory_order_relaxed)) {
+  }
+}
+
+static auto recordFree(void* ptr) -> void {
+  if (!ptr) {
+    return;
+  }
+  sInUse.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+}
+
+extern "C" {
+
+void* __wrap_malloc(size_t size) {
+  void* ptr = __real_malloc(size);
+  recordAlloc(ptr);
+  return ptr;
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  void* ptr = __real_calloc(n, size);
+  recordAlloc(ptr);
+  return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+  void* res = __real_realloc(ptr, size);
+  if (res || size == 0) {
+    sInUse.fetch_sub(old_size, std::memory_order_relaxed);
+  }
+  recordAlloc(res);
+  return res;
+}
+
+void __wrap_free(void* ptr) {
+  recordFree(ptr);
+  __real_free(ptr);
+}
+}
+
+// operator new usually lives in the standard library, where the linker can't
+// wrap its calls to malloc, so replace it with one that calls ours.
+auto operator new(size_t size) -> void* {
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc{};
+  }
+  return ptr;
+}
+
+auto operator new[](size_t size) -> void* {
+  return operator new(size);
+}
+
+auto operator delete(void* ptr) noexcept -> void {
+  free(ptr);
+}
+
+auto operator delete[](void* ptr) noexcept -> void {
+  free(ptr);
+}
+
+auto operator delete(void* ptr, size_t) noexcept -> void {
+  free(ptr);
+}
+
+auto operator delete[](void* ptr, size_t) noexcept -> void {
+  free(ptr);
+}
+
+namespace shim {
+
+auto GetAllocStats() -> AllocStats {
+  return AllocStats{
+      .allocations = sAllocations.load(),
+      .in_use = sInUse.load(),
+      .peak = sPeak.load(),
+  };
+}
+
+auto ResetAllocStats() -> void {
+  sAllocations = 0;
+  sPeak = sInUse.load();
+}
+
+}  // namespace shim
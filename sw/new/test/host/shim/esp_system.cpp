@@ -0,0 +1,61 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "events/event_queue.hpp"
+
+auto esp_timer_get_time() -> int64_t {
+  using Clock = std::chrono::steady_clock;
+  static const auto start = Clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                               start)
+      .count();
+}
+
+extern "C" {
+
+void* heap_caps_malloc(size_t size, unsigned int) {
+  return malloc(size);
+}
+
+void* heap_caps_calloc(size_t n, size_t size, unsigned int) {
+  return calloc(n, size);
+}
+
+void* heap_caps_realloc(void* ptr, size_t size, unsigned int) {
+  return realloc(ptr, size);
+}
+
+void heap_caps_free(void* ptr) {
+  free(ptr);
+}
+
+void* heap_caps_malloc_prefer(size_t size, size_t, ...) {
+  return malloc(size);
+}
+
+void* heap_caps_calloc_prefer(size_t n, size_t size, size_t, ...) {
+  return calloc(n, size);
+}
+
+void* heap_caps_realloc_prefer(void* ptr, size_t size, size_t, ...) {
+  return realloc(ptr, size);
+}
+}
+
+namespace events {
+
+auto Audio() -> Dispatcher& {
+  static Dispatcher sAudio;
+  return sAudio;
+}
+
+}  // namespace events
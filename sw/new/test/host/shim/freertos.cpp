@@ -0,0 +1,165 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "freertos/FreeRTOS.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+using Clock = std::chrono::steady_clock;
+
+static auto deadline(TickType_t wait) -> Clock::time_point {
+  if (wait == portMAX_DELAY) {
+    return Clock::time_point::max();
+  }
+  return Clock::now() + std::chrono::milliseconds(wait);
+}
+
+/* Tasks are threads that are never joined, since FreeRTOS tasks can't be. */
+auto xTaskCreateStatic(TaskFunction_t fn,
+                       const char*,
+                       uint32_t,
+                       void* arg,
+                       UBaseType_t,
+                       StackType_t*,
+                       StaticTask_t* task) -> TaskHandle_t {
+  std::thread{fn, arg}.detach();
+  return task;
+}
+
+auto xTaskCreateStaticPinnedToCore(TaskFunction_t fn,
+                                   const char* name,
+                                   uint32_t stack_size,
+                                   void* arg,
+                                   UBaseType_t priority,
+                                   StackType_t* stack,
+                                   StaticTask_t* task,
+                                   BaseType_t) -> TaskHandle_t {
+  return xTaskCreateStatic(fn, name, stack_size, arg, priority, stack, task);
+}
+
+auto vTaskDelete(TaskHandle_t) -> void {
+  // Only ever used by tasks to delete themselves.
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::hours{1});
+  }
+}
+
+auto vTaskDelay(TickType_t ticks) -> void {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+auto xTaskGetTickCount() -> TickType_t {
+  static const auto start = Clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                               start)
+      .count();
+}
+
+namespace {
+
+// Queues are rings of fixed size items, allocated up front as they are in
+// FreeRTOS, so that the shim doesn't add to the pipeline's allocation count.
+struct Queue {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::byte> storage;
+  size_t length;
+  size_t item_size;
+  size_t head;
+  size_t count;
+};
+
+struct Semaphore {
+  std::mutex mutex;
+  std::condition_variable given;
+  bool available = false;
+};
+
+}  // namespace
+
+auto xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+    -> QueueHandle_t {
+  return new Queue{
+      .storage = std::vector<std::byte>(length * item_size),
+      .length = length,
+      .item_size = item_size,
+      .head = 0,
+      .count = 0,
+  };
+}
+
+auto vQueueDelete(QueueHandle_t handle) -> void {
+  delete static_cast<Queue*>(handle);
+}
+
+auto xQueueSend(QueueHandle_t handle, const void* item, TickType_t wait)
+    -> BaseType_t {
+  auto* q = static_cast<Queue*>(handle);
+  std::unique_lock<std::mutex> lock{q->mutex};
+  if (!q->changed.wait_until(lock, deadline(wait),
+                             [&]() { return q->count < q->length; })) {
+    return pdFALSE;
+  }
+  size_t tail = (q->head + q->count) % q->length;
+  std::memcpy(&q->storage[tail * q->item_size], item, q->item_size);
+  q->count++;
+  q->changed.notify_all();
+  return pdTRUE;
+}
+
+auto xQueueReceive(QueueHandle_t handle, void* item, TickType_t wait)
+    -> BaseType_t {
+  auto* q = static_cast<Queue*>(handle);
+  std::unique_lock<std::mutex> lock{q->mutex};
+  if (!q->changed.wait_until(lock, deadline(wait),
+                             [&]() { return q->count > 0; })) {
+    return pdFALSE;
+  }
+  std::memcpy(item, &q->storage[q->head * q->item_size], q->item_size);
+  q->head = (q->head + 1) % q->length;
+  q->count--;
+  q->changed.notify_all();
+  return pdTRUE;
+}
+
+auto xSemaphoreCreateBinary() -> SemaphoreHandle_t {
+  return new Semaphore{};
+}
+
+auto vSemaphoreDelete(SemaphoreHandle_t handle) -> void {
+  delete static_cast<Semaphore*>(handle);
+}
+
+auto xSemaphoreGive(SemaphoreHandle_t handle) -> BaseType_t {
+  auto* s = static_cast<Semaphore*>(handle);
+  std::lock_guard<std::mutex> lock{s->mutex};
+  if (s->available) {
+    return pdFALSE;
+  }
+  s->available = true;
+  s->given.notify_one();
+  return pdTRUE;
+}
+
+auto xSemaphoreTake(SemaphoreHandle_t handle, TickType_t wait) -> BaseType_t {
+  auto* s = static_cast<Semaphore*>(handle);
+  std::unique_lock<std::mutex> lock{s->mutex};
+  if (!s->given.wait_until(lock, deadline(wait),
+                           [&]() { return s->available; })) {
+    return pdFALSE;
+  }
+  s->available = false;
+  return pdTRUE;
+}
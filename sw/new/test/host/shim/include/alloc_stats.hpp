@@ -0,0 +1,32 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace shim {
+
+/*
+ * Counts of every heap allocation made by the program, whether through
+ * heap_caps, malloc, or operator new.
+ */
+struct AllocStats {
+  // The number of allocations made since the last reset.
+  uint64_t allocations;
+  // Bytes currently allocated.
+  int64_t in_use;
+  // The most bytes that were allocated at once since the last reset.
+  int64_t peak;
+};
+
+auto GetAllocStats() -> AllocStats;
+
+/* Zeroes the allocation count, and lowers the peak to what's in use now. */
+auto ResetAllocStats() -> void;
+
+}  // namespace shim
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include "driver/i2s_types.h"
+
+typedef struct {
+  int unused;
+} i2s_std_clk_config_t;
+
+typedef struct {
+  int unused;
+} i2s_std_slot_config_t;
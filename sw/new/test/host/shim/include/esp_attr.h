@@ -0,0 +1,10 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+/*
+ * Every capability is served by the same heap. Third party C code allocates
+ * through these too, so they have C linkage.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* heap_caps_malloc(size_t size, unsigned int caps);
+void* heap_caps_calloc(size_t n, size_t size, unsigned int caps);
+void* heap_caps_realloc(void* ptr, size_t size, unsigned int caps);
+void heap_caps_free(void* ptr);
+
+void* heap_caps_malloc_prefer(size_t size, size_t num, ...);
+void* heap_caps_calloc_prefer(size_t n, size_t size, size_t num, ...);
+void* heap_caps_realloc_prefer(void* ptr, size_t size, size_t num, ...);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+/* Warnings and errors go to stderr. Everything else is dropped. */
+#define ESP_LOGE(tag, fmt, ...) \
+  fprintf(stderr, "E %s: " fmt "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) \
+  fprintf(stderr, "W %s: " fmt "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ((void)tag)
+#define ESP_LOGD(tag, fmt, ...) ((void)tag)
+#define ESP_LOGV(tag, fmt, ...) ((void)tag)
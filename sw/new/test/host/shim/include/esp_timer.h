@@ -0,0 +1,12 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Microseconds since the program started. */
+auto esp_timer_get_time() -> int64_t;
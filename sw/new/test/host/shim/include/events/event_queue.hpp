@@ -0,0 +1,46 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+/*
+ * Stands in for the firmware's event queues, which would otherwise pull in
+ * every state machine in the firmware. Events are handed straight to a single
+ * listener, on whichever task dispatched them.
+ */
+
+#pragma once
+
+#include <any>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace events {
+
+class Dispatcher {
+ public:
+  using Listener = std::function<void(const std::any&)>;
+
+  template <typename Event>
+  auto Dispatch(const Event& ev) -> void {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (listener_) {
+      listener_(std::any{ev});
+    }
+  }
+
+  auto listen(Listener l) -> void {
+    std::lock_guard<std::mutex> lock{mutex_};
+    listener_ = std::move(l);
+  }
+
+ private:
+  std::mutex mutex_;
+  Listener listener_;
+};
+
+auto Audio() -> Dispatcher&;
+
+}  // namespace events
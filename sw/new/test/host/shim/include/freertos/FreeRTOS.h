@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+/*
+ * Just enough of FreeRTOS for the audio pipeline, implemented on top of the
+ * C++ standard library's threads. Ticks are one millisecond long.
+ */
+
+#pragma once
+
+// esp-idf's FreeRTOS provides assert() to everything that includes it.
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/portmacro.h"
+#include "freertos/projdefs.h"
+
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+typedef struct {
+  uint8_t unused;
+} StaticTask_t;
+
+#define configTICK_RATE_HZ 1000
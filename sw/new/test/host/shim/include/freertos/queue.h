@@ -0,0 +1,15 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+auto xQueueCreate(UBaseType_t length, UBaseType_t item_size) -> QueueHandle_t;
+auto vQueueDelete(QueueHandle_t) -> void;
+auto xQueueSend(QueueHandle_t, const void* item, TickType_t wait)
+    -> BaseType_t;
+auto xQueueReceive(QueueHandle_t, void* item, TickType_t wait) -> BaseType_t;
@@ -0,0 +1,14 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+auto xSemaphoreCreateBinary() -> SemaphoreHandle_t;
+auto vSemaphoreDelete(SemaphoreHandle_t) -> void;
+auto xSemaphoreGive(SemaphoreHandle_t) -> BaseType_t;
+auto xSemaphoreTake(SemaphoreHandle_t, TickType_t wait) -> BaseType_t;
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+auto xTaskCreateStatic(TaskFunction_t fn,
+                       const char* name,
+                       uint32_t stack_size,
+                       void* arg,
+                       UBaseType_t priority,
+                       StackType_t* stack,
+                       StaticTask_t* task) -> TaskHandle_t;
+auto xTaskCreateStaticPinnedToCore(TaskFunction_t fn,
+                                   const char* name,
+                                   uint32_t stack_size,
+                                   void* arg,
+                                   UBaseType_t priority,
+                                   StackType_t* stack,
+                                   StaticTask_t* task,
+                                   BaseType_t core) -> TaskHandle_t;
+auto vTaskDelete(TaskHandle_t) -> void;
+auto vTaskDelay(TickType_t) -> void;
+auto xTaskGetTickCount() -> TickType_t;
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include "wav_sink.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+
+#include "drivers/pcm_buffer.hpp"
+
+static constexpr size_t kChunkSamples = 4096;
+static constexpr size_t kHeaderBytes = 44;
+
+static auto put16le(uint8_t* out, uint16_t val) -> void {
+  out[0] = val;
+  out[1] = val >> 8;
+}
+
+static auto put32le(uint8_t* out, uint32_t val) -> void {
+  put16le(out, val);
+  put16le(out + 2, val >> 16);
+}
+
+/* Writes a header for 16 bit stereo samples, at the start of the file. */
+static auto writeHeader(FILE* file, uint32_t rate, uint32_t data_bytes)
+    -> void {
+  uint8_t header[kHeaderBytes];
+  std::copy_n("RIFF", 4, header);
+  put32le(header + 4, kHeaderBytes - 8 + data_bytes);
+  std::copy_n("WAVEfmt ", 8, header + 8);
+  put32le(header + 16, 16);
+  put16le(header + 20, 1);  // PCM
+  put16le(header + 22, 2);
+  put32le(header + 24, rate);
+  put32le(header + 28, rate * 4);
+  put16le(header + 32, 4);
+  put16le(header + 34, 16);
+  std::copy_n("data", 4, header + 36);
+  put32le(header + 40, data_bytes);
+
+  std::fseek(file, 0, SEEK_SET);
+  std::fwrite(header, 1, kHeaderBytes, file);
+}
+
+WavSink::WavSink(drivers::PcmBuffer& buffer, std::optional<uint32_t> rate)
+    : buffer_(buffer),
+      rate_(rate),
+      configured_rate_(0),
+      file_(nullptr),
+      data_bytes_(0),
+      running_(true),
+      thread_([this]() { Main(); }) {}
+
+WavSink::~WavSink() {
+  running_ = false;
+  thread_.join();
+  close();
+}
+
+auto WavSink::open(const std::string& path) -> bool {
+  close();
+  std::lock_guard<std::mutex> lock{file_mutex_};
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    return false;
+  }
+  // Leave room for the header, which is filled in once the length is known.
+  data_bytes_ = 0;
+  writeHeader(file_, configured_rate_, 0);
+  return true;
+}
+
+auto WavSink::close() -> void {
+  std::lock_guard<std::mutex> lock{file_mutex_};
+  if (!file_) {
+    return;
+  }
+  writeHeader(file_, configured_rate_, data_bytes_);
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+auto WavSink::PrepareFormat(const Format& format) -> Format {
+  return Format{
+      .sample_rate = rate_.value_or(format.sample_rate),
+      .num_channels = 2,
+      .bits_per_sample = 16,
+  };
+}
+
+auto WavSink::Configure(const Format& format) -> void {
+  configured_rate_ = format.sample_rate;
+}
+
+auto WavSink::Main() -> void {
+  while (running_) {
+    size_t received;
+    {
+      std::lock_guard<std::mutex> lock{file_mutex_};
+      received = buffer_.consume(
+          kChunkSamples, [&](std::span<const int16_t> samples) {
+            if (file_) {
+              data_bytes_ += std::fwrite(samples.data(), sizeof(int16_t),
+                                         samples.size(), file_) *
+                             sizeof(int16_t);
+            }
+            return samples.size();
+          });
+    }
+    if (received == 0) {
+      std::this_thread::yield();
+    }
+  }
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2024 jacqueline <me@jacqueline.id.au>
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "audio/audio_sink.hpp"
+#include "drivers/pcm_buffer.hpp"
+
+/*
+ * Output that plays its samples as fast as it can, rather than in real time,
+ * so that the speed of the pipeline feeding it is the only limit. Samples can
+ * optionally be written out to wav files, for checking by ear.
+ */
+class WavSink : public audio::IAudioOutput {
+ public:
+  /*
+   * Drains the given buffer. If `rate` is set, then every stream is resampled
+   * to that rate; otherwise streams are played at their own rates.
+   */
+  WavSink(drivers::PcmBuffer& buffer, std::optional<uint32_t> rate);
+  ~WavSink();
+
+  /* Writes every sample played from now on to a wav file at `path`. */
+  auto open(const std::string& path) -> bool;
+  /* Finishes the current wav file, if there is one. */
+  auto close() -> void;
+
+  auto SetVolumeImbalance(int_fast8_t) -> void override {}
+  auto SetVolume(uint16_t) -> void override {}
+  auto GetVolume() -> uint16_t override { return 0; }
+  auto GetVolumePct() -> uint_fast8_t override { return 0; }
+  auto GetVolumeDb() -> int_fast16_t override { return 0; }
+  auto SetVolumePct(uint_fast8_t) -> bool override { return true; }
+  auto SetVolumeDb(int_fast16_t) -> bool override { return true; }
+  auto AdjustVolumeUp() -> bool override { return true; }
+  auto AdjustVolumeDown() -> bool override { return true; }
+
+  auto PrepareFormat(const Format&) -> Format override;
+  auto Configure(const Format&) -> void override;
+
+  WavSink(const WavSink&) = delete;
+  WavSink& operator=(const WavSink&) = delete;
+
+ protected:
+  auto changeMode(Modes) -> void override {}
+
+ private:
+  auto Main() -> void;
+
+  drivers::PcmBuffer& buffer_;
+  std::optional<uint32_t> rate_;
+  std::atomic<uint32_t> configured_rate_;
+
+  // Guards the current wav file, which is written to by the drain thread.
+  std::mutex file_mutex_;
+  FILE* file_;
+  uint32_t data_bytes_;
+
+  std::atomic<bool> running_;
+  std::thread thread_;
+};